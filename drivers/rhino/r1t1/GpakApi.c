@@ -20,6 +20,10 @@
 #include "GpakCust.h"
 #include "GpakApi.h"
 #include "gpakenum.h"
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 
 /* Boot load interface related definitions. */
 /* only word(16bit) address below 0x4000 could be accessed by Host */
@@ -75,29 +79,87 @@
 #define MSG_BUFFER_SIZE 1000	/* size (words) of Host msg buffer */
 #define WORD_BUFFER_SIZE 84		/* size of DSP Word buffer (words) */
 
-#ifdef __TMS320C55XX__			// debug sections if not on host
-#pragma DATA_SECTION(pDspIfBlk,"GPAKAPIDEBUG_SECT")
-#pragma DATA_SECTION(MaxCmdMsgLen,"GPAKAPIDEBUG_SECT")
-#pragma DATA_SECTION(MaxChannels,"GPAKAPIDEBUG_SECT")
-#pragma DATA_SECTION(DlByteBufr,"GPAKAPIDEBUG_SECT")
-#pragma DATA_SECTION(DlWordBufr,"GPAKAPIDEBUG_SECT")
-#pragma DATA_SECTION(pEventFifoAddress,"GPAKAPIDEBUG_SECT")
-#endif
+/* Asynchronous command queue of a DSP. */
+typedef struct {
+	struct r1t1_card *pCard;	/* card containing the DSP */
+	unsigned short int DspId;	/* DSP identifier */
+	spinlock_t Lock;			/* protects Pending and pWorkQueue */
+	struct list_head Pending;	/* queued gpakCmd_t descriptors */
+	struct work_struct Work;	/* transacts the pending commands */
+	struct workqueue_struct *pWorkQueue;	/* NULL while stopped */
+	DSP_WORD MsgBuffer[MSG_BUFFER_SIZE];	/* message buffer of the work */
+} gpakCmdQueue_t;
+
+/* Host variables related to Host to DSP interface, one set per DSP. */
+typedef struct {
+	DSP_ADDRESS pDspIfBlk;		/* DSP address of I/F block */
+	DSP_WORD MaxCmdMsgLen;		/* max Cmd msg length (octets) */
+	unsigned short int MaxChannels;	/* max num channels */
+	DSP_ADDRESS pEventFifoAddress;	/* event fifo */
+	DSP_ADDRESS pCmdMsgBufr;	/* Cmd message buffer */
+	DSP_ADDRESS pReplyMsgBufr;	/* Reply message buffer */
+	gpakCmdStats_t CmdStats;	/* command statistics */
+	gpakCmdQueue_t CmdQueue;	/* asynchronous command queue */
+	int ResetSeen;				/* DSP lost the host's status since last tested */
+} gpakDspCtx_t;
+
+/* Host state of the DSPs of a card, indexed by DspId - FirstDspId. */
+struct gpakDspTable {
+	unsigned short int FirstDspId;	/* DSP Identifier of the first DSP */
+	unsigned short int NumDsps;	/* number of DSPs on the card */
+	gpakDspCtx_t Dsp[];
+};
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakGetDsp - Find the host state of a DSP.
+ *
+ * FUNCTION
+ *  This function looks up the host state of the specified DSP in the table
+ *  attached to the card by gpakAttachDsps().
+ *
+ * RETURNS
+ *  Pointer to the DSP's state, NULL if the card has no such DSP.
+ *
+ */
+static gpakDspCtx_t *gpakGetDsp(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
+								unsigned short int DspId	/* DSP Identifier */
+	)
+{
+	struct gpakDspTable *pTable = r1t1_card->gpak_dsps;
 
-/* Host variables related to Host to DSP interface. */
-static DSP_ADDRESS pDspIfBlk[MAX_DSP_CORES];	/* DSP address of I/F block */
-static DSP_WORD MaxCmdMsgLen[MAX_DSP_CORES];	/* max Cmd msg length (octets) */
-static unsigned short int MaxChannels[MAX_DSP_CORES];	/* max num channels */
+	if ((pTable == NULL) || (DspId < pTable->FirstDspId) ||
+		(DspId >= pTable->FirstDspId + pTable->NumDsps))
+		return (NULL);
 
-//static unsigned short int MaxPktChannels[MAX_DSP_CORES]; /* max num pkt channels */
-//static unsigned short int MaxConfs[MAX_DSP_CORES];    /* max num conferences */
-//static DSP_ADDRESS pPktInBufr[MAX_DSP_CORES][MAX_PKT_CHANNELS];  /* Pkt In buffer */
-//static DSP_ADDRESS pPktOutBufr[MAX_DSP_CORES][MAX_PKT_CHANNELS]; /* Pkt Out buffer */
-static DSP_ADDRESS pEventFifoAddress[MAX_DSP_CORES];	/* event fifo */
+	return (&pTable->Dsp[DspId - pTable->FirstDspId]);
+}
 
-static unsigned char DlByteBufr[DOWNLOAD_BLOCK_SIZE * 2];	/* Download byte buf */
-static DSP_WORD DlWordBufr[DOWNLOAD_BLOCK_SIZE];	/* Download word buffer */
-static DSP_WORD DlWordChek[DOWNLOAD_BLOCK_SIZE];	/* Check word buffer */
+int gpakAttachDsps(struct r1t1_card *r1t1_card,	/* Card containing the DSPs */
+				   unsigned short int FirstDspId,	// DSP Identifier of the first DSP
+				   unsigned short int NumDsps	// number of DSPs on the card
+	)
+{
+	struct gpakDspTable *pTable;
+
+	pTable = kmalloc(sizeof(*pTable) + NumDsps * sizeof(gpakDspCtx_t), GFP_KERNEL);
+	if (pTable == NULL)
+		return -ENOMEM;
+
+	memset(pTable, 0, sizeof(*pTable) + NumDsps * sizeof(gpakDspCtx_t));
+	pTable->FirstDspId = FirstDspId;
+	pTable->NumDsps = NumDsps;
+	r1t1_card->gpak_dsps = pTable;
+
+	return 0;
+}
+
+void gpakDetachDsps(struct r1t1_card *r1t1_card	/* Card containing the DSPs */
+	)
+{
+	kfree(r1t1_card->gpak_dsps);
+	r1t1_card->gpak_dsps = NULL;
+}
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * CheckDspReset - Check if the DSP was reset.
@@ -105,6 +167,8 @@ static DSP_WORD DlWordChek[DOWNLOAD_BLOCK_SIZE];	/* Check word buffer */
  * FUNCTION
  *  This function determines if the DSP was reset and is ready. If reset
  *  occurred, it reads interface parameters and calculates DSP addresses.
+ *  Once the Interface Block is known only its status word is read; the
+ *  cached addresses are dropped as soon as the status shows a reset.
  *
  * RETURNS
  *  -1 = DSP is not ready.
@@ -116,6 +180,7 @@ static int CheckDspReset(struct r1t1_card *r1t1_card,	/* Card containing the DSP
 						 int DspId	/* DSP Identifier (0 to MaxDSPCores-1) */
 	)
 {
+	gpakDspCtx_t *pDsp = gpakGetDsp(r1t1_card, DspId);	/* DSP host state */
 	DSP_ADDRESS IfBlockPntr;	/* Interface Block pointer */
 	DSP_WORD DspStatus;			/* DSP Status */
 	DSP_WORD DspChannels;		/* number of DSP channels */
@@ -124,6 +189,17 @@ static int CheckDspReset(struct r1t1_card *r1t1_card,	/* Card containing the DSP
 	DSP_WORD Temp[2];
 //    unsigned short int i;    /* loop index / counter */
 
+	/* As long as the DSP keeps the host's status the cached interface
+	   parameters are still valid. */
+	if (pDsp->pDspIfBlk != 0) {
+		gpakReadDspMemory(r1t1_card, DspId, pDsp->pDspIfBlk + DSP_STATUS_OFFSET, 1,
+						  &DspStatus);
+		if (DspStatus == HOST_INIT_STATUS)
+			return (0);
+		pDsp->ResetSeen = 1;
+		pDsp->pDspIfBlk = 0;
+	}
+
 	/* Read the pointer to the Interface Block. */
 	gpakReadDspMemory(r1t1_card, DspId, DSP_IFBLK_ADDRESS, 2, Temp);
 	RECONSTRUCT_LONGWORD(IfBlockPntr, Temp);
@@ -138,23 +214,23 @@ static int CheckDspReset(struct r1t1_card *r1t1_card,	/* Card containing the DSP
 
 	/* If status indicates the DSP was reset, read the DSP's interface
 	   parameters and calculate DSP addresses. */
-//    printk("if DspStatus %x DSP_INIT_STATUS %x or pDspIfBlk[DspId] %x HOST_INIT_STATUS %x\n",
-//    DspStatus, DSP_INIT_STATUS, pDspIfBlk[DspId], HOST_INIT_STATUS);
+//    printk("if DspStatus %x DSP_INIT_STATUS %x or pDsp->pDspIfBlk %x HOST_INIT_STATUS %x\n",
+//    DspStatus, DSP_INIT_STATUS, pDsp->pDspIfBlk, HOST_INIT_STATUS);
 	if (DspStatus == DSP_INIT_STATUS ||
-		((DspStatus == HOST_INIT_STATUS) && (pDspIfBlk[DspId] == 0))) {
+		((DspStatus == HOST_INIT_STATUS) && (pDsp->pDspIfBlk == 0))) {
 		/* Save the address of the DSP's Interface Block. */
-		pDspIfBlk[DspId] = IfBlockPntr;
+		pDsp->pDspIfBlk = IfBlockPntr;
 
 		/* Read the DSP's interface parameters. */
 		gpakReadDspMemory(r1t1_card, DspId, IfBlockPntr + MAX_CMD_MSG_LEN_OFFSET, 1,
-						  &(MaxCmdMsgLen[DspId]));
+						  &(pDsp->MaxCmdMsgLen));
 
 		/* read the number of configured DSP channels */
 		gpakReadDspMemory(r1t1_card, DspId, IfBlockPntr + NUM_CHANNELS_OFFSET, 1, &DspChannels);
 		if (DspChannels > MAX_CHANNELS)
-			MaxChannels[DspId] = MAX_CHANNELS;
+			pDsp->MaxChannels = MAX_CHANNELS;
 		else
-			MaxChannels[DspId] = (unsigned short int) DspChannels;
+			pDsp->MaxChannels = (unsigned short int) DspChannels;
 #if 0
 		/* read the number of configured DSP conferences */
 		gpakReadDspMemory(r1t1_card, DspId, IfBlockPntr + NUM_CONFERENCES_OFFSET, 1, &DspConfs);
@@ -189,9 +265,15 @@ static int CheckDspReset(struct r1t1_card *r1t1_card,	/* Card containing the DSP
 		if (r1t1_card->dsp_type == DSP_5510) {
 			/* read the pointer to the event fifo info struct */
 			gpakReadDspMemory(r1t1_card, DspId, IfBlockPntr + EVENT_MSG_PNTR_OFFSET, 2, Temp);
-			RECONSTRUCT_LONGWORD(pEventFifoAddress[DspId], Temp);
+			RECONSTRUCT_LONGWORD(pDsp->pEventFifoAddress, Temp);
 		}
 
+		/* read the Command and Reply message buffer pointers */
+		gpakReadDspMemory(r1t1_card, DspId, IfBlockPntr + CMD_MSG_PNTR_OFFSET, 2, Temp);
+		RECONSTRUCT_LONGWORD(pDsp->pCmdMsgBufr, Temp);
+		gpakReadDspMemory(r1t1_card, DspId, IfBlockPntr + REPLY_MSG_PNTR_OFFSET, 2, Temp);
+		RECONSTRUCT_LONGWORD(pDsp->pReplyMsgBufr, Temp);
+
 		/* Set the DSP Status to indicate the host recognized the reset. */
 		DspStatus = HOST_INIT_STATUS;
 		gpakWriteDspMemory(r1t1_card, DspId, IfBlockPntr + DSP_STATUS_OFFSET, 1, &DspStatus);
@@ -202,7 +284,7 @@ static int CheckDspReset(struct r1t1_card *r1t1_card,	/* Card containing the DSP
 
 	/* If status doesn't indicate the host recognized a reset, return with an
 	   indication the DSP is not ready. */
-	if ((DspStatus != HOST_INIT_STATUS) || (pDspIfBlk[DspId] == 0))
+	if ((DspStatus != HOST_INIT_STATUS) || (pDsp->pDspIfBlk == 0))
 		return (-1);
 
 	/* Return with an indication that a reset did not occur. */
@@ -229,36 +311,33 @@ static int WriteDspCmdMessage(struct r1t1_card *r1t1_card,	/* Card containing th
 							  DSP_WORD MsgLength	/* length of message (octets) */
 	)
 {
+	gpakDspCtx_t *pDsp = gpakGetDsp(r1t1_card, DspId);	/* DSP host state */
 	DSP_WORD CmdMsgLength;		/* current Cmd message length */
-	DSP_WORD Temp[2];
-	DSP_ADDRESS BufferPointer;	/* message buffer pointer */
 
 	/* Check if the DSP was reset and is ready. */
 	if (CheckDspReset(r1t1_card, DspId) == -1)
 		return (-1);
 
 	/* Make sure the message length is valid. */
-	if ((MsgLength < 1) || (MsgLength > MaxCmdMsgLen[DspId]))
+	if ((MsgLength < 1) || (MsgLength > pDsp->MaxCmdMsgLen))
 		return (-1);
 
 	/* Make sure a previous Command message is not in use by the DSP. */
-	gpakReadDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + CMD_MSG_LEN_OFFSET, 1, &CmdMsgLength);
+	gpakReadDspMemory(r1t1_card, DspId, pDsp->pDspIfBlk + CMD_MSG_LEN_OFFSET, 1, &CmdMsgLength);
 	if (CmdMsgLength != 0)
 		return (0);
 
 	/* Purge any previous Reply message that wasn't read. */
-	gpakWriteDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + REPLY_MSG_LEN_OFFSET, 1,
+	gpakWriteDspMemory(r1t1_card, DspId, pDsp->pDspIfBlk + REPLY_MSG_LEN_OFFSET, 1,
 					   &CmdMsgLength);
 
 	/* Copy the Command message into DSP memory. */
-	gpakReadDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + CMD_MSG_PNTR_OFFSET, 2, Temp);
-	RECONSTRUCT_LONGWORD(BufferPointer, Temp);
-	gpakWriteDspMemory(r1t1_card, DspId, BufferPointer, (MsgLength + 1) / 2, pMessage);
+	gpakWriteDspMemory(r1t1_card, DspId, pDsp->pCmdMsgBufr, (MsgLength + 1) / 2, pMessage);
 
 	/* Store the message length in DSP's Command message length (flags DSP that
 	   a Command message is ready). */
 	CmdMsgLength = MsgLength;
-	gpakWriteDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + CMD_MSG_LEN_OFFSET, 1,
+	gpakWriteDspMemory(r1t1_card, DspId, pDsp->pDspIfBlk + CMD_MSG_LEN_OFFSET, 1,
 					   &CmdMsgLength);
 
 	/* Return with an indication the message was written. */
@@ -284,16 +363,15 @@ static int ReadDspReplyMessage(struct r1t1_card *r1t1_card,	/* Card containing t
 							   DSP_WORD * pMsgLength	/* pointer to msg length var (octets) */
 	)
 {
+	gpakDspCtx_t *pDsp = gpakGetDsp(r1t1_card, DspId);	/* DSP host state */
 	DSP_WORD MsgLength;			/* message length */
-	DSP_ADDRESS BufferPointer;	/* message buffer pointer */
-	DSP_WORD Temp[2];
 
 	/* Check if the DSP was reset and is ready. */
 	if (CheckDspReset(r1t1_card, DspId) == -1)
 		return (-1);
 
 	/* Check if a Reply message is ready. */
-	gpakReadDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + REPLY_MSG_LEN_OFFSET, 1, &MsgLength);
+	gpakReadDspMemory(r1t1_card, DspId, pDsp->pDspIfBlk + REPLY_MSG_LEN_OFFSET, 1, &MsgLength);
 	if (MsgLength == 0)
 		return (0);
 
@@ -302,16 +380,14 @@ static int ReadDspReplyMessage(struct r1t1_card *r1t1_card,	/* Card containing t
 		return (-1);
 
 	/* Copy the Reply message from DSP memory. */
-	gpakReadDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + REPLY_MSG_PNTR_OFFSET, 2, Temp);
-	RECONSTRUCT_LONGWORD(BufferPointer, Temp);
-	gpakReadDspMemory(r1t1_card, DspId, BufferPointer, (MsgLength + 1) / 2, pMessage);
+	gpakReadDspMemory(r1t1_card, DspId, pDsp->pReplyMsgBufr, (MsgLength + 1) / 2, pMessage);
 
 	/* Store the message length in the message length variable. */
 	*pMsgLength = MsgLength;
 
 	/* Indicate a Reply message is not ready. */
 	MsgLength = 0;
-	gpakWriteDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + REPLY_MSG_LEN_OFFSET, 1, &MsgLength);
+	gpakWriteDspMemory(r1t1_card, DspId, pDsp->pDspIfBlk + REPLY_MSG_LEN_OFFSET, 1, &MsgLength);
 
 	/* Return with an indication the message was read. */
 	return (1);
@@ -422,8 +498,11 @@ static unsigned int TransactCmd(struct r1t1_card *r1t1_card,	/* Card containing
 								DSP_WORD ReplyCheckValue	/* reply check value */
 	)
 {
+	gpakDspCtx_t *pDsp = gpakGetDsp(r1t1_card, DspId);	/* DSP host state */
 	int FuncStatus;				/* function status */
-	int LoopCount;				/* wait loop counter */
+	unsigned long Deadline;		/* time to give up waiting (jiffies) */
+	ktime_t StartTime;			/* time the transaction started */
+	unsigned int ElapsedNs;		/* duration of the transaction */
 	DSP_WORD RcvReplyLength;	/* received Reply message length */
 	DSP_WORD RcvReplyType;		/* received Reply message type code */
 	DSP_WORD RetValue;			/* return value */
@@ -434,21 +513,23 @@ static unsigned int TransactCmd(struct r1t1_card *r1t1_card,	/* Card containing
 	/* Lock access to the DSP. */
 	gpakLockAccess(r1t1_card, DspId);
 
+	StartTime = ktime_get();
+	Deadline = jiffies + msecs_to_jiffies(GPAK_REPLY_TIMEOUT_MS);
 
 	/* Attempt to write the command message to the DSP. */
-	LoopCount = 0;
 	while ((FuncStatus = WriteDspCmdMessage(r1t1_card, DspId, pMsgBufr, CmdLength)) != 1) {
 		if (FuncStatus == -1)
 			break;
-		if (++LoopCount > MAX_WAIT_LOOPS)
+		if (time_after(jiffies, Deadline))
 			break;
-		gpakHostDelay();
+		gpakHostPoll();
 	}
 
 	/* Attempt to read the reply message from the DSP if the command message was
 	   sent successfully. */
 	if (FuncStatus == 1) {
-		for (LoopCount = 0; LoopCount < MAX_WAIT_LOOPS; LoopCount++) {
+		Deadline = jiffies + msecs_to_jiffies(GPAK_REPLY_TIMEOUT_MS);
+		for (;;) {
 			RcvReplyLength = MSG_BUFFER_SIZE * 2;
 			FuncStatus = ReadDspReplyMessage(r1t1_card, DspId, pMsgBufr, &RcvReplyLength);
 			if (FuncStatus == 1) {
@@ -462,10 +543,20 @@ static unsigned int TransactCmd(struct r1t1_card *r1t1_card,	/* Card containing
 					break;
 			} else if (FuncStatus == -1)
 				break;
-			gpakHostDelay();
+			if (time_after(jiffies, Deadline))
+				break;
+			gpakHostPoll();
 		}
 	}
 
+	ElapsedNs = (unsigned int) ktime_to_ns(ktime_sub(ktime_get(), StartTime));
+	pDsp->CmdStats.Commands++;
+	if (RetValue == 0)
+		pDsp->CmdStats.Failures++;
+	pDsp->CmdStats.TotalNs += ElapsedNs;
+	if (ElapsedNs > pDsp->CmdStats.MaxNs)
+		pDsp->CmdStats.MaxNs = ElapsedNs;
+
 	/* Unlock access to the DSP. */
 	gpakUnlockAccess(r1t1_card, DspId);
 
@@ -492,7 +583,7 @@ gpakConfigPortStatus_t gpakConfigurePorts(struct r1t1_card * r1t1_card,	/* Card
 	DSP_WORD MsgBuffer[MSG_BUFFER_SIZE];	/* message buffer */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	if (gpakGetDsp(r1t1_card, DspId) == NULL)
 		return (CpsInvalidDsp);
 
 	/* Build the Configure Serial Ports message. */
@@ -611,15 +702,17 @@ gpakConfigChanStatus_t gpakConfigureChannel(struct r1t1_card * r1t1_card,	/* Car
 											GPAK_ChannelConfigStat_t * pStatus	/* pointer to Channel Config Status */
 	)
 {
+	gpakDspCtx_t *pDsp;		/* DSP host state */
 	DSP_WORD MsgBuffer[MSG_BUFFER_SIZE];	/* message buffer */
 	DSP_WORD MsgLength;			/* message length */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
 		return (CcsInvalidDsp);
 
 	/* Make sure the Channel Id is valid. */
-	if (ChannelId >= MaxChannels[DspId])
+	if (ChannelId >= pDsp->MaxChannels)
 		return (CcsInvalidChannel);
 
 	/* Build the Configure Channel message based on the Channel Type. */
@@ -762,14 +855,16 @@ gpakTearDownStatus_t gpakTearDownChannel(struct r1t1_card * r1t1_card,	/* Card c
 										 GPAK_TearDownChanStat_t * pStatus	/* pointer to Tear Down Status */
 	)
 {
+	gpakDspCtx_t *pDsp;		/* DSP host state */
 	DSP_WORD MsgBuffer[MSG_BUFFER_SIZE];	/* message buffer */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
 		return (TdsInvalidDsp);
 
 	/* Make sure the Channel Id is valid. */
-	if (ChannelId >= MaxChannels[DspId])
+	if (ChannelId >= pDsp->MaxChannels)
 		return (TdsInvalidChannel);
 
 	/* Build the Tear Down Channel message. */
@@ -808,14 +903,16 @@ gpakAlgControlStat_t gpakAlgControl(struct r1t1_card * r1t1_card,	/* Card contai
 									GPAK_AlgControlStat_t * pStatus	// pointer to return status
 	)
 {
+	gpakDspCtx_t *pDsp;		/* DSP host state */
 	DSP_WORD MsgBuffer[MSG_BUFFER_SIZE];	/* message buffer */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
 		return (AcInvalidDsp);
 
 	/* Make sure the Channel Id is valid. */
-	if (ChannelId >= MaxChannels[DspId])
+	if (ChannelId >= pDsp->MaxChannels)
 		return (AcInvalidChannel);
 
 	MsgBuffer[0] = MSG_ALG_CONTROL << 8;
@@ -840,6 +937,240 @@ gpakAlgControlStat_t gpakAlgControl(struct r1t1_card * r1t1_card,	/* Card contai
 
 }
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakCmdQueueWork - Transact the commands queued for a DSP.
+ *
+ * FUNCTION
+ *  This function runs from the DSP's work item. It transacts the pending
+ *  commands in order and calls each command's completion callback. The
+ *  callback may queue further commands.
+ *
+ * RETURNS
+ *  nothing
+ *
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void gpakCmdQueueWork(void *data)
+{
+	gpakCmdQueue_t *pQueue = data;
+#else
+static void gpakCmdQueueWork(struct work_struct *work)
+{
+	gpakCmdQueue_t *pQueue = container_of(work, gpakCmdQueue_t, Work);
+#endif
+	gpakDspCtx_t *pDsp = container_of(pQueue, gpakDspCtx_t, CmdQueue);
+	gpakCmd_t *pCmd;
+	unsigned long flags;
+	unsigned int ElapsedNs;
+
+	spin_lock_irqsave(&pQueue->Lock, flags);
+	while (!list_empty(&pQueue->Pending)) {
+		pCmd = list_entry(pQueue->Pending.next, gpakCmd_t, Node);
+		list_del_init(&pCmd->Node);
+		spin_unlock_irqrestore(&pQueue->Lock, flags);
+
+		memcpy(pQueue->MsgBuffer, pCmd->MsgBuffer, sizeof(pCmd->MsgBuffer));
+		pCmd->RcvLength = TransactCmd(pQueue->pCard, pQueue->DspId, pQueue->MsgBuffer,
+									  pCmd->CmdLength, pCmd->ReplyType,
+									  pCmd->ReplyLength, pCmd->ReplyCheckType,
+									  pCmd->ReplyCheckValue);
+		memcpy(pCmd->MsgBuffer, pQueue->MsgBuffer, sizeof(pCmd->MsgBuffer));
+
+		ElapsedNs = (unsigned int) ktime_to_ns(ktime_sub(ktime_get(), pCmd->QueuedAt));
+		pDsp->CmdStats.Queued++;
+		pDsp->CmdStats.QueuedNs += ElapsedNs;
+		if (ElapsedNs > pDsp->CmdStats.QueuedMaxNs)
+			pDsp->CmdStats.QueuedMaxNs = ElapsedNs;
+
+		pCmd->pDone(pCmd);
+
+		spin_lock_irqsave(&pQueue->Lock, flags);
+	}
+	spin_unlock_irqrestore(&pQueue->Lock, flags);
+}
+
+int gpakStartCmdQueue(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
+					  unsigned short int DspId,	// DSP identifier
+					  struct workqueue_struct *pWorkQueue	// queue running the commands
+	)
+{
+	gpakDspCtx_t *pDsp;		/* DSP host state */
+	gpakCmdQueue_t *pQueue;
+
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if ((pDsp == NULL) || (pWorkQueue == NULL))
+		return -EINVAL;
+
+	pQueue = &pDsp->CmdQueue;
+	pQueue->pCard = r1t1_card;
+	pQueue->DspId = DspId;
+	spin_lock_init(&pQueue->Lock);
+	INIT_LIST_HEAD(&pQueue->Pending);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&pQueue->Work, gpakCmdQueueWork, pQueue);
+#else
+	INIT_WORK(&pQueue->Work, gpakCmdQueueWork);
+#endif
+	memset(&pDsp->CmdStats, 0, sizeof(pDsp->CmdStats));
+	pQueue->pWorkQueue = pWorkQueue;
+
+	return 0;
+}
+
+void gpakStopCmdQueue(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
+					  unsigned short int DspId	// DSP identifier
+	)
+{
+	gpakDspCtx_t *pDsp;		/* DSP host state */
+	gpakCmdQueue_t *pQueue;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+	struct workqueue_struct *pWorkQueue;
+#endif
+	gpakCmd_t *pCmd;
+	unsigned long flags;
+
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
+		return;
+
+	pQueue = &pDsp->CmdQueue;
+	if ((pQueue->pCard != r1t1_card) || (pQueue->pWorkQueue == NULL))
+		return;
+
+	spin_lock_irqsave(&pQueue->Lock, flags);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+	pWorkQueue = pQueue->pWorkQueue;
+#endif
+	pQueue->pWorkQueue = NULL;
+	spin_unlock_irqrestore(&pQueue->Lock, flags);
+
+	/* Only this DSP's work is waited for, the caller may run on the same queue */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	cancel_work_sync(&pQueue->Work);
+#else
+	flush_workqueue(pWorkQueue);
+#endif
+
+	/* Nothing can be queued any more, fail whatever is left. */
+	while (!list_empty(&pQueue->Pending)) {
+		pCmd = list_entry(pQueue->Pending.next, gpakCmd_t, Node);
+		list_del_init(&pCmd->Node);
+		pCmd->RcvLength = 0;
+		pCmd->pDone(pCmd);
+	}
+	pQueue->pCard = NULL;
+}
+
+static int gpakQueueCmd(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
+						unsigned short int DspId,	// DSP identifier
+						gpakCmd_t * pCmd	// caller's command descriptor
+	)
+{
+	gpakDspCtx_t *pDsp = gpakGetDsp(r1t1_card, DspId);	/* DSP host state */
+	gpakCmdQueue_t *pQueue = &pDsp->CmdQueue;
+	unsigned long flags;
+	int res = 0;
+
+	spin_lock_irqsave(&pQueue->Lock, flags);
+	if ((pQueue->pCard != r1t1_card) || (pQueue->pWorkQueue == NULL)) {
+		res = -ENODEV;
+	} else {
+		pCmd->RcvLength = 0;
+		pCmd->QueuedAt = ktime_get();
+		list_add_tail(&pCmd->Node, &pQueue->Pending);
+		queue_work(pQueue->pWorkQueue, &pQueue->Work);
+	}
+	spin_unlock_irqrestore(&pQueue->Lock, flags);
+
+	return res;
+}
+
+int gpakQueueAlgControl(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
+						unsigned short int DspId,	// DSP identifier
+						unsigned short int ChannelId,	// channel identifier
+						GpakAlgCtrl_t ControlCode,	// algorithm control code
+						gpakCmd_t * pCmd	// caller's command descriptor
+	)
+{
+	gpakDspCtx_t *pDsp;		/* DSP host state */
+	/* Make sure the DSP Id is valid. */
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
+		return -EINVAL;
+
+	/* Make sure the Channel Id is valid. */
+	if (ChannelId >= pDsp->MaxChannels)
+		return -EINVAL;
+
+	pCmd->MsgBuffer[0] = MSG_ALG_CONTROL << 8;
+	pCmd->MsgBuffer[1] = (DSP_WORD) ((ChannelId << 8) | (ControlCode & 0xFF));
+	pCmd->CmdLength = 4;
+	pCmd->ReplyType = MSG_ALG_CONTROL_REPLY;
+	pCmd->ReplyLength = 4;
+	pCmd->ReplyCheckType = 1;
+	pCmd->ReplyCheckValue = (DSP_WORD) ChannelId;
+
+	return gpakQueueCmd(r1t1_card, DspId, pCmd);
+}
+
+gpakAlgControlStat_t gpakAlgControlResult(gpakCmd_t * pCmd	// completed command
+	)
+{
+	if (pCmd->RcvLength == 0)
+		return (AcDspCommFailure);
+
+	if ((GPAK_AlgControlStat_t) (pCmd->MsgBuffer[1] & 0xFF) == Ac_Success)
+		return (AcSuccess);
+	else
+		return (AcParmError);
+}
+
+void gpakReadCmdStats(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
+					  unsigned short int DspId,	// DSP identifier
+					  gpakCmdStats_t * pStats	// pointer to statistics copy
+	)
+{
+	gpakDspCtx_t *pDsp;		/* DSP host state */
+
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL) {
+		memset(pStats, 0, sizeof(*pStats));
+		return;
+	}
+
+	*pStats = pDsp->CmdStats;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakTestDspReset - Test and clear a DSP's reset indication.
+ *
+ * FUNCTION
+ *  This function tells whether the DSP was found to have lost the status the
+ *  host left in its interface block, i.e. was reset, since it was last asked.
+ *
+ * RETURNS
+ *  1 if the DSP was reset, 0 otherwise.
+ *
+ */
+int gpakTestDspReset(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
+					 unsigned short int DspId	// DSP identifier
+	)
+{
+	gpakDspCtx_t *pDsp;		/* DSP host state */
+	int Reset;
+
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
+		return (0);
+
+	gpakLockAccess(r1t1_card, DspId);
+	Reset = pDsp->ResetSeen;
+	pDsp->ResetSeen = 0;
+	gpakUnlockAccess(r1t1_card, DspId);
+
+	return (Reset);
+}
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * gpakReadEventFIFOMessage - read from the event fifo
  * 
@@ -863,6 +1194,7 @@ gpakReadEventFIFOMessageStat_t gpakReadEventFIFOMessage(struct r1t1_card * r1t1_
 														GpakAsyncEventData_t * pEventData	// pointer to Event Data Struct
 	)
 {
+	gpakDspCtx_t *pDsp;		/* DSP host state */
 	DSP_WORD WordBuffer[WORD_BUFFER_SIZE];	/* DSP words buffer */
 	GpakAsyncEventCode_t EventCode;	/* DSP's event code */
 	DSP_WORD EventDataLength;	/* Length of event to read */
@@ -879,7 +1211,8 @@ gpakReadEventFIFOMessageStat_t gpakReadEventFIFOMessage(struct r1t1_card * r1t1_
 //    DSP_WORD *pDebugData;   /* debug data buffer pointer in event data struct */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
 		return (RefInvalidDsp);
 
 	/* Lock access to the DSP. */
@@ -892,7 +1225,7 @@ gpakReadEventFIFOMessageStat_t gpakReadEventFIFOMessage(struct r1t1_card * r1t1_
 	}
 
 	/* Check if an event message is ready in the DSP. */
-	EventInfoAddress = pEventFifoAddress[DspId];
+	EventInfoAddress = pDsp->pEventFifoAddress;
 	gpakReadDspMemory(r1t1_card, DspId, EventInfoAddress, CIRC_BUFFER_INFO_STRUCT_SIZE,
 					  WordBuffer);
 	RECONSTRUCT_LONGWORD(BufrBaseAddress, ((DSP_WORD *) & WordBuffer[CB_BUFR_BASE]));
@@ -985,7 +1318,7 @@ gpakPingDspStat_t gpakPingDsp(struct r1t1_card * r1t1_card,	/* Card containing t
 	//printk("pDspIfBlk = %x, MaxCmdMsgLen = %x, MaxChannels = %x\n",pDspIfBlk[0], MaxCmdMsgLen[0], MaxChannels[0]);
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	if (gpakGetDsp(r1t1_card, DspId) == NULL)
 		return (PngInvalidDsp);
 
 	/* send value of 1, DSP increments it */
@@ -1025,15 +1358,17 @@ gpakSerialTxFixedValueStat_t gpakSerialTxFixedValue(struct r1t1_card * r1t1_card
 													GpakActivation State	// activation state
 	)
 {
+	gpakDspCtx_t *pDsp;		/* DSP host state */
 	DSP_WORD MsgBuffer[MSG_BUFFER_SIZE];	/* message buffer */
 	DSP_WORD DspStatus;			/* DSP's reply status */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
 		return (TfvInvalidDsp);
 
 	/* Make sure the Channel Id is valid. */
-	if (ChannelId >= MaxChannels[DspId])
+	if (ChannelId >= pDsp->MaxChannels)
 		return (TfvInvalidChannel);
 
 
@@ -1080,7 +1415,7 @@ gpakControlTdmLoopBackStat_t gpakControlTdmLoopBack(struct r1t1_card * r1t1_card
 	DSP_WORD DspStatus;			/* DSP's reply status */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	if (gpakGetDsp(r1t1_card, DspId) == NULL)
 		return (ClbInvalidDsp);
 
 	/* Build the message. */
@@ -1120,21 +1455,25 @@ gpakReadCpuUsageStat_t gpakReadCpuUsage(struct r1t1_card * r1t1_card,	/* Card co
 										unsigned short int *pPrev1SecPeakUsage	// peak usage over previous 1 second   
 	)
 {
+	gpakDspCtx_t *pDsp;		/* DSP host state */
 	DSP_WORD ReadBuffer[2];		/* DSP read buffer */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
 		return (RcuInvalidDsp);
 
 	/* Lock access to the DSP. */
 	gpakLockAccess(r1t1_card, DspId);
 
 	/* Check if the DSP was reset and is ready. */
-	if (CheckDspReset(r1t1_card, DspId) == -1)
+	if (CheckDspReset(r1t1_card, DspId) == -1) {
+		gpakUnlockAccess(r1t1_card, DspId);
 		return (RcuDspCommFailure);
+	}
 
 	/* Read the CPU Usage statistics from the DSP. */
-	gpakReadDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + CPU_USAGE_OFFSET, 2, ReadBuffer);
+	gpakReadDspMemory(r1t1_card, DspId, pDsp->pDspIfBlk + CPU_USAGE_OFFSET, 2, ReadBuffer);
 
 	/* Unlock access to the DSP. */
 	gpakUnlockAccess(r1t1_card, DspId);
@@ -1164,7 +1503,7 @@ gpakResetCpuUsageStat_t gpakResetCpuUsageStats(struct r1t1_card * r1t1_card,	/*
 	DSP_WORD DspStatus;			/* DSP's reply status */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	if (gpakGetDsp(r1t1_card, DspId) == NULL)
 		return (RstcInvalidDsp);
 
 	MsgBuffer[0] = (MSG_RESET_USAGE_STATS << 8);
@@ -1201,25 +1540,29 @@ gpakReadFramingStatsStatus_t gpakReadFramingStats(struct r1t1_card * r1t1_card,
 												  unsigned short int *pDmaSlipStatsBuffer	// DMA slips count
 	)
 {
+	gpakDspCtx_t *pDsp;		/* DSP host state */
 	DSP_WORD ReadBuffer[10];	/* DSP read buffer */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
 		return (RfsInvalidDsp);
 
 	/* Lock access to the DSP. */
 	gpakLockAccess(r1t1_card, DspId);
 
 	/* Check if the DSP was reset and is ready. */
-	if (CheckDspReset(r1t1_card, DspId) == -1)
+	if (CheckDspReset(r1t1_card, DspId) == -1) {
+		gpakUnlockAccess(r1t1_card, DspId);
 		return (RfsDspCommFailure);
+	}
 
 	/* Read the framing interrupt statistics from the DSP. */
 	if (r1t1_card->dsp_type == DSP_5510)
-		gpakReadDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + FRAMING_STATS_OFFSET, 10,
+		gpakReadDspMemory(r1t1_card, DspId, pDsp->pDspIfBlk + FRAMING_STATS_OFFSET, 10,
 						  ReadBuffer);
 	else
-		gpakReadDspMemory(r1t1_card, DspId, pDspIfBlk[DspId] + FRAMING_STATS_OFFSET, 4,
+		gpakReadDspMemory(r1t1_card, DspId, pDsp->pDspIfBlk + FRAMING_STATS_OFFSET, 4,
 						  ReadBuffer);
 
 	/* Unlock access to the DSP. */
@@ -1264,7 +1607,7 @@ gpakResetFramingStatsStatus_t gpakResetFramingStats(struct r1t1_card * r1t1_card
 	DSP_WORD DspStatus;			/* DSP's reply status */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	if (gpakGetDsp(r1t1_card, DspId) == NULL)
 		return (RstfInvalidDsp);
 
 	MsgBuffer[0] = (MSG_RESET_FRAME_STATS << 8);
@@ -1299,97 +1642,81 @@ gpakDownloadStatus_t gpakDownloadDsp_5510(struct r1t1_card * r1t1_card,	/* Card
 										  GPAK_FILE_ID FileId	/* G.PAK Download File Identifier */
 	)
 {
+	gpakDspCtx_t *pDsp;		/* DSP host state */
 	gpakDownloadStatus_t RetStatus;	/* function return status */
-	int NumRead;				/* number of file bytes read */
+	const gpakDlImage_t *pImage;	/* decoded download file */
+	const gpakDlRecord_t *pRecord;	/* current file record */
+	const DSP_WORD *pWords;		/* next record words to write */
+	DSP_WORD *pWordChek;		/* read back buffer */
 	DSP_ADDRESS Address;		/* DSP address */
-	unsigned int WordCount;		/* number of words in record */
+	unsigned int WordCount;		/* number of words left in record */
 	unsigned int NumWords;		/* number of words to read/write */
-	unsigned int i;				/* loop index / counter */
-	unsigned int j;				/* loop index */
-	unsigned int check_count;	/* # of failed checks */
+	unsigned int rec_num;		/* record index */
+	unsigned int check_count;	/* # of attempts to load block */
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	pDsp = gpakGetDsp(r1t1_card, DspId);
+	if (pDsp == NULL)
 		return (GdlInvalidDsp);
 
-	/* Lock access to the DSP. */
-	gpakLockAccess(r1t1_card, DspId);
+	pImage = gpakGetFile_5510(r1t1_card, FileId);
+	if (pImage == NULL)
+		return (GdlFileReadError);
 
-	RetStatus = GdlSuccess;
-	while (RetStatus == GdlSuccess) {
+	pWordChek = kmalloc(DOWNLOAD_BLOCK_SIZE * sizeof(DSP_WORD), GFP_KERNEL);
+	if (pWordChek == NULL)
+		return (GdlFileReadError);
 
-		/* Read a record header from the file. */
-		NumRead = gpakReadFile_5510(r1t1_card, FileId, DlByteBufr, 6);
-		if (NumRead == -1) {
-			RetStatus = GdlFileReadError;
-			break;
-		}
-		if (NumRead != 6) {
-			RetStatus = GdlInvalidFile;
-			break;
-		}
-		Address = (((DSP_ADDRESS) DlByteBufr[1]) << 16) |
-			(((DSP_ADDRESS) DlByteBufr[2]) << 8) | ((DSP_ADDRESS) DlByteBufr[3]);
-		WordCount = (((unsigned int) DlByteBufr[4]) << 8) |
-			((unsigned int) DlByteBufr[5]);
+	/* Lock access to the DSP. */
+	gpakLockAccess(r1t1_card, DspId);
 
-		/* Check for the End Of File record. */
-		if (DlByteBufr[0] == 0xFF)
-			break;
+	/* The image being loaded re-initializes the Interface Block. */
+	pDsp->pDspIfBlk = 0;
 
-		/* Verify the record is for a valid memory type. */
-		if ((DlByteBufr[0] != 0x00) && (DlByteBufr[0] != 0x01)) {
-			RetStatus = GdlInvalidFile;
-			break;
-		}
+	RetStatus = GdlSuccess;
+	for (rec_num = 0; (rec_num < pImage->NumRecords) && (RetStatus == GdlSuccess); rec_num++) {
+		pRecord = &pImage->pRecords[rec_num];
+		Address = pRecord->Address;
+		WordCount = pRecord->NumWords;
+		pWords = pRecord->pWords;
 
-		/* Read a block of words at a time from the file and write to the
-		   DSP's memory . */
+		/* Write a block of words at a time to the DSP's memory. */
 		while (WordCount != 0) {
 			if (WordCount < DOWNLOAD_BLOCK_SIZE)
 				NumWords = WordCount;
 			else
 				NumWords = DOWNLOAD_BLOCK_SIZE;
+
 			WordCount -= NumWords;
-			NumRead = gpakReadFile_5510(r1t1_card, FileId, DlByteBufr, NumWords * 2);
-			if (NumRead == -1) {
-				RetStatus = GdlFileReadError;
-				break;
-			}
-			if (NumRead != (NumWords * 2)) {
-				RetStatus = GdlInvalidFile;
-				break;
-			}
-			for (i = 0, j = 0; i < NumWords; i++, j += 2)
-				DlWordBufr[i] = (((DSP_WORD) DlByteBufr[j]) << 8) |
-					((DSP_WORD) DlByteBufr[j + 1]);
 
 			check_count = 0;
 
 			while (check_count < 4) {
-				gpakWriteDspMemory(r1t1_card, DspId, Address, NumWords, DlWordBufr);
-				gpakReadDspMemory(r1t1_card, DspId, Address, NumWords, DlWordChek);
+				gpakWriteDspMemory(r1t1_card, DspId, Address, NumWords, (DSP_WORD *) pWords);
+				gpakReadDspMemory(r1t1_card, DspId, Address, NumWords, pWordChek);
 
-				if (memcmp(DlWordBufr, DlWordChek, NumWords) == 0)
+				if (memcmp(pWords, pWordChek, NumWords * 2) == 0)
 					break;
 				else
 					check_count++;
 			}
 
-			if (check_count) {
-				if (check_count == 4) {
-					RetStatus = GdlDspCommFailure;
-					printk("Failure to load DSP @ Address 0x%08x\n", Address);
-				}
+			if (check_count == 4) {
+				RetStatus = GdlDspCommFailure;
+				printk("Failure to load DSP @ Address 0x%08x\n", Address);
+				break;
 			}
 
 			Address += ((DSP_ADDRESS) NumWords);
+			pWords += NumWords;
 		}
 	}
 
 	/* Unlock access to the DSP. */
 	gpakUnlockAccess(r1t1_card, DspId);
 
+	kfree(pWordChek);
+
 	/* Return with an indication of success or failure. */
 	return (RetStatus);
 }
@@ -1417,7 +1744,7 @@ gpakReadDSPMemoryStat_t gpakReadDSPMemoryMap(struct r1t1_card * r1t1_card,	// Ca
 
 
 	/* Make sure the DSP Id is valid. */
-	if (DspId >= MAX_DSP_CORES)
+	if (gpakGetDsp(r1t1_card, DspId) == NULL)
 		return (RmmInvalidDsp);
 
 	/* Verify the message buffer is large enough  */
@@ -25,9 +25,11 @@
 
 
 /* Host and DSP system dependent related definitions. */
-#define MAX_DSP_CORES 16		/* maximum number of DSP cores */
 #define MAX_CHANNELS 48			/* maximum number of channels */
 #define MAX_WAIT_LOOPS 50		/* max number of wait delay loops */
+#define GPAK_POLL_MIN_US 100	/* min reply polling interval (usecs) */
+#define GPAK_POLL_MAX_US 200	/* max reply polling interval (usecs) */
+#define GPAK_REPLY_TIMEOUT_MS 250	/* time allowed for a DSP reply (msecs) */
 #define DSP_IFBLK_ADDRESS 0x0100	/* DSP address of I/F block pointer */
 #define DOWNLOAD_BLOCK_SIZE 512	/* download block size (DSP words) */
 
@@ -55,7 +57,7 @@ extern void r1t1_card_hpic_set(struct r1t1_card *r1t1_card, __u16 hpic_data);
  *
  */
 extern void gpakReadDspMemory(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
-							  unsigned short int DspId,	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+							  unsigned short int DspId,	/* DSP Identifier */
 							  DSP_ADDRESS DspAddress,	/* DSP's memory address of first word */
 							  unsigned int NumWords,	/* number of contiguous words to read */
 							  DSP_WORD * pWordValues	/* pointer to array of word values variable */
@@ -74,7 +76,7 @@ extern void gpakReadDspMemory(struct r1t1_card *r1t1_card,	/* Card containing th
  *
  */
 extern void gpakWriteDspMemory(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
-							   unsigned short int DspId,	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+							   unsigned short int DspId,	/* DSP Identifier */
 							   DSP_ADDRESS DspAddress,	/* DSP's memory address of first word */
 							   unsigned int NumWords,	/* number of contiguous words to write */
 							   DSP_WORD * pWordValues	/* pointer to array of word values to write */
@@ -96,6 +98,21 @@ extern void gpakWriteDspMemory(struct r1t1_card *r1t1_card,	/* Card containing t
 extern void gpakHostDelay(void);
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakHostPoll - Delay for one reply polling interval.
+ *
+ * FUNCTION
+ *  This function sleeps for GPAK_POLL_MIN_US to GPAK_POLL_MAX_US before
+ *  returning. It is used to poll a DSP for replies to command messages, which
+ *  usually arrive well within a millisecond.
+ *
+ * RETURNS
+ *  nothing
+ *
+ */
+extern void gpakHostPoll(void);
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * gpakLockAccess - Lock access to the specified DSP.
  *
@@ -107,7 +124,7 @@ extern void gpakHostDelay(void);
  *
  */
 extern void gpakLockAccess(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
-						   unsigned short int DspId	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+						   unsigned short int DspId	/* DSP Identifier */
 	);
 
 
@@ -122,27 +139,81 @@ extern void gpakLockAccess(struct r1t1_card *r1t1_card,	/* Card containing the D
  *
  */
 extern void gpakUnlockAccess(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
-							 unsigned short int DspId	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+							 unsigned short int DspId	/* DSP Identifier */
 	);
 
 
+/* Pre-decoded G.PAK download file record. */
+typedef struct gpakDlRecord {
+	unsigned char MemType;		/* record memory type (0x00 or 0x01) */
+	DSP_ADDRESS Address;		/* DSP address of first word */
+	unsigned int NumWords;		/* number of words in record */
+	const DSP_WORD *pWords;		/* record words in host byte order */
+} gpakDlRecord_t;
+
+/* Pre-decoded G.PAK download file, shared read-only by all DSPs. */
+typedef struct gpakDlImage {
+	unsigned int FileSize;		/* size of the raw file (bytes) */
+	unsigned int NumRecords;	/* number of memory records */
+	unsigned int NumWords;		/* total number of words in all records */
+	gpakDlRecord_t *pRecords;	/* record table followed by word pool */
+} gpakDlImage_t;
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
- * gpakReadFile - Read a block of bytes from a G.PAK Download file.
+ * gpakParseFile - Decode a G.PAK Download file into memory records.
  *
  * FUNCTION
- *  This function reads a contiguous block of bytes from a G.PAK Download file
- *  starting at the current file position.
+ *  This function walks a raw G.PAK Download file, validates every record
+ *  header and converts the big-endian record data into DSP words.
+ *
+ * RETURNS
+ *  0 on success, a negative errno value otherwise.
+ *
+ */
+extern int gpakParseFile(gpakDlImage_t *pImage,	/* image to fill in */
+						 const unsigned char *pData,	/* raw file contents */
+						 unsigned int NumBytes	/* size of the raw file */
+	);
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakFreeFile - Release a decoded G.PAK Download file.
+ *
+ * RETURNS
+ *  nothing
+ *
+ */
+extern void gpakFreeFile(gpakDlImage_t *pImage);
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakRequestFiles / gpakReleaseFiles - Hold the G.PAK images of a card.
+ *
+ * FUNCTION
+ *  gpakRequestFiles takes a reference to the DSP image a card needs and starts
+ *  loading it through the firmware loader if no other card holds it.
+ *  gpakReleaseFiles drops the reference, the image is freed with the last.
+ *
+ * RETURNS
+ *  nothing
+ *
+ */
+extern void gpakRequestFiles(struct r1t1_card *r1t1_card	/* Card needing the images */
+	);
+extern void gpakReleaseFiles(struct r1t1_card *r1t1_card	/* Card done with the images */
+	);
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakGetFile - Get the decoded G.PAK Download file for a DSP.
  *
  * RETURNS
- *  The number of bytes read from the file.
- *   -1 indicates an error occurred.
- *    0 indicates all bytes have been read (end of file)
+ *  Pointer to the shared decoded image, or NULL if it is not available.
  *
  */
-extern int gpakReadFile_5510(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
-							 GPAK_FILE_ID FileId,	/* G.PAK Download File Identifier */
-							 unsigned char *pBuffer,	/* pointer to buffer for storing bytes */
-							 unsigned int NumBytes	/* number of bytes to read */
+extern const gpakDlImage_t *gpakGetFile_5510(struct r1t1_card *r1t1_card,	/* Card containing the DSP */
+											 GPAK_FILE_ID FileId	/* G.PAK Download File Identifier */
 	);
 
 #endif /* prevent multiple inclusion */
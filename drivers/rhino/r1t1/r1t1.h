@@ -64,8 +64,14 @@
 #include <dahdi/user.h>
 #include <linux/moduleparam.h>
 #include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
 
 #include <rhino/rhino_compat.h>
+#include <rhino/rhino_card.h>
 
 #define PCI_VENDOR_RHINO 0xb0b
 #define PCI_DEVICE_R1T1 0x0105
@@ -134,8 +140,14 @@
 #define DS2155_T1TCR2 0x06
 #define DS2155_T1CCR1 0x07
 #define DS2155_SSIE 0x08
+#define DS2155_IIR1 0x14
 #define DS2155_SR2 0x18
+#define DS2155_IMR2 0x19
 #define DS2155_SR3 0x1A
+#define DS2155_IMR3 0x1B
+#define DS2155_SR6 0x20
+#define DS2155_IMR6 0x21
+#define DS2155_INFO5 0x2E
 #define DS2155_E1RCR1 0x33
 #define DS2155_E1RCR2 0x34
 #define DS2155_E1TCR1 0x35
@@ -162,6 +174,31 @@
 #define DS2155_TAF 0xd0
 #define DS2155_TNAF 0xd1
 #define DS2155_TFDL 0xc1
+/* HDLC controller #1 */
+#define DS2155_H1TC 0x90
+#define DS2155_H1FC 0x91
+#define DS2155_H1RCS1 0x92
+#define DS2155_H1RTSBS 0x96
+#define DS2155_H1TCS1 0x97
+#define DS2155_H1TTSBS 0x9B
+#define DS2155_H1RPBA 0x9C
+#define DS2155_H1TF 0x9D
+#define DS2155_H1RF 0x9E
+#define DS2155_H1TFBA 0x9F
+
+#define DS2155_HTC_THR 0x20		/* transmit HDLC reset */
+#define DS2155_HTC_TEOM 0x04		/* next byte written ends the packet */
+#define DS2155_HRPBA_MS 0x80		/* the packet continues past these bytes */
+#define DS2155_SR6_RPE 0x20		/* receive packet end */
+#define DS2155_SR6_RHWM 0x08		/* receive FIFO above high watermark */
+#define DS2155_SR6_RNE 0x04		/* receive FIFO not empty */
+#define DS2155_SR6_TLWM 0x02		/* transmit FIFO below low watermark */
+#define DS2155_INFO5_PS 0x07		/* status of the packet that ended */
+#define DS2155_IIR1_SR6 0x20		/* SR6 latched an unmasked HDLC event */
+#define DS2155_PS_GOOD 0x01
+#define DS2155_PS_CRC 0x02
+#define DS2155_PS_OVERRUN 0x04
+#define R1T1_HDLC_FIFO 128
 #define DS2155_IBOC 0xc5
 
 #define TARG_REGS       0x200
@@ -200,9 +237,28 @@
 #define DSP_5510 2
 
 
+struct r1t1_ec_cmd;
+struct gpakDspTable;
+
+/* DSP load and TDM errors, as sampled by the health work */
+struct r1t1_dsp_health {
+	unsigned long samples;		/* samples taken */
+	unsigned long failures;		/* samples the DSP did not answer */
+	unsigned int cpu_last;		/* CPU peak of the last second, percent */
+	unsigned int cpu_peak;		/* highest CPU peak seen */
+	unsigned int cpu_avg;		/* rolling average of cpu_last, 1/16 percent */
+	int cpu_warned;				/* CPU load warning given */
+	int fail_run;				/* samples failed in a row */
+	unsigned short int raw[5];	/* last framing and slip counters of the DSP */
+	unsigned long framing[4];	/* port 1-3 framing and DMA stop errors */
+	unsigned long slips;		/* DMA slips */
+};
+
 struct r1t1_card {
 	struct pci_dev *dev;
 	spinlock_t lock;
+	struct mutex dsp_mutex;		/* serializes G.PAK access to the DSP */
+	struct gpakDspTable *gpak_dsps;	/* G.PAK host state of the DSP */
 	int ise1;
 	int num;
 	int version;
@@ -228,11 +284,52 @@ struct r1t1_card {
 	int *chanmap;
 	unsigned int nextec;
 	unsigned int currec;
+	struct r1t1_ec_cmd *ec_cmd;	/* EC control command of each channel */
+	unsigned int ec_busy;		/* channels with EC control in flight */
+	unsigned int ec_reconfig;	/* channels waiting for new EC parameters */
+	unsigned int ec_bench;		/* idle channels lent to the EC bench */
+	int ec_pending;				/* EC control commands in flight */
+	int ec_burst;				/* channels changed in the current burst */
+	ktime_t ec_start;			/* start of the current burst */
+	unsigned int ec_last_us;	/* duration of the last burst */
+	unsigned int ec_max_us;		/* longest burst */
+	wait_queue_head_t ec_wait;	/* woken when a burst completes */
+	int dtmf_up;				/* DSP is detecting tones */
+	unsigned long dtmfmask;		/* channels reporting DSP detected tones */
+	unsigned long mutemask;		/* channels muting DSP detected digits */
+	unsigned char dtmf_digit[31];	/* digit being received on each channel */
 
 	wait_queue_head_t regq;
 
 	struct workqueue_struct *wq;
 	struct work_struct work;
+	struct work_struct dtmfwork;	/* drains the DSP's tone events */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	struct work_struct healthwork;	/* samples the DSP's health */
+#else
+	struct delayed_work healthwork;	/* samples the DSP's health */
+#endif
+	int health_up;				/* health sampling is running */
+	int dsp_recovering;			/* DSP is being reloaded */
+	unsigned int dsp_reload_fails;	/* reloads failed in a row */
+	unsigned int dsp_recoveries;	/* times the DSP was reloaded */
+	unsigned int dsp_recovery_us;	/* duration of the last reload */
+	struct r1t1_dsp_health health;	/* health of the DSP */
+
+	struct work_struct launchwork;	/* brings the card up after probe */
+	struct completion launched;	/* the launch has finished */
+
+	struct dahdi_chan *sigchan;	/* channel on the HDLC controller */
+	int sigactive;				/* a frame is being transmitted */
+	unsigned int frames_in;
+	unsigned int frames_out;
+
+	unsigned long pci_reads;	/* register reads, flushes included */
+	unsigned int irq_count;		/* interrupts handled */
+	unsigned int irq_reads_avg;	/* register reads per interrupt, x16 */
+	unsigned int irq_ns_avg;	/* interrupt handler run time, x16 */
+	unsigned int irq_ns_max;	/* longest interrupt handler run */
+	int msi;					/* interrupting through MSI */
 
 	unsigned char ledtestreg;
 	unsigned char outbyte;
@@ -248,7 +345,9 @@ struct r1t1_card {
 	volatile unsigned char *readchunk;	/* Double-word aligned read memory */
 	unsigned char ec_chunk1[31][DAHDI_CHUNKSIZE];
 	unsigned char ec_chunk2[31][DAHDI_CHUNKSIZE];
-	int nextbuf;
+	int nextbuf;				/* half of the DMA buffers DAHDI works on */
+	u_char *readchunks[2][31];	/* channel chunks in each half of the buffers */
+	u_char *writechunks[2][31];
 	struct dahdi_span span;		/* Span */
 	struct dahdi_chan *chans[31];	/* Channels */
 	struct dahdi_echocan_state *ec[31];	/* echocan state for each channel */
@@ -42,6 +42,7 @@
 #include <linux/pci.h>
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
+#include <asm/div64.h>
 #include <linux/moduleparam.h>
 #include "r1t1.h"
 #include "GpakCust.h"
@@ -72,17 +73,35 @@ static int chanmap_e1[] = { 1, 2, 3,
 #define CANARY 0xca1e
 #define addr_t (__u32)(dma_addr_t)
 #define DEBUG_MAIN      (1 << 0)
+#define DEBUG_DTMF      (1 << 1)
+#define DEBUG_HDLC      (1 << 2)
 #define DEBUG_DSP       (1 << 7)
 
+/* Failed DSP reloads in a row before the card gives up on its DSP */
+#define DSP_RELOAD_TRIES 3
+
 static int debug = 0;			/* Start out with no debugging enabled */
 static int e1 = 0;				/* Defines whether or not the card is set to e1 mode */
 static int no_ec = 0;
+static int ecbench = 0;
+static int ec_taps = 0;
+static int dsp_health = 10;
+static int dsp_cpu_warn = 90;
+static int dsp_recover = 1;
+static int dtmf = 1;
+static int dtmfmute = 0;
 static int ec_disable = 0;		/* Mask defining where the ec should be disabled */
 static int ec_sw = 0xffffffff;	/* Mask defining where the ec should be enabled */
 static int nlp_type = 3;
+static int async_launch = 1;
+static int posted_writes = 1;
+static int hardhdlc = 1;
+static int msi = 1;
 
 static struct r1t1_card *cards[RH_MAX_CARDS];
 
+DEFINE_RHINO_LAUNCH(r1t1_launch, RH_MAX_CARDS);
+
 static int r1t1_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 							   struct dahdi_echocanparam *p,
 							   struct dahdi_echocan_state **ec);
@@ -157,14 +176,35 @@ static int __r1t1_get_reg(struct r1t1_card *r1t1_card, int reg)
 {
 	unsigned char res;
 	res = ioread8(r1t1_card->ioaddr + (reg << 2));
+	r1t1_card->pci_reads++;
 	return res;
 }
 
+/* Push the posted register writes out to the card */
+static void __r1t1_flush_regs(struct r1t1_card *r1t1_card)
+{
+	ioread8(r1t1_card->ioaddr + R1T1_CONTROL);
+	r1t1_card->pci_reads++;
+}
+
+/*
+ * Register writes are posted, a sequence of them goes out back to back and
+ *  ends with __r1t1_flush_regs(). A read of the card also waits for them.
+ */
 static int __r1t1_set_reg(struct r1t1_card *r1t1_card, int reg, unsigned char val)
+{
+	iowrite8(val, r1t1_card->ioaddr + (reg << 2));
+	if (unlikely(!posted_writes))
+		__r1t1_get_reg(r1t1_card, reg);
+	return 0;
+}
+
+/* For the framer resets, which must complete before the next write */
+static int __r1t1_set_reg_sync(struct r1t1_card *r1t1_card, int reg, unsigned char val)
 {
 	iowrite8(val, r1t1_card->ioaddr + (reg << 2));
 	/* an extra read to prevent back-to-back burst writes */
-	ioread8(r1t1_card->ioaddr + (reg << 2));
+	__r1t1_get_reg(r1t1_card, reg);
 	return 0;
 }
 
@@ -172,6 +212,7 @@ static int __r1t1_set_reg(struct r1t1_card *r1t1_card, int reg, unsigned char va
 static void __r1t1_stop_framer(struct r1t1_card *r1t1_card)
 {
 	__r1t1_set_reg(r1t1_card, R1T1_CONTROL / 4, 0x00);
+	__r1t1_flush_regs(r1t1_card);
 }
 
 
@@ -186,7 +227,7 @@ static int r1t1_framer_hard_reset(struct r1t1_card *r1t1_card)
 		printk(KERN_DEBUG "R1T1: ise1=%i\n", r1t1_card->ise1);
 
 	/* Soft reset */
-	__r1t1_set_reg(r1t1_card, DS2155_MSTRREG, 0x01);	/* Sets *ALL* regs to default values */
+	__r1t1_set_reg_sync(r1t1_card, DS2155_MSTRREG, 0x01);	/* Sets *ALL* regs to default values */
 	__r1t1_set_reg(r1t1_card, DS2155_IOCR2, 0x03);	/* 2.048 Mhz Pll clock for all */
 	/* 2 TCLK from TCLK pin if alive, or RCLK  6 TCLK from RCLK  4 TCLK from MCLK (Master) */
 	__r1t1_set_reg(r1t1_card, DS2155_CCR1, 0x06);	/* 0 TCLK pin = RCLK from Rhino Chip */
@@ -195,12 +236,12 @@ static int r1t1_framer_hard_reset(struct r1t1_card *r1t1_card)
 
 
 	if (r1t1_card->ise1) {
-		__r1t1_set_reg(r1t1_card, DS2155_MSTRREG, 0x02);	/* Sets E1 Mode */
+		__r1t1_set_reg_sync(r1t1_card, DS2155_MSTRREG, 0x02);	/* Sets E1 Mode */
 		__r1t1_set_reg(r1t1_card, DS2155_E1TCR1, 0x10);	/* International Si */
 		__r1t1_set_reg(r1t1_card, DS2155_SIGCR, 0x80);	/* Sig reinsertion en */
 		__r1t1_set_reg(r1t1_card, DS2155_LIC1, 0x21);	/* TPD turn off Power Down default 120 LBO */
 		__r1t1_set_reg(r1t1_card, DS2155_LIC4, 0x0f);	/* 120 transmit term */
-		__r1t1_set_reg(r1t1_card, DS2155_LIC2, 0xd8);	/* LIRST Line Intf Reset (takes 40ms) */
+		__r1t1_set_reg_sync(r1t1_card, DS2155_LIC2, 0xd8);	/* LIRST Line Intf Reset (takes 40ms) */
 		__r1t1_set_reg(r1t1_card, DS2155_LIC2, 0x98);	/* Sets E1 mode JAMUX, Stops TA1 */
 		__r1t1_set_reg(r1t1_card, DS2155_TAF, 0x1b);	/* Tx Align Frame Sa and Si Pattern */
 		__r1t1_set_reg(r1t1_card, DS2155_TNAF, 0x5f);	/* Tx Non Align Frame Sa and Si Pattern */
@@ -219,15 +260,20 @@ static int r1t1_framer_hard_reset(struct r1t1_card *r1t1_card)
 		__r1t1_set_reg(r1t1_card, DS2155_RDNCD2, 0x00);
 		__r1t1_set_reg(r1t1_card, DS2155_LIC1, 0x01);	/* TPD(0) turn off Power Down default LBO */
 		__r1t1_set_reg(r1t1_card, DS2155_LIC4, 0x05);	/* 75 transmit term */
-		__r1t1_set_reg(r1t1_card, DS2155_LIC2, 0x58);	/* LIRST(6) Line Intf Reset (takes 40ms) */
+		__r1t1_set_reg_sync(r1t1_card, DS2155_LIC2, 0x58);	/* LIRST(6) Line Intf Reset (takes 40ms) */
 		__r1t1_set_reg(r1t1_card, DS2155_LIC2, 0x18);	/* Sets T1 mode JAMUX, Stops TA1 */
 	}
 	/* Wait 100ms to give plenty of time for reset */
 	endjiffies = jiffies + 10;
 	while (endjiffies < jiffies);
 
-	__r1t1_set_reg(r1t1_card, DS2155_ESCR, 0x55);	/* Re-align elastic stores */
+	/* Latch alarm and loop code changes, IIR1 tells the interrupt handler about them */
+	__r1t1_set_reg(r1t1_card, DS2155_IMR2, 0xff);	/* Loss of sync/carrier, AIS, RAI, set and clear */
+	__r1t1_set_reg(r1t1_card, DS2155_IMR3, 0x60);	/* Loop up and down codes */
+
+	__r1t1_set_reg_sync(r1t1_card, DS2155_ESCR, 0x55);	/* Re-align elastic stores */
 	__r1t1_set_reg(r1t1_card, DS2155_ESCR, 0x11);	/* TX & RX elastic (TSYSCLK IN) */
+	__r1t1_flush_regs(r1t1_card);
 
 	spin_unlock_irqrestore(&r1t1_card->lock, flags);
 	return 0;
@@ -260,7 +306,7 @@ static void r1t1_release(struct r1t1_card *r1t1_card)
 #endif
 
 	/* Free resources */
-	free_irq(r1t1_card->dev->irq, r1t1_card);
+	rhino_free_irq(r1t1_card->dev, r1t1_card, &r1t1_card->msi);
 	pci_free_consistent(r1t1_card->dev, DAHDI_MAX_CHUNKSIZE * 2 * 2 * 32 + 8,
 						(void *) r1t1_card->writechunk, r1t1_card->writedma);
 	iounmap(r1t1_card->ioaddr);
@@ -269,6 +315,8 @@ static void r1t1_release(struct r1t1_card *r1t1_card)
 	 * and that rc->ec[0] == ec_block from r1t1_init_one. */
 	kfree(r1t1_card->chans[0]);
 	kfree(r1t1_card->ec[0]);
+	kfree(r1t1_card->ec_cmd);
+	gpakDetachDsps(r1t1_card);
 #if DAHDI_VER >= KERNEL_VERSION(2,6,0)
 	dahdi_free_device(r1t1_card->ddev);
 #endif
@@ -300,6 +348,7 @@ static void r1t1_start_dma(struct r1t1_card *r1t1_card)
 	set_current_state(TASK_INTERRUPTIBLE);
 	schedule_timeout(1);
 	__r1t1_set_reg(r1t1_card, R1T1_CONTROL / 4, 0x01);
+	__r1t1_flush_regs(r1t1_card);
 	if (debug)
 		printk(KERN_DEBUG "R1T1: Started DMA\n");
 }
@@ -327,6 +376,163 @@ static void __r1t1_set_clear(struct r1t1_card *r1t1_card)
 	}
 }
 
+#ifdef DAHDI_SIG_HARDHDLC
+/* The framer has the one controller, it is offered only while it is free */
+static void __r1t1_hdlc_sigcap(struct r1t1_card *r1t1_card)
+{
+	int x;
+
+	for (x = 0; x < r1t1_card->span.channels; x++) {
+		if (hardhdlc && (!r1t1_card->sigchan || (r1t1_card->sigchan == r1t1_card->chans[x])))
+			r1t1_card->chans[x]->sigcap |= DAHDI_SIG_HARDHDLC;
+		else
+			r1t1_card->chans[x]->sigcap &= ~DAHDI_SIG_HARDHDLC;
+	}
+}
+
+/* Put the HDLC controller on the timeslot of chan, all 8 bits of it */
+static void __r1t1_hdlc_start(struct r1t1_card *r1t1_card, struct dahdi_chan *chan)
+{
+	/* E1 counts TS0 as channel 1 */
+	int ts = r1t1_card->ise1 ? chan->chanpos : chan->chanpos - 1;
+	int i;
+
+	if (debug & DEBUG_HDLC)
+		printk(KERN_DEBUG "R1T1: %d: Starting HDLC controller on timeslot %d\n",
+			   r1t1_card->num + 1, ts);
+
+	for (i = 0; i < 4; i++) {
+		__r1t1_set_reg(r1t1_card, DS2155_H1RCS1 + i, ((ts >> 3) == i) ? (1 << (ts & 7)) : 0);
+		__r1t1_set_reg(r1t1_card, DS2155_H1TCS1 + i, ((ts >> 3) == i) ? (1 << (ts & 7)) : 0);
+	}
+	__r1t1_set_reg(r1t1_card, DS2155_H1RTSBS, 0xff);
+	__r1t1_set_reg(r1t1_card, DS2155_H1TTSBS, 0xff);
+	__r1t1_set_reg(r1t1_card, DS2155_H1FC, 0x1b);	/* Watermarks at half of the FIFOs */
+
+	/* Flags between frames, CRC and zero stuffing on */
+	__r1t1_set_reg_sync(r1t1_card, DS2155_H1TC, DS2155_HTC_THR);
+	__r1t1_set_reg(r1t1_card, DS2155_H1TC, 0x00);
+
+	/* Drop whatever was received before */
+	__r1t1_set_reg(r1t1_card, DS2155_SR6, 0xff);
+
+	/* Packet ends and FIFO watermarks show in IIR1 */
+	__r1t1_set_reg(r1t1_card, DS2155_IMR6,
+				   DS2155_SR6_RPE | DS2155_SR6_RHWM | DS2155_SR6_TLWM);
+
+	r1t1_card->sigchan = chan;
+	r1t1_card->sigactive = 0;
+	__r1t1_hdlc_sigcap(r1t1_card);
+}
+
+static void __r1t1_hdlc_stop(struct r1t1_card *r1t1_card)
+{
+	int i;
+
+	if (debug & DEBUG_HDLC)
+		printk(KERN_DEBUG "R1T1: %d: Stopping HDLC controller\n", r1t1_card->num + 1);
+
+	for (i = 0; i < 4; i++) {
+		__r1t1_set_reg(r1t1_card, DS2155_H1RCS1 + i, 0x00);
+		__r1t1_set_reg(r1t1_card, DS2155_H1TCS1 + i, 0x00);
+	}
+	__r1t1_set_reg(r1t1_card, DS2155_H1TC, DS2155_HTC_THR);
+	__r1t1_set_reg(r1t1_card, DS2155_IMR6, 0x00);
+
+	r1t1_card->sigchan = NULL;
+	r1t1_card->sigactive = 0;
+	__r1t1_hdlc_sigcap(r1t1_card);
+}
+
+/* Fill the transmit FIFO with as much of the pending frames as fits */
+static void __r1t1_hdlc_xmit(struct r1t1_card *r1t1_card)
+{
+	unsigned char buf[R1T1_HDLC_FIFO];
+	unsigned int size;
+	int i, res = -1;
+
+	size = __r1t1_get_reg(r1t1_card, DS2155_H1TFBA);
+	if (size > sizeof(buf))
+		size = sizeof(buf);
+	if (!size)
+		return;
+
+	res = dahdi_hdlc_getbuf(r1t1_card->sigchan, buf, &size);
+	if ((res >= 0) && (size > 0)) {
+		r1t1_card->sigactive = 1;
+		for (i = 0; i < size; i++) {
+			/* End of message: the next byte is the last of the frame */
+			if (res && (i == size - 1))
+				__r1t1_set_reg(r1t1_card, DS2155_H1TC, DS2155_HTC_TEOM);
+			__r1t1_set_reg(r1t1_card, DS2155_H1TF, buf[i]);
+		}
+		if (res && !(++r1t1_card->frames_out & 0x0f) && (debug & DEBUG_HDLC))
+			printk(KERN_DEBUG "R1T1: %d: Transmitted %u frames\n", r1t1_card->num + 1,
+				   r1t1_card->frames_out);
+	} else if (res < 0)
+		r1t1_card->sigactive = 0;
+}
+
+/* Serve the SR6 events: drain the receive FIFO into DAHDI, keep the transmit FIFO fed */
+static void __r1t1_hdlc_interrupt(struct r1t1_card *r1t1_card)
+{
+	struct dahdi_chan *sigchan = r1t1_card->sigchan;
+	unsigned char buf[R1T1_HDLC_FIFO];
+	int sr6, rpba, cnt, ps, i, n;
+
+	sr6 = __r1t1_get_reg(r1t1_card, DS2155_SR6);
+	if (sr6)
+		__r1t1_set_reg(r1t1_card, DS2155_SR6, sr6);
+	if (!(sr6 & (DS2155_SR6_RPE | DS2155_SR6_RHWM | DS2155_SR6_RNE)))
+		n = 0;
+	else
+		n = R1T1_HDLC_FIFO / 4;	/* frames the FIFO can hold at most */
+
+	/* Each read of H1RPBA gives the bytes up to the next frame end */
+	for (; n > 0; n--) {
+		rpba = __r1t1_get_reg(r1t1_card, DS2155_H1RPBA);
+		cnt = rpba & 0x7f;
+		if (!cnt)
+			break;
+		for (i = 0; i < cnt; i++)
+			buf[i] = __r1t1_get_reg(r1t1_card, DS2155_H1RF);
+		dahdi_hdlc_putbuf(sigchan, buf, cnt);
+		if (!(rpba & DS2155_HRPBA_MS)) {
+			/* The bytes ended a frame */
+			ps = __r1t1_get_reg(r1t1_card, DS2155_INFO5) & DS2155_INFO5_PS;
+			if (ps == DS2155_PS_GOOD) {
+				dahdi_hdlc_finish(sigchan);
+				++r1t1_card->frames_in;
+			} else if (ps == DS2155_PS_CRC)
+				dahdi_hdlc_abort(sigchan, DAHDI_EVENT_BADFCS);
+			else if (ps == DS2155_PS_OVERRUN)
+				dahdi_hdlc_abort(sigchan, DAHDI_EVENT_OVERRUN);
+			else if (ps)
+				dahdi_hdlc_abort(sigchan, DAHDI_EVENT_ABORT);
+			if (ps && (debug & DEBUG_HDLC))
+				printk(KERN_DEBUG "R1T1: %d: Received frame %u status %d\n",
+					   r1t1_card->num + 1, r1t1_card->frames_in, ps);
+		}
+	}
+
+	if (r1t1_card->sigactive)
+		__r1t1_hdlc_xmit(r1t1_card);
+}
+
+static void r1t1_hdlc_hard_xmit(struct dahdi_chan *chan)
+{
+	struct r1t1_card *r1t1_card = container_of(chan->span, struct r1t1_card, span);
+	unsigned long flags;
+
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	if ((r1t1_card->sigchan == chan) && !r1t1_card->sigactive) {
+		__r1t1_hdlc_xmit(r1t1_card);
+		__r1t1_flush_regs(r1t1_card);
+	}
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+}
+#endif
+
 static void r1t1_t1_framer_start(struct r1t1_card *r1t1_card)
 {
 	char *coding, *framing;
@@ -387,6 +593,7 @@ static void r1t1_t1_framer_start(struct r1t1_card *r1t1_card)
 	__r1t1_set_reg(r1t1_card, DS2155_LIC1,
 				   (__r1t1_get_reg(r1t1_card, DS2155_LIC1) & 0x1f) | (r1t1_card->span.txlevel << 5));
 	__r1t1_set_clear(r1t1_card);
+	__r1t1_flush_regs(r1t1_card);
 
 	printk(KERN_INFO "R1T1: Using %s/%s coding/framing\n", coding, framing);
 	if (!alreadyrunning) {
@@ -483,7 +690,7 @@ static void r1t1_e1_framer_start(struct r1t1_card *r1t1_card)
 	/* Force re-sync  E1RCR1 RESYNC(0) = 1 - 0 */
 	__r1t1_set_reg(r1t1_card, DS2155_E1RCR1, (__r1t1_get_reg(r1t1_card, DS2155_E1RCR1) & 0xfe) | 0x01);
 	__r1t1_set_reg(r1t1_card, DS2155_E1RCR1, (__r1t1_get_reg(r1t1_card, DS2155_E1RCR1) & 0xfe) & ~0x01);
-
+	__r1t1_flush_regs(r1t1_card);
 
 	printk(KERN_NOTICE "R1T1: Using %s/%s coding/signaling%s 120 Ohms\n", coding, framing, crcing);
 	if (!alreadyrunning) {
@@ -504,17 +711,23 @@ static int r1t1_rbsbits(struct dahdi_chan *chan, int bits)
 	spin_lock_irqsave(&r1t1_card->lock, flags);
 
 	if (r1t1_card->ise1) {
-		if (chan->chanpos % 2) {
-			mask = (bits | (r1t1_card->chans[chan->chanpos - 1 + 1]->txsig << 4));
+		/* TS2-TS16 carry channels 1-15 in the upper and 17-31 in the lower nibble */
+		if (chan->chanpos < 16) {
+			o = chan->chanpos - 1;
+			mask = ((bits << 4) | r1t1_card->chans[o + 16]->txsig);
+		} else if (chan->chanpos > 16) {
+			o = chan->chanpos - 17;
+			mask = (bits | (r1t1_card->chans[o]->txsig << 4));
 		} else {
-			mask = ((bits << 4) | r1t1_card->chans[chan->chanpos - 1 - 1]->txsig);
+			/* TS16 carries the signalling itself */
+			spin_unlock_irqrestore(&r1t1_card->lock, flags);
+			return 0;
 		}
-		__r1t1_set_reg(r1t1_card, 0x51 + (chan->chanpos - 1) / 2, mask);
+		__r1t1_set_reg(r1t1_card, 0x51 + o, mask);
 		r1t1_card->chans[chan->chanpos - 1]->txsig = bits;
 		if (debug)
 			printk(KERN_DEBUG "R1T1: Register %x, Addr %x, mask %x\n",
-				   __r1t1_get_reg(r1t1_card, 0x51 + (chan->chanpos - 1) / 2), mask,
-				   (0x51 + (chan->chanpos - 1) / 2));
+				   __r1t1_get_reg(r1t1_card, 0x51 + o), 0x51 + o, mask);
 
 	} else {
 		b = (chan->chanpos - 1) / 2;
@@ -551,13 +764,53 @@ static int r1t1_rbsbits(struct dahdi_chan *chan, int bits)
 		__r1t1_set_reg(r1t1_card, 0x50 + b, r1t1_card->txsig[b]);
 
 	}
+	__r1t1_flush_regs(r1t1_card);
 	spin_unlock_irqrestore(&r1t1_card->lock, flags);
 	return 0;
 }
 
+/*
+ * Switch the tone reporting of a channel. Its digits are muted in the received
+ *  audio when DAHDI asks for it, or by dtmfmute while reporting is on. A new
+ *  mute setting needs a fresh channel configuration, which the EC work does.
+ */
+static void r1t1_chan_tonedetect(struct r1t1_card *r1t1_card, int chan_num, int mode)
+{
+	unsigned long flags;
+	int mute;
+
+	if (mode & DAHDI_TONEDETECT_ON)
+		set_bit(chan_num, &r1t1_card->dtmfmask);
+	else
+		clear_bit(chan_num, &r1t1_card->dtmfmask);
+
+	mute = (mode & DAHDI_TONEDETECT_MUTE) || ((mode & DAHDI_TONEDETECT_ON) && dtmfmute);
+	if (mute == !!test_bit(chan_num, &r1t1_card->mutemask))
+		return;
+
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	if (mute)
+		set_bit(chan_num, &r1t1_card->mutemask);
+	else
+		clear_bit(chan_num, &r1t1_card->mutemask);
+	r1t1_card->ec_reconfig |= (1 << chan_num);
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+	queue_work(r1t1_card->wq, &r1t1_card->work);
+}
+
 static int r1t1_ioctl(struct dahdi_chan *chan, unsigned int cmd, unsigned long data)
 {
+	struct r1t1_card *r1t1_card = container_of(chan->span, struct r1t1_card, span);
+	int x;
+
 	switch (cmd) {
+	case DAHDI_TONEDETECT:
+		if (get_user(x, (__user int *) data))
+			return -EFAULT;
+		if (!r1t1_card->dtmf_up)
+			return -ENOSYS;
+		r1t1_chan_tonedetect(r1t1_card, chan->chanpos - 1, x);
+		return 0;
 	default:
 		return -ENOTTY;
 	}
@@ -587,6 +840,18 @@ static int r1t1_startup(struct dahdi_span *span)
 	}
 	printk(KERN_NOTICE "R1T1: Calling startup (flags is %x)\n", (__u32) (span->flags));
 
+#ifdef DAHDI_SIG_HARDHDLC
+	/* A framer reset dropped the HDLC controller's setup */
+	if (r1t1_card->sigchan) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&r1t1_card->lock, flags);
+		__r1t1_hdlc_start(r1t1_card, r1t1_card->sigchan);
+		__r1t1_flush_regs(r1t1_card);
+		spin_unlock_irqrestore(&r1t1_card->lock, flags);
+	}
+#endif
+
 	if (!alreadyrunning) {
 		/* Only if we're not already going */
 		r1t1_enable_interrupts(r1t1_card);
@@ -658,6 +923,7 @@ static int r1t1_maint(struct dahdi_span *span, int cmd)
 			res = -EINVAL;
 		}
 	}
+	__r1t1_flush_regs(r1t1_card);
 	spin_unlock_irqrestore(&r1t1_card->lock, flags);
 	return res;
 }
@@ -676,9 +942,29 @@ static int r1t1_chanconfig(struct dahdi_chan *chan, int sigtype)
 
 		spin_lock_irqsave(&r1t1_card->lock, flags);
 
+#ifdef DAHDI_SIG_HARDHDLC
+		/* Another channel already has the HDLC controller */
+		if ((sigtype == DAHDI_SIG_HARDHDLC) && r1t1_card->sigchan &&
+			(r1t1_card->sigchan != chan)) {
+			spin_unlock_irqrestore(&r1t1_card->lock, flags);
+			return -EBUSY;
+		}
+#endif
+
 		if (alreadyrunning && !r1t1_card->ise1)
 			__r1t1_set_clear(r1t1_card);
 
+#ifdef DAHDI_SIG_HARDHDLC
+		/* (re)configure the signalling channel */
+		if ((sigtype == DAHDI_SIG_HARDHDLC) || (r1t1_card->sigchan == chan)) {
+			if (r1t1_card->sigchan)
+				__r1t1_hdlc_stop(r1t1_card);
+			if (sigtype == DAHDI_SIG_HARDHDLC)
+				__r1t1_hdlc_start(r1t1_card, chan);
+		}
+		__r1t1_flush_regs(r1t1_card);
+#endif
+
 		spin_unlock_irqrestore(&r1t1_card->lock, flags);
 	}
 	return 0;
@@ -727,12 +1013,15 @@ static int r1t1_software_init(struct r1t1_card *r1t1_card)
 		.ioctl = r1t1_ioctl,
 #ifdef USE_G168_DSP
 		.echocan_create = r1t1_echocan_create,
+#endif
+#ifdef DAHDI_SIG_HARDHDLC
+		.hdlc_hard_xmit = r1t1_hdlc_hard_xmit,
 #endif
 		.owner = THIS_MODULE
 	};
 #endif
 
-	int x;
+	int x, y;
 
 
 #if DAHDI_VER >= KERNEL_VERSION(2,4,0)
@@ -747,6 +1036,9 @@ static int r1t1_software_init(struct r1t1_card *r1t1_card)
 	r1t1_card->span.open = r1t1_open;
 	r1t1_card->span.close = r1t1_close;
 	r1t1_card->span.ioctl = r1t1_ioctl;
+#ifdef DAHDI_SIG_HARDHDLC
+	r1t1_card->span.hdlc_hard_xmit = r1t1_hdlc_hard_xmit;
+#endif
 #endif
 
 	sprintf(r1t1_card->span.name, "R1T1/%d", r1t1_card->num);
@@ -789,19 +1081,17 @@ static int r1t1_software_init(struct r1t1_card *r1t1_card)
 	init_waitqueue_head(&r1t1_card->span.maintq);
 #endif
 	for (x = 0; x < r1t1_card->span.channels; x++) {
-
-
-		if (r1t1_card->ise1) {
-			r1t1_card->chans[x]->writechunk = (u_char *) (r1t1_card->writechunk +
-												   (chanmap_e1[x] * DAHDI_CHUNKSIZE));
-			r1t1_card->chans[x]->readchunk = (u_char *) (r1t1_card->readchunk +
-												  (chanmap_e1[x] * DAHDI_CHUNKSIZE));
-		} else {
-			r1t1_card->chans[x]->writechunk = (u_char *) (r1t1_card->writechunk +
-												   (chanmap_t1[x] * DAHDI_CHUNKSIZE));
-			r1t1_card->chans[x]->readchunk = (u_char *) (r1t1_card->readchunk +
-												  (chanmap_t1[x] * DAHDI_CHUNKSIZE));
+		int slot = r1t1_card->ise1 ? chanmap_e1[x] : chanmap_t1[x];
+
+		/* The DMA alternates between two halves of 32 slots */
+		for (y = 0; y < 2; y++) {
+			r1t1_card->writechunks[y][x] = (u_char *) (r1t1_card->writechunk +
+						((y * 32 + slot) * DAHDI_CHUNKSIZE));
+			r1t1_card->readchunks[y][x] = (u_char *) (r1t1_card->readchunk +
+						((y * 32 + slot) * DAHDI_CHUNKSIZE));
 		}
+		r1t1_card->chans[x]->writechunk = r1t1_card->writechunks[0][x];
+		r1t1_card->chans[x]->readchunk = r1t1_card->readchunks[0][x];
 
 		sprintf(r1t1_card->chans[x]->name, "R1T1/%d/%d", r1t1_card->num, x + 1);
 		r1t1_card->chans[x]->sigcap = DAHDI_SIG_EM | DAHDI_SIG_CLEAR | DAHDI_SIG_EM_E1 |
@@ -811,9 +1101,17 @@ static int r1t1_software_init(struct r1t1_card *r1t1_card)
 			DAHDI_SIG_FXONS |
 #endif
 			DAHDI_SIG_FXOGS | DAHDI_SIG_FXOKS | DAHDI_SIG_CAS | DAHDI_SIG_SF;
+#ifdef DAHDI_SIG_HARDHDLC
+		if (hardhdlc)
+			r1t1_card->chans[x]->sigcap |= DAHDI_SIG_HARDHDLC;
+#endif
 		r1t1_card->chans[x]->chanpos = x + 1;
 	}
+	return 0;
+}
 
+static int r1t1_register(struct r1t1_card *r1t1_card)
+{
 #if DAHDI_VER >= KERNEL_VERSION(2,6,0)
 	list_add_tail(&r1t1_card->span.device_node, &r1t1_card->ddev->spans);
 	if (dahdi_register_device(r1t1_card->ddev, &r1t1_card->dev->dev)) {
@@ -831,51 +1129,61 @@ static int r1t1_software_init(struct r1t1_card *r1t1_card)
 
 static void r1t1_transmitprep(struct r1t1_card *r1t1_card, int nextbuf)
 {
+	int x;
+
+	for (x = 0; x < r1t1_card->span.channels; x++)
+		r1t1_card->chans[x]->writechunk = r1t1_card->writechunks[nextbuf][x];
 	dahdi_transmit(&r1t1_card->span);
 }
 
 static void r1t1_receiveprep(struct r1t1_card *r1t1_card, int nextbuf)
 {
+	int x;
+
+	for (x = 0; x < r1t1_card->span.channels; x++)
+		r1t1_card->chans[x]->readchunk = r1t1_card->readchunks[nextbuf][x];
 	if (!r1t1_card->dsp_up)
 		dahdi_ec_span(&r1t1_card->span);
 	dahdi_receive(&r1t1_card->span);
 }
 
+/* Channels without robbed bit or CAS signalling have nothing to read */
+#define R1T1_NOSIG(chan) (!(chan)->sig || ((chan)->sig & DAHDI_SIG_CLEAR))
+
+/* Read the signalling register holding channels lo (lower nibble) and hi (upper nibble) */
+static void __r1t1_check_rxsig(struct r1t1_card *r1t1_card, int reg, int lo, int hi)
+{
+	struct dahdi_chan *chan_lo = r1t1_card->chans[lo];
+	struct dahdi_chan *chan_hi = r1t1_card->chans[hi];
+	int a, rxs;
+
+	if (R1T1_NOSIG(chan_lo) && R1T1_NOSIG(chan_hi))
+		return;
+
+	a = __r1t1_get_reg(r1t1_card, reg);
+	rxs = a & 0x0f;
+	if (!R1T1_NOSIG(chan_lo) && (chan_lo->rxsig != rxs))
+		dahdi_rbsbits(chan_lo, rxs);
+	rxs = (a >> 4) & 0x0f;
+	if (!R1T1_NOSIG(chan_hi) && (chan_hi->rxsig != rxs))
+		dahdi_rbsbits(chan_hi, rxs);
+}
+
+/* Slots 0-2 each scan a third of the span */
 static void __r1t1_check_sigbits(struct r1t1_card *r1t1_card, int x)
 {
-	int a, i, y, rxs;
+	int i, y;
 
 	if (r1t1_card->ise1) {
-		for (y = 0; y < 10; y += 2) {
-			i = x * 10 + y;
-			a = __r1t1_get_reg(r1t1_card, 0x61 + (i / 2));
-			rxs = (a & 0xf);
-			if (!(r1t1_card->chans[i]->sig & DAHDI_SIG_CLEAR)) {
-				if (r1t1_card->chans[i]->rxsig != rxs)
-					dahdi_rbsbits(r1t1_card->chans[i], rxs);
-			}
-			i++;
-			rxs = (a >> 4) & 0xf;
-			if (!(r1t1_card->chans[i]->sig & DAHDI_SIG_CLEAR)) {
-				if (r1t1_card->chans[i]->rxsig != rxs)
-					dahdi_rbsbits(r1t1_card->chans[i], rxs);
-			}
+		/* RS2-RS16 carry channels 1-15 in the upper and 17-31 in the lower nibble */
+		for (y = 0; y < 5; y++) {
+			i = x * 5 + y;
+			__r1t1_check_rxsig(r1t1_card, 0x61 + i, i + 16, i);
 		}
 	} else {
 		for (y = 0; y < 8; y += 2) {
 			i = x * 8 + y;
-			a = __r1t1_get_reg(r1t1_card, 0x60 + (i / 2));
-			rxs = a & 0x0f;
-			if (!(r1t1_card->chans[i]->sig & DAHDI_SIG_CLEAR)) {
-				if (r1t1_card->chans[i]->rxsig != rxs)
-					dahdi_rbsbits(r1t1_card->chans[i], rxs);
-			}
-			i++;
-			rxs = (a >> 4) & 0x0f;
-			if (!(r1t1_card->chans[i]->sig & DAHDI_SIG_CLEAR)) {
-				if (r1t1_card->chans[i]->rxsig != rxs)
-					dahdi_rbsbits(r1t1_card->chans[i], rxs);
-			}
+			__r1t1_check_rxsig(r1t1_card, 0x60 + (i / 2), i, i + 1);
 		}
 	}
 }
@@ -1018,6 +1326,22 @@ static void __r1t1_check_alarms(struct r1t1_card *r1t1_card)
 	dahdi_alarm_notify(&r1t1_card->span);
 }
 
+/*
+ * The alarms are checked when the framer latched a change in SR2 or SR3,
+ *  while they need following, and once a second as a watchdog.
+ */
+static int __r1t1_alarms_due(struct r1t1_card *r1t1_card)
+{
+	/* alarm recovery and loop code detection count on being polled */
+	if (r1t1_card->span.alarms || r1t1_card->alarmtimer ||
+		r1t1_card->loopupcnt || r1t1_card->loopdowncnt)
+		return 1;
+	if (!(r1t1_card->intcount & 0x3c0))
+		return 1;
+	/* SR2 or SR3 latched an unmasked change */
+	return __r1t1_get_reg(r1t1_card, DS2155_IIR1) & 0x06;
+}
+
 static void __r1t1_do_counters(struct r1t1_card *r1t1_card)
 {
 	if (r1t1_card->alarmtimer) {
@@ -1036,8 +1360,12 @@ static void __r1t1_do_counters(struct r1t1_card *r1t1_card)
 static irqreturn_t r1t1_interrupt(int irq, void *dev_id)
 {
 	struct r1t1_card *r1t1_card = dev_id;
-	unsigned long flags;
-	unsigned int x, nextbuf;
+	unsigned long flags, reads;
+	unsigned int x, nextbuf, took_ns;
+	ktime_t start;
+
+	start = ktime_get();
+	reads = r1t1_card->pci_reads;
 
 	nextbuf = ioread8(r1t1_card->ioaddr + 0x805) & 0x3;
 
@@ -1050,8 +1378,13 @@ static irqreturn_t r1t1_interrupt(int irq, void *dev_id)
 
 	--r1t1_card->clocktimeout;
 
-	r1t1_receiveprep(r1t1_card, r1t1_card->nextbuf);
-	r1t1_transmitprep(r1t1_card, r1t1_card->nextbuf);
+	/* The card reports the half that is ours, seeing it twice means a lost interrupt */
+	if (unlikely(nextbuf == r1t1_card->nextbuf))
+		r1t1_card->miss++;
+	r1t1_card->nextbuf = nextbuf;
+
+	r1t1_receiveprep(r1t1_card, nextbuf);
+	r1t1_transmitprep(r1t1_card, nextbuf);
 
 	spin_lock_irqsave(&r1t1_card->lock, flags);
 
@@ -1071,16 +1404,43 @@ static irqreturn_t r1t1_interrupt(int irq, void *dev_id)
 		__r1t1_check_sigbits(r1t1_card, x);
 		break;
 	case 4:
-		/* Check alarms 1/4 as frequently */
-		if (!(r1t1_card->intcount & 0x30))
+		/* Check alarms 1/4 as frequently, if the framer flagged them */
+		if (!(r1t1_card->intcount & 0x30) && __r1t1_alarms_due(r1t1_card))
 			__r1t1_check_alarms(r1t1_card);
 		break;
 	}
 
-	r1t1_card->nextbuf = (r1t1_card->nextbuf + 1) & 0x01;
+#ifdef DAHDI_SIG_HARDHDLC
+	/*
+	 * The HDLC FIFOs hold 16 ms of a 64k D-channel. Every 4 ms they are
+	 *  served if SR6 raised its interrupt in IIR1, or a frame is going out.
+	 */
+	if (r1t1_card->sigchan && ((x & 3) == 3) &&
+		(r1t1_card->sigactive || (__r1t1_get_reg(r1t1_card, DS2155_IIR1) & DS2155_IIR1_SR6)))
+		__r1t1_hdlc_interrupt(r1t1_card);
+#endif
+
+	/* One read for the acknowledge and whatever the above wrote */
+	__r1t1_flush_regs(r1t1_card);
+
+	/* The status read above counts too */
+	reads = r1t1_card->pci_reads - reads + 1;
+	r1t1_card->pci_reads++;
+	took_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	r1t1_card->irq_count++;
+	r1t1_card->irq_reads_avg += reads - (r1t1_card->irq_reads_avg >> 4);
+	r1t1_card->irq_ns_avg += took_ns - (r1t1_card->irq_ns_avg >> 4);
+	if (took_ns > r1t1_card->irq_ns_max)
+		r1t1_card->irq_ns_max = took_ns;
 
 	spin_unlock_irqrestore(&r1t1_card->lock, flags);
 
+#ifdef USE_G168_DSP
+	/* Drain the tone events of the DSP every 8 interrupts */
+	if (r1t1_card->dtmf_up && !(r1t1_card->intcount & 7))
+		queue_work(r1t1_card->wq, &r1t1_card->dtmfwork);
+#endif /* USE_G168_DSP */
+
 	return IRQ_RETVAL(1);
 }
 
@@ -1110,8 +1470,13 @@ static void r1t1_card_reset_dsp(struct r1t1_card *r1t1_card)
 
 	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_HPIC, (hpi_c & ~DSP_RST));
 	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_HPIC, (hpi_c & ~DSP_RST));
-	mdelay(100);
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
 
+	/* Not under the lock, the spans keep running while the DSP is reset */
+	msleep(100);
+
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	hpi_c = __r1t1_card_pci_in(r1t1_card, TARG_REGS + R1T1_HPIC);
 	r1t1_card->hpi_fast = 0;
 	r1t1_card->hpi_xadd = 0;
 	r1t1_card->dsp_sel = 0;
@@ -1184,7 +1549,7 @@ static unsigned short int r1t1_card_dsp_ping(struct r1t1_card *r1t1_card)
 		return 0;
 }
 
-static int __devinit r1t1_span_download_dsp(struct r1t1_card *r1t1_card)
+static int r1t1_span_download_dsp(struct r1t1_card *r1t1_card)
 {
 	unsigned short int DspId;
 	gpakDownloadStatus_t dl_res = 0;
@@ -1209,7 +1574,7 @@ static int __devinit r1t1_span_download_dsp(struct r1t1_card *r1t1_card)
 		return 0;
 }
 
-static void __devinit r1t1_span_run_dsp(struct r1t1_card *r1t1_card)
+static void r1t1_span_run_dsp(struct r1t1_card *r1t1_card)
 {
 	r1t1_card_select_dsp(r1t1_card);
 	r1t1_card_hpic_set(r1t1_card, R1T1_BL_GO);
@@ -1417,8 +1782,8 @@ static void r1t1_card_dsp_show_portconfig(GpakPortConfig_t PortConfig)
 	return;
 }
 
-static int __devinit r1t1_span_dsp_configureports(struct r1t1_card *r1t1_card,
-												  GpakPortConfig_t PortConfig)
+static int r1t1_span_dsp_configureports(struct r1t1_card *r1t1_card,
+										GpakPortConfig_t PortConfig)
 {
 	gpakConfigPortStatus_t cp_res;
 	GPAK_PortConfigStat_t cp_error;
@@ -1544,6 +1909,34 @@ static GpakChannelConfig_t Gpak_chan_config = {
 	Disabled
 };
 
+/*
+ * Channel configuration the card's DSP runs with, built from the template on
+ *  every call. Cards launch in parallel, the template itself is never written.
+ */
+static void r1t1_card_dsp_chanconfig(struct r1t1_card *r1t1_card, GpakChannelConfig_t *ChanConfig)
+{
+	*ChanConfig = Gpak_chan_config;
+
+	ChanConfig->EcanParametersA.EcanNlpType = nlp_type;
+	ChanConfig->EcanParametersB.EcanNlpType = nlp_type;
+
+	ChanConfig->EcanEnableB = Enabled;
+
+	ChanConfig->EcanEnableA = Disabled;
+	ChanConfig->SoftwareCompand = cmpNone;
+
+	/* Tones are detected on the echo cancelled line side, only the 5510
+	 *  images carry the detectors. */
+	if (dtmf && (r1t1_card->dsp_type == DSP_5510)) {
+		ChanConfig->ToneTypesB = DTMF_tone;
+		ChanConfig->FaxCngDetB = Enabled;
+	} else {
+		ChanConfig->ToneTypesB = Null_tone;
+		ChanConfig->FaxCngDetB = Disabled;
+	}
+	ChanConfig->MuteToneB = Disabled;
+}
+
 static void r1t1_card_dsp_show_chanconfig(GpakChannelConfig_t ChanConfig)
 {
 	if (debug & DEBUG_DSP) {
@@ -1632,9 +2025,35 @@ static void r1t1_card_dsp_show_chanconfig(GpakChannelConfig_t ChanConfig)
 	return;
 }
 
-static int __devinit r1t1_span_dsp_configurechannel(struct r1t1_card *r1t1_card,
-													GpakChannelConfig_t ChanConfig,
-													int chan_num)
+/* Fill in the time slots, companding and digit muting of a channel on the DSP */
+static void r1t1_card_dsp_chanslots(struct r1t1_card *r1t1_card, int chan_num,
+									GpakChannelConfig_t *ChanConfig)
+{
+	int slot_num;
+
+	if ((ChanConfig->ToneTypesB != Null_tone) && test_bit(chan_num, &r1t1_card->mutemask))
+		ChanConfig->MuteToneB = Enabled;
+
+	if (r1t1_card->ise1) {
+		slot_num = chanmap_e1[chan_num];
+		if (chan_num != 15)
+			ChanConfig->SoftwareCompand = cmpPCMU;
+		else
+			ChanConfig->SoftwareCompand = cmpNone;
+	} else {
+		slot_num = chanmap_t1[chan_num];
+		ChanConfig->SoftwareCompand = cmpPCMU;
+	}
+
+	ChanConfig->PcmInSlotA = slot_num * 4;
+	ChanConfig->PcmOutSlotA = slot_num * 4;
+	ChanConfig->PcmInSlotB = slot_num * 4;
+	ChanConfig->PcmOutSlotB = slot_num * 4;
+}
+
+static int r1t1_span_dsp_configurechannel(struct r1t1_card *r1t1_card,
+										  GpakChannelConfig_t ChanConfig,
+										  int chan_num)
 {
 	GPAK_ChannelConfigStat_t chan_config_err;
 	gpakConfigChanStatus_t chan_conf_stat;
@@ -1646,7 +2065,7 @@ static int __devinit r1t1_span_dsp_configurechannel(struct r1t1_card *r1t1_card,
 	DspId = r1t1_card->num;
 
 	if ((chan_conf_stat =
-		 gpakConfigureChannel(r1t1_card, DspId, chan_num, tdmToTdm, &Gpak_chan_config,
+		 gpakConfigureChannel(r1t1_card, DspId, chan_num, tdmToTdm, &ChanConfig,
 							  &chan_config_err)))
 		printk(KERN_ERR "R1T1: %d DSP %d: Chan %d G168 DSP Chan Config failed error = %d  %d\n",
 			   r1t1_card->num + 1, 1, chan_num, chan_config_err, chan_conf_stat);
@@ -1742,48 +2161,162 @@ static void r1t1_card_dsp_cpustats(struct r1t1_card *r1t1_card)
 	return;
 }
 
-static void r1t1_chan_ec_enable(struct r1t1_card *r1t1_card, int chan_num)
+/*
+ * Sample the CPU load and the TDM error counters of the DSP. The DSP counts
+ *  framing errors and slips since its last reset, so only the growth of a
+ *  counter is new. The rolling average covers about eight samples.
+ *  Returns 1 when the DSP was found reset or has stopped answering.
+ */
+static int r1t1_card_dsp_health(struct r1t1_card *r1t1_card)
 {
-	gpakAlgControlStat_t a_c_stat;
-	GPAK_AlgControlStat_t a_c_err;
-	unsigned short int DspId;
-	unsigned int mask, slot_num;
+	struct r1t1_dsp_health *health = &r1t1_card->health;
+	unsigned short int peak, prev_peak, dsp_ver;
+	unsigned short int raw[5], slips[6];
+	unsigned long framing = 0, slipped = 0;
+	unsigned short int delta;
+	int x, failed;
+
+	memset(slips, 0, sizeof(slips));
+	failed = (gpakPingDsp(r1t1_card, r1t1_card->num, &dsp_ver) != PngSuccess) ||
+		gpakReadCpuUsage(r1t1_card, r1t1_card->num, &peak, &prev_peak) ||
+		gpakReadFramingStats(r1t1_card, r1t1_card->num, &raw[0], &raw[1], &raw[2], &raw[3],
+							 &slips[0]);
+
+	if (gpakTestDspReset(r1t1_card, r1t1_card->num)) {
+		printk(KERN_ERR "R1T1: %d: DSP was reset\n", r1t1_card->num + 1);
+		return 1;
+	}
+	if (failed) {
+		health->failures++;
+		if (++health->fail_run < 3)
+			return 0;
+		printk(KERN_ERR "R1T1: %d: DSP stopped answering\n", r1t1_card->num + 1);
+		return 1;
+	}
+	health->fail_run = 0;
+	raw[4] = slips[0] + slips[1] + slips[2] + slips[3] + slips[4] + slips[5];
+
+	if (health->samples++) {
+		for (x = 0; x < 4; x++) {
+			delta = raw[x] - health->raw[x];
+			health->framing[x] += delta;
+			framing += delta;
+		}
+		slipped = (unsigned short int) (raw[4] - health->raw[4]);
+		health->slips += slipped;
+		health->cpu_avg += (prev_peak << 1) - (health->cpu_avg >> 3);
+	} else
+		health->cpu_avg = prev_peak << 4;
+	memcpy(health->raw, raw, sizeof(raw));
+
+	health->cpu_last = prev_peak;
+	if (peak > health->cpu_peak)
+		health->cpu_peak = peak;
+	if (prev_peak > health->cpu_peak)
+		health->cpu_peak = prev_peak;
+
+	if (prev_peak >= dsp_cpu_warn) {
+		if (!health->cpu_warned)
+			printk(KERN_WARNING "R1T1: %d: DSP CPU load at %d%%, close to saturation\n",
+				   r1t1_card->num + 1, prev_peak);
+		health->cpu_warned = 1;
+	} else
+		health->cpu_warned = 0;
 
-	if (ec_disable & (1 << chan_num)) {
-		if (debug & DEBUG_DSP)
-			printk(KERN_DEBUG "r1t1 %d: Echo Can NOT enable DSP EC Chan %d\n", r1t1_card->num + 1,
-				   chan_num);
-		return;
-	}
+	if (framing || slipped)
+		printk(KERN_WARNING "R1T1: %d: DSP %lu TDM framing errors and %lu slips\n",
+			   r1t1_card->num + 1, framing, slipped);
 
-	DspId = r1t1_card->num;
+	return 0;
+}
 
-	if (r1t1_card->ise1)
-		slot_num = chanmap_e1[chan_num];
-	else
-		slot_num = chanmap_t1[chan_num];
+/* EC control command of one channel, queued to the DSP */
+struct r1t1_ec_cmd {
+	gpakCmd_t cmd;
+	struct r1t1_card *r1t1_card;
+	int chan_num;
+	int enable;
+	int retried;
+	GpakEcanParms_t ecan_next;	/* canceller parameters last requested */
+	GpakEcanParms_t ecan_cur;	/* canceller parameters the DSP runs with */
+	GpakEcanParms_t ecan_bench;	/* parameters to give back after the EC bench */
+};
 
-	if (debug & DEBUG_DSP)
-		printk(KERN_DEBUG "R1T1: %d: Echo Can enable DSP %d EC Chan %d\n", r1t1_card->num + 1, 1, chan_num);
+/*
+ * Give channels lent to the EC bench back the canceller parameters they had,
+ *  with the canceller bypassed as it was. Called with the card lock held.
+ */
+static void __r1t1_card_ec_bench_return(struct r1t1_card *r1t1_card, unsigned int bits)
+{
+	int chan_num;
 
-	r1t1_card_select_dsp(r1t1_card);
+	bits &= r1t1_card->ec_bench;
+	for (chan_num = 0; chan_num < r1t1_card->span.channels; chan_num++) {
+		if (bits & (1 << chan_num))
+			r1t1_card->ec_cmd[chan_num].ecan_next =
+				r1t1_card->ec_cmd[chan_num].ecan_bench;
+	}
+	r1t1_card->nextec &= ~bits;
+	r1t1_card->ec_reconfig |= bits;
+	r1t1_card->ec_bench &= ~bits;
+}
 
-	if ((a_c_stat = gpakAlgControl(r1t1_card, DspId, chan_num, EnableEcanB, &a_c_err))) {
-		if ((a_c_stat = gpakAlgControl(r1t1_card, DspId, chan_num, EnableEcanB, &a_c_err))) {
-			if ((a_c_stat = gpakAlgControl(r1t1_card, DspId, chan_num, EnableEcanB, &a_c_err))) {
-				printk
-					(KERN_ERR "R1T1: %d: G168 DSP Enable Alg Control failed res = %d error = %d\n",
-					 r1t1_card->num + 1, a_c_stat, a_c_err);
-			}
-		}
+/*
+ * Record the outcome of a channel's EC control. When the last command of a
+ *  burst completes the time since the first one was queued is kept as the
+ *  time-to-EC-active of the burst.
+ */
+static void r1t1_chan_ec_complete(struct r1t1_card *r1t1_card, int chan_num, int enable,
+								  gpakAlgControlStat_t a_c_stat)
+{
+	u64 burst_ns;
+
+	if (a_c_stat != AcSuccess)
+		printk(KERN_ERR "R1T1: %d: G168 DSP %s Alg Control failed on Chan %d res = %d\n",
+			   r1t1_card->num + 1, enable ? "Enable" : "Disable", chan_num, a_c_stat);
+
+	if (enable)
+		r1t1_card->currec |= (1 << chan_num);
+	else
+		r1t1_card->currec &= ~(1 << chan_num);
+	r1t1_card->ec_busy &= ~(1 << chan_num);
+
+	if (--r1t1_card->ec_pending == 0) {
+		burst_ns = ktime_to_ns(ktime_sub(ktime_get(), r1t1_card->ec_start));
+		do_div(burst_ns, 1000);
+		r1t1_card->ec_last_us = (unsigned int) burst_ns;
+		if (r1t1_card->ec_last_us > r1t1_card->ec_max_us)
+			r1t1_card->ec_max_us = r1t1_card->ec_last_us;
+		if (debug & DEBUG_DSP)
+			printk(KERN_DEBUG "R1T1: %d: Echo Can %d channels changed in %u us (max %u us)\n",
+				   r1t1_card->num + 1, r1t1_card->ec_burst, r1t1_card->ec_last_us,
+				   r1t1_card->ec_max_us);
+		wake_up(&r1t1_card->ec_wait);
 	}
 
-	mask = __r1t1_card_pci_in(r1t1_card, TARG_REGS + R1T1_ECA1);
-	mask |= (1 << slot_num);
+	/* The channel may have been toggled or given new parameters while its
+	 *  command was in flight */
+	if (((r1t1_card->nextec ^ r1t1_card->currec) | r1t1_card->ec_reconfig) & (1 << chan_num))
+		queue_work(r1t1_card->wq, &r1t1_card->work);
+}
 
-	r1t1_card_unselect_dsp(r1t1_card);
+static void r1t1_chan_ec_done(gpakCmd_t *pCmd)
+{
+	struct r1t1_ec_cmd *ec_cmd = container_of(pCmd, struct r1t1_ec_cmd, cmd);
+	struct r1t1_card *r1t1_card = ec_cmd->r1t1_card;
+	gpakAlgControlStat_t a_c_stat;
 
-	return;
+	a_c_stat = gpakAlgControlResult(pCmd);
+
+	/* A lost reply is worth one more attempt, a rejected command is not */
+	if ((a_c_stat == AcDspCommFailure) && !ec_cmd->retried) {
+		ec_cmd->retried = 1;
+		if (!gpakQueueAlgControl(r1t1_card, r1t1_card->num, ec_cmd->chan_num,
+								 ec_cmd->enable ? EnableEcanB : BypassEcanB, pCmd))
+			return;
+	}
+
+	r1t1_chan_ec_complete(r1t1_card, ec_cmd->chan_num, ec_cmd->enable, a_c_stat);
 }
 
 static void r1t1_chan_ec_disable(struct r1t1_card *r1t1_card, int chan_num)
@@ -1791,33 +2324,18 @@ static void r1t1_chan_ec_disable(struct r1t1_card *r1t1_card, int chan_num)
 	gpakAlgControlStat_t a_c_stat;
 	GPAK_AlgControlStat_t a_c_err;
 	unsigned short int DspId;
-	unsigned int mask, slot_num;
 
 	DspId = r1t1_card->num;
 
-	if (r1t1_card->ise1)
-		slot_num = chanmap_e1[chan_num];
-	else
-		slot_num = chanmap_t1[chan_num];
-
 	if (debug & DEBUG_DSP)
 		printk(KERN_DEBUG "R1T1: %d: Echo Can disable DSP %d EC Chan %d\n", r1t1_card->num + 1, 1,
 			   chan_num);
 
 	r1t1_card_select_dsp(r1t1_card);
 
-	if ((a_c_stat = gpakAlgControl(r1t1_card, DspId, chan_num, BypassEcanB, &a_c_err))) {
-		if ((a_c_stat = gpakAlgControl(r1t1_card, DspId, chan_num, BypassEcanB, &a_c_err))) {
-			if ((a_c_stat = gpakAlgControl(r1t1_card, DspId, chan_num, BypassEcanB, &a_c_err))) {
-				printk
-					(KERN_ERR "R1T1: %d: G168 DSP Disable Alg Control failed res = %d error = %d\n",
-					 r1t1_card->num + 1, a_c_stat, a_c_err);
-			}
-		}
-	}
-
-	mask = __r1t1_card_pci_in(r1t1_card, TARG_REGS + R1T1_ECA1);
-	mask &= ~(1 << slot_num);
+	if ((a_c_stat = gpakAlgControl(r1t1_card, DspId, chan_num, BypassEcanB, &a_c_err)))
+		printk(KERN_ERR "R1T1: %d: G168 DSP Disable Alg Control failed res = %d error = %d\n",
+			   r1t1_card->num + 1, a_c_stat, a_c_err);
 
 	r1t1_card_unselect_dsp(r1t1_card);
 
@@ -1825,45 +2343,169 @@ static void r1t1_chan_ec_disable(struct r1t1_card *r1t1_card, int chan_num)
 }
 
 
-static int r1t1_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
-							   struct dahdi_echocanparam *p,
-							   struct dahdi_echocan_state **ec)
-{
-	struct dahdi_span *span = chan->span;
-	struct r1t1_card *r1t1_card = container_of(span, struct r1t1_card, span);
-	int chan_num;
+/* DAHDI echo canceller parameters and the canceller settings they set */
+static const struct {
+	const char *name;
+	size_t offset;
+} r1t1_ec_params[] = {
+	{"tail", offsetof(GpakEcanParms_t, EcanTapLength)},
+	{"nlp", offsetof(GpakEcanParms_t, EcanNlpType)},
+	{"adapt", offsetof(GpakEcanParms_t, EcanAdaptEnable)},
+	{"g165", offsetof(GpakEcanParms_t, EcanG165DetEnable)},
+	{"dbl_talk", offsetof(GpakEcanParms_t, EcanDblTalkThresh)},
+	{"nlp_thresh", offsetof(GpakEcanParms_t, EcanNlpThreshold)},
+	{"nlp_conv", offsetof(GpakEcanParms_t, EcanNlpConv)},
+	{"nlp_unconv", offsetof(GpakEcanParms_t, EcanNlpUnConv)},
+	{"nlp_supp", offsetof(GpakEcanParms_t, EcanNlpMaxSuppress)},
+	{"cng_thresh", offsetof(GpakEcanParms_t, EcanCngThreshold)},
+	{"adapt_limit", offsetof(GpakEcanParms_t, EcanAdaptLimit)},
+	{"cross_corr", offsetof(GpakEcanParms_t, EcanCrossCorrLimit)},
+	{"fir_segs", offsetof(GpakEcanParms_t, EcanNumFirSegments)},
+	{"fir_seg_len", offsetof(GpakEcanParms_t, EcanFirSegmentLen)},
+};
 
-	chan_num = chan->chanpos - 1;
+/*
+ * Build the canceller parameters of a DAHDI echo canceller request on top of
+ *  the driver defaults. The tail can only be shortened, the DSP channels are
+ *  sized for the default one.
+ */
+static int r1t1_chan_ec_params(struct r1t1_card *r1t1_card, struct dahdi_echocanparams *ecp,
+							   struct dahdi_echocanparam *p, GpakEcanParms_t *parms)
+{
+	GpakChannelConfig_t ChanConfig;
+	int x, y;
+
+	r1t1_card_dsp_chanconfig(r1t1_card, &ChanConfig);
+	*parms = ChanConfig.EcanParametersB;
+	if (ec_taps && ecp->tap_length)
+		parms->EcanTapLength = ecp->tap_length;
+
+	for (x = 0; x < ecp->param_count; x++) {
+		for (y = 0; y < ARRAY_SIZE(r1t1_ec_params); y++) {
+			if (!strcasecmp(p[x].name, r1t1_ec_params[y].name))
+				break;
+		}
+		if ((y == ARRAY_SIZE(r1t1_ec_params)) || (p[x].value < 0) || (p[x].value > 0x7fff) ||
+			((r1t1_ec_params[y].offset == offsetof(GpakEcanParms_t, EcanNlpType)) &&
+			 (p[x].value > RHINO_NLP_MAX))) {
+			printk(KERN_WARNING "R1T1: %d: invalid echo canceller parameter %s=%d; failing request\n",
+				   r1t1_card->num + 1, p[x].name, p[x].value);
+			return -EINVAL;
+		}
+		*(short int *) ((char *) parms + r1t1_ec_params[y].offset) = p[x].value;
+	}
 
-	if (ecp->param_count > 0) {
-		printk(KERN_WARNING
-			   "R1T1 echo canceller does not support parameters; failing request\n");
+	if ((parms->EcanTapLength == 0) ||
+		(parms->EcanTapLength > Gpak_chan_config.EcanParametersB.EcanTapLength)) {
+		printk(KERN_WARNING "R1T1: %d: echo canceller tail of %d taps not supported; failing request\n",
+			   r1t1_card->num + 1, parms->EcanTapLength);
 		return -EINVAL;
 	}
 
-	if (debug & DEBUG_DSP) {
-		printk(KERN_DEBUG "R1T1: %d Echo Can control Span %d Chan %d dahdi_chan %d\n", r1t1_card->num + 1,
-			   1, chan_num, chan->channo);
-		printk(KERN_DEBUG "DSP up %x\n", r1t1_card->dsp_up);
-	}
-	if (r1t1_card->dsp_up == 1) {
-		*ec = r1t1_card->ec[chan_num];
-		(*ec)->ops = &my_ec_ops;
-		(*ec)->features = my_ec_features;
-		r1t1_card->nextec |= (1 << chan_num);
-		queue_work(r1t1_card->wq, &r1t1_card->work);
-	}
 	return 0;
 }
 
-static void r1t1_echocan_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec)
+/*
+ * Reload a channel with the canceller parameters last requested for it. The
+ *  DSP only takes them with a fresh channel configuration, which leaves the
+ *  canceller enabled. A configuration the DSP rejects is replaced by the one
+ *  the channel ran with before.
+ */
+static void r1t1_chan_ec_reconfigure(struct r1t1_card *r1t1_card, int chan_num)
 {
-	struct dahdi_span *span = chan->span;
-	struct r1t1_card *r1t1_card = container_of(span, struct r1t1_card, span);
-	int chan_num;
+	struct r1t1_ec_cmd *ec_cmd = &r1t1_card->ec_cmd[chan_num];
+	GpakChannelConfig_t ChanConfig;
+	GPAK_TearDownChanStat_t td_err;
+	GPAK_ChannelConfigStat_t cc_err;
+	gpakTearDownStatus_t td_stat;
+	gpakConfigChanStatus_t cc_stat;
+	unsigned long flags;
 
-	memset(ec, 0, sizeof(*ec));
-	chan_num = chan->chanpos - 1;
+	r1t1_card_dsp_chanconfig(r1t1_card, &ChanConfig);
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	ChanConfig.EcanParametersB = ec_cmd->ecan_next;
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+	r1t1_card_dsp_chanslots(r1t1_card, chan_num, &ChanConfig);
+	ChanConfig.EcanEnableB = Enabled;
+
+	if ((td_stat = gpakTearDownChannel(r1t1_card, r1t1_card->num, chan_num, &td_err))) {
+		printk(KERN_ERR "R1T1: %d: Chan %d G168 DSP Tear Down failed res = %d error = %d\n",
+			   r1t1_card->num + 1, chan_num, td_stat, td_err);
+		return;
+	}
+
+	cc_stat = gpakConfigureChannel(r1t1_card, r1t1_card->num, chan_num, tdmToTdm, &ChanConfig,
+								   &cc_err);
+	if (cc_stat == CcsSuccess) {
+		ec_cmd->ecan_cur = ChanConfig.EcanParametersB;
+		if (debug & DEBUG_DSP)
+			printk(KERN_DEBUG "R1T1: %d: Chan %d Echo Can tail %d NLP %d\n", r1t1_card->num + 1,
+				   chan_num, ec_cmd->ecan_cur.EcanTapLength, ec_cmd->ecan_cur.EcanNlpType);
+		return;
+	}
+
+	printk(KERN_ERR "R1T1: %d: Chan %d Echo Can parameters rejected res = %d error = %d\n",
+		   r1t1_card->num + 1, chan_num, cc_stat, cc_err);
+	ChanConfig.EcanParametersB = ec_cmd->ecan_cur;
+	if ((cc_stat = gpakConfigureChannel(r1t1_card, r1t1_card->num, chan_num, tdmToTdm,
+										&ChanConfig, &cc_err)))
+		printk(KERN_ERR "R1T1: %d: Chan %d G168 DSP Chan Config failed error = %d  %d\n",
+			   r1t1_card->num + 1, chan_num, cc_err, cc_stat);
+}
+
+static int r1t1_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
+							   struct dahdi_echocanparam *p,
+							   struct dahdi_echocan_state **ec)
+{
+	struct dahdi_span *span = chan->span;
+	struct r1t1_card *r1t1_card = container_of(span, struct r1t1_card, span);
+	struct r1t1_ec_cmd *ec_cmd;
+	GpakEcanParms_t parms;
+	unsigned long flags;
+	int chan_num, res;
+
+	chan_num = chan->chanpos - 1;
+
+	if ((res = r1t1_chan_ec_params(r1t1_card, ecp, p, &parms)))
+		return res;
+
+	/* The DSP could not be reloaded, there is no canceller to give */
+	if (r1t1_card->dsp_reload_fails >= DSP_RELOAD_TRIES)
+		return -EIO;
+
+	if (debug & DEBUG_DSP) {
+		printk(KERN_DEBUG "R1T1: %d Echo Can control Span %d Chan %d dahdi_chan %d\n", r1t1_card->num + 1,
+			   1, chan_num, chan->channo);
+		printk(KERN_DEBUG "DSP up %x\n", r1t1_card->dsp_up);
+	}
+	if (r1t1_card->dsp_up == 1) {
+		*ec = r1t1_card->ec[chan_num];
+		(*ec)->ops = &my_ec_ops;
+		(*ec)->features = my_ec_features;
+		ec_cmd = &r1t1_card->ec_cmd[chan_num];
+		spin_lock_irqsave(&r1t1_card->lock, flags);
+		/* The EC bench gives the channel up */
+		__r1t1_card_ec_bench_return(r1t1_card, 1 << chan_num);
+		if (memcmp(&parms, &ec_cmd->ecan_next, sizeof(parms)) &&
+			!(ec_disable & (1 << chan_num))) {
+			ec_cmd->ecan_next = parms;
+			r1t1_card->ec_reconfig |= (1 << chan_num);
+		}
+		spin_unlock_irqrestore(&r1t1_card->lock, flags);
+		r1t1_card->nextec |= (1 << chan_num);
+		queue_work(r1t1_card->wq, &r1t1_card->work);
+	}
+	return 0;
+}
+
+static void r1t1_echocan_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec)
+{
+	struct dahdi_span *span = chan->span;
+	struct r1t1_card *r1t1_card = container_of(span, struct r1t1_card, span);
+	int chan_num;
+
+	memset(ec, 0, sizeof(*ec));
+	chan_num = chan->chanpos - 1;
 
 	if (debug & DEBUG_DSP) {
 		printk(KERN_DEBUG "R1T1: %d Echo Can control Span %d Chan %d dahdi_chan %d\n", r1t1_card->num + 1,
@@ -1887,54 +2529,304 @@ static void echocan_bh(struct work_struct *data)
 {
 	struct r1t1_card *r1t1_card = container_of(data, struct r1t1_card, work);
 #endif
+	struct r1t1_ec_cmd *ec_cmd;
 	unsigned int todo, chan_num;
+	unsigned long flags;
+	int enable;
+
+	/* Left for the DSP recovery to replay */
+	if (r1t1_card->dsp_recovering || r1t1_card->dsp_reload_fails)
+		return;
+
+	/*
+	 * Channels with new canceller parameters are reconfigured first. That is
+	 *  done synchronously, with the channels marked busy.
+	 */
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	todo = r1t1_card->ec_reconfig & ~r1t1_card->ec_busy;
+	r1t1_card->ec_reconfig &= ~todo;
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+	if (todo) {
+		r1t1_card->ec_busy |= todo;
+		for (chan_num = 0; chan_num < r1t1_card->span.channels; chan_num++) {
+			if (r1t1_card->dsp_recovering)
+				break;
+			if (todo & (1 << chan_num))
+				r1t1_chan_ec_reconfigure(r1t1_card, chan_num);
+		}
+		/* A reload in the meantime configures the channels again */
+		spin_lock_irqsave(&r1t1_card->lock, flags);
+		r1t1_card->ec_busy &= ~todo;
+		if (r1t1_card->dsp_recovering)
+			r1t1_card->ec_reconfig |= todo;
+		else
+			r1t1_card->currec |= todo;
+		spin_unlock_irqrestore(&r1t1_card->lock, flags);
+		wake_up(&r1t1_card->ec_wait);
+	}
 
-	todo = r1t1_card->nextec ^ r1t1_card->currec;
+	if (r1t1_card->dsp_recovering)
+		return;
+
+	/*
+	 * Queue the EC control of every changed channel at once. The commands are
+	 *  transacted back to back by the DSP command queue and complete in
+	 *  r1t1_chan_ec_done(), channels still in flight are left for the next pass.
+	 */
+	todo = (r1t1_card->nextec ^ r1t1_card->currec) & ~r1t1_card->ec_busy;
 	if (debug & DEBUG_DSP) {
 		printk(KERN_DEBUG "R1T1: %d Echo Can control bh change %x to %x\n", r1t1_card->num + 1, todo,
 			   (r1t1_card->nextec & todo));
-		printk(KERN_DEBUG "nextec %x currec %x\n", r1t1_card->nextec, r1t1_card->currec);
+		printk(KERN_DEBUG "nextec %x currec %x busy %x\n", r1t1_card->nextec, r1t1_card->currec,
+			   r1t1_card->ec_busy);
 		printk(KERN_DEBUG "span.channels = %d\n", r1t1_card->span.channels);
 	}
 	for (chan_num = 0; chan_num < r1t1_card->span.channels; chan_num++) {
-		if (todo & (1 << chan_num)) {
-			if (r1t1_card->nextec & (1 << chan_num)) {
-				r1t1_chan_ec_enable(r1t1_card, chan_num);
-				r1t1_card->currec |= (1 << chan_num);
-				schedule();
-			} else {
-				r1t1_chan_ec_disable(r1t1_card, chan_num);
-				r1t1_card->currec &= ~(1 << chan_num);
-				schedule();
-			}
+		if (!(todo & (1 << chan_num)))
+			continue;
+
+		enable = (r1t1_card->nextec & (1 << chan_num)) ? 1 : 0;
+		if (enable && (ec_disable & (1 << chan_num))) {
+			if (debug & DEBUG_DSP)
+				printk(KERN_DEBUG "r1t1 %d: Echo Can NOT enable DSP EC Chan %d\n", r1t1_card->num + 1,
+					   chan_num);
+			r1t1_card->currec |= (1 << chan_num);
+			continue;
 		}
+
+		if (debug & DEBUG_DSP)
+			printk(KERN_DEBUG "R1T1: %d: Echo Can %s DSP %d EC Chan %d\n", r1t1_card->num + 1,
+				   enable ? "enable" : "disable", 1, chan_num);
+
+		if (r1t1_card->ec_pending++ == 0) {
+			r1t1_card->ec_start = ktime_get();
+			r1t1_card->ec_burst = 0;
+		}
+		r1t1_card->ec_burst++;
+		r1t1_card->ec_busy |= (1 << chan_num);
+
+		ec_cmd = &r1t1_card->ec_cmd[chan_num];
+		ec_cmd->enable = enable;
+		ec_cmd->retried = 0;
+		if (gpakQueueAlgControl(r1t1_card, r1t1_card->num, chan_num,
+								enable ? EnableEcanB : BypassEcanB, &ec_cmd->cmd))
+			r1t1_chan_ec_complete(r1t1_card, chan_num, enable, AcDspCommFailure);
 	}
 }
 
+static const char r1t1_dtmf_digits[] = "123A456B789C*0#D";
 
-static int __devinit r1t1_card_init_dsp(struct r1t1_card *r1t1_card)
+/*
+ * Report a tone detected by the DSP to DAHDI. The DSP tells the start of a
+ *  digit and the end of the last one, fax CNG is only reported once it ends
+ *  and is passed on as the 'f' digit.
+ */
+static void r1t1_chan_tone_event(struct r1t1_card *r1t1_card, unsigned short int chan_num,
+								 GpakToneCodes_t tone)
 {
-	int loops = 0;
-	__u16 high, low;
-	int chan_num, chan_count, slot_num;
-	int ifb_z = 4;
+	struct dahdi_chan *chan;
+	unsigned char digit;
 
-	if (debug & DEBUG_DSP)
-		printk(KERN_DEBUG "R1T1: Reset DSP\n");
+	if (chan_num >= r1t1_card->span.channels)
+		return;
+	chan = r1t1_card->chans[chan_num];
 
-	r1t1_card_reset_dsp(r1t1_card);
+	if (debug & DEBUG_DTMF)
+		printk(KERN_DEBUG "R1T1: %d: Chan %d tone %d\n", r1t1_card->num + 1, chan_num, tone);
 
-	if (debug & DEBUG_DSP)
-		printk(KERN_DEBUG "R1T1: Un-Reset DSP\n");
+	if (!test_bit(chan_num, &r1t1_card->dtmfmask)) {
+		r1t1_card->dtmf_digit[chan_num] = 0;
+		return;
+	}
 
-	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_ECB1, 0x00000000);	/* use ec b */
-	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_ECA1, 0x00000000);	/* use ec a */
+	if (tone <= DtmfDigitD) {
+		digit = r1t1_dtmf_digits[tone];
+		r1t1_card->dtmf_digit[chan_num] = digit;
+		dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFDOWN | digit);
+	} else if (tone == EndofMFDigit) {
+		digit = r1t1_card->dtmf_digit[chan_num];
+		r1t1_card->dtmf_digit[chan_num] = 0;
+		if (digit)
+			dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFUP | digit);
+	} else if (tone == EndofCngDigit) {
+		dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFDOWN | 'f');
+		dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFUP | 'f');
+	}
+}
 
-	if (no_ec)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void dtmf_bh(void *data)
+{
+	struct r1t1_card *r1t1_card = data;
+#else
+static void dtmf_bh(struct work_struct *data)
+{
+	struct r1t1_card *r1t1_card = container_of(data, struct r1t1_card, dtmfwork);
+#endif
+	gpakReadEventFIFOMessageStat_t ref_stat;
+	GpakAsyncEventCode_t event_code;
+	GpakAsyncEventData_t event_data;
+	unsigned short int chan_num;
+	int events;
+
+	/* Bounded, so a DSP that keeps failing cannot hold the queue */
+	for (events = 0; events < 32; events++) {
+		/* A DSP reload stops the detection */
+		if (!r1t1_card->dtmf_up)
+			return;
+		ref_stat = gpakReadEventFIFOMessage(r1t1_card, r1t1_card->num, &chan_num,
+											&event_code, &event_data);
+		if (ref_stat == RefInvalidEvent)
+			continue;
+		if (ref_stat != RefEventAvail)
+			break;
+		if (event_code == EventToneDetect)
+			r1t1_chan_tone_event(r1t1_card, chan_num, event_data.toneEvent.ToneCode);
+	}
+}
+
+static int r1t1_card_ec_settled(struct r1t1_card *r1t1_card)
+{
+	return (r1t1_card->nextec == r1t1_card->currec) &&
+		!(r1t1_card->ec_reconfig | r1t1_card->ec_busy);
+}
+
+/*
+ * Lend the idle channels to the EC bench, those neither open nor cancelling,
+ *  or give back the lent ones that have been opened since. Called with the
+ *  card lock held. Returns the number of channels lent.
+ */
+static int __r1t1_card_ec_bench_idle(struct r1t1_card *r1t1_card, int lend)
+{
+	unsigned int open = 0;
+	int chan_num;
+
+	for (chan_num = 0; chan_num < r1t1_card->span.channels; chan_num++) {
+		if (r1t1_card->chans[chan_num] &&
+			(r1t1_card->chans[chan_num]->flags & DAHDI_FLAG_OPEN))
+			open |= (1 << chan_num);
+	}
+	if (lend) {
+		r1t1_card->ec_bench = ((1U << r1t1_card->span.channels) - 1) & ~open &
+			~r1t1_card->nextec;
+		for (chan_num = 0; chan_num < r1t1_card->span.channels; chan_num++) {
+			if (r1t1_card->ec_bench & (1 << chan_num))
+				r1t1_card->ec_cmd[chan_num].ecan_bench =
+					r1t1_card->ec_cmd[chan_num].ecan_next;
+		}
+	} else
+		__r1t1_card_ec_bench_return(r1t1_card, open);
+	return hweight32(r1t1_card->ec_bench);
+}
+
+/*
+ * Reload the channels lent to the EC bench with the given tail length and
+ *  the canceller enabled.
+ */
+static int r1t1_card_ec_bench_taps(struct r1t1_card *r1t1_card, int taps)
+{
+	GpakChannelConfig_t ChanConfig;
+	int chan_num;
+	unsigned long flags;
+
+	r1t1_card_dsp_chanconfig(r1t1_card, &ChanConfig);
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	__r1t1_card_ec_bench_idle(r1t1_card, 0);
+	for (chan_num = 0; chan_num < r1t1_card->span.channels; chan_num++) {
+		if (!(r1t1_card->ec_bench & (1 << chan_num)))
+			continue;
+		r1t1_card->ec_cmd[chan_num].ecan_next = ChanConfig.EcanParametersB;
+		r1t1_card->ec_cmd[chan_num].ecan_next.EcanTapLength = taps;
+	}
+	r1t1_card->ec_reconfig |= r1t1_card->ec_bench;
+	r1t1_card->nextec |= r1t1_card->ec_bench;
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+	queue_work(r1t1_card->wq, &r1t1_card->work);
+
+	if (!wait_event_timeout(r1t1_card->ec_wait, r1t1_card_ec_settled(r1t1_card), 10 * HZ)) {
+		printk(KERN_WARNING "R1T1: %d: EC bench timed out reloading the channels\n",
+			   r1t1_card->num + 1);
 		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Enable and then bypass the echo canceller on every idle channel at once
+ *  and report how long each burst took to reach the DSP. Then report the DSP
+ *  load with those cancellers running at a range of tail lengths. Channels
+ *  that are opened meanwhile are left alone from then on, the others get
+ *  their parameters back at the end.
+ */
+static void r1t1_card_ec_bench(struct r1t1_card *r1t1_card)
+{
+	unsigned short int peak, prev_peak;
+	int pass, taps, lent;
+	unsigned long flags;
+
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	lent = __r1t1_card_ec_bench_idle(r1t1_card, 1);
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+	if (!lent) {
+		printk(KERN_INFO "R1T1: %d: EC bench: no idle channels\n", r1t1_card->num + 1);
+		return;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		spin_lock_irqsave(&r1t1_card->lock, flags);
+		__r1t1_card_ec_bench_idle(r1t1_card, 0);
+		r1t1_card->ec_burst = 0;
+		r1t1_card->ec_last_us = 0;
+		if (pass == 0)
+			r1t1_card->nextec |= r1t1_card->ec_bench;
+		else
+			r1t1_card->nextec &= ~r1t1_card->ec_bench;
+		spin_unlock_irqrestore(&r1t1_card->lock, flags);
+		queue_work(r1t1_card->wq, &r1t1_card->work);
+
+		if (!wait_event_timeout(r1t1_card->ec_wait, r1t1_card_ec_settled(r1t1_card), HZ)) {
+			printk(KERN_WARNING "R1T1: %d: EC bench timed out\n", r1t1_card->num + 1);
+			goto done;
+		}
+		printk(KERN_INFO "R1T1: %d: EC bench: %s %d channels took %u us\n",
+			   r1t1_card->num + 1, pass ? "bypassing" : "enabling", r1t1_card->ec_burst,
+			   r1t1_card->ec_last_us);
+	}
+
+	for (taps = Gpak_chan_config.EcanParametersB.EcanTapLength; taps >= 128; taps /= 2) {
+		if (r1t1_card_ec_bench_taps(r1t1_card, taps))
+			goto done;
+		/* let the DSP's one second peak cover the new load only */
+		msleep(2000);
+		if (gpakReadCpuUsage(r1t1_card, r1t1_card->num, &peak, &prev_peak) == RcuSuccess)
+			printk(KERN_INFO "R1T1: %d: EC bench: %d taps on %d channels: CPU peak %d, last second %d\n",
+				   r1t1_card->num + 1, taps, hweight32(r1t1_card->ec_bench), peak, prev_peak);
+	}
+
+done:
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	__r1t1_card_ec_bench_return(r1t1_card, ~0U);
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+	queue_work(r1t1_card->wq, &r1t1_card->work);
+	if (!wait_event_timeout(r1t1_card->ec_wait, r1t1_card_ec_settled(r1t1_card), 10 * HZ))
+		printk(KERN_WARNING "R1T1: %d: EC bench timed out restoring the channels\n",
+			   r1t1_card->num + 1);
+}
 
-	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_HPIC,
-						(~EC_ON & __r1t1_card_pci_in(r1t1_card, TARG_REGS + R1T1_HPIC)));
+
+/*
+ * Download and start the DSP, then configure its ports and channels with
+ *  every echo canceller bypassed. Channels that ran before keep the
+ *  canceller parameters they had.
+ */
+static int r1t1_card_load_dsp(struct r1t1_card *r1t1_card)
+{
+	GpakChannelConfig_t ChanConfig;
+	unsigned long flags;
+	int loops = 0;
+	__u16 high, low;
+	int chan_num, chan_count;
+	int ifb_z = 4;
 
 	if (r1t1_span_download_dsp(r1t1_card)) {
 		return -1;
@@ -1974,14 +2866,6 @@ static int __devinit r1t1_card_init_dsp(struct r1t1_card *r1t1_card)
 	if (r1t1_span_dsp_configureports(r1t1_card, Gpak_32_chan_port_config))
 		return -1;
 
-	Gpak_chan_config.EcanParametersA.EcanNlpType = nlp_type;
-	Gpak_chan_config.EcanParametersB.EcanNlpType = nlp_type;
-
-	Gpak_chan_config.EcanEnableB = Enabled;
-
-	Gpak_chan_config.EcanEnableA = Disabled;
-	Gpak_chan_config.SoftwareCompand = cmpNone;
-
 	r1t1_card_dsp_ping(r1t1_card);
 	chan_count = 0;
 
@@ -1990,25 +2874,19 @@ static int __devinit r1t1_card_init_dsp(struct r1t1_card *r1t1_card)
 
 		if (r1t1_card->ise1) {
 			unsigned int hpi_c;
+			spin_lock_irqsave(&r1t1_card->lock, flags);
 			hpi_c = __r1t1_card_pci_in(r1t1_card, TARG_REGS + R1T1_HPIC);
 			__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_HPIC, (hpi_c | XLATE));
 			__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_XLATE_EN, 0xffff7fff);
-			slot_num = chanmap_e1[chan_num];
-			if (chan_num != 15)
-				Gpak_chan_config.SoftwareCompand = cmpPCMU;
-			else
-				Gpak_chan_config.SoftwareCompand = cmpNone;
-		} else {
-			slot_num = chanmap_t1[chan_num];
-			Gpak_chan_config.SoftwareCompand = cmpPCMU;
+			spin_unlock_irqrestore(&r1t1_card->lock, flags);
 		}
 
-		Gpak_chan_config.PcmInSlotA = slot_num * 4;
-		Gpak_chan_config.PcmOutSlotA = slot_num * 4;
-		Gpak_chan_config.PcmInSlotB = slot_num * 4;
-		Gpak_chan_config.PcmOutSlotB = slot_num * 4;
+		r1t1_card_dsp_chanconfig(r1t1_card, &ChanConfig);
+		r1t1_card_dsp_chanslots(r1t1_card, chan_num, &ChanConfig);
+		if (r1t1_card->ec_cmd)
+			ChanConfig.EcanParametersB = r1t1_card->ec_cmd[chan_num].ecan_cur;
 
-		if (r1t1_span_dsp_configurechannel(r1t1_card, Gpak_chan_config, chan_num))
+		if (r1t1_span_dsp_configurechannel(r1t1_card, ChanConfig, chan_num))
 			return -1;
 
 		r1t1_chan_ec_disable(r1t1_card, chan_num);
@@ -2016,6 +2894,208 @@ static int __devinit r1t1_card_init_dsp(struct r1t1_card *r1t1_card)
 
 	printk(KERN_NOTICE "R1T1: %d DSP %d: %d channels configured\n", r1t1_card->num + 1, 1, chan_count);
 
+	return 0;
+}
+
+/*
+ * Reload the DSP after it was found reset or stopped answering. The span
+ *  keeps running on the direct audio path meanwhile. The canceller of every
+ *  channel DAHDI has asked for is enabled again once the DSP is up.
+ */
+static void r1t1_card_recover_dsp(struct r1t1_card *r1t1_card)
+{
+	int res;
+	unsigned long flags;
+	ktime_t start;
+	u64 took_ns;
+
+	printk(KERN_WARNING "R1T1: %d: Reloading the DSP\n", r1t1_card->num + 1);
+	start = ktime_get();
+
+	/* Stop all DSP traffic, EC changes are held until the DSP is back */
+	r1t1_card->dsp_recovering = 1;
+	r1t1_card->dtmf_up = 0;
+	synchronize_irq(r1t1_card->dev->irq);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	cancel_work_sync(&r1t1_card->work);
+	cancel_work_sync(&r1t1_card->dtmfwork);
+#else
+	flush_workqueue(r1t1_card->wq);
+#endif
+	gpakStopCmdQueue(r1t1_card, r1t1_card->num);
+
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_HPIC,
+						(~EC_ON & __r1t1_card_pci_in(r1t1_card, TARG_REGS + R1T1_HPIC)));
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+
+	gpakRequestFiles(r1t1_card);
+	r1t1_card_reset_dsp(r1t1_card);
+	res = r1t1_card_load_dsp(r1t1_card);
+	gpakReleaseFiles(r1t1_card);
+
+	/* Every canceller is bypassed now, the EC work enables them again */
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	r1t1_card->currec = 0;
+	r1t1_card->ec_busy = 0;
+	r1t1_card->ec_pending = 0;
+	r1t1_card->health.fail_run = 0;
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+
+	gpakTestDspReset(r1t1_card, r1t1_card->num);
+	if (gpakStartCmdQueue(r1t1_card, r1t1_card->num, r1t1_card->wq))
+		printk(KERN_ERR "r1t1: Unable to start the DSP command queue\n");
+
+	/* The cancellers stay bypassed, the health work tries again later */
+	if (res) {
+		if (++r1t1_card->dsp_reload_fails < DSP_RELOAD_TRIES)
+			printk(KERN_ERR "R1T1: %d: DSP reload failed, echo cancellation is off\n",
+				   r1t1_card->num + 1);
+		else
+			printk(KERN_ERR "R1T1: %d: DSP reload failed %u times, echo cancellation stays off\n",
+				   r1t1_card->num + 1, r1t1_card->dsp_reload_fails);
+		r1t1_card->dsp_recovering = 0;
+		return;
+	}
+
+	spin_lock_irqsave(&r1t1_card->lock, flags);
+	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_HPIC,
+						(EC_ON | __r1t1_card_pci_in(r1t1_card, TARG_REGS + R1T1_HPIC)));
+	spin_unlock_irqrestore(&r1t1_card->lock, flags);
+
+	r1t1_card->dtmf_up = dtmf && (r1t1_card->dsp_type == DSP_5510);
+	r1t1_card->dsp_reload_fails = 0;
+	r1t1_card->dsp_recovering = 0;
+	queue_work(r1t1_card->wq, &r1t1_card->work);
+
+	took_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	do_div(took_ns, 1000);
+	r1t1_card->dsp_recovery_us = (unsigned int) took_ns;
+	r1t1_card->dsp_recoveries++;
+	printk(KERN_NOTICE "R1T1: %d: DSP reloaded in %u us\n", r1t1_card->num + 1,
+		   r1t1_card->dsp_recovery_us);
+}
+
+/* Health samples go on the EC queue, or the shared one before 2.6.22 (see gpakStopCmdQueue) */
+static void r1t1_card_health_sched(struct r1t1_card *r1t1_card, unsigned long delay)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	queue_delayed_work(r1t1_card->wq, &r1t1_card->healthwork, delay);
+#else
+	schedule_delayed_work(&r1t1_card->healthwork, delay);
+#endif
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void health_bh(void *data)
+{
+	struct r1t1_card *r1t1_card = data;
+#else
+static void health_bh(struct work_struct *data)
+{
+	struct r1t1_card *r1t1_card = container_of(data, struct r1t1_card, healthwork.work);
+#endif
+
+	if (r1t1_card_dsp_health(r1t1_card) && dsp_recover)
+		r1t1_card_recover_dsp(r1t1_card);
+
+	/* Back off while the reloads fail, stop once the card gave up */
+	if (r1t1_card->health_up && (dsp_health > 0) &&
+		(r1t1_card->dsp_reload_fails < DSP_RELOAD_TRIES))
+		r1t1_card_health_sched(r1t1_card, (dsp_health * HZ) << r1t1_card->dsp_reload_fails);
+}
+
+/* Command transactions of a DSP, and how long the queued ones took to complete */
+static int r1t1_dsp_cmds_show(struct r1t1_card *r1t1_card, unsigned short int DspId,
+							 int dsp, char *buf, int len)
+{
+	gpakCmdStats_t stats;
+	u64 avg_ns = 0, queued_ns = 0;
+
+	gpakReadCmdStats(r1t1_card, DspId, &stats);
+	if (stats.Commands) {
+		avg_ns = stats.TotalNs;
+		do_div(avg_ns, stats.Commands);
+	}
+	if (stats.Queued) {
+		queued_ns = stats.QueuedNs;
+		do_div(queued_ns, stats.Queued);
+	}
+	return scnprintf(buf + len, PAGE_SIZE - len,
+					 "dsp %d: cmds %lu failed %lu avg %u us max %u us rate %u/s "
+					 "queued %lu avg %u us max %u us\n", dsp, stats.Commands, stats.Failures,
+					 (unsigned int) avg_ns / 1000, stats.MaxNs / 1000,
+					 avg_ns ? (unsigned int) (NSEC_PER_SEC / (unsigned int) avg_ns) : 0,
+					 stats.Queued, (unsigned int) queued_ns / 1000, stats.QueuedMaxNs / 1000);
+}
+
+static ssize_t r1t1_dsp_health_show(struct device *dev, struct device_attribute *attr,
+									char *buf)
+{
+	struct r1t1_card *r1t1_card = pci_get_drvdata(to_pci_dev(dev));
+	struct r1t1_dsp_health *health = &r1t1_card->health;
+	int len;
+
+	len = scnprintf(buf, PAGE_SIZE,
+					 "dsp 1: cpu %u peak %u avg %u framing %lu %lu %lu dma %lu slips %lu "
+					 "samples %lu failed %lu\nrecoveries %u last %u us failed %u\n",
+					 health->cpu_last,
+					 health->cpu_peak, health->cpu_avg >> 4, health->framing[0],
+					 health->framing[1], health->framing[2], health->framing[3], health->slips,
+					 health->samples, health->failures, r1t1_card->dsp_recoveries,
+					 r1t1_card->dsp_recovery_us, r1t1_card->dsp_reload_fails);
+	len += r1t1_dsp_cmds_show(r1t1_card, r1t1_card->num, 1, buf, len);
+	return len;
+}
+
+static DEVICE_ATTR(dsp_health, S_IRUGO, r1t1_dsp_health_show, NULL);
+
+static int r1t1_card_init_dsp(struct r1t1_card *r1t1_card)
+{
+	GpakChannelConfig_t ChanConfig;
+	int chan_num;
+
+	if (debug & DEBUG_DSP)
+		printk(KERN_DEBUG "R1T1: Reset DSP\n");
+
+	r1t1_card_reset_dsp(r1t1_card);
+
+	if (debug & DEBUG_DSP)
+		printk(KERN_DEBUG "R1T1: Un-Reset DSP\n");
+
+	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_ECB1, 0x00000000);	/* use ec b */
+	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_ECA1, 0x00000000);	/* use ec a */
+
+	if (no_ec)
+		return -1;
+
+	__r1t1_card_pci_out(r1t1_card, TARG_REGS + R1T1_HPIC,
+						(~EC_ON & __r1t1_card_pci_in(r1t1_card, TARG_REGS + R1T1_HPIC)));
+
+	if (gpakAttachDsps(r1t1_card, r1t1_card->num, 1)) {
+		printk(KERN_ERR "R1T1: %d: Unable to allocate DSP state\n", r1t1_card->num + 1);
+		return -1;
+	}
+
+	if (r1t1_card_load_dsp(r1t1_card))
+		return -1;
+
+	r1t1_card->ec_cmd = kmalloc_node(r1t1_card->span.channels * sizeof *r1t1_card->ec_cmd,
+									 GFP_KERNEL, dev_to_node(&r1t1_card->dev->dev));
+	if (r1t1_card->ec_cmd == NULL) {
+		printk(KERN_ERR "R1T1: %d: Unable to allocate EC control commands\n", r1t1_card->num + 1);
+		return -1;
+	}
+	memset(r1t1_card->ec_cmd, 0, r1t1_card->span.channels * sizeof *r1t1_card->ec_cmd);
+	r1t1_card_dsp_chanconfig(r1t1_card, &ChanConfig);
+	for (chan_num = 0; chan_num < r1t1_card->span.channels; chan_num++) {
+		r1t1_card->ec_cmd[chan_num].r1t1_card = r1t1_card;
+		r1t1_card->ec_cmd[chan_num].chan_num = chan_num;
+		r1t1_card->ec_cmd[chan_num].cmd.pDone = r1t1_chan_ec_done;
+		r1t1_card->ec_cmd[chan_num].ecan_next = ChanConfig.EcanParametersB;
+		r1t1_card->ec_cmd[chan_num].ecan_cur = ChanConfig.EcanParametersB;
+	}
+
 	r1t1_card->dsp_up = 1;
 #if DAHDI_VER < KERNEL_VERSION(2,4,0)
 	r1t1_card->span.echocan_create = r1t1_echocan_create;
@@ -2077,10 +3157,31 @@ static int __devinit r1t1_card_init_dsp(struct r1t1_card *r1t1_card)
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 	INIT_WORK(&r1t1_card->work, echocan_bh, r1t1_card);
+	INIT_WORK(&r1t1_card->dtmfwork, dtmf_bh, r1t1_card);
+	INIT_WORK(&r1t1_card->healthwork, health_bh, r1t1_card);
 #else
 	INIT_WORK(&r1t1_card->work, echocan_bh);
+	INIT_WORK(&r1t1_card->dtmfwork, dtmf_bh);
+	INIT_DELAYED_WORK(&r1t1_card->healthwork, health_bh);
 #endif
 
+	if (gpakStartCmdQueue(r1t1_card, r1t1_card->num, r1t1_card->wq))
+		printk(KERN_ERR "r1t1: Unable to start the DSP command queue\n");
+
+	if (ecbench)
+		r1t1_card_ec_bench(r1t1_card);
+
+	if (dtmf && (r1t1_card->dsp_type == DSP_5510)) {
+		r1t1_card->dtmf_up = 1;
+		printk(KERN_INFO "R1T1: %d: DSP DTMF detection enabled\n", r1t1_card->num + 1);
+	}
+
+	if (device_create_file(&r1t1_card->dev->dev, &dev_attr_dsp_health))
+		printk(KERN_WARNING "R1T1: %d: Unable to export the DSP health\n", r1t1_card->num + 1);
+	r1t1_card->health_up = 1;
+	if (dsp_health > 0)
+		r1t1_card_health_sched(r1t1_card, dsp_health * HZ);
+
 	return (0);
 }
 
@@ -2111,10 +3212,74 @@ static int r1t1_hardware_init(struct r1t1_card *r1t1_card)
 
 }
 
+static int r1t1_launch(struct r1t1_card *r1t1_card)
+{
+#ifdef USE_G168_DSP
+	/* The DSP image loads while the DSP is reset */
+	int dsp_fw = !no_ec;
+
+	if (dsp_fw)
+		gpakRequestFiles(r1t1_card);
+	r1t1_card->dsp_type = DSP_5510;
+	r1t1_card_init_dsp(r1t1_card);
+	if (dsp_fw)
+		gpakReleaseFiles(r1t1_card);
+#endif /* USE_G168_DSP */
+
+	/* Cards launch in parallel, but keep their span numbers in card order */
+	rhino_launch_wait_turn(&r1t1_launch, r1t1_card->num);
+
+	return r1t1_register(r1t1_card);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void launch_bh(void *data)
+{
+	struct r1t1_card *r1t1_card = data;
+#else
+static void launch_bh(struct work_struct *data)
+{
+	struct r1t1_card *r1t1_card = container_of(data, struct r1t1_card, launchwork);
+#endif
+	ktime_t start = ktime_get();
+
+	r1t1_launch(r1t1_card);
+	printk(KERN_INFO "R1T1: %d: Launched in %u ms\n", r1t1_card->num + 1,
+		   (unsigned int) ktime_to_ms(ktime_sub(ktime_get(), start)));
+	rhino_launch_done(&r1t1_launch, r1t1_card->num, &r1t1_card->launched);
+}
+
+static ssize_t r1t1_irq_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct r1t1_card *r1t1_card = pci_get_drvdata(to_pci_dev(dev));
+	unsigned int reads = r1t1_card->irq_reads_avg;
+
+	return scnprintf(buf, PAGE_SIZE, "interrupts %u reads %u.%02u avg %u ns max %u ns misses %d\n",
+					 r1t1_card->irq_count, reads >> 4, (reads & 15) * 100 / 16,
+					 r1t1_card->irq_ns_avg >> 4, r1t1_card->irq_ns_max, r1t1_card->miss);
+}
+
+static DEVICE_ATTR(irq_stats, S_IRUGO, r1t1_irq_stats_show, NULL);
+
+static int r1t1_request_irq(struct r1t1_card *r1t1_card)
+{
+	struct pci_dev *pdev = r1t1_card->dev;
+	int cpu;
+
+	if (rhino_request_irq(pdev, r1t1_interrupt, "r1t1", r1t1_card, msi, r1t1_card->num,
+						  &r1t1_card->msi, &cpu))
+		return -EIO;
+
+	printk(KERN_INFO "R1T1: %d: %s interrupt %d, node %d, cpu %d\n", r1t1_card->num + 1,
+		   r1t1_card->msi ? "MSI" : "INTx", pdev->irq, dev_to_node(&pdev->dev), cpu);
+	return 0;
+}
+
 static int __devinit r1t1_init_one(struct pci_dev *pdev, const struct pci_device_id *ent)
 {
 	struct r1t1_card *r1t1_card;
 	unsigned int *canary;
+	int node = dev_to_node(&pdev->dev);
 	int x;
 	struct dahdi_chan *chan_block;
 	struct dahdi_echocan_state *ec_block;
@@ -2138,7 +3303,8 @@ static int __devinit r1t1_init_one(struct pci_dev *pdev, const struct pci_device
 	if (x >= RH_MAX_CARDS)
 		return -1;
 
-	r1t1_card = kmalloc(sizeof *r1t1_card, GFP_KERNEL);
+	/* Keep the card's state on the node its DMA lands on */
+	r1t1_card = kmalloc_node(sizeof *r1t1_card, GFP_KERNEL, node);
 
 	if (r1t1_card == NULL) {
 		printk(KERN_ERR "R1T1: No memory available for card\n");
@@ -2149,6 +3315,14 @@ static int __devinit r1t1_init_one(struct pci_dev *pdev, const struct pci_device
 	r1t1_card->num = x;
 	cards[r1t1_card->num] = r1t1_card;
 	spin_lock_init(&r1t1_card->lock);
+	mutex_init(&r1t1_card->dsp_mutex);
+	init_waitqueue_head(&r1t1_card->ec_wait);
+	init_completion(&r1t1_card->launched);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&r1t1_card->launchwork, launch_bh, r1t1_card);
+#else
+	INIT_WORK(&r1t1_card->launchwork, launch_bh);
+#endif
 	r1t1_card->dev = pdev;
 	r1t1_card->pciaddr = pci_resource_start(pdev, 0);
 
@@ -2163,8 +3337,8 @@ static int __devinit r1t1_init_one(struct pci_dev *pdev, const struct pci_device
 	}
 
 	chan_count = r1t1_card->ise1 ? 31 : 24;
-	chan_block = kmalloc(chan_count * sizeof *chan_block, GFP_KERNEL);
-	ec_block = kmalloc(chan_count * sizeof *ec_block, GFP_KERNEL);
+	chan_block = kmalloc_node(chan_count * sizeof *chan_block, GFP_KERNEL, node);
+	ec_block = kmalloc_node(chan_count * sizeof *ec_block, GFP_KERNEL, node);
 
 	if (chan_block == NULL || ec_block == NULL) {
 		if (chan_block)
@@ -2231,7 +3405,7 @@ static int __devinit r1t1_init_one(struct pci_dev *pdev, const struct pci_device
 	canary = (unsigned int *) (r1t1_card->readchunk + DAHDI_CHUNKSIZE * 64 - 4);
 	*canary = (CANARY << 16) | (0xffff);
 
-	r1t1_card->nextbuf = 0;
+	r1t1_card->nextbuf = 1;
 
 	/* Enable bus mastering */
 	pci_set_master(pdev);
@@ -2241,8 +3415,9 @@ static int __devinit r1t1_init_one(struct pci_dev *pdev, const struct pci_device
 
 	/* Disable interrupts on the board before enabling them in Linux */
 	__r1t1_set_reg(r1t1_card, R1T1_CONTROL / 4, 0x00);
+	__r1t1_flush_regs(r1t1_card);
 
-	if (request_irq(pdev->irq, r1t1_interrupt, IRQF_SHARED, "r1t1", r1t1_card)) {
+	if (r1t1_request_irq(r1t1_card)) {
 		printk(KERN_ERR "R1T1: Unable to request IRQ %d\n", pdev->irq);
 		iounmap(r1t1_card->ioaddr);
 		release_mem_region(r1t1_card->pciaddr, R1T1_SIZE);
@@ -2265,7 +3440,7 @@ static int __devinit r1t1_init_one(struct pci_dev *pdev, const struct pci_device
 		release_mem_region(r1t1_card->pciaddr, R1T1_SIZE);
 		pci_free_consistent(r1t1_card->dev, DAHDI_MAX_CHUNKSIZE * 2 * 2 * 32 + 8,
 							(void *) r1t1_card->writechunk, r1t1_card->writedma);
-		free_irq(pdev->irq, r1t1_card);
+		rhino_free_irq(r1t1_card->dev, r1t1_card, &r1t1_card->msi);
 		kfree(chan_block);
 		kfree(ec_block);
 		cards[r1t1_card->num] = NULL;
@@ -2279,10 +3454,19 @@ static int __devinit r1t1_init_one(struct pci_dev *pdev, const struct pci_device
 	/* Misc. software stuff */
 	r1t1_software_init(r1t1_card);
 
-#ifdef USE_G168_DSP
-	r1t1_card->dsp_type = DSP_5510;
-	r1t1_card_init_dsp(r1t1_card);
-#endif /* USE_G168_DSP */
+	if (device_create_file(&pdev->dev, &dev_attr_irq_stats))
+		printk(KERN_WARNING "R1T1: %d: Unable to export the interrupt statistics\n",
+			   r1t1_card->num + 1);
+
+	/*
+	 * The DSP download and span registration take seconds per card, launch
+	 * the cards from a work item so that they come up in parallel.
+	 */
+	if (!rhino_launch_queue(&r1t1_launch, r1t1_card->num, &r1t1_card->launchwork,
+							async_launch)) {
+		r1t1_launch(r1t1_card);
+		rhino_launch_done(&r1t1_launch, r1t1_card->num, &r1t1_card->launched);
+	}
 
 	printk(KERN_NOTICE "R1T1: Spotted a Rhino: %s version %d. Module Version " RHINOPKGVER
 		   "\n", r1t1_card->variety, r1t1_card->version);
@@ -2294,8 +3478,27 @@ static void __devexit r1t1_remove_one(struct pci_dev *pdev)
 {
 	struct r1t1_card *r1t1_card = pci_get_drvdata(pdev);
 	if (r1t1_card) {
+		/* The launch owns the card until it is finished */
+		wait_for_completion(&r1t1_card->launched);
+		device_remove_file(&pdev->dev, &dev_attr_irq_stats);
+
 #ifdef USE_G168_DSP
 		if (r1t1_card->dsp_up) {
+			/* Keep the interrupt handler from queueing tone work */
+			r1t1_card->dtmf_up = 0;
+			synchronize_irq(pdev->irq);
+			if (r1t1_card->health_up) {
+				device_remove_file(&pdev->dev, &dev_attr_dsp_health);
+				r1t1_card->health_up = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+				cancel_delayed_work_sync(&r1t1_card->healthwork);
+#else
+				cancel_delayed_work(&r1t1_card->healthwork);
+				flush_scheduled_work();
+				cancel_delayed_work(&r1t1_card->healthwork);
+#endif
+			}
+			gpakStopCmdQueue(r1t1_card, r1t1_card->num);
 			flush_workqueue(r1t1_card->wq);
 			destroy_workqueue(r1t1_card->wq);
 		}
@@ -2329,12 +3532,25 @@ static struct pci_driver r1t1_driver = {
 
 static int __init r1t1_init(void)
 {
-	return pci_register_driver(&r1t1_driver);
+	int res;
+
+	rhino_launch_init(&r1t1_launch, "r1t1_launch");
+
+	res = pci_register_driver(&r1t1_driver);
+	if (res) {
+		rhino_launch_exit(&r1t1_launch);
+		return res;
+	}
+
+	/* The spans are registered once module load returns, so dahdi_cfg can follow */
+	rhino_launch_wait_all(&r1t1_launch);
+	return 0;
 }
 
 static void __exit r1t1_cleanup(void)
 {
 	pci_unregister_driver(&r1t1_driver);
+	rhino_launch_exit(&r1t1_launch);
 }
 
 
@@ -2345,8 +3561,30 @@ MODULE_PARM_DESC(e1, "1 for E1 mode set from module_param");
 module_param(ec_disable, int, 0600);
 module_param(ec_sw, int, 0600);
 module_param(no_ec, int, 0600);
-module_param(nlp_type, int, 0600);
+module_param(ecbench, int, 0600);
+MODULE_PARM_DESC(ecbench, "Time EC enable/bypass and DSP load per tail length on the idle channels when the DSP comes up");
+module_param(dtmf, int, 0600);
+MODULE_PARM_DESC(dtmf, "Detect DTMF and fax CNG tones on the DSP");
+module_param(dtmfmute, int, 0600);
+MODULE_PARM_DESC(dtmfmute, "Mute DTMF digits detected by the DSP on channels that report tones");
+module_param_call(nlp_type, rhino_param_set_nlp, param_get_int, &nlp_type, 0600);
 MODULE_PARM_DESC(nlp_type, "0 - off, 1 - mute, 2 - rand, 3 - hoth, 4 - supp");
+module_param(ec_taps, int, 0600);
+MODULE_PARM_DESC(ec_taps, "Run the echo canceller with the tail length requested by DAHDI instead of 1024 taps");
+module_param(dsp_health, int, 0600);
+MODULE_PARM_DESC(dsp_health, "Seconds between DSP health samples, 0 to disable");
+module_param(dsp_cpu_warn, int, 0600);
+MODULE_PARM_DESC(dsp_cpu_warn, "DSP CPU load in percent that is warned about");
+module_param(dsp_recover, int, 0600);
+MODULE_PARM_DESC(dsp_recover, "Reload the DSP when it is found reset or not answering");
+module_param(async_launch, int, 0600);
+MODULE_PARM_DESC(async_launch, "Bring the cards up in parallel, module load still waits for all of them");
+module_param(posted_writes, int, 0600);
+MODULE_PARM_DESC(posted_writes, "0 to read back every register write, as the card was driven before");
+module_param(hardhdlc, int, 0400);
+MODULE_PARM_DESC(hardhdlc, "Offer the DS2155 HDLC controller for hardhdlc D-channels");
+module_param(msi, int, 0400);
+MODULE_PARM_DESC(msi, "Interrupt through MSI when the platform supports it, 0 for the shared INTx line");
 
 MODULE_DESCRIPTION("Rhino R1T1 T1-E1-J1 Driver " RHINOPKGVER);
 MODULE_AUTHOR
@@ -19,7 +19,12 @@
 
 #include "GpakCust.h"
 #include "rcbfx.h"
+#include <linux/version.h>
 #include <linux/delay.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/firmware.h>
 
 void rcb_card_wait_hpi(struct rcb_card_t *rcb_card, __u8 flags)
 {
@@ -111,7 +116,7 @@ __u16 rcb_card_dsp_get(struct rcb_card_t * rcb_card, __u32 dsp_address)
  *
  */
 void gpakReadDspMemory(struct rcb_card_t *rcb_card,	/* Card containing the DSP */
-					   unsigned short int DspId,	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+					   unsigned short int DspId,	/* DSP Identifier */
 					   DSP_ADDRESS DspAddress,	/* DSP's memory address of first word */
 					   unsigned int NumWords,	/* number of contiguous words to read */
 					   DSP_WORD * pWordValues	/* pointer to array of word values variable */
@@ -146,7 +151,7 @@ void gpakReadDspMemory(struct rcb_card_t *rcb_card,	/* Card containing the DSP *
  *
  */
 void gpakWriteDspMemory(struct rcb_card_t *rcb_card,	/* Card containing the DSP */
-						unsigned short int DspId,	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+						unsigned short int DspId,	/* DSP Identifier */
 						DSP_ADDRESS DspAddress,	/* DSP's memory address of first word */
 						unsigned int NumWords,	/* number of contiguous words to write */
 						DSP_WORD * pWordValues	/* pointer to array of word values to write */
@@ -188,6 +193,28 @@ void gpakHostDelay(void)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakHostPoll - Delay for one reply polling interval.
+ *
+ * FUNCTION
+ *  This function sleeps for one reply polling interval. usleep_range() is
+ *  backed by an hrtimer, older kernels fall back to a jiffy based sleep.
+ *
+ * RETURNS
+ *  nothing
+ *
+ */
+void gpakHostPoll(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	usleep_range(GPAK_POLL_MIN_US, GPAK_POLL_MAX_US);
+#else
+	msleep(1);
+#endif
+	return;
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * gpakLockAccess - Lock access to the specified DSP.
  *
@@ -200,9 +227,10 @@ void gpakHostDelay(void)
  */
 
 void gpakLockAccess(struct rcb_card_t *rcb_card,	/* Card containing the DSP */
-					unsigned short int DspId	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+					unsigned short int DspId	/* DSP Identifier */
 	)
 {
+	mutex_lock(&rcb_card->dsp_mutex);
 	return;
 }
 
@@ -218,132 +246,244 @@ void gpakLockAccess(struct rcb_card_t *rcb_card,	/* Card containing the DSP */
  *
  */
 void gpakUnlockAccess(struct rcb_card_t *rcb_card,	/* Card containing the DSP */
-					  unsigned short int DspId	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+					  unsigned short int DspId	/* DSP Identifier */
 	)
 {
+	mutex_unlock(&rcb_card->dsp_mutex);
 	return;
 }
 
-extern const unsigned char _binary_DspLoader_fw_start[];
-extern const unsigned int _binary_DspLoader_fw_size;
-extern const unsigned char _binary_GpakDsp10_fw_start[];
-extern const unsigned int _binary_GpakDsp10_fw_size;
-extern const unsigned char _binary_GpakDsp0708_fw_start[];
-extern const unsigned int _binary_GpakDsp0708_fw_size;
-extern const unsigned char _binary_GpakDsp0704_fw_start[];
-extern const unsigned int _binary_GpakDsp0704_fw_size;
-
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
- * gpakReadFile - Read a block of bytes from a G.PAK Download file.
+ * gpakParseFile - Decode a G.PAK Download file into memory records.
  *
  * FUNCTION
- *  This function reads a contiguous block of bytes from a G.PAK Download file
- *  starting at the current file position.
+ *  The file is a sequence of records, each made of a 6 byte header (memory
+ *  type, 24 bit address, 16 bit word count) followed by the big-endian record
+ *  words, and terminated by a record of type 0xFF. The first pass validates
+ *  the file and sizes the tables, the second one decodes the words into a
+ *  single allocation holding the record table and the word pool.
  *
  * RETURNS
- *  The number of bytes read from the file.
- *   -1 indicates an error occurred.
- *    0 indicates all bytes have been read (end of file)
+ *  0 on success, a negative errno value otherwise.
  *
  */
+int gpakParseFile(gpakDlImage_t *pImage,	/* image to fill in */
+				  const unsigned char *pData,	/* raw file contents */
+				  unsigned int NumBytes	/* size of the raw file */
+	)
+{
+	const unsigned char *pHdr;
+	gpakDlRecord_t *pRecord;
+	DSP_WORD *pWord;
+	unsigned int pos;
+	unsigned int rec_num;
+	unsigned int word_count;
+	unsigned int num_records = 0;
+	unsigned int num_words = 0;
+	unsigned int i;
+
+	memset(pImage, 0, sizeof(*pImage));
+
+	for (pos = 0;;) {
+		if (pos + 6 > NumBytes)
+			return -EINVAL;
+		pHdr = &pData[pos];
+		if (pHdr[0] == 0xFF)
+			break;
+		if ((pHdr[0] != 0x00) && (pHdr[0] != 0x01))
+			return -EINVAL;
+		word_count = (((unsigned int) pHdr[4]) << 8) | ((unsigned int) pHdr[5]);
+		pos += 6 + word_count * 2;
+		if (pos > NumBytes)
+			return -EINVAL;
+		num_records++;
+		num_words += word_count;
+	}
 
+	pImage->pRecords = vmalloc(num_records * sizeof(gpakDlRecord_t) +
+							   num_words * sizeof(DSP_WORD));
+	if (!pImage->pRecords)
+		return -ENOMEM;
+
+	pWord = (DSP_WORD *) (pImage->pRecords + num_records);
+	for (pos = 0, rec_num = 0; rec_num < num_records; rec_num++) {
+		pHdr = &pData[pos];
+		pRecord = &pImage->pRecords[rec_num];
+		pRecord->MemType = pHdr[0];
+		pRecord->Address = (((DSP_ADDRESS) pHdr[1]) << 16) |
+			(((DSP_ADDRESS) pHdr[2]) << 8) | ((DSP_ADDRESS) pHdr[3]);
+		pRecord->NumWords = (((unsigned int) pHdr[4]) << 8) | ((unsigned int) pHdr[5]);
+		pRecord->pWords = pWord;
+		pos += 6;
+
+		for (i = 0; i < pRecord->NumWords; i++, pos += 2)
+			*pWord++ = (((DSP_WORD) pData[pos]) << 8) | ((DSP_WORD) pData[pos + 1]);
+	}
 
-int gpakReadFile_5510(struct rcb_card_t *rcb_card,	/* Card containing the DSP */
-					  GPAK_FILE_ID FileId,	/* G.PAK Download File Identifier */
-					  unsigned char *pBuffer,	/* pointer to buffer for storing bytes */
-					  unsigned int NumBytes	/* number of bytes to read */
-	)
+	pImage->FileSize = NumBytes;
+	pImage->NumRecords = num_records;
+	pImage->NumWords = num_words;
+
+	return 0;
+}
+
+void gpakFreeFile(gpakDlImage_t *pImage)
 {
-	static int stats = 0;
-	int core_num;
-	int byte_num = -1;
-	int DspId;
-	static unsigned int file_pos[MAX_DSP_CORES];
-	static unsigned int file_size;
-	if (!(stats)) {
-		stats++;
-		for (core_num = 0; core_num < MAX_DSP_CORES; core_num++) {
-			file_pos[core_num] = 0;
-		}
+	if (pImage->pRecords)
+		vfree(pImage->pRecords);
+	memset(pImage, 0, sizeof(*pImage));
+}
+
+/* A G.PAK image loaded from userspace, shared by the cards using it */
+typedef struct gpakFwFile {
+	const char *Name;			/* firmware file name */
+	int Users;					/* references held by cards */
+	int Status;					/* 0 once decoded, or why it is not */
+	struct completion Done;		/* completed once the load has ended */
+	gpakDlImage_t Image;		/* decoded image */
+} gpakFwFile_t;
 
-		file_size = (unsigned int) &_binary_GpakDsp10_fw_size;
+/* Serializes the reference counts and load starts of all images */
+static DEFINE_MUTEX(gpak_fw_mutex);
+
+static void gpakFileLoaded(const struct firmware *fw, void *context)
+{
+	gpakFwFile_t *pFile = context;
 
-		printk("rcbfx %d: G168 DSP App file size = %d %x\n", rcb_card->pos + 1,
-			   (unsigned int) &_binary_GpakDsp10_fw_size,
-			   (unsigned int) &_binary_GpakDsp10_fw_size);
+	if (fw == NULL)
+		pFile->Status = -ENOENT;
+	else {
+		pFile->Status = gpakParseFile(&pFile->Image, fw->data, fw->size);
+		release_firmware(fw);
 	}
 
-	DspId = rcb_card->pos;
+	if (pFile->Status)
+		printk(KERN_ERR "rcbfx: Unable to load %s (%d)\n", pFile->Name, pFile->Status);
+	else
+		printk(KERN_DEBUG "rcbfx: %s size = %d, %d records, %d words\n", pFile->Name,
+			   pFile->Image.FileSize, pFile->Image.NumRecords, pFile->Image.NumWords);
 
-	for (byte_num = 0; byte_num < NumBytes; byte_num++) {
-		if ((file_size - 1) >= file_pos[DspId]) {
-			pBuffer[byte_num] = _binary_GpakDsp10_fw_start[file_pos[DspId]++];
+	complete_all(&pFile->Done);
+}
+
+/*
+ * Take a reference to an image. The first reference starts loading it in
+ *  the background, the raw file is released as soon as it is decoded.
+ */
+static void gpakRequestFile(gpakFwFile_t *pFile, struct device *dev)
+{
+	int res;
+
+	mutex_lock(&gpak_fw_mutex);
+	if (pFile->Users++ == 0) {
+		init_completion(&pFile->Done);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+		res = request_firmware_nowait(THIS_MODULE, 1, pFile->Name, dev, GFP_KERNEL, pFile,
+									  gpakFileLoaded);
+#else
+		res = request_firmware_nowait(THIS_MODULE, 1, pFile->Name, dev, pFile,
+									  gpakFileLoaded);
+#endif
+		if (res) {
+			printk(KERN_ERR "rcbfx: Unable to request %s (%d)\n", pFile->Name, res);
+			pFile->Status = res;
+			complete_all(&pFile->Done);
 		}
 	}
+	mutex_unlock(&gpak_fw_mutex);
+}
+
+/*
+ * Drop a reference to an image, the last one frees it. The load is waited
+ *  for while the reference is still held, so no new load can reinitialize
+ *  the completion and other cards are not held up on the mutex meanwhile.
+ */
+static void gpakReleaseFile(gpakFwFile_t *pFile)
+{
+	wait_for_completion(&pFile->Done);
 
-	return byte_num;
+	mutex_lock(&gpak_fw_mutex);
+	if (--pFile->Users == 0)
+		gpakFreeFile(&pFile->Image);
+	mutex_unlock(&gpak_fw_mutex);
 }
 
-int gpakReadFile_5507(struct rcb_card_t *rcb_card,	/* Card containing the DSP */
-					  GPAK_FILE_ID FileId,	/* G.PAK Download File Identifier */
-					  unsigned char *pBuffer,	/* pointer to buffer for storing bytes */
-					  unsigned int NumBytes	/* number of bytes to read */
-	)
+/* Wait for an image the caller holds a reference to */
+static const gpakDlImage_t *gpakWaitFile(gpakFwFile_t *pFile)
 {
-	static int stats = 0;
-	int core_num;
-	int byte_num = -1;
-	int DspId;
-	static unsigned int file_pos[num_files][MAX_DSP_CORES];
-	static unsigned int file_size[num_files];
-	if (!(stats)) {
-		stats++;
-		for (core_num = 0; core_num < MAX_DSP_CORES; core_num++) {
-			file_pos[loader_file][core_num] = 0;
-			file_pos[app_file][core_num] = 0;
-		}
+	int users;
 
-		file_size[loader_file] = (unsigned int) &_binary_DspLoader_fw_size;
-
-		if (rcb_card->num_chans > 4)
-			file_size[app_file] = (unsigned int) &_binary_GpakDsp0708_fw_size;
-		else
-			file_size[app_file] = (unsigned int) &_binary_GpakDsp0704_fw_size;
-
-		if (rcb_card->num_chans > 4)
-			printk("rcbfx %d: G168 07 08 DSP Loader file size = %d App file size = %d\n",
-				   rcb_card->pos + 1, (unsigned int) &_binary_DspLoader_fw_size,
-				   (unsigned int) &_binary_GpakDsp0708_fw_size);
-		else
-			printk("rcbfx %d: G168 07 04 DSP Loader file size = %d App file size = %d\n",
-				   rcb_card->pos + 1, (unsigned int) &_binary_DspLoader_fw_size,
-				   (unsigned int) &_binary_GpakDsp0704_fw_size);
-	}
+	mutex_lock(&gpak_fw_mutex);
+	users = pFile->Users;
+	mutex_unlock(&gpak_fw_mutex);
+	if (users == 0)
+		return NULL;
 
-	DspId = rcb_card->pos;
+	wait_for_completion(&pFile->Done);
+	return pFile->Status ? NULL : &pFile->Image;
+}
 
+static gpakFwFile_t gpak_loader_file = { "DspLoader.fw" };
+static gpakFwFile_t gpak_5510_file = { "GpakDsp10.fw" };
+static gpakFwFile_t gpak_0704_file = { "GpakDsp0704.fw" };
+static gpakFwFile_t gpak_0708_file = { "GpakDsp0708.fw" };
 
-	if (FileId == loader_file) {
-		for (byte_num = 0; byte_num < NumBytes; byte_num++) {
-			if ((file_size[loader_file] - 1) >= file_pos[loader_file][DspId]) {
-				pBuffer[byte_num] =
-					_binary_DspLoader_fw_start[file_pos[loader_file][DspId]++];
-			}
-		}
-	}
+/* The application image matching the DSP and the number of channels */
+static gpakFwFile_t *gpakAppFile(struct rcb_card_t *rcb_card)
+{
+	if (rcb_card->dsp_type == DSP_5510)
+		return &gpak_5510_file;
+	if (rcb_card->num_chans > 4)
+		return &gpak_0708_file;
+	return &gpak_0704_file;
+}
 
-	if (FileId == app_file) {
-		for (byte_num = 0; byte_num < NumBytes; byte_num++) {
-			if ((file_size[app_file] - 1) >= file_pos[app_file][DspId]) {
-				if (rcb_card->num_chans > 4)
-					pBuffer[byte_num] =
-						_binary_GpakDsp0708_fw_start[file_pos[app_file][DspId]++];
-				else
-					pBuffer[byte_num] =
-						_binary_GpakDsp0704_fw_start[file_pos[app_file][DspId]++];
-			}
-		}
-	}
+void gpakRequestFiles(struct rcb_card_t *rcb_card	/* Card needing the images */
+	)
+{
+	if (rcb_card->dsp_type == DSP_5507)
+		gpakRequestFile(&gpak_loader_file, &rcb_card->dev->dev);
+	gpakRequestFile(gpakAppFile(rcb_card), &rcb_card->dev->dev);
+}
 
-	return byte_num;
+void gpakReleaseFiles(struct rcb_card_t *rcb_card	/* Card done with the images */
+	)
+{
+	if (rcb_card->dsp_type == DSP_5507)
+		gpakReleaseFile(&gpak_loader_file);
+	gpakReleaseFile(gpakAppFile(rcb_card));
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakGetFile - Get the decoded G.PAK Download file for a DSP.
+ *
+ * FUNCTION
+ *  This function waits for one of the images requested by gpakRequestFiles.
+ *  The images are never modified once decoded, so any number of DSPs may
+ *  walk them at the same time.
+ *
+ * RETURNS
+ *  Pointer to the shared decoded image, or NULL if it is not available.
+ *
+ */
+const gpakDlImage_t *gpakGetFile_5510(struct rcb_card_t *rcb_card,	/* Card containing the DSP */
+									  GPAK_FILE_ID FileId	/* G.PAK Download File Identifier */
+	)
+{
+	if (FileId != app_file)
+		return NULL;
+
+	return gpakWaitFile(&gpak_5510_file);
+}
+
+const gpakDlImage_t *gpakGetFile_5507(struct rcb_card_t *rcb_card,	/* Card containing the DSP */
+									  GPAK_FILE_ID FileId	/* G.PAK Download File Identifier */
+	)
+{
+	if (FileId == loader_file)
+		return gpakWaitFile(&gpak_loader_file);
+	else if (FileId == app_file)
+		return gpakWaitFile(gpakAppFile(rcb_card));
+	else
+		return NULL;
 }
@@ -70,11 +70,18 @@
 #include <linux/pci.h>
 #include <linux/interrupt.h>
 #include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
 #include <asm/io.h>
 
 #include <dahdi/kernel.h>
 #include <dahdi/user.h>
 
+#include <rhino/rhino_card.h>
+
 #define NUM_FXO_REGS 60
 
 #define RH_MAX_IFACES 128
@@ -168,6 +175,7 @@
 #define DEBUG_DSP   (1 << 2)
 #define DEBUG_SIG   (1 << 3)
 #define DEBUG_POINTERS	(1 << 4)
+#define DEBUG_DTMF  (1 << 5)
 
 #define STOP_DMA    (1 << 0)
 #define FREE_DMA    (1 << 1)
@@ -198,6 +206,9 @@
 
 #define MAX_ALARMS 10
 
+/* Failed DSP reloads in a row before the card gives up on its DSP */
+#define DSP_RELOAD_TRIES 3
+
 #define MOD_TYPE_UNK    0
 #define MOD_TYPE_FXS    1
 #define MOD_TYPE_FXO    2
@@ -215,6 +226,34 @@
 #define RCB_CHAN_REG 72
 
 
+struct rcbfx_ec_cmd;
+struct gpakDspTable;
+
+/* DSP load and TDM errors, as sampled by the health work */
+struct rcb_dsp_health {
+	unsigned long samples;		/* samples taken */
+	unsigned long failures;		/* samples the DSP did not answer */
+	unsigned int cpu_last;		/* CPU peak of the last second, percent */
+	unsigned int cpu_peak;		/* highest CPU peak seen */
+	unsigned int cpu_avg;		/* rolling average of cpu_last, 1/16 percent */
+	int cpu_warned;				/* CPU load warning given */
+	int fail_run;				/* samples failed in a row */
+	unsigned short int raw[5];	/* last framing and slip counters of the DSP */
+	unsigned long framing[4];	/* port 1-3 framing and DMA stop errors */
+	unsigned long slips;		/* DMA slips */
+};
+
+#define RCB_TELE_HIST    16	/* telemetry samples kept per card */
+#define RCB_TELE_PORTS   24	/* ports covered by the loop voltage and register tables */
+
+struct rcb_tele_sample {
+	unsigned long stamp;		/* jiffies when taken */
+	int reg_addr;				/* register held in reg[], 0 while it is gathered */
+	signed char lvs[RCB_TELE_PORTS];	/* loop voltage of each port */
+	unsigned char reg[RCB_TELE_PORTS];	/* selected register of each port */
+	unsigned char sig[RCB_TELE_PORTS];	/* last received signalling bits of each port */
+};
+
 struct rcb_card_t {
 	struct pci_dev *dev;
 	struct dahdi_span span;
@@ -234,28 +273,81 @@ struct rcb_card_t {
 	int dsp_up;
 	int dsp_type;
 	int curcard;
-	int oldreg_addr;
-	int read_on_int;
+	struct mutex tele_mutex;	/* protects the telemetry below */
+	struct rcb_tele_sample tele[RCB_TELE_HIST];	/* history ring, oldest sample overwritten */
+	unsigned int tele_count;	/* samples taken */
+	int tele_reg_addr;			/* register the card gathers */
+	unsigned long tele_reg_ready;	/* jiffies when its values are in */
+	int regdumping;				/* a register dump owns RCB_REGADDR */
+	unsigned char rxsig[MAX_CHANS];	/* last received signalling bits */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	struct work_struct telework;	/* samples the telemetry */
+#else
+	struct delayed_work telework;	/* samples the telemetry */
+#endif
+	int tele_up;				/* telemetry sampling is running */
+	int regdump_first;			/* registers of the debugfs dump */
+	int regdump_last;
+#ifdef CONFIG_DEBUG_FS
+	struct dentry *debugfs;		/* debugfs directory of the card */
+#endif
+	unsigned int audio_ints;	/* interrupts that moved audio */
+	unsigned int sig_ints;		/* interrupts that reported signalling changes */
+	unsigned int coincident_ints;	/* interrupts that did both */
+	unsigned int sig_deferred;	/* signalling passes run by the tasklet */
+	int sig_pending;			/* signalling changes left for the tasklet */
+	struct tasklet_struct sig_tasklet;
 	int num_chans;
 	int num_slots;
 	int chanflag;				/* Bit-map of present cards */
 	spinlock_t lock;
+	struct mutex dsp_mutex;		/* serializes G.PAK access to the DSP */
+	struct gpakDspTable *gpak_dsps;	/* G.PAK host state of the DSP */
 
 	/* Receive hook state and debouncing */
 	int modtype[MAX_CHANS];
 	int fxs_chanmap;
 	int fxo_chanmap;
 	int chans_configed;
-	int param_upd_state;
+	unsigned int param_pending;	/* RCB_TXSIGSTAT commit bits the card still holds */
+	struct mutex param_mutex;	/* serializes uploads to PARAM_TBL */
 	int comerr[MAX_CHANS];
 	int retry[MAX_CHANS];
 	int lastcomerr[MAX_CHANS];
 	long unsigned int baseaddr;
 	int currec;
 	int nextec;
-	wait_queue_head_t regq;
+	struct rcbfx_ec_cmd *ec_cmd;	/* EC control command of each channel */
+	unsigned int ec_busy;		/* channels with EC control in flight */
+	unsigned int ec_reconfig;	/* channels waiting for new EC parameters */
+	unsigned int ec_bench;		/* idle channels lent to the EC bench */
+	int ec_pending;				/* EC control commands in flight */
+	int ec_burst;				/* channels changed in the current burst */
+	ktime_t ec_start;			/* start of the current burst */
+	unsigned int ec_last_us;	/* duration of the last burst */
+	unsigned int ec_max_us;		/* longest burst */
+	wait_queue_head_t ec_wait;	/* woken when a burst completes */
+	int dtmf_up;				/* DSP is detecting tones */
+	unsigned long dtmfmask;		/* channels reporting DSP detected tones */
+	unsigned long mutemask;		/* channels muting DSP detected digits */
+	unsigned char dtmf_digit[MAX_CHANS];	/* digit being received on each channel */
+	wait_queue_head_t regq;		/* woken when the card takes the parameters */
 	struct workqueue_struct *wq;
 	struct work_struct work;
+	struct work_struct dtmfwork;	/* drains the DSP's tone events */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	struct work_struct healthwork;	/* samples the DSP's health */
+#else
+	struct delayed_work healthwork;	/* samples the DSP's health */
+#endif
+	int health_up;				/* health sampling is running */
+	int dsp_recovering;			/* DSP is being reloaded */
+	unsigned int dsp_reload_fails;	/* reloads failed in a row */
+	unsigned int dsp_recoveries;	/* times the DSP was reloaded */
+	unsigned int dsp_recovery_us;	/* duration of the last reload */
+	struct rcb_dsp_health health;	/* health of the DSP */
+	struct work_struct launchwork;	/* brings the card up after probe */
+	struct completion launched;	/* the launch has finished */
 	int memlen;
 	int hw_ver_min;
 	void *memaddr;
@@ -264,6 +356,11 @@ struct rcb_card_t {
 	volatile unsigned char *writechunk;	/* Double-word aligned write memory */
 	volatile unsigned char *readchunk;	/* Double-word aligned read memory */
 	struct dahdi_chan *chans[MAX_CHANS];
+	u_char *readchunks[2][MAX_CHANS];	/* channel chunks in each half of the DMA buffers */
+	u_char *writechunks[2][MAX_CHANS];
+	int dmahalf;				/* half DAHDI worked on last */
+	unsigned int dmamisses;		/* interrupts that found the same half twice */
+	int msi;					/* interrupting through MSI */
 	char *variety;
 	struct dahdi_echocan_state *ec[MAX_CHANS];	/* echocan state for each channel */
 	struct dahdi_device *ddev;
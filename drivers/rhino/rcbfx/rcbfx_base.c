@@ -73,9 +73,15 @@
 #include <asm/types.h>
 #include <asm/mman.h>
 #include <asm/io.h>
+#include <asm/div64.h>
 #include <asm/stat.h>
 #include <asm/page.h>
 #include <linux/firmware.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
 
 #include "rcbfx.h"
 #include <rhino/rcbfx_ioctl.h>
@@ -102,6 +108,12 @@ static struct rcb_card_desc rcb24fxo = { "Rhino RCB24FXO", FLAG_2CHAN_SPI, 24, 3
 static struct rcb_card_desc rcb4fxo = { "Rhino RCB4FXO", FLAG_2CHAN_SPI, 4, 4, 7 };
 
 static struct rcb_card_t *ifaces[RH_MAX_IFACES];
+static DEFINE_MUTEX(ifaces_mutex);	/* protects ifaces[] for readers outside probe */
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *rcb_debugfs;
+#endif
+
+DEFINE_RHINO_LAUNCH(rcb_launch, RH_MAX_IFACES);
 
 static int debug = 0;
 /* static int debug = (DEBUG_MAIN | DEBUG_INTS | DEBUG_DSP); */
@@ -114,13 +126,25 @@ static int use_ec_zap = -1;		/* Enable zaptel echo can */
 static int use_ec = -1;			/* Switch in DSP's TDM bus */
 static int force_fw = 0;
 static int no_ec = 0;
+static int ecbench = 0;
+static int ec_taps = 0;
+static int dsp_health = 10;
+static int dsp_cpu_warn = 90;
+static int dsp_recover = 1;
+static int dtmf = 1;
+static int dtmfmute = 0;
 static int nlp_type = 3;
+static int async_launch = 1;
+static int sig_defer = 0;
+static int param_timeout = 1000;
+static int msi = 1;
 /* Internal results of calculations */
 static int zt_ec_chanmap = 0;
 static int fxs_alg_chanmap = 0;
 static int fxo_alg_chanmap = 0;
 static int use_fxs_chanmap = 0;
 static int use_fxo_chanmap = 0;
+/* Telemetry of the first card, as read by rcb_regdump.sh */
 static int lvs[24];
 static int reg_val[24];
 static int battime = 100;
@@ -132,6 +156,13 @@ int open(const char *path, int oflags);
 
 static const char *rcbfx_firmware = "rcbfx.fw";
 
+/* Firmware file last read, so that cards already running it skip reading it */
+static struct {
+	int version;
+	u32 crc;
+} rcb_fw_cache;
+static DEFINE_MUTEX(rcb_fw_mutex);
+
 static int rcbfx_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 								struct dahdi_echocanparam *p,
 								struct dahdi_echocan_state **ec);
@@ -152,11 +183,19 @@ static const struct dahdi_echocan_ops my_ec_ops = {
 
 static inline void rcb_card_transmit(struct rcb_card_t *rcb_card, unsigned char ints)
 {
+	int x;
+
+	for (x = 0; x < rcb_card->num_chans; x++)
+		rcb_card->chans[x]->writechunk = rcb_card->writechunks[ints][x];
 	dahdi_transmit(&rcb_card->span);
 }
 
 static inline void rcb_card_receive(struct rcb_card_t *rcb_card, unsigned char ints)
 {
+	int x;
+
+	for (x = 0; x < rcb_card->num_chans; x++)
+		rcb_card->chans[x]->readchunk = rcb_card->readchunks[ints][x];
 	if (!rcb_card->dsp_up)
 		dahdi_ec_span(&rcb_card->span);
 	dahdi_receive(&rcb_card->span);
@@ -190,8 +229,30 @@ static int rcb_dahdi_chan_rbsbits(struct dahdi_chan *chan, int bits)
 	return 0;
 }
 
+/*
+ * Read len bytes of a card table as aligned dwords, only the dwords holding
+ *  a byte flagged in mask when it is not zero.
+ */
+static inline void rcb_card_read_tab(struct rcb_card_t *rcb_card, unsigned int reg,
+									 __u8 *buf, int len, unsigned int mask)
+{
+	__u32 val;
+	int x;
+
+	for (x = 0; x < len; x += 4) {
+		if (mask && !((mask >> x) & 0xf))
+			continue;
+		val = ioread32(rcb_card->memaddr + reg + x);
+		buf[x] = val;
+		buf[x + 1] = val >> 8;
+		buf[x + 2] = val >> 16;
+		buf[x + 3] = val >> 24;
+	}
+}
+
 static void rcb_card_check_sigbits(struct rcb_card_t *rcb_card, int status)
 {
+	__u8 rxsig[12];
 	int rxs, regnum;
 
 	if (debug & DEBUG_SIG)
@@ -199,9 +260,13 @@ static void rcb_card_check_sigbits(struct rcb_card_t *rcb_card, int status)
 			   rcb_card->chans_configed);
 
 	if (rcb_card->chans_configed) {
+		/* 12 bytes of sig data, fetched by the dword holding changed ones */
+		rcb_card_read_tab(rcb_card, RCB_RXSIG0, rxsig, 12, status & 0xfff);
 		for (regnum = 0; regnum < 12; regnum++) {	/* 12 bytes of sig data to check */
 			if (status & (1 << regnum)) {
-				rxs = *(volatile __u8 *) (rcb_card->memaddr + RCB_RXSIG0 + regnum);
+				rxs = rxsig[regnum];
+				rcb_card->rxsig[regnum * 2] = rxs & 0xf;
+				rcb_card->rxsig[regnum * 2 + 1] = (rxs & 0xf0) >> 4;
 				if (rcb_card->num_chans > (regnum * 2)) {	/* make sure the chan exists */
 					if (debug & DEBUG_SIG)
 						printk(KERN_DEBUG "rcbfx %d: rbsbits channel: %x, bits: %x\n",
@@ -230,104 +295,483 @@ static void rcb_card_check_sigbits(struct rcb_card_t *rcb_card, int status)
 
 }
 
+/* Signalling changes deferred by the interrupt handler */
+static void rcb_card_sig_tasklet(unsigned long data)
+{
+	struct rcb_card_t *rcb_card = (struct rcb_card_t *) data;
+	unsigned long flags;
+	int status;
+
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	status = rcb_card->sig_pending;
+	rcb_card->sig_pending = 0;
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+
+	if (status) {
+		rcb_card->sig_deferred++;
+		rcb_card_check_sigbits(rcb_card, status);
+	}
+}
+
+static ssize_t rcb_card_irq_stats_show(struct device *dev, struct device_attribute *attr,
+									   char *buf)
+{
+	struct rcb_card_t *rcb_card = pci_get_drvdata(to_pci_dev(dev));
+
+	return sprintf(buf, "audio %u signalling %u coincident %u deferred %u misses %u\n",
+				   rcb_card->audio_ints, rcb_card->sig_ints, rcb_card->coincident_ints,
+				   rcb_card->sig_deferred, rcb_card->dmamisses);
+}
+
+static DEVICE_ATTR(irq_stats, S_IRUGO, rcb_card_irq_stats_show, NULL);
+
+/*
+ * Sample the loop voltage, the selected register and the signalling state of
+ *  every port into the card's history ring. Changing reg_addr points the card
+ *  at another register, its values are read once the card has gathered them.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void tele_bh(void *data)
+{
+	struct rcb_card_t *rcb_card = data;
+#else
+static void tele_bh(struct work_struct *data)
+{
+	struct rcb_card_t *rcb_card = container_of(data, struct rcb_card_t, telework.work);
+#endif
+	struct rcb_tele_sample *sample;
+	__u8 tab[RCB_TELE_PORTS];
+	int port;
+
+	mutex_lock(&rcb_card->tele_mutex);
+	sample = &rcb_card->tele[rcb_card->tele_count % RCB_TELE_HIST];
+	memset(sample, 0, sizeof(*sample));
+	sample->stamp = jiffies;
+
+	rcb_card_read_tab(rcb_card, RCB_LVSTAB, tab, RCB_TELE_PORTS, 0);
+	for (port = 0; port < RCB_TELE_PORTS; port++) {
+		if (tab[port] & 0x80)	/* negative */
+			sample->lvs[port] = -(0x80 - (tab[port] & 0x7f));
+		else
+			sample->lvs[port] = tab[port];
+	}
+
+	if (rcb_card->regdumping) {
+		/* the register dump owns RCB_REGADDR */
+	} else if (reg_addr != rcb_card->tele_reg_addr) {
+		if (debug)
+			printk(KERN_DEBUG "rcbfx %d: New reg_addr = %x\n", rcb_card->pos + 1, reg_addr);
+		rcb_card->tele_reg_addr = reg_addr;
+		iowrite8(reg_addr, rcb_card->memaddr + RCB_REGADDR);
+		rcb_card->tele_reg_ready = jiffies + msecs_to_jiffies(RCB_REGTIME);
+	} else if (reg_addr && time_after_eq(jiffies, rcb_card->tele_reg_ready)) {
+		rcb_card_read_tab(rcb_card, RCB_REGTAB, sample->reg, RCB_TELE_PORTS, 0);
+		sample->reg_addr = reg_addr;
+	}
+
+	for (port = 0; (port < RCB_TELE_PORTS) && (port < rcb_card->num_chans); port++)
+		sample->sig[port] = rcb_card->rxsig[port];
+	rcb_card->tele_count++;
+
+	if (rcb_card->pos == 0) {
+		for (port = 0; port < RCB_TELE_PORTS; port++) {
+			lvs[port] = sample->lvs[port];
+			if (sample->reg_addr)
+				reg_val[port] = sample->reg[port];
+		}
+	}
+	mutex_unlock(&rcb_card->tele_mutex);
+
+	if (rcb_card->tele_up)
+		schedule_delayed_work(&rcb_card->telework, msecs_to_jiffies(RCB_LVSSAMP + 1));
+}
+
+/* Newest sample, one line per present port */
+static ssize_t rcb_card_telemetry_show(struct device *dev, struct device_attribute *attr,
+									   char *buf)
+{
+	struct rcb_card_t *rcb_card = pci_get_drvdata(to_pci_dev(dev));
+	struct rcb_tele_sample *sample;
+	int port, len = 0;
+
+	mutex_lock(&rcb_card->tele_mutex);
+	if (rcb_card->tele_count) {
+		sample = &rcb_card->tele[(rcb_card->tele_count - 1) % RCB_TELE_HIST];
+		len += sprintf(buf + len, "age %u ms reg %d\n",
+					   jiffies_to_msecs(jiffies - sample->stamp), sample->reg_addr);
+		for (port = 0; (port < RCB_TELE_PORTS) && (port < rcb_card->num_chans); port++) {
+			if (!(rcb_card->chanflag & (1 << port)))
+				continue;
+			len += sprintf(buf + len, "%d %s lv %d reg %d sig %x\n", port + 1,
+						   (rcb_card->modtype[port] == MOD_TYPE_FXO) ? "FXO" : "FXS",
+						   sample->lvs[port], sample->reg[port], sample->sig[port]);
+		}
+	}
+	mutex_unlock(&rcb_card->tele_mutex);
+	return len;
+}
+
+static DEVICE_ATTR(telemetry, S_IRUGO, rcb_card_telemetry_show, NULL);
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * The history of every card, oldest sample first, one line per sample:
+ *  card, age in ms, register, then the loop voltages, register values and
+ *  signalling bits of the card's ports.
+ */
+static int rcb_telemetry_show(struct seq_file *m, void *v)
+{
+	struct rcb_card_t *rcb_card;
+	struct rcb_tele_sample *sample;
+	unsigned int n, first;
+	int x, port, ports;
+
+	mutex_lock(&ifaces_mutex);
+	for (x = 0; x < RH_MAX_IFACES; x++) {
+		if (!(rcb_card = ifaces[x]))
+			continue;
+		ports = min(rcb_card->num_chans, RCB_TELE_PORTS);
+		mutex_lock(&rcb_card->tele_mutex);
+		first = (rcb_card->tele_count > RCB_TELE_HIST) ?
+			rcb_card->tele_count - RCB_TELE_HIST : 0;
+		for (n = first; n < rcb_card->tele_count; n++) {
+			sample = &rcb_card->tele[n % RCB_TELE_HIST];
+			seq_printf(m, "%d %u %d lv", rcb_card->pos + 1,
+					   jiffies_to_msecs(jiffies - sample->stamp), sample->reg_addr);
+			for (port = 0; port < ports; port++)
+				seq_printf(m, " %d", sample->lvs[port]);
+			seq_printf(m, " reg");
+			for (port = 0; port < ports; port++)
+				seq_printf(m, " %d", sample->reg[port]);
+			seq_printf(m, " sig");
+			for (port = 0; port < ports; port++)
+				seq_printf(m, " %x", sample->sig[port]);
+			seq_printf(m, "\n");
+		}
+		mutex_unlock(&rcb_card->tele_mutex);
+	}
+	mutex_unlock(&ifaces_mutex);
+	return 0;
+}
+
+static int rcb_telemetry_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rcb_telemetry_show, NULL);
+}
+
+static const struct file_operations rcb_telemetry_fops = {
+	.owner = THIS_MODULE,
+	.open = rcb_telemetry_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Read module registers first to last of every port into buf, 24 bytes per
+ *  register. The card gathers the register selected in RCB_REGADDR from all
+ *  of its ports, so the registers are selected back to back. The card does not
+ *  tell when it has been round all of them, so each register is read after a
+ *  full RCB_REGTIME gather period. A signal stops the dump.
+ */
+static int rcb_card_regdump(struct rcb_card_t *rcb_card, int first, int last, __u8 *buf)
+{
+	int reg, res = 0;
+
+	/* the telemetry leaves RCB_REGADDR alone meanwhile */
+	mutex_lock(&rcb_card->tele_mutex);
+	if (rcb_card->regdumping) {
+		mutex_unlock(&rcb_card->tele_mutex);
+		return -EBUSY;
+	}
+	rcb_card->regdumping = 1;
+	mutex_unlock(&rcb_card->tele_mutex);
+
+	for (reg = first; reg <= last; reg++, buf += RCB_TELE_PORTS) {
+		iowrite8(reg, rcb_card->memaddr + RCB_REGADDR);
+		if (msleep_interruptible(RCB_REGTIME)) {
+			res = -EINTR;
+			break;
+		}
+		rcb_card_read_tab(rcb_card, RCB_REGTAB, buf, RCB_TELE_PORTS, 0);
+	}
+
+	/* back to the register of the telemetry */
+	mutex_lock(&rcb_card->tele_mutex);
+	iowrite8(rcb_card->tele_reg_addr, rcb_card->memaddr + RCB_REGADDR);
+	rcb_card->tele_reg_ready = jiffies + msecs_to_jiffies(RCB_REGTIME);
+	rcb_card->regdumping = 0;
+	mutex_unlock(&rcb_card->tele_mutex);
+	return res;
+}
+
+struct rcb_regdump {
+	size_t len;
+	__u8 data[0];
+};
+
+/* Opening the file takes the snapshot, reading returns it as one blob */
+static int rcb_regs_open(struct inode *inode, struct file *file)
+{
+	struct rcb_card_t *rcb_card = inode->i_private;
+	struct rcb_regdump *dump;
+	int first = rcb_card->regdump_first, last = rcb_card->regdump_last;
+	ktime_t start;
+	int res;
+
+	if (!(file->f_mode & FMODE_READ)) {
+		file->private_data = NULL;
+		return 0;
+	}
+
+	dump = vmalloc(sizeof(*dump) + (last - first + 1) * RCB_TELE_PORTS);
+	if (!dump)
+		return -ENOMEM;
+	dump->len = (last - first + 1) * RCB_TELE_PORTS;
+
+	start = ktime_get();
+	if ((res = rcb_card_regdump(rcb_card, first, last, dump->data))) {
+		vfree(dump);
+		return res;
+	}
+	if (debug)
+		printk(KERN_DEBUG "rcbfx %d: Dumped registers %d-%d in %u ms\n", rcb_card->pos + 1,
+			   first, last, (unsigned int) ktime_to_ms(ktime_sub(ktime_get(), start)));
+
+	file->private_data = dump;
+	return 0;
+}
+
+static ssize_t rcb_regs_read(struct file *file, char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct rcb_regdump *dump = file->private_data;
+
+	if (!dump)
+		return -EINVAL;
+	return simple_read_from_buffer(ubuf, count, ppos, dump->data, dump->len);
+}
+
+/* "<first> <last>" selects the registers of the next snapshots */
+static ssize_t rcb_regs_write(struct file *file, const char __user *ubuf, size_t count,
+							  loff_t *ppos)
+{
+	struct rcb_card_t *rcb_card = file->f_path.dentry->d_inode->i_private;
+	char buf[16];
+	int first, last;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%d %d", &first, &last) != 2)
+		return -EINVAL;
+	if ((first < 0) || (last > 255) || (first > last))
+		return -EINVAL;
+
+	rcb_card->regdump_first = first;
+	rcb_card->regdump_last = last;
+	return count;
+}
+
+static int rcb_regs_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations rcb_regs_fops = {
+	.owner = THIS_MODULE,
+	.open = rcb_regs_open,
+	.read = rcb_regs_read,
+	.write = rcb_regs_write,
+	.release = rcb_regs_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
 static unsigned short int rcb_card_dsp_ping(struct rcb_card_t *rcb_card);
 
 static irqreturn_t rcb_card_interrupt(int irq, void *dev_id)
 {
 	struct rcb_card_t *rcb_card = dev_id;
-	int status, upd_state, regnum;
-	__u8 ints, regval;
+	int status, done;
+	__u32 ctrl;
+	__u8 ints;
 
-	/* read flancter */
-	status = *(volatile __u16 *) (rcb_card->memaddr + RCB_RXSIGSTAT);
-
-	if (status) {
-		if (debug & DEBUG_SIG)
-			printk(KERN_DEBUG "RXCHANGE flags = %x\n", status);
-		/* reset flancter */
-		*(volatile __u16 *) (rcb_card->memaddr + RCB_RXSIGSTAT) = status;
-		if (debug & DEBUG_SIG)
-			printk(KERN_DEBUG "RXCHANGE flags = %x\n",
-				   *(volatile __u16 *) (rcb_card->memaddr + RCB_RXSIGSTAT));
+	/* read flancter, and control with the interrupt status in its next byte */
+	status = ioread16(rcb_card->memaddr + RCB_RXSIGSTAT);
+	ctrl = ioread32(rcb_card->memaddr + RCB_CONTROL);
 
-		rcb_card_check_sigbits(rcb_card, status);
-	}
+	if (!status && !(ctrl & (0x02 << 8)))
+		return IRQ_NONE;
 
-	else if (*(volatile __u8 *) (rcb_card->memaddr + RCB_INTSTAT) & 0x02) {
-		/* int acknowledge */
-		*(volatile __u8 *) (rcb_card->memaddr + RCB_CONTROL) |= INT_ACK;
-		*(volatile __u8 *) (rcb_card->memaddr + RCB_CONTROL) &= ~INT_ACK;
+	/* Audio first, a signalling change must not cost a DMA period */
+	if (ctrl & (0x02 << 8)) {
+		/* int acknowledge, with the control bits just read */
+		iowrite8((ctrl & 0xff) | INT_ACK, rcb_card->memaddr + RCB_CONTROL);
+		iowrite8((ctrl & 0xff) & ~INT_ACK, rcb_card->memaddr + RCB_CONTROL);
 
-		/* read DMA address pointer MSB */
-		ints = *(volatile __u8 *) (rcb_card->memaddr + RCB_INTSTAT) & 0x01;
+		/* DMA address pointer MSB */
+		ints = (ctrl >> 8) & 0x01;
 
 		if ((rcb_card->intcount < 10) && (debug))
 			printk(KERN_DEBUG "rcbfx %d: INT count %d PTR %x\n", rcb_card->pos + 1,
-				   rcb_card->intcount,
-				   *(volatile __u32 *) (rcb_card->memaddr + RCB_TDM_PTR));
+				   rcb_card->intcount, ioread32(rcb_card->memaddr + RCB_TDM_PTR));
 
 		rcb_card->intcount++;
+		rcb_card->audio_ints++;
+		/* The pointer names the half that is ours, seeing it twice means a lost interrupt */
+		if (unlikely(ints == rcb_card->dmahalf))
+			rcb_card->dmamisses++;
+		rcb_card->dmahalf = ints;
 		rcb_card_receive(rcb_card, ints);
 		rcb_card_transmit(rcb_card, ints);
 
+#ifdef USE_G168_DSP
+		/* Drain the tone events of the DSP every 8 interrupts */
+		if (rcb_card->dtmf_up && !(rcb_card->intcount & 7))
+			queue_work(rcb_card->wq, &rcb_card->dtmfwork);
+#endif
+	}
 
-		if ((rcb_card->intcount & RCB_LVSSAMP) == 0) {
-			for (regnum = 0; regnum < 24; regnum++) {
-				regval = *(volatile __u8 *) (rcb_card->memaddr + RCB_LVSTAB + regnum);
-				if (regval & 0x80) {	/* negative */
-					regval &= 0x7f;
-					lvs[regnum] = -(0x80 - regval);
-				} else
-					lvs[regnum] = regval;
-			}
-		}
+	if (status) {
+		if (debug & DEBUG_SIG)
+			printk(KERN_DEBUG "RXCHANGE flags = %x\n", status);
+		/* reset flancter */
+		iowrite16(status, rcb_card->memaddr + RCB_RXSIGSTAT);
+		if (debug & DEBUG_SIG)
+			printk(KERN_DEBUG "RXCHANGE flags = %x\n",
+				   ioread16(rcb_card->memaddr + RCB_RXSIGSTAT));
+
+		rcb_card->sig_ints++;
+		if (ctrl & (0x02 << 8))
+			rcb_card->coincident_ints++;
+
+		if (sig_defer) {
+			/* the tasklet reads the latest bits of every channel flagged so far */
+			spin_lock(&rcb_card->lock);
+			rcb_card->sig_pending |= status;
+			spin_unlock(&rcb_card->lock);
+			tasklet_schedule(&rcb_card->sig_tasklet);
+		} else
+			rcb_card_check_sigbits(rcb_card, status);
+	}
 
-		if (reg_addr != rcb_card->oldreg_addr) {
+	/* the card clears the commit bits of the tables it has taken */
+	if (rcb_card->param_pending) {
+		spin_lock(&rcb_card->lock);
+		rcb_card->param_pending &= ioread32(rcb_card->memaddr + RCB_TXSIGSTAT);
+		done = !rcb_card->param_pending;
+		spin_unlock(&rcb_card->lock);
+		if (done) {
 			if (debug)
-				printk(KERN_DEBUG "New reg_addr = %x\n", reg_addr);
-			rcb_card->oldreg_addr = reg_addr;
-			*(volatile __u8 *) (rcb_card->memaddr + RCB_REGADDR) = reg_addr;
-			rcb_card->read_on_int = rcb_card->intcount + RCB_REGTIME;
+				printk(KERN_DEBUG "rcbfx %d: parameters accepted and set\n", rcb_card->pos + 1);
+			wake_up_interruptible(&rcb_card->regq);
 		}
+	}
 
-		if (rcb_card->intcount == rcb_card->read_on_int) {
-			if (debug)
-				printk(KERN_DEBUG "updating valuesfor reg %x\n", reg_addr);
-			for (regnum = 0; regnum < 24; regnum++) {
-				reg_val[regnum] =
-					*(volatile __u8 *) (rcb_card->memaddr + RCB_REGTAB + regnum);
-			}
-		}
+	return IRQ_RETVAL(1);
+}
+
+/*
+ * Copy len bytes of tab to offset off of the parameter table and hand them
+ *  to the card with commit bit bit of RCB_TXSIGSTAT. The card clears the bit
+ *  once it has taken the table, which the interrupt handler notices. Returns
+ *  -EBUSY while any of the busy bits is still set. Called with param_mutex.
+ */
+static int rcb_card_param_post(struct rcb_card_t *rcb_card, __u32 busy, __u32 bit,
+							   const void *tab, unsigned int off, unsigned int len)
+{
+	unsigned long flags;
 
+	if (ioread32(rcb_card->memaddr + RCB_TXSIGSTAT) & busy) {
+		if (debug)
+			printk(KERN_DEBUG "rcbfx %d: Board not ready for params -- not setting\n",
+				   rcb_card->pos + 1);
+		return -EBUSY;
 	}
 
-	else
-		return IRQ_NONE;
+	memcpy_toio(rcb_card->memaddr + PARAM_TBL + off, tab, len);
 
-	upd_state = (*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) & 0x08000);
-	if ((!upd_state) && (rcb_card->param_upd_state)) {
-		printk(KERN_INFO "parameters accepted and set\n");
-		rcb_card->param_upd_state = 0;
-	}
-	if ((upd_state) && (!rcb_card->param_upd_state)) {
-		printk(KERN_INFO "parameters loaded to card\n");
-		rcb_card->param_upd_state = 1;
+	/*
+	 * Notify of the parameter update with the interrupt handler held off.
+	 *  The read back flushes the posted write, so the handler never sees
+	 *  the bit pending before the card has it. A bit the card already took
+	 *  is not left pending.
+	 */
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	iowrite32(bit, rcb_card->memaddr + RCB_TXSIGSTAT);
+	rcb_card->param_pending |= ioread32(rcb_card->memaddr + RCB_TXSIGSTAT) & bit;
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+	return 0;
+}
+
+/* Sleep until the card has taken every table handed to it, or timeout ms pass */
+static int rcb_card_param_wait(struct rcb_card_t *rcb_card, int timeout)
+{
+	long ret;
+
+	ret = wait_event_interruptible_timeout(rcb_card->regq, !rcb_card->param_pending,
+										   msecs_to_jiffies(timeout));
+	if (ret < 0)
+		return ret;
+	if (!ret && rcb_card->param_pending) {
+		printk(KERN_ERR "rcbfx %d: Card did not take the parameters in %d ms\n",
+			   rcb_card->pos + 1, timeout);
+		return -ETIMEDOUT;
 	}
+	return 0;
+}
 
-	return IRQ_RETVAL(1);
+/*
+ * Switch the tone reporting of a channel. Its digits are muted in the received
+ *  audio when DAHDI asks for it, or by dtmfmute while reporting is on. A new
+ *  mute setting needs a fresh channel configuration, which the EC work does.
+ */
+static void rcbfx_chan_tonedetect(struct rcb_card_t *rcb_card, int chan_num, int mode)
+{
+	unsigned long flags;
+	int mute;
+
+	if (mode & DAHDI_TONEDETECT_ON)
+		set_bit(chan_num, &rcb_card->dtmfmask);
+	else
+		clear_bit(chan_num, &rcb_card->dtmfmask);
+
+	mute = (mode & DAHDI_TONEDETECT_MUTE) || ((mode & DAHDI_TONEDETECT_ON) && dtmfmute);
+	if (mute == !!test_bit(chan_num, &rcb_card->mutemask))
+		return;
+
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	if (mute)
+		set_bit(chan_num, &rcb_card->mutemask);
+	else
+		clear_bit(chan_num, &rcb_card->mutemask);
+	rcb_card->ec_reconfig |= (1 << chan_num);
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+	queue_work(rcb_card->wq, &rcb_card->work);
 }
 
 static int rcb_dahdi_chan_ioctl(struct dahdi_chan *chan, unsigned int cmd,
 								unsigned long data)
 {
-	int regnum;
 	struct rcb_card_params_t rcb_card_params;
+	__u8 tune[10];
 	struct dahdi_span *span = chan->span;
 	struct rcb_card_t *rcb_card = container_of(span, struct rcb_card_t, span);
 	int num_chans = rcb_card->num_chans;
 	struct rcb_chan_echo_coefs coefs;
+	int tonedetect, timeout, res;
 
 	switch (cmd) {
+	case DAHDI_TONEDETECT:
+		if (get_user(tonedetect, (__user int *) data))
+			return -EFAULT;
+		if (!rcb_card->dtmf_up)
+			return -ENOSYS;
+		rcbfx_chan_tonedetect(rcb_card, chan->chanpos - 1, tonedetect);
+		break;
 	case DAHDI_ONHOOKTRANSFER:
 		return -EINVAL;
 		break;
@@ -335,32 +779,26 @@ static int rcb_dahdi_chan_ioctl(struct dahdi_chan *chan, unsigned int cmd,
 		return -EINVAL;
 		break;
 	case RCB_CHAN_SET_CBPARAMS:
-		if (debug)
-			printk(KERN_DEBUG "rcbfx %d: Setting cbfx parameters: \n", rcb_card->pos + 1);
-		if (*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) & 0x09000) {
-			printk(KERN_ERR "rcbfx %d: Board not ready for params -- not setting\n",
-				   rcb_card->pos + 1);
-			return -EFAULT;
-			break;
-		}
+	case RCB_CHAN_SET_CBPARAMS_NB:
 		if (copy_from_user
 			(&rcb_card_params, (struct rcb_card_params_t *) data,
 			 sizeof(rcb_card_params)))
 			return -EFAULT;
-
-		printk(KERN_INFO "rcbfx %d: Recieved cbfx parameters: \n", rcb_card->pos + 1);
-
-		for (regnum = 0; regnum < P_TBL_CNT; regnum++) {
-			if (debug)
-				printk(KERN_DEBUG "rcbfx %d: IO Address: %x, Regnum: %x, Data: %x \n",
-					   rcb_card->pos + 1, PARAM_TBL + regnum, regnum,
-					   (__u8) (rcb_card_params.settings[regnum]));
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + regnum) =
-				(__u8) (rcb_card_params.settings[regnum]);
-		}
-		/* notify of parameter update */
-		*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) = 0x08000;
-		break;
+		if (debug)
+			printk(KERN_DEBUG "rcbfx %d: Setting cbfx parameters\n", rcb_card->pos + 1);
+
+		mutex_lock(&rcb_card->param_mutex);
+		/* the blocking call waits out the tables still pending first */
+		res = 0;
+		if (cmd == RCB_CHAN_SET_CBPARAMS)
+			res = rcb_card_param_wait(rcb_card, param_timeout);
+		if (!res)
+			res = rcb_card_param_post(rcb_card, 0x09000, 0x08000, rcb_card_params.settings, 0,
+								  P_TBL_CNT);
+		if (!res && (cmd == RCB_CHAN_SET_CBPARAMS))
+			res = rcb_card_param_wait(rcb_card, param_timeout);
+		mutex_unlock(&rcb_card->param_mutex);
+		return res;
 	case RCB_CHAN_GET_BDINFO:
 		if (debug)
 			printk(KERN_DEBUG "rcbfx %d: ioctl RCB_CHAN_GET_BDINFO sending %d\n", rcb_card->pos + 1,
@@ -370,52 +808,47 @@ static int rcb_dahdi_chan_ioctl(struct dahdi_chan *chan, unsigned int cmd,
 		break;
 
 	case RCB_CHAN_SET_ECHOTUNE:
+	case RCB_CHAN_SET_ECHOTUNE_NB:
+		if (copy_from_user(&coefs, (struct rcb_chan_echo_coefs *) data, sizeof(coefs)))
+			return -EFAULT;
 		if (debug) {
 			printk(KERN_DEBUG "rcbfx %d: ioctl RCB_CHAN_SET_ECHOTUNE sending\n", rcb_card->pos + 1);
 			printk(KERN_DEBUG "chan %x, ac %x, 1 %x, 2 %x, 3 %x, 4 %x, 5 %x, 6 %x, 7 %x, 8 %x,\n",
 				   chan->chanpos, coefs.acim, coefs.coef1, coefs.coef2, coefs.coef3,
 				   coefs.coef4, coefs.coef5, coefs.coef6, coefs.coef7, coefs.coef8);
 		}
-		if (*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) & 0x05000) {
-			printk(KERN_ERR "rcbfx %d: Board not ready for params -- not setting %x\n",
-				   rcb_card->pos + 1,
-				   *(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT));
-			return -EFAULT;
-			break;
-		}
+		if (rcb_card->modtype[chan->chanpos - 1] != MOD_TYPE_FXO)
+			return -EINVAL;
 
-		if (copy_from_user(&coefs, (struct rcb_chan_echo_coefs *) data, sizeof(coefs)))
+		tune[0] = chan->chanpos;
+		tune[1] = coefs.acim;
+		tune[2] = coefs.coef1;
+		tune[3] = coefs.coef2;
+		tune[4] = coefs.coef3;
+		tune[5] = coefs.coef4;
+		tune[6] = coefs.coef5;
+		tune[7] = coefs.coef6;
+		tune[8] = coefs.coef7;
+		tune[9] = coefs.coef8;
+
+		mutex_lock(&rcb_card->param_mutex);
+		res = 0;
+		if (cmd == RCB_CHAN_SET_ECHOTUNE)
+			res = rcb_card_param_wait(rcb_card, param_timeout);
+		if (!res)
+			res = rcb_card_param_post(rcb_card, 0x05000, 0x04000, tune, RCB_CHAN_REG,
+								  sizeof(tune));
+		if (!res && (cmd == RCB_CHAN_SET_ECHOTUNE))
+			res = rcb_card_param_wait(rcb_card, param_timeout);
+		mutex_unlock(&rcb_card->param_mutex);
+		return res;
+
+	case RCB_CHAN_PARAM_WAIT:
+		if (get_user(timeout, (__user int *) data))
 			return -EFAULT;
-
-		if (rcb_card->modtype[chan->chanpos - 1] == MOD_TYPE_FXO) {
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG) =
-				chan->chanpos;
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG + 1) =
-				coefs.acim;
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG + 2) =
-				coefs.coef1;
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG + 3) =
-				coefs.coef2;
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG + 4) =
-				coefs.coef3;
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG + 5) =
-				coefs.coef4;
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG + 6) =
-				coefs.coef5;
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG + 7) =
-				coefs.coef6;
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG + 8) =
-				coefs.coef7;
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + RCB_CHAN_REG + 9) =
-				coefs.coef8;
-		} else {
+		if (timeout < 0)
 			return -EINVAL;
-		}
-
-		/* notify of parameter update */
-		*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) = 0x04000;
-		msleep(100);
-		break;
+		return rcb_card_param_wait(rcb_card, timeout);
 
 	default:
 		return -ENOTTY;
@@ -424,13 +857,53 @@ static int rcb_dahdi_chan_ioctl(struct dahdi_chan *chan, unsigned int cmd,
 	return 0;
 }
 
+/* Sleep until the bootloader echoes val in FW_COMIN, or the timeout in jiffies passes */
+static int rcb_card_fw_wait(struct rcb_card_t *rcb_card, __u8 val, long timeout)
+{
+	long end_jiffies = jiffies + timeout;
+
+	while (*(volatile __u8 *) (rcb_card->memaddr + FW_COMIN) != val) {
+		if (time_after(jiffies, end_jiffies))
+			return -1;
+		msleep(1);
+	}
+	return 0;
+}
+
+/* Load one block into the parameter table and hand it to the bootloader */
+static int rcb_card_fw_block(struct rcb_card_t *rcb_card, unsigned int block_count,
+							 const u8 *data, unsigned int len)
+{
+	unsigned char block_sum = 0;
+	unsigned int char_count;
+
+	for (char_count = 0; char_count < len; char_count++)
+		block_sum = (unsigned char) (block_sum + data[char_count]);
+
+	/* the checksum covers the whole table, clear the tail of a partial block */
+	if (len < 0x100)
+		memset_io(rcb_card->memaddr + PARAM_TBL + len, 0, 0x100 - len);
+	memcpy_toio(rcb_card->memaddr + PARAM_TBL, data, len);
+
+	/* update block counter */
+	*(volatile __u8 *) (rcb_card->memaddr + FW_COMOUT) = block_count;
+	*(volatile __u8 *) (rcb_card->memaddr + FW_SUM) = block_sum;
+
+	/* wait for block to take */
+	if (rcb_card_fw_wait(rcb_card, block_count, 2000)) {
+		printk(KERN_ERR "rcbfx %d: Time out!!!! %d blocks transfered %d blocks taken\n",
+			   rcb_card->pos + 1, block_count,
+			   *(volatile __u8 *) (rcb_card->memaddr + FW_COMIN));
+		return -1;
+	}
+	return 0;
+}
+
 static int rcb_card_update_fw(struct rcb_card_t *rcb_card,
 							  const struct firmware *firmware)
 {
-	long end_jiffies;
 	unsigned int block_count = 0;
 	unsigned int total_blocks, frac_block, char_count, zeros = 0;
-	unsigned char block_sum;
 
 	total_blocks = (firmware->size - 2) >> 8;	/* 256 char blocks */
 	frac_block = (firmware->size - 2) & 0xff;
@@ -461,81 +934,31 @@ static int rcb_card_update_fw(struct rcb_card_t *rcb_card,
 	}
 	/* reset and set boot code to bootloader */
 	*(volatile __u8 *) (rcb_card->memaddr + FW_BOOT) = FW_BOOT_LOAD | FW_BOOT_RST;
-	end_jiffies = jiffies + 50;
-	while (end_jiffies > jiffies);
+	schedule_timeout_uninterruptible(50);
 	*(volatile __u8 *) (rcb_card->memaddr + FW_BOOT) = FW_BOOT_LOAD;	/* release reset */
-	end_jiffies = jiffies + 50;
-	while (end_jiffies > jiffies);	/* wait for reset */
+	schedule_timeout_uninterruptible(50);	/* wait for reset */
 	if (debug)
 		printk(KERN_DEBUG "rcbfx %d: Starting to send firmware\n", rcb_card->pos + 1);
 	for (block_count = 1; block_count <= total_blocks; block_count++) {
-		schedule();
 		/* send block */
-		block_sum = 0;
-		for (char_count = 0; char_count < 0x100; char_count++) {
-			*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + char_count) =
-				firmware->data[char_count + 2 + ((block_count - 1) << 8)];
-			block_sum =
-				(unsigned char) (block_sum + firmware->data[char_count + 2 +
-															((block_count - 1) << 8)]);
-		}
-		/* update block counter */
-		*(volatile __u8 *) (rcb_card->memaddr + FW_COMOUT) = block_count;
-		*(volatile __u8 *) (rcb_card->memaddr + FW_SUM) = block_sum;
-
-		end_jiffies = jiffies + 2000;
-		/* wait for block to take */
-		while ((*(volatile __u8 *) (rcb_card->memaddr + FW_COMIN) != block_count) &&
-			   (end_jiffies > jiffies));
-		if (*(volatile __u8 *) (rcb_card->memaddr + FW_COMIN) != block_count) {
-			printk(KERN_ERR "rcbfx %d: Time out!!!! %d blocks transfered %d blocks taken\n",
-				   rcb_card->pos + 1, block_count,
-				   *(volatile __u8 *) (rcb_card->memaddr + FW_COMIN));
+		if (rcb_card_fw_block(rcb_card, block_count,
+							  firmware->data + 2 + ((block_count - 1) << 8), 0x100))
 			return -1;
-		}
 		if (debug)
 			printk(KERN_DEBUG "rcbfx %d: Acked block %x of %x  ", rcb_card->pos + 1, block_count,
 				   total_blocks);
 	}
-	/* clear block for checksum purposes */
-	for (char_count = 0; char_count < 0x100; char_count++)
-		*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + char_count) = 0;
 	/* send the partial block */
-	block_sum = 0;
-	for (char_count = 0; char_count < frac_block; char_count++) {
-		*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + char_count) =
-			firmware->data[char_count + 2 + ((block_count - 1) << 8)];
-		block_sum = (unsigned char) (block_sum + firmware->data[char_count + 2 +
-																((block_count -
-																  1) << 8)]);
-	}
-	/* update block counter */
-	*(volatile __u8 *) (rcb_card->memaddr + FW_COMOUT) = block_count;
-	*(volatile __u8 *) (rcb_card->memaddr + FW_SUM) = block_sum;
-	if (debug)
-		printk(KERN_DEBUG "rcbfx %d: Sent partial block %x\n", rcb_card->pos + 1, block_count);
-
-	end_jiffies = jiffies + 2000;
-	/* wait for block to take */
-	while ((*(volatile __u8 *) (rcb_card->memaddr + FW_COMIN) != block_count) &&
-		   (end_jiffies > jiffies));
-	if (*(volatile __u8 *) (rcb_card->memaddr + FW_COMIN) != block_count) {
-		printk(KERN_ERR "rcbfx %d: Time out!!!! %d blocks transfered %d blocks taken\n",
-			   rcb_card->pos + 1, block_count,
-			   *(volatile __u8 *) (rcb_card->memaddr + FW_COMIN));
+	if (rcb_card_fw_block(rcb_card, block_count,
+						  firmware->data + 2 + ((block_count - 1) << 8), frac_block))
 		return -1;
-	}
 	if (debug)
 		printk(KERN_DEBUG "rcbfx %d: Acked partial block %x\n", rcb_card->pos + 1, block_count);
 	/* say done */
 	*(volatile __u8 *) (rcb_card->memaddr + FW_BOOT) = 0;
 	*(volatile __u8 *) (rcb_card->memaddr + FW_COMOUT) = 0xff;
 	/* wait for it */
-	end_jiffies = jiffies + 100;
-	while ((*(volatile __u8 *) (rcb_card->memaddr + FW_COMIN) != 0xff) ||
-		   (end_jiffies > jiffies));
-
-	if (*(volatile __u8 *) (rcb_card->memaddr + FW_COMIN) != 0xff) {
+	if (rcb_card_fw_wait(rcb_card, 0xff, 100)) {
 		printk(KERN_ERR "rcbfx %d: All blocks transfered no ACK\n", rcb_card->pos + 1);
 		return -1;
 	} else
@@ -547,6 +970,33 @@ static int rcb_card_update_fw(struct rcb_card_t *rcb_card,
 	return 0;
 }
 
+/*
+ * Whether the card already runs the newest firmware file seen by the driver.
+ *  Cards launching after the first one skip reading the file again.
+ */
+static int rcb_card_fw_current(struct rcb_card_t *rcb_card, int fwv_register)
+{
+	int current_fw;
+
+	mutex_lock(&rcb_fw_mutex);
+	current_fw = !force_fw && rcb_fw_cache.version && (fwv_register >= rcb_fw_cache.version);
+	if (current_fw)
+		printk(KERN_INFO "rcbfx %d: Firmware is current with %s version %x.%x crc32 %08x\n",
+			   rcb_card->pos + 1, rcbfx_firmware, (rcb_fw_cache.version & 0xff00) >> 8,
+			   rcb_fw_cache.version & 0xff, rcb_fw_cache.crc);
+	mutex_unlock(&rcb_fw_mutex);
+	return current_fw;
+}
+
+/* Remember the version and hash of the firmware file */
+static void rcb_card_fw_cache(const struct firmware *firmware, int fwv_file)
+{
+	mutex_lock(&rcb_fw_mutex);
+	rcb_fw_cache.version = fwv_file;
+	rcb_fw_cache.crc = crc32_le(~0, firmware->data, firmware->size) ^ ~0;
+	mutex_unlock(&rcb_fw_mutex);
+}
+
 static int rcb_dahdi_chan_open(struct dahdi_chan *chan)
 {
 	struct dahdi_span *span = chan->span;
@@ -584,14 +1034,18 @@ static void rcb_card_release(struct rcb_card_t *rcb_card)
 	if (debug)
 		printk(KERN_DEBUG "rcbfx %d: Statout = %x\n", rcb_card->pos + 1,
 			   *(volatile __u8 *) (rcb_card->memaddr + RCB_STATOUT));
+	/* A card whose launch failed never registered its span */
+	if (rcb_card->chans_configed)
 #if DAHDI_VER >= KERNEL_VERSION(2,6,0)
-	dahdi_unregister_device(rcb_card->ddev);
+		dahdi_unregister_device(rcb_card->ddev);
 #else
-	dahdi_unregister(&rcb_card->span);
+		dahdi_unregister(&rcb_card->span);
 #endif
 	if (rcb_card->freeregion)
 		release_region(rcb_card->baseaddr, rcb_card->memlen);
 	printk(KERN_NOTICE "rcbfx %d: Released a Rhino\n", rcb_card->pos + 1);
+	kfree(rcb_card->ec_cmd);
+	gpakDetachDsps(rcb_card);
 	kfree(rcb_card);
 }
 
@@ -623,7 +1077,7 @@ static int rcb_card_initialize(struct rcb_card_t *rcb_card)
 	};
 #endif
 
-	int chan_num;
+	int chan_num, x;
 	/* daddy stuff */
 
 	sprintf(rcb_card->span.name, "%s/%d", rcb_card->variety, rcb_card->pos + 1);
@@ -632,10 +1086,15 @@ static int rcb_card_initialize(struct rcb_card_t *rcb_card)
 
 	for (chan_num = 0; chan_num < rcb_card->num_chans; chan_num++) {
 
-		rcb_card->chans[chan_num]->writechunk =
-			(u_char *) (rcb_card->writechunk + (chan_num * DAHDI_CHUNKSIZE));
-		rcb_card->chans[chan_num]->readchunk =
-			(u_char *) (rcb_card->readchunk + (chan_num * DAHDI_CHUNKSIZE));
+		/* The DMA alternates between two halves of num_chans chunks */
+		for (x = 0; x < 2; x++) {
+			rcb_card->writechunks[x][chan_num] = (u_char *) (rcb_card->writechunk +
+						((x * rcb_card->num_chans + chan_num) * DAHDI_CHUNKSIZE));
+			rcb_card->readchunks[x][chan_num] = (u_char *) (rcb_card->readchunk +
+						((x * rcb_card->num_chans + chan_num) * DAHDI_CHUNKSIZE));
+		}
+		rcb_card->chans[chan_num]->writechunk = rcb_card->writechunks[0][chan_num];
+		rcb_card->chans[chan_num]->readchunk = rcb_card->readchunks[0][chan_num];
 		if (debug & DEBUG_POINTERS)
 			printk(KERN_DEBUG "rcbfx %d: Chan %d writechunk %lx readchunk %lx\n",
 				   rcb_card->pos + 1, chan_num,
@@ -728,7 +1187,7 @@ static int rcb_card_hardware_init(struct rcb_card_t *rcb_card)
 	int chan_num, time_out, res, tries = 0;
 	int fwv_register, fwv_file;
 	int done = 0;
-	static const struct firmware *firmware_rcb;
+	const struct firmware *firmware_rcb;
 
 	/* reset DSP */
 	*(volatile __u8 *) (rcb_card->memaddr + FW_BOOT) = DSP_RST;
@@ -741,9 +1200,11 @@ static int rcb_card_hardware_init(struct rcb_card_t *rcb_card)
 	if (*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) & 0x02000) {
 		printk(KERN_INFO "rcbfx %d: Waiting for response from card ......... \n",
 			   rcb_card->pos + 1);
+		/* Sleep between polls, the other cards launch meanwhile */
 		while ((*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) & 0x02000) &&
 			   (time_out == 0)) {
-			if (jiffies > end_jiffies)
+			msleep(1);
+			if (time_after(jiffies, end_jiffies))
 				time_out = 1;
 		}
 	}
@@ -755,7 +1216,9 @@ static int rcb_card_hardware_init(struct rcb_card_t *rcb_card)
 	printk(KERN_NOTICE "rcbfx %d: Firmware Version %x.%x\n", rcb_card->pos + 1,
 		   (fwv_register & 0xff00) >> 8, (fwv_register & 0xff));
 
-	if ((request_firmware(&firmware_rcb, rcbfx_firmware, &rcb_card->dev->dev) != 0) ||
+	if (rcb_card_fw_current(rcb_card, fwv_register)) {
+		/* nothing to upgrade */
+	} else if ((request_firmware(&firmware_rcb, rcbfx_firmware, &rcb_card->dev->dev) != 0) ||
 		!firmware_rcb) {
 		printk(KERN_INFO "rcbfx %d: firmware %s not available from userspace\n", rcb_card->pos + 1,
 			   rcbfx_firmware);
@@ -763,6 +1226,7 @@ static int rcb_card_hardware_init(struct rcb_card_t *rcb_card)
 		fwv_file = ((firmware_rcb->data[0] << 8) | (firmware_rcb->data[1]));
 		printk(KERN_INFO "rcbfx %d: Firmware File Version is %x.%x\n", rcb_card->pos + 1,
 			   (fwv_file & 0xff00) >> 8, fwv_file & 0xff);
+		rcb_card_fw_cache(firmware_rcb, fwv_file);
 		if ((fwv_file > fwv_register) || (force_fw)) {
 			if (force_fw)
 				printk(KERN_WARNING "rcbfx %d: Firmware Upgrade beeing forced\n", rcb_card->pos + 1);
@@ -804,8 +1268,8 @@ static int rcb_card_hardware_init(struct rcb_card_t *rcb_card)
 			printk(KERN_INFO "Waiting for response from card ......... \n");
 			while ((*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) &
 					(__u32) (0x02000)) && (time_out == 0)) {
-				schedule();
-				if (jiffies > end_jiffies)
+				msleep(1);
+				if (time_after(jiffies, end_jiffies))
 					time_out = 1;
 			}
 		}
@@ -893,6 +1357,20 @@ static void rcb_card_stop_dma(struct rcb_card_t *rcb_card)
 	*(volatile __u8 *) (rcb_card->memaddr + FW_COMOUT) = 0x00;
 }
 
+static int rcb_card_request_irq(struct rcb_card_t *rcb_card)
+{
+	struct pci_dev *pdev = rcb_card->dev;
+	int cpu;
+
+	if (rhino_request_irq(pdev, rcb_card_interrupt, rcb_card->variety, rcb_card, msi,
+						  rcb_card->pos, &rcb_card->msi, &cpu))
+		return -EIO;
+
+	printk(KERN_INFO "rcbfx %d: %s interrupt %d, node %d, cpu %d\n", rcb_card->pos + 1,
+		   rcb_card->msi ? "MSI" : "INTx", pdev->irq, dev_to_node(&pdev->dev), cpu);
+	return 0;
+}
+
 static void rcb_card_cleaner(struct rcb_card_t *rcb_card, int flags)
 {
 	if (rcb_card) {
@@ -926,9 +1404,13 @@ static void rcb_card_cleaner(struct rcb_card_t *rcb_card, int flags)
 				rcb_card->dead = 1;
 		}
 		if (flags & FREE_INT)
-			free_irq(rcb_card->dev->irq, rcb_card);
-		if (flags & RH_KFREE)
+			rhino_free_irq(rcb_card->dev, rcb_card, &rcb_card->msi);
+		if (flags & RH_KFREE) {
+			mutex_lock(&ifaces_mutex);
+			ifaces[rcb_card->pos] = NULL;
+			mutex_unlock(&ifaces_mutex);
 			kfree(rcb_card);
+		}
 		if (flags & PCI_FREE)
 			pci_set_drvdata(rcb_card->dev, NULL);
 	}
@@ -1229,8 +1711,31 @@ static void rcb_card_dsp_show_portconfig(GpakPortConfig_t PortConfig)
 	return;
 }
 
-static void rcb_card_dsp_show_chanconfig(GpakChannelConfig_t ChanConfig)
-{
+/*
+ * Channel configuration the card's DSP runs with, built from the template on
+ *  every call. Cards launch in parallel, the template itself is never written.
+ */
+static void rcb_card_dsp_chanconfig(struct rcb_card_t *rcb_card, GpakChannelConfig_t *ChanConfig)
+{
+	*ChanConfig = Gpak_chan_config;
+
+	ChanConfig->EcanParametersA.EcanNlpType = nlp_type;
+	ChanConfig->EcanParametersB.EcanNlpType = nlp_type;
+
+	/* Tones are detected on the echo cancelled line side, only the 5510
+	 *  images carry the detectors. */
+	if (dtmf && (rcb_card->dsp_type == DSP_5510)) {
+		ChanConfig->ToneTypesA = DTMF_tone;
+		ChanConfig->FaxCngDetA = Enabled;
+	} else {
+		ChanConfig->ToneTypesA = Null_tone;
+		ChanConfig->FaxCngDetA = Disabled;
+	}
+	ChanConfig->MuteToneA = Disabled;
+}
+
+static void rcb_card_dsp_show_chanconfig(GpakChannelConfig_t ChanConfig)
+{
 	if (debug & DEBUG_DSP) {
 		printk("%x = %s\n", ChanConfig.PcmInPortA, "PcmInPortA");
 		printk("%x = %s\n", ChanConfig.PcmInSlotA, "PcmInSlotA");
@@ -1309,6 +1814,21 @@ static void rcb_card_dsp_show_chanconfig(GpakChannelConfig_t ChanConfig)
 	return;
 }
 
+/* Fill in the time slots, companding and digit muting of a channel on the DSP */
+static void rcb_card_dsp_chanslots(struct rcb_card_t *rcb_card, int chan_num,
+								   GpakChannelConfig_t *ChanConfig)
+{
+	if ((ChanConfig->ToneTypesA != Null_tone) && test_bit(chan_num, &rcb_card->mutemask))
+		ChanConfig->MuteToneA = Enabled;
+	ChanConfig->EcanEnableA = Enabled;
+	ChanConfig->SoftwareCompand = cmpPCMU;
+
+	ChanConfig->PcmInSlotA = chan_num;
+	ChanConfig->PcmOutSlotA = chan_num;
+	ChanConfig->PcmInSlotB = chan_num;
+	ChanConfig->PcmOutSlotB = chan_num;
+}
+
 static unsigned short int rcb_card_dsp_ping(struct rcb_card_t *rcb_card)
 {
 
@@ -1331,21 +1851,162 @@ static unsigned short int rcb_card_dsp_ping(struct rcb_card_t *rcb_card)
 		return 0;
 }
 
-static void rcbfx_chan_ec_enable(struct rcb_card_t *rcb_card, int chan_num)
+/*
+ * Sample the CPU load and the TDM error counters of the DSP. The DSP counts
+ *  framing errors and slips since its last reset, so only the growth of a
+ *  counter is new. The rolling average covers about eight samples.
+ *  Returns 1 when the DSP was found reset or has stopped answering.
+ */
+static int rcb_card_dsp_health(struct rcb_card_t *rcb_card)
+{
+	struct rcb_dsp_health *health = &rcb_card->health;
+	unsigned short int peak, prev_peak, dsp_ver;
+	unsigned short int raw[5], slips[6];
+	unsigned long framing = 0, slipped = 0;
+	unsigned short int delta;
+	int x, failed;
+
+	memset(slips, 0, sizeof(slips));
+	failed = (gpakPingDsp(rcb_card, rcb_card->pos, &dsp_ver) != PngSuccess) ||
+		gpakReadCpuUsage(rcb_card, rcb_card->pos, &peak, &prev_peak) ||
+		gpakReadFramingStats(rcb_card, rcb_card->pos, &raw[0], &raw[1], &raw[2], &raw[3],
+							 &slips[0]);
+
+	if (gpakTestDspReset(rcb_card, rcb_card->pos)) {
+		printk(KERN_ERR "rcbfx %d: DSP was reset\n", rcb_card->pos + 1);
+		return 1;
+	}
+	if (failed) {
+		health->failures++;
+		if (++health->fail_run < 3)
+			return 0;
+		printk(KERN_ERR "rcbfx %d: DSP stopped answering\n", rcb_card->pos + 1);
+		return 1;
+	}
+	health->fail_run = 0;
+	raw[4] = slips[0] + slips[1] + slips[2] + slips[3] + slips[4] + slips[5];
+
+	if (health->samples++) {
+		for (x = 0; x < 4; x++) {
+			delta = raw[x] - health->raw[x];
+			health->framing[x] += delta;
+			framing += delta;
+		}
+		slipped = (unsigned short int) (raw[4] - health->raw[4]);
+		health->slips += slipped;
+		health->cpu_avg += (prev_peak << 1) - (health->cpu_avg >> 3);
+	} else
+		health->cpu_avg = prev_peak << 4;
+	memcpy(health->raw, raw, sizeof(raw));
+
+	health->cpu_last = prev_peak;
+	if (peak > health->cpu_peak)
+		health->cpu_peak = peak;
+	if (prev_peak > health->cpu_peak)
+		health->cpu_peak = prev_peak;
+
+	if (prev_peak >= dsp_cpu_warn) {
+		if (!health->cpu_warned)
+			printk(KERN_WARNING "rcbfx %d: DSP CPU load at %d%%, close to saturation\n",
+				   rcb_card->pos + 1, prev_peak);
+		health->cpu_warned = 1;
+	} else
+		health->cpu_warned = 0;
+
+	if (framing || slipped)
+		printk(KERN_WARNING "rcbfx %d: DSP %lu TDM framing errors and %lu slips\n",
+			   rcb_card->pos + 1, framing, slipped);
+
+	return 0;
+}
+
+/* EC control command of one channel, queued to the DSP */
+struct rcbfx_ec_cmd {
+	gpakCmd_t cmd;
+	struct rcb_card_t *rcb_card;
+	int chan_num;
+	int enable;
+	int retried;
+	GpakEcanParms_t ecan_next;	/* canceller parameters last requested */
+	GpakEcanParms_t ecan_cur;	/* canceller parameters the DSP runs with */
+	GpakEcanParms_t ecan_bench;	/* parameters to give back after the EC bench */
+};
+
+/*
+ * Give channels lent to the EC bench back the canceller parameters they had,
+ *  with the canceller bypassed as it was. Called with the card lock held.
+ */
+static void __rcb_card_ec_bench_return(struct rcb_card_t *rcb_card, unsigned int bits)
+{
+	int chan_num;
+
+	bits &= rcb_card->ec_bench;
+	for (chan_num = 0; chan_num < rcb_card->num_chans; chan_num++) {
+		if (bits & (1 << chan_num))
+			rcb_card->ec_cmd[chan_num].ecan_next =
+				rcb_card->ec_cmd[chan_num].ecan_bench;
+	}
+	rcb_card->nextec &= ~bits;
+	rcb_card->ec_reconfig |= bits;
+	rcb_card->ec_bench &= ~bits;
+}
+
+/*
+ * Record the outcome of a channel's EC control. When the last command of a
+ *  burst completes the time since the first one was queued is kept as the
+ *  time-to-EC-active of the burst.
+ */
+static void rcbfx_chan_ec_complete(struct rcb_card_t *rcb_card, int chan_num, int enable,
+								   gpakAlgControlStat_t a_c_stat)
 {
+	u64 burst_ns;
+
+	if (a_c_stat != AcSuccess)
+		printk(KERN_ERR "rcbfx: %d: G168 DSP %s Alg Control failed on Chan %d res = %d\n",
+			   rcb_card->pos + 1, enable ? "Enable" : "Disable", chan_num, a_c_stat);
+
+	if (enable)
+		rcb_card->currec |= (1 << chan_num);
+	else
+		rcb_card->currec &= ~(1 << chan_num);
+	rcb_card->ec_busy &= ~(1 << chan_num);
+
+	if (--rcb_card->ec_pending == 0) {
+		burst_ns = ktime_to_ns(ktime_sub(ktime_get(), rcb_card->ec_start));
+		do_div(burst_ns, 1000);
+		rcb_card->ec_last_us = (unsigned int) burst_ns;
+		if (rcb_card->ec_last_us > rcb_card->ec_max_us)
+			rcb_card->ec_max_us = rcb_card->ec_last_us;
+		if (debug & DEBUG_DSP)
+			printk(KERN_DEBUG "rcbfx: %d: Echo Can %d channels changed in %u us (max %u us)\n",
+				   rcb_card->pos + 1, rcb_card->ec_burst, rcb_card->ec_last_us,
+				   rcb_card->ec_max_us);
+		wake_up(&rcb_card->ec_wait);
+	}
+
+	/* The channel may have been toggled or given new parameters while its
+	 *  command was in flight */
+	if (((rcb_card->nextec ^ rcb_card->currec) | rcb_card->ec_reconfig) & (1 << chan_num))
+		queue_work(rcb_card->wq, &rcb_card->work);
+}
+
+static void rcbfx_chan_ec_done(gpakCmd_t *pCmd)
+{
+	struct rcbfx_ec_cmd *ec_cmd = container_of(pCmd, struct rcbfx_ec_cmd, cmd);
+	struct rcb_card_t *rcb_card = ec_cmd->rcb_card;
 	gpakAlgControlStat_t a_c_stat;
-	GPAK_AlgControlStat_t a_c_err;
-	unsigned short int DspId = rcb_card->pos;
 
-	if (debug & DEBUG_DSP)
-		printk(KERN_DEBUG "rcbfx: %d: Echo Can enable DSP %d EC Chan %d\n", rcb_card->pos + 1, 1,
-			   chan_num - 1);
+	a_c_stat = gpakAlgControlResult(pCmd);
 
-	if ((a_c_stat = gpakAlgControl(rcb_card, DspId, chan_num, EnableEcanB, &a_c_err)))
-		printk(KERN_ERR "rcbfx: %d: G168 DSP Enable Alg Control failed res = %d error = %d\n",
-			   rcb_card->pos + 1, a_c_stat, a_c_err);
+	/* A lost reply is worth one more attempt, a rejected command is not */
+	if ((a_c_stat == AcDspCommFailure) && !ec_cmd->retried) {
+		ec_cmd->retried = 1;
+		if (!gpakQueueAlgControl(rcb_card, rcb_card->pos, ec_cmd->chan_num,
+								 ec_cmd->enable ? EnableEcanB : BypassEcanB, pCmd))
+			return;
+	}
 
-	return;
+	rcbfx_chan_ec_complete(rcb_card, ec_cmd->chan_num, ec_cmd->enable, a_c_stat);
 }
 
 static void rcbfx_chan_ec_disable(struct rcb_card_t *rcb_card, int chan_num)
@@ -1365,6 +2026,115 @@ static void rcbfx_chan_ec_disable(struct rcb_card_t *rcb_card, int chan_num)
 	return;
 }
 
+/* DAHDI echo canceller parameters and the canceller settings they set */
+static const struct {
+	const char *name;
+	size_t offset;
+} rcbfx_ec_params[] = {
+	{"tail", offsetof(GpakEcanParms_t, EcanTapLength)},
+	{"nlp", offsetof(GpakEcanParms_t, EcanNlpType)},
+	{"adapt", offsetof(GpakEcanParms_t, EcanAdaptEnable)},
+	{"g165", offsetof(GpakEcanParms_t, EcanG165DetEnable)},
+	{"dbl_talk", offsetof(GpakEcanParms_t, EcanDblTalkThresh)},
+	{"nlp_thresh", offsetof(GpakEcanParms_t, EcanNlpThreshold)},
+	{"nlp_conv", offsetof(GpakEcanParms_t, EcanNlpConv)},
+	{"nlp_unconv", offsetof(GpakEcanParms_t, EcanNlpUnConv)},
+	{"nlp_supp", offsetof(GpakEcanParms_t, EcanNlpMaxSuppress)},
+	{"cng_thresh", offsetof(GpakEcanParms_t, EcanCngThreshold)},
+	{"adapt_limit", offsetof(GpakEcanParms_t, EcanAdaptLimit)},
+	{"cross_corr", offsetof(GpakEcanParms_t, EcanCrossCorrLimit)},
+	{"fir_segs", offsetof(GpakEcanParms_t, EcanNumFirSegments)},
+	{"fir_seg_len", offsetof(GpakEcanParms_t, EcanFirSegmentLen)},
+};
+
+/*
+ * Build the canceller parameters of a DAHDI echo canceller request on top of
+ *  the driver defaults. The tail can only be shortened, the DSP channels are
+ *  sized for the default one.
+ */
+static int rcbfx_chan_ec_params(struct rcb_card_t *rcb_card, struct dahdi_echocanparams *ecp,
+								struct dahdi_echocanparam *p, GpakEcanParms_t *parms)
+{
+	GpakChannelConfig_t ChanConfig;
+	int x, y;
+
+	rcb_card_dsp_chanconfig(rcb_card, &ChanConfig);
+	*parms = ChanConfig.EcanParametersA;
+	if (ec_taps && ecp->tap_length)
+		parms->EcanTapLength = ecp->tap_length;
+
+	for (x = 0; x < ecp->param_count; x++) {
+		for (y = 0; y < ARRAY_SIZE(rcbfx_ec_params); y++) {
+			if (!strcasecmp(p[x].name, rcbfx_ec_params[y].name))
+				break;
+		}
+		if ((y == ARRAY_SIZE(rcbfx_ec_params)) || (p[x].value < 0) || (p[x].value > 0x7fff) ||
+			((rcbfx_ec_params[y].offset == offsetof(GpakEcanParms_t, EcanNlpType)) &&
+			 (p[x].value > RHINO_NLP_MAX))) {
+			printk(KERN_ERR "rcbfx %d: invalid echo canceller parameter %s=%d; failing request\n",
+				   rcb_card->pos + 1, p[x].name, p[x].value);
+			return -EINVAL;
+		}
+		*(short int *) ((char *) parms + rcbfx_ec_params[y].offset) = p[x].value;
+	}
+
+	if ((parms->EcanTapLength == 0) ||
+		(parms->EcanTapLength > Gpak_chan_config.EcanParametersA.EcanTapLength)) {
+		printk(KERN_ERR "rcbfx %d: echo canceller tail of %d taps not supported; failing request\n",
+			   rcb_card->pos + 1, parms->EcanTapLength);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Reload a channel with the canceller parameters last requested for it. The
+ *  DSP only takes them with a fresh channel configuration, which leaves the
+ *  canceller enabled. A configuration the DSP rejects is replaced by the one
+ *  the channel ran with before.
+ */
+static void rcbfx_chan_ec_reconfigure(struct rcb_card_t *rcb_card, int chan_num)
+{
+	struct rcbfx_ec_cmd *ec_cmd = &rcb_card->ec_cmd[chan_num];
+	GpakChannelConfig_t ChanConfig;
+	GPAK_TearDownChanStat_t td_err;
+	GPAK_ChannelConfigStat_t cc_err;
+	gpakTearDownStatus_t td_stat;
+	gpakConfigChanStatus_t cc_stat;
+	unsigned long flags;
+
+	rcb_card_dsp_chanconfig(rcb_card, &ChanConfig);
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	ChanConfig.EcanParametersA = ec_cmd->ecan_next;
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+	rcb_card_dsp_chanslots(rcb_card, chan_num, &ChanConfig);
+
+	if ((td_stat = gpakTearDownChannel(rcb_card, rcb_card->pos, chan_num, &td_err))) {
+		printk(KERN_ERR "rcbfx %d: Chan %d G168 DSP Tear Down failed res = %d error = %d\n",
+			   rcb_card->pos + 1, chan_num + 1, td_stat, td_err);
+		return;
+	}
+
+	cc_stat = gpakConfigureChannel(rcb_card, rcb_card->pos, chan_num, tdmToTdm, &ChanConfig,
+								   &cc_err);
+	if (cc_stat == CcsSuccess) {
+		ec_cmd->ecan_cur = ChanConfig.EcanParametersA;
+		if (debug & DEBUG_DSP)
+			printk(KERN_DEBUG "rcbfx %d: Chan %d Echo Can tail %d NLP %d\n", rcb_card->pos + 1,
+				   chan_num + 1, ec_cmd->ecan_cur.EcanTapLength, ec_cmd->ecan_cur.EcanNlpType);
+		return;
+	}
+
+	printk(KERN_ERR "rcbfx %d: Chan %d Echo Can parameters rejected res = %d error = %d\n",
+		   rcb_card->pos + 1, chan_num + 1, cc_stat, cc_err);
+	ChanConfig.EcanParametersA = ec_cmd->ecan_cur;
+	if ((cc_stat = gpakConfigureChannel(rcb_card, rcb_card->pos, chan_num, tdmToTdm,
+										&ChanConfig, &cc_err)))
+		printk(KERN_ERR "rcbfx %d: Chan %d G168 DSP Chan Config failed error = %d  %d\n",
+			   rcb_card->pos + 1, chan_num + 1, cc_err, cc_stat);
+}
+
 /*static int rcbfx_dahdi_chan_echocan(struct dahdi_chan *chan, int eclen)*/
 static int rcbfx_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 								struct dahdi_echocanparam *p,
@@ -1372,15 +2142,19 @@ static int rcbfx_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanpar
 {
 	struct dahdi_span *span = chan->span;
 	struct rcb_card_t *rcb_card = container_of(span, struct rcb_card_t, span);
-	int chan_num;
+	struct rcbfx_ec_cmd *ec_cmd;
+	GpakEcanParms_t parms;
+	unsigned long flags;
+	int chan_num, res;
 
 	chan_num = chan->chanpos - 1;
 
-	if (ecp->param_count > 0) {
-		printk(KERN_ERR
-			   "rcbfx: echo canceller does not support parameters; failing request\n");
-		return -EINVAL;
-	}
+	if ((res = rcbfx_chan_ec_params(rcb_card, ecp, p, &parms)))
+		return res;
+
+	/* The DSP could not be reloaded, there is no canceller to give */
+	if (rcb_card->dsp_reload_fails >= DSP_RELOAD_TRIES)
+		return -EIO;
 
 	if (debug & DEBUG_DSP) {
 		printk(KERN_DEBUG "rcbfx: %d Echo Can control Span %d Chan %d daddy chan %d\n",
@@ -1391,6 +2165,16 @@ static int rcbfx_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanpar
 		*ec = rcb_card->ec[chan_num];
 		(*ec)->ops = &my_ec_ops;
 		(*ec)->features = my_ec_features;
+		ec_cmd = &rcb_card->ec_cmd[chan_num];
+		spin_lock_irqsave(&rcb_card->lock, flags);
+		/* The EC bench gives the channel up */
+		__rcb_card_ec_bench_return(rcb_card, 1 << chan_num);
+		if (memcmp(&parms, &ec_cmd->ecan_next, sizeof(parms)) &&
+			(rcb_card->chanflag & (1 << chan_num))) {
+			ec_cmd->ecan_next = parms;
+			rcb_card->ec_reconfig |= (1 << chan_num);
+		}
+		spin_unlock_irqrestore(&rcb_card->lock, flags);
 		rcb_card->nextec |= (1 << chan_num);
 		queue_work(rcb_card->wq, &rcb_card->work);
 	}
@@ -1427,61 +2211,302 @@ static void echocan_bh(struct work_struct *data)
 {
 	struct rcb_card_t *rcb_card = container_of(data, struct rcb_card_t, work);
 #endif
+	struct rcbfx_ec_cmd *ec_cmd;
 	unsigned int todo, chan_num;
+	unsigned long flags;
+	int enable;
 
-	todo = rcb_card->nextec ^ rcb_card->currec;
+	/* Left for the DSP recovery to replay */
+	if (rcb_card->dsp_recovering || rcb_card->dsp_reload_fails)
+		return;
+
+	/*
+	 * Channels with new canceller parameters are reconfigured first. That is
+	 *  done synchronously, with the channels marked busy.
+	 */
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	todo = rcb_card->ec_reconfig & ~rcb_card->ec_busy;
+	rcb_card->ec_reconfig &= ~todo;
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+	if (todo) {
+		rcb_card->ec_busy |= todo;
+		for (chan_num = 0; chan_num < rcb_card->num_chans; chan_num++) {
+			if (rcb_card->dsp_recovering)
+				break;
+			if (todo & (1 << chan_num))
+				rcbfx_chan_ec_reconfigure(rcb_card, chan_num);
+		}
+		/* A reload in the meantime configures the channels again */
+		spin_lock_irqsave(&rcb_card->lock, flags);
+		rcb_card->ec_busy &= ~todo;
+		if (rcb_card->dsp_recovering)
+			rcb_card->ec_reconfig |= todo;
+		else
+			rcb_card->currec |= todo;
+		spin_unlock_irqrestore(&rcb_card->lock, flags);
+		wake_up(&rcb_card->ec_wait);
+	}
+
+	if (rcb_card->dsp_recovering)
+		return;
+
+	/*
+	 * Queue the EC control of every changed channel at once. The commands are
+	 *  transacted back to back by the DSP command queue and complete in
+	 *  rcbfx_chan_ec_done(), channels still in flight are left for the next pass.
+	 */
+	todo = (rcb_card->nextec ^ rcb_card->currec) & ~rcb_card->ec_busy;
 	if (debug & DEBUG_DSP) {
 		printk(KERN_DEBUG "rcbfx %d Echo Can control bh change %x to %x\n", rcb_card->pos + 1, todo,
 			   (rcb_card->nextec & todo));
-		printk(KERN_DEBUG "nextec %x currec %x\n", rcb_card->nextec, rcb_card->currec);
+		printk(KERN_DEBUG "nextec %x currec %x busy %x\n", rcb_card->nextec, rcb_card->currec,
+			   rcb_card->ec_busy);
 	}
 
 	for (chan_num = 0; chan_num < rcb_card->num_chans; chan_num++) {
+		if (!(todo & (1 << chan_num)))
+			continue;
 
-		if (todo & (1 << chan_num)) {
-			if (rcb_card->nextec & (1 << chan_num)) {
-				rcbfx_chan_ec_enable(rcb_card, chan_num);
-				rcb_card->currec |= (1 << chan_num);
-				schedule();
-			} else {
-				rcb_card->currec &= ~(1 << chan_num);
-				schedule();
-			}
+		enable = (rcb_card->nextec & (1 << chan_num)) ? 1 : 0;
+		if (debug & DEBUG_DSP)
+			printk(KERN_DEBUG "rcbfx: %d: Echo Can %s DSP %d EC Chan %d\n", rcb_card->pos + 1,
+				   enable ? "enable" : "disable", 1, chan_num);
+
+		if (rcb_card->ec_pending++ == 0) {
+			rcb_card->ec_start = ktime_get();
+			rcb_card->ec_burst = 0;
 		}
+		rcb_card->ec_burst++;
+		rcb_card->ec_busy |= (1 << chan_num);
+
+		ec_cmd = &rcb_card->ec_cmd[chan_num];
+		ec_cmd->enable = enable;
+		ec_cmd->retried = 0;
+		if (gpakQueueAlgControl(rcb_card, rcb_card->pos, chan_num,
+								enable ? EnableEcanB : BypassEcanB, &ec_cmd->cmd))
+			rcbfx_chan_ec_complete(rcb_card, chan_num, enable, AcDspCommFailure);
 	}
 }
 
+static const char rcbfx_dtmf_digits[] = "123A456B789C*0#D";
 
-static int rcb_card_dsp_init(struct rcb_card_t *rcb_card)
+/*
+ * Report a tone detected by the DSP to DAHDI. The DSP tells the start of a
+ *  digit and the end of the last one, fax CNG is only reported once it ends
+ *  and is passed on as the 'f' digit.
+ */
+static void rcbfx_chan_tone_event(struct rcb_card_t *rcb_card, unsigned short int chan_num,
+								  GpakToneCodes_t tone)
+{
+	struct dahdi_chan *chan;
+	unsigned char digit;
+
+	if ((chan_num >= rcb_card->num_chans) || !(rcb_card->chanflag & (1 << chan_num)))
+		return;
+	chan = rcb_card->chans[chan_num];
+
+	if (debug & DEBUG_DTMF)
+		printk(KERN_DEBUG "rcbfx %d: Chan %d tone %d\n", rcb_card->pos + 1, chan_num, tone);
+
+	if (!test_bit(chan_num, &rcb_card->dtmfmask)) {
+		rcb_card->dtmf_digit[chan_num] = 0;
+		return;
+	}
+
+	if (tone <= DtmfDigitD) {
+		digit = rcbfx_dtmf_digits[tone];
+		rcb_card->dtmf_digit[chan_num] = digit;
+		dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFDOWN | digit);
+	} else if (tone == EndofMFDigit) {
+		digit = rcb_card->dtmf_digit[chan_num];
+		rcb_card->dtmf_digit[chan_num] = 0;
+		if (digit)
+			dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFUP | digit);
+	} else if (tone == EndofCngDigit) {
+		dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFDOWN | 'f');
+		dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFUP | 'f');
+	}
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void dtmf_bh(void *data)
+{
+	struct rcb_card_t *rcb_card = data;
+#else
+static void dtmf_bh(struct work_struct *data)
+{
+	struct rcb_card_t *rcb_card = container_of(data, struct rcb_card_t, dtmfwork);
+#endif
+	gpakReadEventFIFOMessageStat_t ref_stat;
+	GpakAsyncEventCode_t event_code;
+	GpakAsyncEventData_t event_data;
+	unsigned short int chan_num;
+	int events;
+
+	/* Bounded, so a DSP that keeps failing cannot hold the queue */
+	for (events = 0; events < 32; events++) {
+		/* A DSP reload stops the detection */
+		if (!rcb_card->dtmf_up)
+			return;
+		ref_stat = gpakReadEventFIFOMessage(rcb_card, rcb_card->pos, &chan_num,
+											&event_code, &event_data);
+		if (ref_stat == RefInvalidEvent)
+			continue;
+		if (ref_stat != RefEventAvail)
+			break;
+		if (event_code == EventToneDetect)
+			rcbfx_chan_tone_event(rcb_card, chan_num, event_data.toneEvent.ToneCode);
+	}
+}
+
+static int rcb_card_ec_settled(struct rcb_card_t *rcb_card)
+{
+	return (rcb_card->nextec == rcb_card->currec) &&
+		!(rcb_card->ec_reconfig | rcb_card->ec_busy);
+}
+
+/*
+ * Lend the idle channels to the EC bench, those neither open nor cancelling,
+ *  or give back the lent ones that have been opened since. Called with the
+ *  card lock held. Returns the number of channels lent.
+ */
+static int __rcb_card_ec_bench_idle(struct rcb_card_t *rcb_card, int lend)
+{
+	unsigned int open = 0;
+	int chan_num;
+
+	for (chan_num = 0; chan_num < rcb_card->num_chans; chan_num++) {
+		if (rcb_card->chans[chan_num] &&
+			(rcb_card->chans[chan_num]->flags & DAHDI_FLAG_OPEN))
+			open |= (1 << chan_num);
+	}
+	if (lend) {
+		rcb_card->ec_bench = rcb_card->chanflag & ~open & ~rcb_card->nextec;
+		for (chan_num = 0; chan_num < rcb_card->num_chans; chan_num++) {
+			if (rcb_card->ec_bench & (1 << chan_num))
+				rcb_card->ec_cmd[chan_num].ecan_bench =
+					rcb_card->ec_cmd[chan_num].ecan_next;
+		}
+	} else
+		__rcb_card_ec_bench_return(rcb_card, open);
+	return hweight32(rcb_card->ec_bench);
+}
+
+/*
+ * Reload the channels lent to the EC bench with the given tail length and
+ *  the canceller enabled.
+ */
+static int rcb_card_ec_bench_taps(struct rcb_card_t *rcb_card, int taps)
+{
+	GpakChannelConfig_t ChanConfig;
+	int chan_num;
+	unsigned long flags;
+
+	rcb_card_dsp_chanconfig(rcb_card, &ChanConfig);
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	__rcb_card_ec_bench_idle(rcb_card, 0);
+	for (chan_num = 0; chan_num < rcb_card->num_chans; chan_num++) {
+		if (!(rcb_card->ec_bench & (1 << chan_num)))
+			continue;
+		rcb_card->ec_cmd[chan_num].ecan_next = ChanConfig.EcanParametersA;
+		rcb_card->ec_cmd[chan_num].ecan_next.EcanTapLength = taps;
+	}
+	rcb_card->ec_reconfig |= rcb_card->ec_bench;
+	rcb_card->nextec |= rcb_card->ec_bench;
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+	queue_work(rcb_card->wq, &rcb_card->work);
+
+	if (!wait_event_timeout(rcb_card->ec_wait, rcb_card_ec_settled(rcb_card), 10 * HZ)) {
+		printk(KERN_WARNING "rcbfx %d: EC bench timed out reloading the channels\n",
+			   rcb_card->pos + 1);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Enable and then bypass the echo canceller on every idle channel at once
+ *  and report how long each burst took to reach the DSP. Then report the DSP
+ *  load with those cancellers running at a range of tail lengths. Channels
+ *  that are opened meanwhile are left alone from then on, the others get
+ *  their parameters back at the end.
+ */
+static void rcb_card_ec_bench(struct rcb_card_t *rcb_card)
+{
+	unsigned short int peak, prev_peak;
+	int pass, taps, lent;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	lent = __rcb_card_ec_bench_idle(rcb_card, 1);
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+	if (!lent) {
+		printk(KERN_INFO "rcbfx %d: EC bench: no idle channels\n", rcb_card->pos + 1);
+		return;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		spin_lock_irqsave(&rcb_card->lock, flags);
+		__rcb_card_ec_bench_idle(rcb_card, 0);
+		rcb_card->ec_burst = 0;
+		rcb_card->ec_last_us = 0;
+		if (pass == 0)
+			rcb_card->nextec |= rcb_card->ec_bench;
+		else
+			rcb_card->nextec &= ~rcb_card->ec_bench;
+		spin_unlock_irqrestore(&rcb_card->lock, flags);
+		queue_work(rcb_card->wq, &rcb_card->work);
+
+		if (!wait_event_timeout(rcb_card->ec_wait, rcb_card_ec_settled(rcb_card), HZ)) {
+			printk(KERN_WARNING "rcbfx %d: EC bench timed out\n", rcb_card->pos + 1);
+			goto done;
+		}
+		printk(KERN_INFO "rcbfx %d: EC bench: %s %d channels took %u us\n",
+			   rcb_card->pos + 1, pass ? "bypassing" : "enabling", rcb_card->ec_burst,
+			   rcb_card->ec_last_us);
+	}
+
+	for (taps = Gpak_chan_config.EcanParametersA.EcanTapLength; taps >= 128; taps /= 2) {
+		if (rcb_card_ec_bench_taps(rcb_card, taps))
+			goto done;
+		/* let the DSP's one second peak cover the new load only */
+		msleep(2000);
+		if (gpakReadCpuUsage(rcb_card, rcb_card->pos, &peak, &prev_peak) == RcuSuccess)
+			printk(KERN_INFO "rcbfx %d: EC bench: %d taps on %d channels: CPU peak %d, last second %d\n",
+				   rcb_card->pos + 1, taps, hweight32(rcb_card->ec_bench), peak, prev_peak);
+	}
+
+done:
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	__rcb_card_ec_bench_return(rcb_card, ~0U);
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+	queue_work(rcb_card->wq, &rcb_card->work);
+	if (!wait_event_timeout(rcb_card->ec_wait, rcb_card_ec_settled(rcb_card), 10 * HZ))
+		printk(KERN_WARNING "rcbfx %d: EC bench timed out restoring the channels\n",
+			   rcb_card->pos + 1);
+}
+
+
+/*
+ * Download and start the DSP, then configure its port and channels with
+ *  every echo canceller bypassed. Channels that ran before keep the
+ *  canceller parameters they had. Returns the number of channels
+ *  configured, or -1.
+ */
+static int rcb_card_load_dsp(struct rcb_card_t *rcb_card)
 {
 	gpakDownloadStatus_t dl_res = 0;
 	gpakConfigPortStatus_t cp_res;
 	GPAK_PortConfigStat_t cp_error;
+	GpakPortConfig_t PortConfig = Gpak_24_chan_port_config;
 	GPAK_ChannelConfigStat_t chan_config_err;
+	GpakChannelConfig_t ChanConfig;
 	int chan_num;
 	gpakConfigChanStatus_t chan_conf_stat;
-	int dsp_chans = 0;
 	int dsp_in_use = 0;
 	gpakReadFramingStatsStatus_t framing_status_status;
 	unsigned short int ec1, ec2, ec3, dmaec, slips;
 
-	*(volatile __u32 *) (rcb_card->memaddr + RCB_EC_ENA) = 0;
-	*(volatile __u32 *) (rcb_card->memaddr + RCB_EC_ENB) = 0;
-
-	if (no_ec)
-		return 0;
-
-	rcb_card->hpi_fast = 0;
-	*(volatile __u32 *) (rcb_card->memaddr + RCB_HPIC) = 0;
-	rcb_card_wait_hpi(rcb_card, RCB_HRDY);
-	rcb_card->hpi_xadd = 0;
-
-	/* quit here if no dsp channels on */
-	if (!(dsp_chans = rcb_card->chanflag)) {
-		printk(KERN_NOTICE "rcbfx %d: G168 DSP Disabled\n", rcb_card->pos + 1);
-		return 0;
-	}
-
 	if (rcb_card->dsp_type == DSP_5507) {
 
 		/* Load the loader file */
@@ -1564,17 +2589,17 @@ static int rcb_card_dsp_init(struct rcb_card_t *rcb_card)
 		}
 	}
 
-	Gpak_24_chan_port_config.FirstSlotMask1 = (rcb_card->chanflag & 0xffff);
-	Gpak_24_chan_port_config.SecSlotMask1 = ((rcb_card->chanflag >> 16) & 0xffff);
+	PortConfig.FirstSlotMask1 = (rcb_card->chanflag & 0xffff);
+	PortConfig.SecSlotMask1 = ((rcb_card->chanflag >> 16) & 0xffff);
 
-	Gpak_24_chan_port_config.FirstSlotMask2 = (rcb_card->chanflag & 0xffff);
-	Gpak_24_chan_port_config.SecSlotMask2 = ((rcb_card->chanflag >> 16) & 0xffff);
+	PortConfig.FirstSlotMask2 = (rcb_card->chanflag & 0xffff);
+	PortConfig.SecSlotMask2 = ((rcb_card->chanflag >> 16) & 0xffff);
 
-	rcb_card_dsp_show_portconfig(Gpak_24_chan_port_config);
+	rcb_card_dsp_show_portconfig(PortConfig);
 
 
 	if ((cp_res =
-		 gpakConfigurePorts(rcb_card, rcb_card->pos, &Gpak_24_chan_port_config,
+		 gpakConfigurePorts(rcb_card, rcb_card->pos, &PortConfig,
 							&cp_error))) {
 		printk(KERN_ERR "rcbfx %d: G168 DSP Port Config failed res = %d error = %d\n",
 			   rcb_card->pos + 1, cp_res, cp_error);
@@ -1604,27 +2629,21 @@ static int rcb_card_dsp_init(struct rcb_card_t *rcb_card)
 		}
 	}
 
-	Gpak_chan_config.EcanParametersA.EcanNlpType = nlp_type;
-	Gpak_chan_config.EcanParametersB.EcanNlpType = nlp_type;
-
 	for (chan_num = 0; chan_num < rcb_card->num_chans; chan_num++) {
 
 		if (rcb_card->chanflag & (1 << chan_num)) {
 
 			dsp_in_use++;
-			Gpak_chan_config.EcanEnableA = Enabled;
-			Gpak_chan_config.SoftwareCompand = cmpPCMU;
-
-			Gpak_chan_config.PcmInSlotA = chan_num;
-			Gpak_chan_config.PcmOutSlotA = chan_num;
-			Gpak_chan_config.PcmInSlotB = chan_num;
-			Gpak_chan_config.PcmOutSlotB = chan_num;
+			rcb_card_dsp_chanconfig(rcb_card, &ChanConfig);
+			rcb_card_dsp_chanslots(rcb_card, chan_num, &ChanConfig);
+			if (rcb_card->ec_cmd)
+				ChanConfig.EcanParametersA = rcb_card->ec_cmd[chan_num].ecan_cur;
 
-			rcb_card_dsp_show_chanconfig(Gpak_chan_config);
+			rcb_card_dsp_show_chanconfig(ChanConfig);
 
 			if ((chan_conf_stat =
 				 gpakConfigureChannel(rcb_card, rcb_card->pos, chan_num, tdmToTdm,
-									  &Gpak_chan_config, &chan_config_err))) {
+									  &ChanConfig, &chan_config_err))) {
 				printk(KERN_ERR "rcbfx %d: Chan %d G168 DSP Chan Config failed error = %d  %d\n",
 					   rcb_card->pos + 1, chan_num + 1, chan_config_err, chan_conf_stat);
 				return -1;
@@ -1641,6 +2660,224 @@ static int rcb_card_dsp_init(struct rcb_card_t *rcb_card)
 		}
 	}
 
+	return dsp_in_use;
+}
+
+/* Reset the DSP and bring its host port back to the power up state */
+static void rcb_card_reset_dsp(struct rcb_card_t *rcb_card)
+{
+	*(volatile __u8 *) (rcb_card->memaddr + FW_BOOT) = DSP_RST;
+	msleep(100);
+	*(volatile __u8 *) (rcb_card->memaddr + FW_BOOT) = 0x00;
+
+	rcb_card->hpi_fast = 0;
+	*(volatile __u32 *) (rcb_card->memaddr + RCB_HPIC) = 0;
+	rcb_card_wait_hpi(rcb_card, RCB_HRDY);
+	rcb_card->hpi_xadd = 0;
+}
+
+/*
+ * Reload the DSP after it was found reset or stopped answering. The
+ *  channels keep running on the direct audio path meanwhile. The canceller
+ *  of every channel DAHDI has asked for is enabled again once the DSP is up.
+ */
+static void rcb_card_recover_dsp(struct rcb_card_t *rcb_card)
+{
+	int ec_on, res;
+	unsigned long flags;
+	ktime_t start;
+	u64 took_ns;
+
+	printk(KERN_WARNING "rcbfx %d: Reloading the DSP\n", rcb_card->pos + 1);
+	start = ktime_get();
+
+	/* Stop all DSP traffic, EC changes are held until the DSP is back */
+	rcb_card->dsp_recovering = 1;
+	rcb_card->dtmf_up = 0;
+	synchronize_irq(rcb_card->dev->irq);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	cancel_work_sync(&rcb_card->work);
+	cancel_work_sync(&rcb_card->dtmfwork);
+#else
+	flush_workqueue(rcb_card->wq);
+#endif
+	gpakStopCmdQueue(rcb_card, rcb_card->pos);
+
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	ec_on = *(volatile __u8 *) (rcb_card->memaddr + EC_CNTL) & EC_ON;
+	*(volatile __u8 *) (rcb_card->memaddr + EC_CNTL) &= ~EC_ON;
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+
+	gpakRequestFiles(rcb_card);
+	rcb_card_reset_dsp(rcb_card);
+	res = rcb_card_load_dsp(rcb_card);
+	gpakReleaseFiles(rcb_card);
+
+	/* Every canceller is bypassed now, the EC work enables them again */
+	spin_lock_irqsave(&rcb_card->lock, flags);
+	rcb_card->currec = 0;
+	rcb_card->ec_busy = 0;
+	rcb_card->ec_pending = 0;
+	rcb_card->health.fail_run = 0;
+	spin_unlock_irqrestore(&rcb_card->lock, flags);
+
+	gpakTestDspReset(rcb_card, rcb_card->pos);
+	if (gpakStartCmdQueue(rcb_card, rcb_card->pos, rcb_card->wq))
+		printk(KERN_ERR "rcbfx %d: Unable to start the DSP command queue\n", rcb_card->pos + 1);
+
+	/* The cancellers stay bypassed, the health work tries again later */
+	if (res < 0) {
+		if (++rcb_card->dsp_reload_fails < DSP_RELOAD_TRIES)
+			printk(KERN_ERR "rcbfx %d: DSP reload failed, echo cancellation is off\n",
+				   rcb_card->pos + 1);
+		else
+			printk(KERN_ERR "rcbfx %d: DSP reload failed %u times, echo cancellation stays off\n",
+				   rcb_card->pos + 1, rcb_card->dsp_reload_fails);
+		rcb_card->dsp_recovering = 0;
+		return;
+	}
+
+	if (ec_on) {
+		spin_lock_irqsave(&rcb_card->lock, flags);
+		*(volatile __u8 *) (rcb_card->memaddr + EC_CNTL) |= EC_ON;
+		spin_unlock_irqrestore(&rcb_card->lock, flags);
+	}
+
+	rcb_card->dtmf_up = dtmf && (rcb_card->dsp_type == DSP_5510);
+	rcb_card->dsp_reload_fails = 0;
+	rcb_card->dsp_recovering = 0;
+	queue_work(rcb_card->wq, &rcb_card->work);
+
+	took_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	do_div(took_ns, 1000);
+	rcb_card->dsp_recovery_us = (unsigned int) took_ns;
+	rcb_card->dsp_recoveries++;
+	printk(KERN_NOTICE "rcbfx %d: DSP reloaded in %u us\n", rcb_card->pos + 1,
+		   rcb_card->dsp_recovery_us);
+}
+
+/* Sampled from the card's EC queue, except before 2.6.22 where a reload would flush it */
+static void rcb_card_health_sched(struct rcb_card_t *rcb_card, unsigned long delay)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	queue_delayed_work(rcb_card->wq, &rcb_card->healthwork, delay);
+#else
+	schedule_delayed_work(&rcb_card->healthwork, delay);
+#endif
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void health_bh(void *data)
+{
+	struct rcb_card_t *rcb_card = data;
+#else
+static void health_bh(struct work_struct *data)
+{
+	struct rcb_card_t *rcb_card = container_of(data, struct rcb_card_t, healthwork.work);
+#endif
+
+	if (rcb_card_dsp_health(rcb_card) && dsp_recover)
+		rcb_card_recover_dsp(rcb_card);
+
+	/* Back off while the reloads fail, stop once the card gave up */
+	if (rcb_card->health_up && (dsp_health > 0) &&
+		(rcb_card->dsp_reload_fails < DSP_RELOAD_TRIES))
+		rcb_card_health_sched(rcb_card, (dsp_health * HZ) << rcb_card->dsp_reload_fails);
+}
+
+/* Command transactions of a DSP, and how long the queued ones took to complete */
+static int rcb_dsp_cmds_show(struct rcb_card_t *rcb_card, unsigned short int DspId,
+							 int dsp, char *buf, int len)
+{
+	gpakCmdStats_t stats;
+	u64 avg_ns = 0, queued_ns = 0;
+
+	gpakReadCmdStats(rcb_card, DspId, &stats);
+	if (stats.Commands) {
+		avg_ns = stats.TotalNs;
+		do_div(avg_ns, stats.Commands);
+	}
+	if (stats.Queued) {
+		queued_ns = stats.QueuedNs;
+		do_div(queued_ns, stats.Queued);
+	}
+	return scnprintf(buf + len, PAGE_SIZE - len,
+					 "dsp %d: cmds %lu failed %lu avg %u us max %u us rate %u/s "
+					 "queued %lu avg %u us max %u us\n", dsp, stats.Commands, stats.Failures,
+					 (unsigned int) avg_ns / 1000, stats.MaxNs / 1000,
+					 avg_ns ? (unsigned int) (NSEC_PER_SEC / (unsigned int) avg_ns) : 0,
+					 stats.Queued, (unsigned int) queued_ns / 1000, stats.QueuedMaxNs / 1000);
+}
+
+static ssize_t rcb_dsp_health_show(struct device *dev, struct device_attribute *attr,
+									char *buf)
+{
+	struct rcb_card_t *rcb_card = pci_get_drvdata(to_pci_dev(dev));
+	struct rcb_dsp_health *health = &rcb_card->health;
+	int len;
+
+	len = scnprintf(buf, PAGE_SIZE,
+					 "dsp 1: cpu %u peak %u avg %u framing %lu %lu %lu dma %lu slips %lu "
+					 "samples %lu failed %lu\nrecoveries %u last %u us failed %u\n",
+					 health->cpu_last,
+					 health->cpu_peak, health->cpu_avg >> 4, health->framing[0],
+					 health->framing[1], health->framing[2], health->framing[3], health->slips,
+					 health->samples, health->failures, rcb_card->dsp_recoveries,
+					 rcb_card->dsp_recovery_us, rcb_card->dsp_reload_fails);
+	len += rcb_dsp_cmds_show(rcb_card, rcb_card->pos, 1, buf, len);
+	return len;
+}
+
+static DEVICE_ATTR(dsp_health, S_IRUGO, rcb_dsp_health_show, NULL);
+
+static int rcb_card_dsp_init(struct rcb_card_t *rcb_card)
+{
+	GpakChannelConfig_t ChanConfig;
+	int chan_num;
+	int dsp_chans = 0;
+	int dsp_in_use = 0;
+
+	*(volatile __u32 *) (rcb_card->memaddr + RCB_EC_ENA) = 0;
+	*(volatile __u32 *) (rcb_card->memaddr + RCB_EC_ENB) = 0;
+
+	if (no_ec)
+		return 0;
+
+	rcb_card->hpi_fast = 0;
+	*(volatile __u32 *) (rcb_card->memaddr + RCB_HPIC) = 0;
+	rcb_card_wait_hpi(rcb_card, RCB_HRDY);
+	rcb_card->hpi_xadd = 0;
+
+	/* quit here if no dsp channels on */
+	if (!(dsp_chans = rcb_card->chanflag)) {
+		printk(KERN_NOTICE "rcbfx %d: G168 DSP Disabled\n", rcb_card->pos + 1);
+		return 0;
+	}
+
+	if (gpakAttachDsps(rcb_card, rcb_card->pos, 1)) {
+		printk(KERN_ERR "rcbfx %d: Unable to allocate DSP state\n", rcb_card->pos + 1);
+		return -1;
+	}
+
+	if ((dsp_in_use = rcb_card_load_dsp(rcb_card)) < 0)
+		return -1;
+
+	rcb_card->ec_cmd = kmalloc_node(rcb_card->num_chans * sizeof *rcb_card->ec_cmd, GFP_KERNEL,
+									dev_to_node(&rcb_card->dev->dev));
+	if (rcb_card->ec_cmd == NULL) {
+		printk(KERN_ERR "rcbfx %d: Unable to allocate EC control commands\n", rcb_card->pos + 1);
+		return -1;
+	}
+	memset(rcb_card->ec_cmd, 0, rcb_card->num_chans * sizeof *rcb_card->ec_cmd);
+	rcb_card_dsp_chanconfig(rcb_card, &ChanConfig);
+	for (chan_num = 0; chan_num < rcb_card->num_chans; chan_num++) {
+		rcb_card->ec_cmd[chan_num].rcb_card = rcb_card;
+		rcb_card->ec_cmd[chan_num].chan_num = chan_num;
+		rcb_card->ec_cmd[chan_num].cmd.pDone = rcbfx_chan_ec_done;
+		rcb_card->ec_cmd[chan_num].ecan_next = ChanConfig.EcanParametersA;
+		rcb_card->ec_cmd[chan_num].ecan_cur = ChanConfig.EcanParametersA;
+	}
+
 	/* switch to dsp audio stream */
 	if ((use_ec == -1) || (use_ec == 1))
 		*(volatile __u8 *) (rcb_card->memaddr + EC_CNTL) |= EC_ON;
@@ -1654,14 +2891,35 @@ static int rcb_card_dsp_init(struct rcb_card_t *rcb_card)
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 	INIT_WORK(&rcb_card->work, echocan_bh, rcb_card);
+	INIT_WORK(&rcb_card->dtmfwork, dtmf_bh, rcb_card);
+	INIT_WORK(&rcb_card->healthwork, health_bh, rcb_card);
 #else
 	INIT_WORK(&rcb_card->work, echocan_bh);
+	INIT_WORK(&rcb_card->dtmfwork, dtmf_bh);
+	INIT_DELAYED_WORK(&rcb_card->healthwork, health_bh);
 #endif
 
+	if (gpakStartCmdQueue(rcb_card, rcb_card->pos, rcb_card->wq))
+		printk(KERN_ERR "rcbfx %d: Unable to start the DSP command queue\n", rcb_card->pos + 1);
+
+	if (ecbench)
+		rcb_card_ec_bench(rcb_card);
+
+	if (dtmf && (rcb_card->dsp_type == DSP_5510)) {
+		rcb_card->dtmf_up = 1;
+		printk(KERN_INFO "rcbfx %d: DSP DTMF detection enabled\n", rcb_card->pos + 1);
+	}
+
 #if DAHDI_VER < KERNEL_VERSION(2,4,0)
 	rcb_card->span.echocan_create = rcbfx_echocan_create;
 #endif
 
+	if (device_create_file(&rcb_card->dev->dev, &dev_attr_dsp_health))
+		printk(KERN_WARNING "rcbfx %d: Unable to export the DSP health\n", rcb_card->pos + 1);
+	rcb_card->health_up = 1;
+	if (dsp_health > 0)
+		rcb_card_health_sched(rcb_card, dsp_health * HZ);
+
 	printk(KERN_NOTICE "rcbfx %d: G168 DSP Active and Servicing %d Channels - %x\n",
 		   rcb_card->pos + 1, dsp_in_use, dsp_chans);
 
@@ -1670,12 +2928,144 @@ static int rcb_card_dsp_init(struct rcb_card_t *rcb_card)
 
 #endif
 
+static int rcb_card_launch(struct rcb_card_t *rcb_card)
+{
+#ifdef USE_G168_DSP
+	/* The DSP images load while the hardware is set up */
+	int dsp_fw = !no_ec;
+#endif
+	int regnum, x, cardcount = 0;
+
+#ifdef USE_G168_DSP
+	if (dsp_fw)
+		gpakRequestFiles(rcb_card);
+#endif
+
+	/* sticks in here without up */
+	if (rcb_card_hardware_init(rcb_card)) {
+		printk(KERN_ERR "rcbfx %d: Unable to initialize hardware\n", rcb_card->pos + 1);
+#ifdef USE_G168_DSP
+		if (dsp_fw)
+			gpakReleaseFiles(rcb_card);
+#endif
+		/* The card stays bound, its removal releases the rest */
+		rcb_card_cleaner(rcb_card, STOP_DMA);
+		return -EIO;	/* had some ducks EI */
+	}
+
+	rcb_card->dsp_up = 0;
+
+#ifdef USE_G168_DSP
+	if (rcb_card_dsp_init(rcb_card) < 0)
+		printk(KERN_ERR "rcbfx %d: Unable to initialize G168 DSP\n", rcb_card->pos + 1);
+	if (dsp_fw)
+		gpakReleaseFiles(rcb_card);
+#endif
+
+	if ((use_ec_zap > 0) || (use_ec_zap == 0))	/* forced value */
+		zt_ec_chanmap = use_ec_zap;
+	else if (rcb_card->dsp_up == 0)	/* Switch on if there is no DSP */
+		zt_ec_chanmap = -1;
+	else
+		zt_ec_chanmap = 0;
+
+
+	if (use_ec == 1)
+		*(volatile __u8 *) (rcb_card->memaddr + EC_CNTL) |= EC_ON;
+
+	if (use_ec == 0)
+		*(volatile __u8 *) (rcb_card->memaddr + EC_CNTL) &= ~EC_ON;
+
+	/* Cards launch in parallel, but keep their span numbers in card order */
+	rhino_launch_wait_turn(&rcb_launch, rcb_card->pos);
+
+	if (rcb_card_initialize(rcb_card)) {
+		/* set up and register span and channels */
+		printk(KERN_ERR "rcbfx %d: Unable to initialize \n", rcb_card->pos + 1);
+		rcb_card_cleaner(rcb_card, STOP_DMA);
+		return -EIO;	/* had some goats EI */
+	}
+
+	printk(KERN_INFO "rcbfx %d: Starting DMA\n", rcb_card->pos + 1);
+
+	rcb_card_start_dma(rcb_card);
+
+	for (regnum = 0; regnum < P_TBL_CNT; regnum++) {
+
+		*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + regnum) =
+			rcb_settings_default[regnum];
+	}
+
+	/* notify changes */
+	*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) = 0x01000;
+
+	for (x = 0; x < rcb_card->num_chans; x++) {
+		if (rcb_card->chanflag & (1 << x))
+			cardcount++;
+	}
+	/* let board run signaling data now */
+	/* notify changes */
+	*(volatile __u8 *) (rcb_card->memaddr + RCB_STATOUT) |= 0x01;
+	if (debug)
+		printk(KERN_DEBUG "rcbfx %d: Statout = %x\n", rcb_card->pos + 1,
+			   *(volatile __u8 *) (rcb_card->memaddr + RCB_STATOUT));
+	/* notify changes */
+	*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) = 0x04000;
+
+	if ((rcb_card->dev->device == PCI_DEVICE_RCB4FXO) ||
+		(rcb_card->dev->device == PCI_DEVICE_RCB24FXO) ||
+		(rcb_card->dev->device == PCI_DEVICE_RCB24FXS))
+
+		printk(KERN_NOTICE "rcbfx %d: Spotted a Rhino: %s (%d channels)\n", rcb_card->pos + 1,
+			   rcb_card->variety, cardcount);
+	else
+		printk(KERN_NOTICE "rcbfx %d: Spotted a Rhino: %s (%d modules)\n", rcb_card->pos + 1,
+			   rcb_card->variety, cardcount / 2);
+
+	if (device_create_file(&rcb_card->dev->dev, &dev_attr_telemetry))
+		printk(KERN_WARNING "rcbfx %d: Unable to export the telemetry\n", rcb_card->pos + 1);
+	rcb_card->tele_up = 1;
+	schedule_delayed_work(&rcb_card->telework, msecs_to_jiffies(RCB_LVSSAMP + 1));
+
+#ifdef CONFIG_DEBUG_FS
+	if (!IS_ERR_OR_NULL(rcb_debugfs)) {
+		char name[8];
+
+		sprintf(name, "%d", rcb_card->pos + 1);
+		rcb_card->debugfs = debugfs_create_dir(name, rcb_debugfs);
+		if (!IS_ERR_OR_NULL(rcb_card->debugfs))
+			debugfs_create_file("regs", S_IRUSR | S_IWUSR, rcb_card->debugfs, rcb_card,
+								&rcb_regs_fops);
+	}
+#endif
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void launch_bh(void *data)
+{
+	struct rcb_card_t *rcb_card = data;
+#else
+static void launch_bh(struct work_struct *data)
+{
+	struct rcb_card_t *rcb_card = container_of(data, struct rcb_card_t, launchwork);
+#endif
+	ktime_t start = ktime_get();
+
+	rcb_card_launch(rcb_card);
+	printk(KERN_INFO "rcbfx %d: Launched in %u ms\n", rcb_card->pos + 1,
+		   (unsigned int) ktime_to_ms(ktime_sub(ktime_get(), start)));
+	rhino_launch_done(&rcb_launch, rcb_card->pos, &rcb_card->launched);
+}
+
 static int __devinit rcb_card_init_one(struct pci_dev *pdev,
 									   const struct pci_device_id *ent)
 {
-	int res, regnum;
+	int res;
 	static struct rcb_card_t *rcb_card;
 	struct rcb_card_desc *d = (struct rcb_card_desc *) ent->driver_data;
+	int node = dev_to_node(&pdev->dev);
 	int x, i;
 	static int initd_ifaces = 0;
 
@@ -1697,22 +3087,30 @@ static int __devinit rcb_card_init_one(struct pci_dev *pdev,
 		printk(KERN_WARNING "No Rhino spotted\n");
 		res = -EIO;
 	} else {
-		rcb_card = kmalloc(sizeof(struct rcb_card_t), GFP_KERNEL);
+		/* Keep the card's state on the node its DMA lands on */
+		rcb_card = kmalloc_node(sizeof(struct rcb_card_t), GFP_KERNEL, node);
 		if (rcb_card) {
-			int cardcount = 0;
-			ifaces[x] = rcb_card;
 			memset(rcb_card, 0, sizeof(struct rcb_card_t));
+			mutex_init(&rcb_card->tele_mutex);
+			mutex_init(&rcb_card->param_mutex);
+			rcb_card->dmahalf = 1;
+			init_waitqueue_head(&rcb_card->regq);
+			rcb_card->regdump_first = 1;
+			rcb_card->regdump_last = 255;
+			mutex_lock(&ifaces_mutex);
+			ifaces[x] = rcb_card;
+			mutex_unlock(&ifaces_mutex);
 
 			for (i = 0; i < d->num_chans; i++) {
 				printk(KERN_DEBUG "alloc chan %x ec %x\n", i, i);
 				if (!
 					(rcb_card->chans[i] =
-					 kmalloc(sizeof(*rcb_card->chans[i]), GFP_KERNEL))) {
+					 kmalloc_node(sizeof(*rcb_card->chans[i]), GFP_KERNEL, node))) {
 					return -ENOMEM;
 				}
 				memset(rcb_card->chans[i], 0, sizeof(*rcb_card->chans[i]));
 
-				if (!(rcb_card->ec[i] = kmalloc(sizeof(*rcb_card->ec[i]), GFP_KERNEL))) {
+				if (!(rcb_card->ec[i] = kmalloc_node(sizeof(*rcb_card->ec[i]), GFP_KERNEL, node))) {
 					return -ENOMEM;
 				}
 				memset(rcb_card->ec[i], 0, sizeof(*rcb_card->ec[i]));
@@ -1720,6 +3118,13 @@ static int __devinit rcb_card_init_one(struct pci_dev *pdev,
 			}
 
 			spin_lock_init(&rcb_card->lock);
+			mutex_init(&rcb_card->dsp_mutex);
+			init_waitqueue_head(&rcb_card->ec_wait);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+			INIT_WORK(&rcb_card->telework, tele_bh, rcb_card);
+#else
+			INIT_DELAYED_WORK(&rcb_card->telework, tele_bh);
+#endif
 			rcb_card->curcard = -1;
 			rcb_card->baseaddr = pci_resource_start(pdev, 0);
 			rcb_card->memlen = pci_resource_len(pdev, 0);
@@ -1765,91 +3170,40 @@ static int __devinit rcb_card_init_one(struct pci_dev *pdev,
 
 			pci_set_drvdata(pdev, rcb_card);
 
-			if (request_irq
-				(pdev->irq, rcb_card_interrupt, IRQF_SHARED, rcb_card->variety,
-				 rcb_card)) {
+			tasklet_init(&rcb_card->sig_tasklet, rcb_card_sig_tasklet,
+						 (unsigned long) rcb_card);
+
+			if (rcb_card_request_irq(rcb_card)) {
 				printk(KERN_ERR "rcbfx %d: Unable to request IRQ %d\n", rcb_card->pos + 1,
 					   pdev->irq);
 				rcb_card_cleaner(rcb_card,
 								 RH_KFREE | PCI_FREE | IOUNMAP | FREE_DMA | STOP_DMA |
-								 FREE_INT | ZUNREG);
+								 ZUNREG);
 				return -EIO;	/* had some pigs EI */
 			}
 
-			/* sticks in here without up */
-			if (rcb_card_hardware_init(rcb_card)) {
-				printk(KERN_ERR "rcbfx %d: Unable to initialize hardware\n", rcb_card->pos + 1);
-				rcb_card_cleaner(rcb_card,
-								 RH_KFREE | PCI_FREE | IOUNMAP | FREE_DMA | STOP_DMA |
-								 FREE_INT | ZUNREG);
-				return -EIO;	/* had some ducks EI */
-			}
-
-			rcb_card->dsp_up = 0;
+			if (device_create_file(&pdev->dev, &dev_attr_irq_stats))
+				printk(KERN_WARNING "rcbfx %d: Unable to export the interrupt counters\n",
+					   rcb_card->pos + 1);
 
-#ifdef USE_G168_DSP
-			if (rcb_card_dsp_init(rcb_card) < 0)
-				printk(KERN_ERR "rcbfx %d: Unable to initialize G168 DSP\n", rcb_card->pos + 1);
+			init_completion(&rcb_card->launched);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+			INIT_WORK(&rcb_card->launchwork, launch_bh, rcb_card);
+#else
+			INIT_WORK(&rcb_card->launchwork, launch_bh);
 #endif
 
-			if ((use_ec_zap > 0) || (use_ec_zap == 0))	/* forced value */
-				zt_ec_chanmap = use_ec_zap;
-			else if (rcb_card->dsp_up == 0)	/* Switch on if there is no DSP */
-				zt_ec_chanmap = -1;
-			else
-				zt_ec_chanmap = 0;
-
-
-			if (use_ec == 1)
-				*(volatile __u8 *) (rcb_card->memaddr + EC_CNTL) |= EC_ON;
-
-			if (use_ec == 0)
-				*(volatile __u8 *) (rcb_card->memaddr + EC_CNTL) &= ~EC_ON;
-
-			if (rcb_card_initialize(rcb_card)) {
-				/* set up and register span and channels */
-				printk(KERN_ERR "rcbfx %d: Unable to initialize \n", rcb_card->pos + 1);
-				rcb_card_cleaner(rcb_card,
-								 RH_KFREE | IOUNMAP | FREE_DMA | STOP_DMA | FREE_INT);
-				return -EIO;	/* had some goats EI */
+			/*
+			 * Waiting for the card, the firmware check and the DSP download
+			 *  take seconds per card, launch the cards from a work item so
+			 *  that they come up in parallel.
+			 */
+			if (!rhino_launch_queue(&rcb_launch, rcb_card->pos, &rcb_card->launchwork,
+									async_launch)) {
+				rcb_card_launch(rcb_card);
+				rhino_launch_done(&rcb_launch, rcb_card->pos, &rcb_card->launched);
 			}
 
-			printk(KERN_INFO "rcbfx %d: Starting DMA\n", rcb_card->pos + 1);
-
-			rcb_card_start_dma(rcb_card);
-
-			for (regnum = 0; regnum < P_TBL_CNT; regnum++) {
-
-				*(volatile __u8 *) (rcb_card->memaddr + PARAM_TBL + regnum) =
-					rcb_settings_default[regnum];
-			}
-
-			/* notify changes */
-			*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) = 0x01000;
-
-			for (x = 0; x < rcb_card->num_chans; x++) {
-				if (rcb_card->chanflag & (1 << x))
-					cardcount++;
-			}
-			/* let board run signaling data now */
-			/* notify changes */
-			*(volatile __u8 *) (rcb_card->memaddr + RCB_STATOUT) |= 0x01;
-			if (debug)
-				printk(KERN_DEBUG "rcbfx %d: Statout = %x\n", rcb_card->pos + 1,
-					   *(volatile __u8 *) (rcb_card->memaddr + RCB_STATOUT));
-			/* notify changes */
-			*(volatile __u32 *) (rcb_card->memaddr + RCB_TXSIGSTAT) = 0x04000;
-
-			if ((rcb_card->dev->device == PCI_DEVICE_RCB4FXO) ||
-				(rcb_card->dev->device == PCI_DEVICE_RCB24FXO) ||
-				(rcb_card->dev->device == PCI_DEVICE_RCB24FXS))
-
-				printk(KERN_NOTICE "rcbfx %d: Spotted a Rhino: %s (%d channels)\n", rcb_card->pos + 1,
-					   rcb_card->variety, cardcount);
-			else
-				printk(KERN_NOTICE "rcbfx %d: Spotted a Rhino: %s (%d modules)\n", rcb_card->pos + 1,
-					   rcb_card->variety, cardcount / 2);
-
 			res = 0;
 
 		} else					/*  if (!rcb_card) */
@@ -1862,7 +3216,47 @@ static void __devexit rcb_card_remove_one(struct pci_dev *pdev)
 {
 	struct rcb_card_t *rcb_card = pci_get_drvdata(pdev);
 	if (rcb_card) {
+		/* The launch owns the card until it is finished */
+		wait_for_completion(&rcb_card->launched);
+
+		/* Out of reach of the debugfs readers before anything is freed */
+		mutex_lock(&ifaces_mutex);
+		ifaces[rcb_card->pos] = NULL;
+		mutex_unlock(&ifaces_mutex);
+
+#ifdef CONFIG_DEBUG_FS
+		debugfs_remove_recursive(rcb_card->debugfs);
+		rcb_card->debugfs = NULL;
+#endif
+
+		if (rcb_card->tele_up) {
+			device_remove_file(&pdev->dev, &dev_attr_telemetry);
+			rcb_card->tele_up = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+			cancel_delayed_work_sync(&rcb_card->telework);
+#else
+			cancel_delayed_work(&rcb_card->telework);
+			flush_scheduled_work();
+			cancel_delayed_work(&rcb_card->telework);
+#endif
+		}
+
 		if (rcb_card->dsp_up) {
+			/* Keep the interrupt handler from queueing tone work */
+			rcb_card->dtmf_up = 0;
+			synchronize_irq(pdev->irq);
+			if (rcb_card->health_up) {
+				device_remove_file(&pdev->dev, &dev_attr_dsp_health);
+				rcb_card->health_up = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+				cancel_delayed_work_sync(&rcb_card->healthwork);
+#else
+				cancel_delayed_work(&rcb_card->healthwork);
+				flush_scheduled_work();
+				cancel_delayed_work(&rcb_card->healthwork);
+#endif
+			}
+			gpakStopCmdQueue(rcb_card, rcb_card->pos);
 			flush_workqueue(rcb_card->wq);
 			destroy_workqueue(rcb_card->wq);
 		}
@@ -1878,7 +3272,9 @@ static void __devexit rcb_card_remove_one(struct pci_dev *pdev)
 		*(volatile __u8 *) (rcb_card->memaddr + FW_COMOUT) = 0x00;
 		pci_free_consistent(pdev, DAHDI_MAX_CHUNKSIZE * 2 * rcb_card->num_chans,
 							(void *) rcb_card->writechunk, rcb_card->writedma);
-		free_irq(pdev->irq, rcb_card);
+		rhino_free_irq(rcb_card->dev, rcb_card, &rcb_card->msi);
+		tasklet_kill(&rcb_card->sig_tasklet);
+		device_remove_file(&pdev->dev, &dev_attr_irq_stats);
 		if (!rcb_card->usecount)
 			rcb_card_release(rcb_card);
 		else
@@ -1916,23 +3312,60 @@ static struct pci_driver rcb_driver = {
 static int __init rcb_card_init(void)
 {
 	int res;
+
+#ifdef CONFIG_DEBUG_FS
+	rcb_debugfs = debugfs_create_dir("rcbfx", NULL);
+	if (!IS_ERR_OR_NULL(rcb_debugfs))
+		debugfs_create_file("telemetry", S_IRUGO, rcb_debugfs, NULL, &rcb_telemetry_fops);
+#endif
+
+	rhino_launch_init(&rcb_launch, "rcbfx_launch");
+
 	res = pci_register_driver(&rcb_driver);
-	if (res)
+	if (res) {
+		rhino_launch_exit(&rcb_launch);
+#ifdef CONFIG_DEBUG_FS
+		debugfs_remove_recursive(rcb_debugfs);
+#endif
 		return -ENODEV;
+	}
+
+	/* The spans are registered once module load returns, so dahdi_cfg can follow */
+	rhino_launch_wait_all(&rcb_launch);
 	return 0;
 }
 
 static void __exit rcb_card_cleanup(void)
 {
 	pci_unregister_driver(&rcb_driver);
+	rhino_launch_exit(&rcb_launch);
+#ifdef CONFIG_DEBUG_FS
+	debugfs_remove_recursive(rcb_debugfs);
+#endif
 }
 
 module_param(force_fw, int, 0600);
 MODULE_PARM_DESC(force_fw, "Reprogram firmware regardless of version");
 module_param(debug, int, 0600);
 MODULE_PARM_DESC(debug, "1 for debugging messages");
-module_param(nlp_type, int, 0600);
+module_param_call(nlp_type, rhino_param_set_nlp, param_get_int, &nlp_type, 0600);
 MODULE_PARM_DESC(nlp_type, "0 - off, 1 - mute, 2 - rand, 3 - hoth, 4 - supp");
+module_param(ec_taps, int, 0600);
+MODULE_PARM_DESC(ec_taps, "Run the echo canceller with the tail length requested by DAHDI instead of 1024 taps");
+module_param(dsp_health, int, 0600);
+MODULE_PARM_DESC(dsp_health, "Seconds between DSP health samples, 0 to disable");
+module_param(dsp_cpu_warn, int, 0600);
+MODULE_PARM_DESC(dsp_cpu_warn, "DSP CPU load in percent that is warned about");
+module_param(dsp_recover, int, 0600);
+MODULE_PARM_DESC(dsp_recover, "Reload the DSP when it is found reset or not answering");
+module_param(async_launch, int, 0600);
+MODULE_PARM_DESC(async_launch, "Bring the cards up in parallel, module load still waits for all of them");
+module_param(sig_defer, int, 0600);
+MODULE_PARM_DESC(sig_defer, "Pass signalling changes to DAHDI from a tasklet instead of the interrupt handler");
+module_param(param_timeout, int, 0600);
+MODULE_PARM_DESC(param_timeout, "Milliseconds the blocking parameter ioctls wait for the card to take the table");
+module_param(msi, int, 0400);
+MODULE_PARM_DESC(msi, "Interrupt through MSI when the platform supports it, 0 for the shared INTx line");
 
 module_param(zt_ec_chanmap, int, 0600);
 module_param(fxs_alg_chanmap, int, 0600);
@@ -1941,11 +3374,20 @@ module_param(use_fxs_chanmap, int, 0600);
 module_param(use_fxo_chanmap, int, 0600);
 #if defined(module_param_array) && LINUX_VERSION_CODE > KERNEL_VERSION(2,6,9)
 module_param_array(lvs, int, &arr_argc, 0600);
+MODULE_PARM_DESC(lvs, "Loop voltages of the first card, the telemetry files cover every card");
 module_param_array(reg_val, int, &arr_argc, 0600);
+MODULE_PARM_DESC(reg_val, "Values of reg_addr on the first card, the telemetry files cover every card");
 #endif /* param arrays */
 module_param(battime, int, 0600);
 module_param(reg_addr, int, 0600);
+MODULE_PARM_DESC(reg_addr, "Module register sampled on every port into the telemetry");
 module_param(no_ec, int, 0600);
+module_param(ecbench, int, 0600);
+MODULE_PARM_DESC(ecbench, "Time EC enable/bypass and DSP load per tail length on the idle channels when the DSP comes up");
+module_param(dtmf, int, 0600);
+MODULE_PARM_DESC(dtmf, "Detect DTMF and fax CNG tones on the DSP (5510 DSP only)");
+module_param(dtmfmute, int, 0600);
+MODULE_PARM_DESC(dtmfmute, "Mute DTMF digits detected by the DSP on channels that report tones");
 
 MODULE_DESCRIPTION("Rhino Equipment Modular Analog Interface Driver " RHINOPKGVER);
 MODULE_AUTHOR
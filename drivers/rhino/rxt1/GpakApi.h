@@ -262,6 +262,131 @@ extern gpakAlgControlStat_t gpakAlgControl(struct rxt1_card_t *rxt1_card,	/* Car
 	);
 
 
+/* Asynchronous command descriptor. The caller owns it and must not touch it
+ * from the moment it is queued until its pDone callback has been run. */
+#define GPAK_CMD_MAX_WORDS 36	/* largest queued command/reply (words) */
+
+typedef struct gpakCmd gpakCmd_t;
+typedef void (*gpakCmdDone_t) (gpakCmd_t * pCmd);
+
+struct gpakCmd {
+	struct list_head Node;		/* link in the DSP's command queue */
+	DSP_WORD MsgBuffer[GPAK_CMD_MAX_WORDS];	/* command, then reply message */
+	DSP_WORD CmdLength;			/* length of command message (octets) */
+	DSP_WORD ReplyType;			/* required type of reply message */
+	DSP_WORD ReplyLength;		/* required length of reply message (octets) */
+	int ReplyCheckType;			/* reply check type */
+	DSP_WORD ReplyCheckValue;	/* reply check value */
+	unsigned int RcvLength;		/* received reply length (0 = failure) */
+	gpakCmdDone_t pDone;		/* completion callback, process context */
+	void *pContext;				/* caller's data for pDone */
+	ktime_t QueuedAt;			/* when the command was queued */
+};
+
+/* Command execution statistics of a DSP. */
+typedef struct {
+	unsigned long Commands;		/* commands transacted */
+	unsigned long Failures;		/* commands without a valid reply */
+	unsigned long long TotalNs;	/* total time spent in transactions */
+	unsigned int MaxNs;			/* longest transaction */
+	unsigned long Queued;		/* commands run from the queue */
+	unsigned long long QueuedNs;	/* total time from queueing to completion */
+	unsigned int QueuedMaxNs;	/* longest time from queueing to completion */
+} gpakCmdStats_t;
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakAttachDsps - Allocate the host state of a card's DSPs.
+ * gpakDetachDsps - Release it.
+ *
+ * FUNCTION
+ *  The host keeps interface parameters, statistics and a command queue for
+ *  every DSP. They are allocated per card for the NumDsps DSPs whose
+ *  identifiers start at FirstDspId; G.PAK calls for any other DSP Identifier
+ *  fail as an invalid DSP.
+ *
+ * RETURNS
+ *  gpakAttachDsps: 0 on success, a negative errno value otherwise.
+ *
+ */
+extern int gpakAttachDsps(struct rxt1_card_t *rxt1_card,	/* Card containing the DSPs */
+						  unsigned short int FirstDspId,	// DSP Identifier of the first DSP
+						  unsigned short int NumDsps	// number of DSPs on the card
+	);
+
+extern void gpakDetachDsps(struct rxt1_card_t *rxt1_card	/* Card containing the DSPs */
+	);
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakStartCmdQueue - Enable the asynchronous command queue of a DSP.
+ * gpakStopCmdQueue - Disable it, failing all commands still pending.
+ *
+ * FUNCTION
+ *  Queued commands are transacted in order, one at a time, from a work item
+ *  on the specified workqueue.
+ *
+ * RETURNS
+ *  gpakStartCmdQueue: 0 on success, a negative errno value otherwise.
+ *
+ */
+extern int gpakStartCmdQueue(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
+							 unsigned short int DspId,	// DSP identifier
+							 struct workqueue_struct *pWorkQueue	// queue running the commands
+	);
+
+extern void gpakStopCmdQueue(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
+							 unsigned short int DspId	// DSP identifier
+	);
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakQueueAlgControl - Queue an Algorithm control command.
+ *
+ * FUNCTION
+ *  This function builds an Algorithm control command in the caller's
+ *  descriptor and queues it. pCmd->pDone is called once the DSP replied or
+ *  the transaction failed; gpakAlgControlResult decodes the outcome.
+ *
+ * RETURNS
+ *  0 if the command was queued, a negative errno value otherwise.
+ *
+ */
+extern int gpakQueueAlgControl(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
+							   unsigned short int DspId,	// DSP identifier
+							   unsigned short int ChannelId,	// channel identifier
+							   GpakAlgCtrl_t ControlCode,	// algorithm control code
+							   gpakCmd_t * pCmd	// caller's command descriptor
+	);
+
+extern gpakAlgControlStat_t gpakAlgControlResult(gpakCmd_t * pCmd	// completed command
+	);
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakReadCmdStats - Read a DSP's command execution statistics.
+ *
+ * RETURNS
+ *  nothing
+ *
+ */
+extern void gpakReadCmdStats(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
+							 unsigned short int DspId,	// DSP identifier
+							 gpakCmdStats_t * pStats	// pointer to statistics copy
+	);
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakTestDspReset - Test and clear a DSP's reset indication.
+ *
+ * FUNCTION
+ *  A DSP is found reset when it no longer holds the status the host left in
+ *  its interface block. The first G.PAK access after that raises the
+ *  indication, which stays until it is tested.
+ *
+ * RETURNS
+ *  1 if the DSP was reset since the last test, 0 otherwise.
+ *
+ */
+extern int gpakTestDspReset(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
+							unsigned short int DspId	// DSP identifier
+	);
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 /* gpakConfigurePorts return status. */
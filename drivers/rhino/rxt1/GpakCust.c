@@ -19,7 +19,12 @@
 
 #include "GpakCust.h"
 #include "rxt1.h"
+#include <linux/version.h>
 #include <linux/delay.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/firmware.h>
 
 void __rxt1_card_wait_hpi(struct rxt1_card_t *rxt1_card, __u8 flags)
 {
@@ -66,7 +71,8 @@ void rxt1_card_hpic_set(struct rxt1_card_t *rxt1_card, __u16 hpic_data)
 	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_HPIC, hpi_lock, 0);
 }
 
-void rxt1_card_dsp_set(struct rxt1_card_t *rxt1_card, __u32 dsp_address, __u16 dsp_data)
+void rxt1_card_hpi_write(struct rxt1_card_t *rxt1_card, int dsp_num, __u32 dsp_address,
+						 __u16 dsp_data)
 {
 	__u32 u_nib;
 	unsigned int hpi_lock;
@@ -74,7 +80,7 @@ void rxt1_card_dsp_set(struct rxt1_card_t *rxt1_card, __u32 dsp_address, __u16 d
 	__u32 hcs;
 
 	spin_lock_irqsave(&rxt1_card->reglock, flags);
-	hcs = 1 << rxt1_card->dsp_sel;
+	hcs = 1 << dsp_num;
 
 	__rxt1_card_pci_out(rxt1_card, RXT1_HCS_REG + TARG_REGS, hcs, 0);
 
@@ -84,9 +90,9 @@ void rxt1_card_dsp_set(struct rxt1_card_t *rxt1_card, __u32 dsp_address, __u16 d
 
 	if (rxt1_card->dsp_type == DSP_5510) {
 		u_nib = ((dsp_address & 0xf0000) >> 16);
-		if (!(rxt1_card->hpi_xadd[rxt1_card->dsp_sel] == u_nib)) {
+		if (!(rxt1_card->hpi_xadd[dsp_num] == u_nib)) {
 
-			rxt1_card->hpi_xadd[rxt1_card->dsp_sel] = u_nib;
+			rxt1_card->hpi_xadd[dsp_num] = u_nib;
 
 			__rxt1_card_pci_out(rxt1_card, RXT1_DSP_HPIC + TARG_REGS, RXT1_XADD, 0);
 			__rxt1_card_wait_hpi(rxt1_card, RXT1_HRDY);
@@ -113,7 +119,12 @@ void rxt1_card_dsp_set(struct rxt1_card_t *rxt1_card, __u32 dsp_address, __u16 d
 	return;
 }
 
-__u16 rxt1_card_dsp_get(struct rxt1_card_t * rxt1_card, __u32 dsp_address)
+void rxt1_card_dsp_set(struct rxt1_card_t *rxt1_card, __u32 dsp_address, __u16 dsp_data)
+{
+	rxt1_card_hpi_write(rxt1_card, rxt1_card->dsp_sel, dsp_address, dsp_data);
+}
+
+__u16 rxt1_card_hpi_read(struct rxt1_card_t * rxt1_card, int dsp_num, __u32 dsp_address)
 {
 	__u32 dsp_data;
 	__u32 u_nib;
@@ -122,7 +133,7 @@ __u16 rxt1_card_dsp_get(struct rxt1_card_t * rxt1_card, __u32 dsp_address)
 	__u32 hcs;
 
 	spin_lock_irqsave(&rxt1_card->reglock, flags);
-	hcs = 1 << rxt1_card->dsp_sel;
+	hcs = 1 << dsp_num;
 	__rxt1_card_pci_out(rxt1_card, RXT1_HCS_REG + TARG_REGS, hcs, 0);
 
 	hpi_lock = __rxt1_card_pci_in(rxt1_card, TARG_REGS + RXT1_HPIC);
@@ -133,8 +144,8 @@ __u16 rxt1_card_dsp_get(struct rxt1_card_t * rxt1_card, __u32 dsp_address)
 
 		u_nib = ((dsp_address & 0xf0000) >> 16);
 
-		if (!(rxt1_card->hpi_xadd[rxt1_card->dsp_sel] == u_nib)) {
-			rxt1_card->hpi_xadd[rxt1_card->dsp_sel] = u_nib;
+		if (!(rxt1_card->hpi_xadd[dsp_num] == u_nib)) {
+			rxt1_card->hpi_xadd[dsp_num] = u_nib;
 
 			__rxt1_card_pci_out(rxt1_card, RXT1_DSP_HPIC + TARG_REGS, RXT1_XADD, 0);
 			__rxt1_card_wait_hpi(rxt1_card, RXT1_HRDY);
@@ -161,6 +172,11 @@ __u16 rxt1_card_dsp_get(struct rxt1_card_t * rxt1_card, __u32 dsp_address)
 	return dsp_data & 0xFFFF;
 }
 
+__u16 rxt1_card_dsp_get(struct rxt1_card_t * rxt1_card, __u32 dsp_address)
+{
+	return rxt1_card_hpi_read(rxt1_card, rxt1_card->dsp_sel, dsp_address);
+}
+
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * gpakReadDspMemory - Read DSP memory.
@@ -174,7 +190,7 @@ __u16 rxt1_card_dsp_get(struct rxt1_card_t * rxt1_card, __u32 dsp_address)
  *
  */
 void gpakReadDspMemory(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
-					   unsigned short int DspId,	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+					   unsigned short int DspId,	/* DSP Identifier */
 					   DSP_ADDRESS DspAddress,	/* DSP's memory address of first word */
 					   unsigned int NumWords,	/* number of contiguous words to read */
 					   DSP_WORD * pWordValues	/* pointer to array of word values variable */
@@ -191,7 +207,8 @@ void gpakReadDspMemory(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP
 
 	/* read NumWords from auto increment data register */
 	for (word_num = 0; word_num < NumWords; word_num++) {
-		pWordValues[word_num] = rxt1_card_dsp_get(rxt1_card, DspAddress + word_num);
+		pWordValues[word_num] =
+			rxt1_card_hpi_read(rxt1_card, GPAK_DSP_NUM(rxt1_card, DspId), DspAddress + word_num);
 	}
 
 	return;
@@ -210,7 +227,7 @@ void gpakReadDspMemory(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP
  *
  */
 void gpakWriteDspMemory(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
-						unsigned short int DspId,	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+						unsigned short int DspId,	/* DSP Identifier */
 						DSP_ADDRESS DspAddress,	/* DSP's memory address of first word */
 						unsigned int NumWords,	/* number of contiguous words to write */
 						DSP_WORD * pWordValues	/* pointer to array of word values to write */
@@ -227,7 +244,8 @@ void gpakWriteDspMemory(struct rxt1_card_t *rxt1_card,	/* Card containing the DS
 
 	/* read NumWords from auto increment data register */
 	for (word_num = 0; word_num < NumWords; word_num++) {
-		rxt1_card_dsp_set(rxt1_card, DspAddress + word_num, pWordValues[word_num]);
+		rxt1_card_hpi_write(rxt1_card, GPAK_DSP_NUM(rxt1_card, DspId), DspAddress + word_num,
+							pWordValues[word_num]);
 	}
 
 	return;
@@ -253,20 +271,46 @@ void gpakHostDelay(void)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakHostPoll - Delay for one reply polling interval.
+ *
+ * FUNCTION
+ *  This function sleeps for one reply polling interval. usleep_range() is
+ *  backed by an hrtimer, older kernels fall back to a jiffy based sleep.
+ *
+ * RETURNS
+ *  nothing
+ *
+ */
+void gpakHostPoll(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	usleep_range(GPAK_POLL_MIN_US, GPAK_POLL_MAX_US);
+#else
+	msleep(1);
+#endif
+	return;
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * gpakLockAccess - Lock access to the specified DSP.
  *
  * FUNCTION
- *  This function aquires exclusive access to the specified DSP.
+ *  This function aquires exclusive access to the specified DSP. Each of the
+ *  card's DSPs has its own mutex, so commands to different DSPs can be in
+ *  flight at the same time while the HPI transfers themselves are serialized
+ *  by the register lock.
  *
  * RETURNS
  *  nothing
  *
  */
 void gpakLockAccess(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
-					unsigned short int DspId	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+					unsigned short int DspId	/* DSP Identifier */
 	)
 {
+	mutex_lock(&rxt1_card->dsp_mutex[GPAK_DSP_NUM(rxt1_card, DspId)]);
 	return;
 }
 
@@ -282,62 +326,215 @@ void gpakLockAccess(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
  *
  */
 void gpakUnlockAccess(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
-					  unsigned short int DspId	/* DSP Identifier (0 to MAX_DSP_CORES-1) */
+					  unsigned short int DspId	/* DSP Identifier */
 	)
 {
+	mutex_unlock(&rxt1_card->dsp_mutex[GPAK_DSP_NUM(rxt1_card, DspId)]);
 	return;
 }
 
-extern const unsigned char _binary_GpakDsp_fw_start[];
-extern const unsigned int _binary_GpakDsp_fw_size;
-
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
- * gpakReadFile - Read a block of bytes from a G.PAK Download file.
+ * gpakParseFile - Decode a G.PAK Download file into memory records.
  *
  * FUNCTION
- *  This function reads a contiguous block of bytes from a G.PAK Download file
- *  starting at the current file position.
+ *  The file is a sequence of records, each made of a 6 byte header (memory
+ *  type, 24 bit address, 16 bit word count) followed by the big-endian record
+ *  words, and terminated by a record of type 0xFF. The first pass validates
+ *  the file and sizes the tables, the second one decodes the words into a
+ *  single allocation holding the record table and the word pool.
  *
  * RETURNS
- *  The number of bytes read from the file.
- *   -1 indicates an error occurred.
- *    0 indicates all bytes have been read (end of file)
+ *  0 on success, a negative errno value otherwise.
  *
  */
+int gpakParseFile(gpakDlImage_t *pImage,	/* image to fill in */
+				  const unsigned char *pData,	/* raw file contents */
+				  unsigned int NumBytes	/* size of the raw file */
+	)
+{
+	const unsigned char *pHdr;
+	gpakDlRecord_t *pRecord;
+	DSP_WORD *pWord;
+	unsigned int pos;
+	unsigned int rec_num;
+	unsigned int word_count;
+	unsigned int num_records = 0;
+	unsigned int num_words = 0;
+	unsigned int i;
+
+	memset(pImage, 0, sizeof(*pImage));
+
+	for (pos = 0;;) {
+		if (pos + 6 > NumBytes)
+			return -EINVAL;
+		pHdr = &pData[pos];
+		if (pHdr[0] == 0xFF)
+			break;
+		if ((pHdr[0] != 0x00) && (pHdr[0] != 0x01))
+			return -EINVAL;
+		word_count = (((unsigned int) pHdr[4]) << 8) | ((unsigned int) pHdr[5]);
+		pos += 6 + word_count * 2;
+		if (pos > NumBytes)
+			return -EINVAL;
+		num_records++;
+		num_words += word_count;
+	}
+
+	pImage->pRecords = vmalloc(num_records * sizeof(gpakDlRecord_t) +
+							   num_words * sizeof(DSP_WORD));
+	if (!pImage->pRecords)
+		return -ENOMEM;
+
+	pWord = (DSP_WORD *) (pImage->pRecords + num_records);
+	for (pos = 0, rec_num = 0; rec_num < num_records; rec_num++) {
+		pHdr = &pData[pos];
+		pRecord = &pImage->pRecords[rec_num];
+		pRecord->MemType = pHdr[0];
+		pRecord->Address = (((DSP_ADDRESS) pHdr[1]) << 16) |
+			(((DSP_ADDRESS) pHdr[2]) << 8) | ((DSP_ADDRESS) pHdr[3]);
+		pRecord->NumWords = (((unsigned int) pHdr[4]) << 8) | ((unsigned int) pHdr[5]);
+		pRecord->pWords = pWord;
+		pos += 6;
+
+		for (i = 0; i < pRecord->NumWords; i++, pos += 2)
+			*pWord++ = (((DSP_WORD) pData[pos]) << 8) | ((DSP_WORD) pData[pos + 1]);
+	}
 
+	pImage->FileSize = NumBytes;
+	pImage->NumRecords = num_records;
+	pImage->NumWords = num_words;
 
-int gpakReadFile_5510(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP       */
-					  GPAK_FILE_ID FileId,	/* G.PAK Download File Identifier  */
-					  unsigned char *pBuffer,	/* pointer to buffer for storing bytes */
-					  unsigned int NumBytes	/* number of bytes to read         */
-	)
+	return 0;
+}
+
+void gpakFreeFile(gpakDlImage_t *pImage)
 {
-	static int stats = 0;
-	int core_num;
-	int byte_num = -1;
-	int DspId;
-	static unsigned int file_pos[MAX_DSP_CORES];
-	static unsigned int file_size;
-
-	if (!(stats)) {
-		stats++;
-		for (core_num = 0; core_num < MAX_DSP_CORES; core_num++) {
-			file_pos[core_num] = 0;
-		}
+	if (pImage->pRecords)
+		vfree(pImage->pRecords);
+	memset(pImage, 0, sizeof(*pImage));
+}
+
+/* A G.PAK image loaded from userspace, shared by the cards using it */
+typedef struct gpakFwFile {
+	const char *Name;			/* firmware file name */
+	int Users;					/* references held by cards */
+	int Status;					/* 0 once decoded, or why it is not */
+	struct completion Done;		/* completed once the load has ended */
+	gpakDlImage_t Image;		/* decoded image */
+} gpakFwFile_t;
 
-		file_size = (unsigned int) &_binary_GpakDsp_fw_size;
+/* Serializes the reference counts and load starts of all images */
+static DEFINE_MUTEX(gpak_fw_mutex);
+
+static void gpakFileLoaded(const struct firmware *fw, void *context)
+{
+	gpakFwFile_t *pFile = context;
 
-		printk("R%dT1[%d]: G168 DSP App file size = %d 0x%X\n", rxt1_card->numspans,
-			   rxt1_card->num, file_size, file_size);
+	if (fw == NULL)
+		pFile->Status = -ENOENT;
+	else {
+		pFile->Status = gpakParseFile(&pFile->Image, fw->data, fw->size);
+		release_firmware(fw);
 	}
 
-	DspId = rxt1_card->dsp_sel + rxt1_card->num * 4;
+	if (pFile->Status)
+		printk(KERN_ERR "RXT1: Unable to load %s (%d)\n", pFile->Name, pFile->Status);
+	else
+		printk(KERN_DEBUG "RXT1: %s size = %d, %d records, %d words\n", pFile->Name,
+			   pFile->Image.FileSize, pFile->Image.NumRecords, pFile->Image.NumWords);
 
-	for (byte_num = 0; byte_num < NumBytes; byte_num++) {
-		if ((file_size - 1) >= file_pos[DspId]) {
-			pBuffer[byte_num] = _binary_GpakDsp_fw_start[file_pos[DspId]++];
+	complete_all(&pFile->Done);
+}
+
+/*
+ * Take a reference to an image. The first reference starts loading it in
+ *  the background, the raw file is released as soon as it is decoded.
+ */
+static void gpakRequestFile(gpakFwFile_t *pFile, struct device *dev)
+{
+	int res;
+
+	mutex_lock(&gpak_fw_mutex);
+	if (pFile->Users++ == 0) {
+		init_completion(&pFile->Done);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+		res = request_firmware_nowait(THIS_MODULE, 1, pFile->Name, dev, GFP_KERNEL, pFile,
+									  gpakFileLoaded);
+#else
+		res = request_firmware_nowait(THIS_MODULE, 1, pFile->Name, dev, pFile,
+									  gpakFileLoaded);
+#endif
+		if (res) {
+			printk(KERN_ERR "RXT1: Unable to request %s (%d)\n", pFile->Name, res);
+			pFile->Status = res;
+			complete_all(&pFile->Done);
 		}
 	}
+	mutex_unlock(&gpak_fw_mutex);
+}
+
+/*
+ * Drop a reference to an image, the last one frees it. The load is waited
+ *  for while the reference is still held, so no new load can reinitialize
+ *  the completion and other cards are not held up on the mutex meanwhile.
+ */
+static void gpakReleaseFile(gpakFwFile_t *pFile)
+{
+	wait_for_completion(&pFile->Done);
+
+	mutex_lock(&gpak_fw_mutex);
+	if (--pFile->Users == 0)
+		gpakFreeFile(&pFile->Image);
+	mutex_unlock(&gpak_fw_mutex);
+}
+
+/* Wait for an image the caller holds a reference to */
+static const gpakDlImage_t *gpakWaitFile(gpakFwFile_t *pFile)
+{
+	int users;
+
+	mutex_lock(&gpak_fw_mutex);
+	users = pFile->Users;
+	mutex_unlock(&gpak_fw_mutex);
+	if (users == 0)
+		return NULL;
+
+	wait_for_completion(&pFile->Done);
+	return pFile->Status ? NULL : &pFile->Image;
+}
+
+static gpakFwFile_t gpak_app_file = { "GpakDsp.fw" };
+
+void gpakRequestFiles(struct rxt1_card_t *rxt1_card	/* Card needing the images */
+	)
+{
+	gpakRequestFile(&gpak_app_file, &rxt1_card->dev->dev);
+}
+
+void gpakReleaseFiles(struct rxt1_card_t *rxt1_card	/* Card done with the images */
+	)
+{
+	gpakReleaseFile(&gpak_app_file);
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * gpakGetFile - Get the decoded G.PAK Download file for a DSP.
+ *
+ * FUNCTION
+ *  This function waits for the image requested by gpakRequestFiles. The
+ *  image is never modified once decoded, so any number of DSPs may walk it
+ *  at the same time.
+ *
+ * RETURNS
+ *  Pointer to the shared decoded image, or NULL if it is not available.
+ *
+ */
+const gpakDlImage_t *gpakGetFile_5510(struct rxt1_card_t *rxt1_card,	/* Card containing the DSP */
+									  GPAK_FILE_ID FileId	/* G.PAK Download File Identifier */
+	)
+{
+	if (FileId != app_file)
+		return NULL;
 
-	return byte_num;
+	return gpakWaitFile(&gpak_app_file);
 }
@@ -67,11 +67,17 @@
 #include <linux/types.h>
 #include <linux/delay.h>
 #include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
 
 #include <dahdi/kernel.h>
 #include <dahdi/user.h>
 
 #include <rhino/rhino_compat.h>
+#include <rhino/rhino_card.h>
 
 #define addr_t (__u32)(dma_addr_t)
 
@@ -296,6 +302,59 @@ struct rxt1_regs {
 #define MAX_RXT1_CARDS 64
 
 struct rxt1_card_t;
+struct rxt1_ec_cmd;
+struct gpakDspTable;
+
+/* DSP load and TDM errors, as sampled by the health work */
+struct rxt1_dsp_health {
+	unsigned long samples;		/* samples taken */
+	unsigned long failures;		/* samples the DSP did not answer */
+	unsigned int cpu_last;		/* CPU peak of the last second, percent */
+	unsigned int cpu_peak;		/* highest CPU peak seen */
+	unsigned int cpu_avg;		/* rolling average of cpu_last, 1/16 percent */
+	int cpu_warned;				/* CPU load warning given */
+	int fail_run;				/* samples failed in a row */
+	unsigned short int raw[5];	/* last framing and slip counters of the DSP */
+	unsigned long framing[4];	/* port 1-3 framing and DMA stop errors */
+	unsigned long slips;		/* DMA slips */
+};
+
+/* Loopback self-test phases and loops */
+#define SELFTEST_IDLE		0
+#define SELFTEST_LATENCY	1	/* waiting for the marker to come back */
+#define SELFTEST_PATTERN	2	/* checking the returned pattern */
+
+#define SELFTEST_FRAMER		0	/* framer local loop */
+#define SELFTEST_DSP		1	/* DSP serial port loop */
+
+/* Self-test state of one span, driven from the interrupt handler */
+struct rxt1_selftest {
+	int state;					/* SELFTEST_* phase */
+	int chan;					/* channel carrying the pattern */
+	unsigned int tx_samples;	/* samples sent since the start */
+	unsigned int rx_samples;	/* samples received since the start */
+	unsigned int pattern_start;	/* first sample of the pattern */
+	int latency;				/* round trip in frames, -1 until measured */
+	unsigned short int tx_prbs;	/* pattern generator */
+	unsigned short int rx_prbs;	/* last 15 bits received */
+	int rx_sync;				/* bits received into rx_prbs */
+	unsigned long bits;			/* bits checked */
+	unsigned long errors;		/* bits in error */
+};
+
+/* Outcome of the last self-test of one span */
+struct rxt1_selftest_result {
+	unsigned int runs;			/* tests run */
+	int mode;					/* SELFTEST_FRAMER or SELFTEST_DSP */
+	int chan;
+	int secs;
+	int latency;				/* round trip in frames, -1 if nothing came back */
+	unsigned long bits;
+	unsigned long errors;
+	unsigned int slips;			/* framer slips */
+	unsigned int dsp_slips;		/* slips counted by the DSP */
+	unsigned int dmamisses;		/* DMA buffers the host missed */
+};
 
 struct rxt1_span_t {
 	struct rxt1_card_t *owner;
@@ -333,6 +392,17 @@ struct rxt1_span_t {
 #endif
 	struct dahdi_chan *chans[31];	/* Individual channels */
 	struct dahdi_echocan_state *ec[31];	/* echocan state for each channel */
+	struct rxt1_ec_cmd *ec_cmd;	/* EC control command of each channel */
+	unsigned int ec_busy;		/* channels with EC control in flight */
+	unsigned int ec_reconfig;	/* channels waiting for new EC parameters */
+	unsigned int ec_bench;		/* idle channels lent to the EC bench */
+	unsigned long dtmfmask;		/* channels reporting DSP detected tones */
+	unsigned long mutemask;		/* channels muting DSP detected digits */
+	unsigned char dtmf_digit[31];	/* digit being received on each channel */
+	struct rxt1_dsp_health health;	/* health of the span's DSP */
+	unsigned int slips;			/* framer slips, while their interrupts are on */
+	struct rxt1_selftest selftest;	/* running self-test */
+	struct rxt1_selftest_result selftest_last;	/* last self-test */
 };
 
 struct rxt1_card_t {
@@ -349,10 +419,39 @@ struct rxt1_card_t {
 	int hpi_xadd[4];
 	int dsp_sel;
 	int dsp_type;
+	struct mutex dsp_mutex[4];	/* serializes G.PAK access per DSP */
+	struct gpakDspTable *gpak_dsps;	/* G.PAK host state of the DSPs */
+	spinlock_t ec_lock;			/* protects the EC control state below */
 	struct workqueue_struct *dspwq;
 	struct work_struct dspwork;
+	struct work_struct dtmfwork;	/* drains the DSPs' tone events */
+	int dtmf_up;				/* DSPs are detecting tones */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	struct work_struct healthwork;	/* samples the DSPs' health */
+#else
+	struct delayed_work healthwork;	/* samples the DSPs' health */
+#endif
+	int health_up;				/* health sampling is running */
+	int dsp_recovering;			/* DSPs are being reloaded */
+	unsigned int dsp_reload_fails;	/* reloads failed in a row */
+	unsigned int dsp_recoveries;	/* times the DSPs were reloaded */
+	unsigned int dsp_recovery_us;	/* duration of the last reload */
+	struct mutex selftest_mutex;	/* one span self-test at a time */
+	unsigned int dmamisses;		/* DMA buffers the host missed */
+	struct work_struct launchwork;	/* brings the card up after probe */
+	struct completion launched;	/* the launch has finished */
+	int msi;					/* interrupting through MSI */
+	int grouped;				/* DMA serviced by the group master's interrupt */
+	int group_check;			/* measure the DMA edge for the group */
+	ktime_t dma_stamp;			/* last DMA edge taken on the card's own interrupt */
 	unsigned int nextec[4];
 	unsigned int currec[4];
+	int ec_pending;				/* EC control commands in flight */
+	int ec_burst;				/* channels changed in the current burst */
+	ktime_t ec_start;			/* start of the current burst */
+	unsigned int ec_last_us;	/* duration of the last burst */
+	unsigned int ec_max_us;		/* longest burst */
+	wait_queue_head_t ec_wait;	/* woken when a burst completes */
 	int blinktimer;
 	int irq;					/* IRQ used by device */
 	int order;					/* Order */
@@ -391,6 +490,7 @@ struct rxt1_card_t {
 	unsigned int passno;		/* number of interrupt passes */
 	char *variety;
 	int nextbuf;
+	int dmachunks;				/* DAHDI chunks in each half of the DMA buffers */
 	int last_jiffie;
 	int last0;					/* for detecting double-missed IRQ */
 	int checktiming;			/* Set >0 to cause the timing source to be checked */
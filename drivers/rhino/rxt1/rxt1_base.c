@@ -68,6 +68,7 @@
 #include <linux/interrupt.h>
 #include <linux/spinlock.h>
 #include <asm/io.h>
+#include <asm/div64.h>
 #include <linux/workqueue.h>
 #ifdef LINUX26
 #include <linux/moduleparam.h>
@@ -125,6 +126,14 @@ static int ec_disable_2 = 0;
 static int ec_disable_3 = 0;
 static int ec_disable_4 = 0;
 static int no_ec = 0;
+static int ecbench = 0;
+static int ec_taps = 0;
+static int dtmf = 1;
+static int dtmfmute = 0;
+static int dsp_health = 10;
+static int dsp_cpu_warn = 90;
+static int dsp_recover = 1;
+static int selftest_port = SerialPort2;
 static int nlp_type = 3;
 static int porboot = 0;
 static int memloop = 0;
@@ -134,7 +143,15 @@ static int regdumped = 0;
 static int insert_idle = 0;
 static int local_loop = 0;
 static int double_buffer = 0;
-static int highestorder;
+/*
+ * DAHDI chunks per DMA interrupt.  Each half of the DMA buffers holds this
+ * many chunks, so audio waits up to dma_chunks ms in each direction instead
+ * of 1 ms: 2(dma_chunks - 1) ms more round trip, and DAHDI sees the chunks
+ * in bursts.  Needs double_buffer=1.
+ */
+static int dma_chunks = 1;
+static int async_launch = 1;
+static int msi = 1;
 static int t1e1override = 0x00;	/* -1 = jumper; 0xFF = E1 */
 static int j1mode = 0;
 static int sigmode = FRMR_MODE_NO_ADDR_CMP;
@@ -148,9 +165,13 @@ static int noburst = 1;
 static int debugslips = 0;
 static int polling = 0;
 static int gen_clk = 0;
+static int single_irq = 0;
 
 #define MAX_SpanS 16
 
+/* Failed DSP reloads in a row before the card gives up on its DSPs */
+#define DSP_RELOAD_TRIES 3
+
 #define FLAG_STARTED (1 << 0)
 #define FLAG_NMF (1 << 1)
 #define FLAG_SENDINGYELLOW (1 << 2)
@@ -597,6 +618,12 @@ static void __rxt1_card_set_timing_source(struct rxt1_card_t *rxt1_card, int uni
 										  int master, int slave);
 static void rxt1_span_check_alarms(struct rxt1_card_t *rxt1_card, int span);
 static void rxt1_span_check_sigbits(struct rxt1_card_t *rxt1_card, int span);
+static void rxt1_card_group_update(void);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void rxt1_group_bh(void *data);
+#else
+static void rxt1_group_bh(struct work_struct *data);
+#endif
 
 static int rxt1_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 							   struct dahdi_echocanparam *p,
@@ -623,6 +650,18 @@ static void rxt1_tasklet(unsigned long data);
 
 static struct rxt1_card_t *rxt1_cards[MAX_RXT1_CARDS];
 
+/* Cards on the timing cable whose DMA the timing master services, see single_irq */
+static struct rxt1_card_t *rxt1_group[MAX_RXT1_CARDS];
+static struct rxt1_card_t *rxt1_group_master;
+static DEFINE_MUTEX(rxt1_group_mutex);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static DECLARE_WORK(rxt1_group_work, rxt1_group_bh, NULL);
+#else
+static DECLARE_WORK(rxt1_group_work, rxt1_group_bh);
+#endif
+
+DEFINE_RHINO_LAUNCH(rxt1_launch, MAX_RXT1_CARDS);
+
 #define MAX_TDM_CHAN 32
 #define MAX_DTMF_DET 16
 
@@ -1067,6 +1106,38 @@ static int rxt1_dahdi_chan_dacs(struct dahdi_chan *dahdi_chan_dst,
 }
 #endif
 
+/*
+ * Switch the tone reporting of a channel. Its digits are muted in the received
+ *  audio when DAHDI asks for it, or by dtmfmute while reporting is on. The DSP
+ *  only takes a new mute setting with a fresh channel configuration, so the
+ *  channel is handed to the EC work like for new canceller parameters.
+ */
+static void rxt1_span_tonedetect(struct rxt1_card_t *rxt1_card, int span_num, int chan_num,
+								 int mode)
+{
+	struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[span_num];
+	unsigned long flags;
+	int mute;
+
+	if (mode & DAHDI_TONEDETECT_ON)
+		set_bit(chan_num, &rxt1_span->dtmfmask);
+	else
+		clear_bit(chan_num, &rxt1_span->dtmfmask);
+
+	mute = (mode & DAHDI_TONEDETECT_MUTE) || ((mode & DAHDI_TONEDETECT_ON) && dtmfmute);
+	if (mute == !!test_bit(chan_num, &rxt1_span->mutemask))
+		return;
+
+	spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+	if (mute)
+		set_bit(chan_num, &rxt1_span->mutemask);
+	else
+		clear_bit(chan_num, &rxt1_span->mutemask);
+	rxt1_span->ec_reconfig |= (1 << chan_num);
+	spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
+	queue_work(rxt1_card->dspwq, &rxt1_card->dspwork);
+}
+
 static int rxt1_dahdi_chan_ioctl(struct dahdi_chan *dahdi_chan, unsigned int cmd,
 							   unsigned long data)
 {
@@ -1091,6 +1162,13 @@ static int rxt1_dahdi_chan_ioctl(struct dahdi_chan *dahdi_chan, unsigned int cmd
 		if (copy_to_user((struct rxt1_regs *) data, &regs, regs_size))
 			return -EFAULT;
 		break;
+	case DAHDI_TONEDETECT:
+		if (get_user(x, (__user int *) data))
+			return -EFAULT;
+		if (!rxt1_card->dtmf_up)
+			return -ENOSYS;
+		rxt1_span_tonedetect(rxt1_card, dahdi_chan->span->offset, dahdi_chan->chanpos - 1, x);
+		break;
 	default:
 		return -ENOTTY;
 	}
@@ -1313,6 +1391,7 @@ static int rxt1_span_shutdown(struct dahdi_span *span)
 {
 	int span_num;
 	int wasrunning;
+	int stopped = 0;
 	unsigned long flags;
 #if DAHDI_VER >= KERNEL_VERSION(2,4,0)
 	struct rxt1_span_t *rxt1_span = container_of(span, struct rxt1_span_t, span);
@@ -1358,10 +1437,14 @@ static int rxt1_span_shutdown(struct dahdi_span *span)
 		__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS, rxt1_card->dmactrl,
 							target_regs[RXT1_DMA].iomask);
 		__rxt1_card_set_timing_source(rxt1_card, 4, 0, 0);
+		stopped = 1;
 	} else
 		rxt1_card->checktiming = 1;
 	spin_unlock_irqrestore(&rxt1_card->reglock, flags);
 
+	if (stopped)
+		rxt1_card_group_update();
+
 	/* Wait for interrupt routine to shut itself down */
 	msleep(10);
 	if (wasrunning)
@@ -1996,6 +2079,8 @@ static int __rxt1_card_findsync(struct rxt1_card_t *rxt1_card)
 	  found:
 		if ((syncnum != newsyncnum) || (syncsrc != newsyncsrc) ||
 			(newsyncspan != syncspan)) {
+			if (single_irq && (syncnum != newsyncnum))
+				schedule_work(&rxt1_group_work);
 			syncnum = newsyncnum;
 			syncsrc = newsyncsrc;
 			syncspan = newsyncspan;
@@ -2358,10 +2443,13 @@ static int rxt1_span_startup(struct dahdi_span *span)
 
 		/* this is for test -- remove */
 		rxt1_card->dmactrl |= FRMR_IMSK;
-		rxt1_card->dmactrl &= ~(DMA_IMSK);
+		if (!rxt1_card->grouped)
+			rxt1_card->dmactrl &= ~(DMA_IMSK);
 		rxt1_card->dmactrl |= (DMA_GO | FRMR_IEN);
 		__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS, rxt1_card->dmactrl,
 							target_regs[RXT1_DMA].iomask);
+		rxt1_card->group_check = single_irq && timingcable;
+		rxt1_card_group_update();
 
 		/* Startup HDLC controller too */
 		if (rxt1_span->sigchan) {
@@ -2405,6 +2493,80 @@ static int rxt1_span_startup(struct dahdi_span *span)
 #error Sorry, rxt1 does not support chunksize != 8
 #endif
 
+/* Samples of idle before the latency marker is sent */
+#define SELFTEST_MARK		64
+#define SELFTEST_MARKER		0x5a
+
+/* Next eight bits of the x^15 + x^14 + 1 test pattern */
+static inline unsigned char rxt1_selftest_prbs(unsigned short int *prbs)
+{
+	unsigned char byte = 0;
+	int bit, x;
+
+	for (x = 0; x < 8; x++) {
+		bit = ((*prbs >> 14) ^ (*prbs >> 13)) & 1;
+		*prbs = ((*prbs << 1) | bit) & 0x7fff;
+		byte = (byte << 1) | bit;
+	}
+	return byte;
+}
+
+/*
+ * Check the self-test channel of a span. The marker gives the round trip,
+ *  after that the pattern is checked bit by bit against the previous 15
+ *  bits received, so no alignment is needed. A single line error shows as
+ *  three pattern errors.
+ */
+static inline void __rxt1_span_selftest_rx(struct rxt1_span_t *rxt1_span)
+{
+	struct rxt1_selftest *st = &rxt1_span->selftest;
+	unsigned char *rxb = rxt1_span->chans[st->chan]->readchunk;
+	int samp_num, x, bit, expect;
+
+	for (samp_num = 0; samp_num < DAHDI_CHUNKSIZE; samp_num++, st->rx_samples++) {
+		if (st->state == SELFTEST_LATENCY) {
+			if ((st->rx_samples >= SELFTEST_MARK) && (rxb[samp_num] == SELFTEST_MARKER)) {
+				st->latency = st->rx_samples - SELFTEST_MARK;
+				st->pattern_start = st->tx_samples;
+				st->state = SELFTEST_PATTERN;
+			}
+			continue;
+		}
+		if (st->rx_samples < st->pattern_start + st->latency)
+			continue;
+
+		for (x = 7; x >= 0; x--) {
+			bit = (rxb[samp_num] >> x) & 1;
+			if (st->rx_sync < 15)
+				st->rx_sync++;
+			else {
+				expect = ((st->rx_prbs >> 14) ^ (st->rx_prbs >> 13)) & 1;
+				st->bits++;
+				if (bit != expect)
+					st->errors++;
+			}
+			st->rx_prbs = ((st->rx_prbs << 1) | bit) & 0x7fff;
+		}
+	}
+}
+
+/* Send idle and the marker, then the pattern, on the self-test channel */
+static inline void __rxt1_span_selftest_tx(struct rxt1_span_t *rxt1_span)
+{
+	struct rxt1_selftest *st = &rxt1_span->selftest;
+	unsigned char *txb = rxt1_span->chans[st->chan]->writechunk;
+	int samp_num;
+
+	for (samp_num = 0; samp_num < DAHDI_CHUNKSIZE; samp_num++, st->tx_samples++) {
+		if (st->state == SELFTEST_PATTERN)
+			txb[samp_num] = rxt1_selftest_prbs(&st->tx_prbs);
+		else if (st->tx_samples == SELFTEST_MARK)
+			txb[samp_num] = SELFTEST_MARKER;
+		else
+			txb[samp_num] = 0xff;
+	}
+}
+
 static inline void __rxt1_receive_span(struct rxt1_span_t *rxt1_span)
 {
 	int chan_num, samp_num;
@@ -2463,6 +2625,9 @@ static inline void __rxt1_receive_span(struct rxt1_span_t *rxt1_span)
 		}
 	}
 
+	if (unlikely(rxt1_span->selftest.state))
+		__rxt1_span_selftest_rx(rxt1_span);
+
 	dahdi_ec_span(&rxt1_span->span);
 	dahdi_receive(&rxt1_span->span);
 }
@@ -2473,6 +2638,9 @@ static inline void __rxt1_transmit_span(struct rxt1_span_t *rxt1_span)
 
 	dahdi_transmit(&rxt1_span->span);
 
+	if (unlikely(rxt1_span->selftest.state))
+		__rxt1_span_selftest_tx(rxt1_span);
+
 	if (test_pat == 1) {
 		for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
 			for (samp_num = 0; samp_num < DAHDI_CHUNKSIZE; samp_num++) {
@@ -2486,11 +2654,13 @@ static inline void __rxt1_transmit_span(struct rxt1_span_t *rxt1_span)
 	}
 }
 
-static void rxt1_card_prep_gen2(struct rxt1_card_t *rxt1_card)
+static void rxt1_card_prep_gen2(struct rxt1_card_t *rxt1_card, int chunk)
 {
 	int offset = 1;
 	int span_num;
 	int chan_num;
+	/* chunks are laid out one after the other through both halves */
+	int buf = rxt1_card->nextbuf * rxt1_card->dmachunks + chunk;
 
 	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
 		struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[span_num];
@@ -2500,10 +2670,10 @@ static void rxt1_card_prep_gen2(struct rxt1_card_t *rxt1_card)
 			if (double_buffer == 1) {
 				rxt1_span->writechunk =
 					(void *) (rxt1_card->writechunk + span_num * 32 * 2 +
-							  (rxt1_card->nextbuf * 8 * 32));
+							  (buf * 8 * 32));
 				rxt1_span->readchunk =
 					(void *) (rxt1_card->readchunk + span_num * 32 * 2 +
-							  (rxt1_card->nextbuf * 8 * 32));
+							  (buf * 8 * 32));
 
 				for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
 					struct dahdi_chan *mychans = rxt1_span->chans[chan_num];
@@ -2511,11 +2681,11 @@ static void rxt1_card_prep_gen2(struct rxt1_card_t *rxt1_card)
 					mychans->writechunk =
 						(void *) (rxt1_card->writechunk +
 								  (span_num * 32 + chan_num + offset) * 2 +
-								  (rxt1_card->nextbuf * 8 * 32));
+								  (buf * 8 * 32));
 					mychans->readchunk =
 						(void *) (rxt1_card->readchunk +
 								  (span_num * 32 + chan_num + offset) * 2 +
-								  (rxt1_card->nextbuf * 8 * 32));
+								  (buf * 8 * 32));
 				}
 			}
 
@@ -2858,6 +3028,8 @@ static inline void rxt1_span_framer_interrupt(struct rxt1_card_t *rxt1_card, int
 			rxt1_span_check_alarms(rxt1_card, span);
 	}
 
+	rxt1_span->slips += hweight8(isr3 & 0x3) + hweight8(isr4 & 0xc0);
+
 	if (!rxt1_span->span.alarms) {
 		if ((isr3 & 0x3) || (isr4 & 0xc0))
 			if (debug & DEBUG_MAIN) {
@@ -2985,98 +3157,56 @@ static inline void rxt1_span_framer_interrupt(struct rxt1_card_t *rxt1_card, int
 
 }
 
-static irqreturn_t rxt1_card_interrupt_gen2(int irq, void *dev_id)
+/* Everything done once per DAHDI chunk, the counters all run in chunks */
+static void rxt1_card_dma_chunk(struct rxt1_card_t *rxt1_card, int chunk)
 {
-	struct rxt1_card_t *rxt1_card = dev_id;
-	unsigned char cis;
 	int x, span_num, reg_num;
 	struct file *file = NULL;
 
-	unsigned int status;
-	inirq = 1;
-
-	/* Make sure it's really for us */
-	status = rxt1_card_pci_in(rxt1_card, RXT1_DMA + TARG_REGS);
-
-	/* Ignore if it's not for us */
-	if (!(status & (FRMR_ISTAT | DMA_INT))) {
-		if (unlikely(debug & DEBUG_MAIN))
-			printk(KERN_DEBUG "R%dT1[%d]: Int called with no INT status high!\n", rxt1_card->numspans, rxt1_card->num);
-		return IRQ_NONE;
-	}
-
-	if (unlikely(!rxt1_card->spansstarted)) {
-		if (status & DMA_INT)
-			__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS,
-								rxt1_card->dmactrl | DMA_ACK,
-								target_regs[RXT1_DMA].iomask);
-		if (debug & DEBUG_MAIN)
-			printk(KERN_DEBUG "R%dT1[%d]: Not prepped yet!\n", rxt1_card->numspans, rxt1_card->num);
-		return IRQ_NONE;
-	}
-
-	if (unlikely((rxt1_card->intcount < 20) && debug & DEBUG_MAIN))
-		printk(KERN_DEBUG "R%dT1[%d]: 2G: Got interrupt, status = 0x%08X, CIS = 0x%04X\n",
-			   rxt1_card->numspans, rxt1_card->num, status,
-			   __rxt1_span_framer_in(rxt1_card, 0, FRMR_CIS));
-
-	if (status & DMA_INT) {
-		rxt1_card->intcount++;
-
-		__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS, rxt1_card->dmactrl | DMA_ACK,
-							target_regs[RXT1_DMA].iomask);
-
-		if (status & BUFF_PTR) {
-			if (unlikely((rxt1_card->nextbuf == 1) && debug))
-				printk(KERN_DEBUG "R%dT1[%d]: Miss %d PTR was 1 twice\n", rxt1_card->numspans, rxt1_card->num, rxt1_card->intcount);
-			rxt1_card->nextbuf = 1;
-		} else {
-			if (unlikely((rxt1_card->nextbuf == 0) && debug))
-				printk(KERN_DEBUG "R%dT1[%d]: Miss %d PTR was 0 twice\n", rxt1_card->numspans, rxt1_card->num, rxt1_card->intcount);
-			rxt1_card->nextbuf = 0;
-		}
+	rxt1_card->intcount++;
 
-		if (unlikely((rxt1_card->intcount % 10000) == 0)) {
-			for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
-				struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[span_num];
-				unsigned int frs0 = __rxt1_span_framer_in(rxt1_card, span_num, 0x4c);
-				if (rxt1_span->span.flags & DAHDI_FLAG_RUNNING) {
-					if (frs0 & (FRMR_FRS0_LFA | FRMR_FRS0_LOS)) {
-						/* XXX TODO Stop spamming dmesg, print once per change */
-						printk(KERN_INFO "R%dT1[%d]: Span %d down - resync 0x%2X %s%s%s%s%s%s%s\n",
-							   rxt1_card->numspans, rxt1_card->num, span_num + 1, frs0,
-							   (frs0 & FRMR_FRS0_LOS ? "LOS " : ""),
-							   (frs0 & FRMR_FRS0_LFA ? "LFA " : ""),
-							   (frs0 & FRMR_FRS0_FSRF ? "FSRF " : ""),
-							   (frs0 & FRMR_FRS0_LMFA ? "LMFA " : ""),
-							   (frs0 & FRMR_FRS0_NMF ? "NMF " : ""),
-							   (frs0 & FRMR_FRS0_RRA ? "RRA " : ""),
-							   (frs0 & FRMR_FRS0_AIS ? "AIS " : ""));
+	if (unlikely((rxt1_card->intcount % 10000) == 0)) {
+		for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+			struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[span_num];
+			unsigned int frs0 = __rxt1_span_framer_in(rxt1_card, span_num, 0x4c);
+			if (rxt1_span->span.flags & DAHDI_FLAG_RUNNING) {
+				if (frs0 & (FRMR_FRS0_LFA | FRMR_FRS0_LOS)) {
+					/* XXX TODO Stop spamming dmesg, print once per change */
+					printk(KERN_INFO "R%dT1[%d]: Span %d down - resync 0x%2X %s%s%s%s%s%s%s\n",
+						   rxt1_card->numspans, rxt1_card->num, span_num + 1, frs0,
+						   (frs0 & FRMR_FRS0_LOS ? "LOS " : ""),
+						   (frs0 & FRMR_FRS0_LFA ? "LFA " : ""),
+						   (frs0 & FRMR_FRS0_FSRF ? "FSRF " : ""),
+						   (frs0 & FRMR_FRS0_LMFA ? "LMFA " : ""),
+						   (frs0 & FRMR_FRS0_NMF ? "NMF " : ""),
+						   (frs0 & FRMR_FRS0_RRA ? "RRA " : ""),
+						   (frs0 & FRMR_FRS0_AIS ? "AIS " : ""));
 #if DAHDI_VER >= KERNEL_VERSION(2,5,0)
-						rxt1_span_startup(file, &rxt1_span->span);
+					rxt1_span_startup(file, &rxt1_span->span);
 #else
-						rxt1_span_startup(&rxt1_span->span);
+					rxt1_span_startup(&rxt1_span->span);
 #endif
-					}
 				}
 			}
 		}
+	}
 
-		if (unlikely((rxt1_card->intcount > 8500) && (regdump == 1) && (regdumped == 0))) {
-			for (span_num = 0; span_num < 4; span_num++) {
-				for (reg_num = 0; reg_num < 0xba; reg_num++)
-					printk(KERN_DEBUG "R%dT1[%d]: Span %d Reg 0x%X: %s 0x%02X\n", rxt1_card->numspans, rxt1_card->num, span_num, reg_num,
-						   framer_regs[reg_num].name,
-						   __rxt1_span_framer_in(rxt1_card, span_num, reg_num));
-			}
-			regdumped = 1;
+	if (unlikely((rxt1_card->intcount > 8500) && (regdump == 1) && (regdumped == 0))) {
+		for (span_num = 0; span_num < 4; span_num++) {
+			for (reg_num = 0; reg_num < 0xba; reg_num++)
+				printk(KERN_DEBUG "R%dT1[%d]: Span %d Reg 0x%X: %s 0x%02X\n", rxt1_card->numspans, rxt1_card->num, span_num, reg_num,
+					   framer_regs[reg_num].name,
+					   __rxt1_span_framer_in(rxt1_card, span_num, reg_num));
 		}
-		rxt1_card_prep_gen2(rxt1_card);
+		regdumped = 1;
 	}
+	rxt1_card_prep_gen2(rxt1_card, chunk);
 
+	rxt1_card_do_counters(rxt1_card);
 
-	if (status & DMA_INT)
-		rxt1_card_do_counters(rxt1_card);
+	/* Drain the tone events of the DSPs every 8 chunks */
+	if (rxt1_card->dtmf_up && !(rxt1_card->intcount & 7))
+		queue_work(rxt1_card->dspwq, &rxt1_card->dtmfwork);
 
 	/* This should be something like :
 	 * x = (intcount & (7 << shift)) >> shift
@@ -3086,7 +3216,7 @@ static irqreturn_t rxt1_card_interrupt_gen2(int irq, void *dev_id)
 	 *
 	 * Look up the required response time for shift
 	 */
-	if (polling && (status & DMA_INT)) {
+	if (polling) {
 		x = rxt1_card->intcount & 15 /* 63 */ ;
 		switch (x) {
 		case 0:
@@ -3102,7 +3232,127 @@ static irqreturn_t rxt1_card_interrupt_gen2(int irq, void *dev_id)
 			rxt1_span_check_alarms(rxt1_card, x - 4);
 			break;
 		}
-	} else if (status & FRMR_ISTAT) {
+	}
+}
+
+/*
+ * Everything done once per DMA buffer, run from the card's own interrupt or
+ * for a grouped card from the group master's.
+ */
+static void rxt1_card_dma_interrupt(struct rxt1_card_t *rxt1_card, unsigned int status)
+{
+	int chunk;
+
+	__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS, rxt1_card->dmactrl | DMA_ACK,
+						target_regs[RXT1_DMA].iomask);
+
+	if (status & BUFF_PTR) {
+		if (unlikely(rxt1_card->nextbuf == 1)) {
+			rxt1_card->dmamisses++;
+			if (debug)
+				printk(KERN_DEBUG "R%dT1[%d]: Miss %d PTR was 1 twice\n", rxt1_card->numspans, rxt1_card->num, rxt1_card->intcount);
+		}
+		rxt1_card->nextbuf = 1;
+	} else {
+		if (unlikely(rxt1_card->nextbuf == 0)) {
+			rxt1_card->dmamisses++;
+			if (debug)
+				printk(KERN_DEBUG "R%dT1[%d]: Miss %d PTR was 0 twice\n", rxt1_card->numspans, rxt1_card->num, rxt1_card->intcount);
+		}
+		rxt1_card->nextbuf = 0;
+	}
+
+	for (chunk = 0; chunk < rxt1_card->dmachunks; chunk++)
+		rxt1_card_dma_chunk(rxt1_card, chunk);
+}
+
+static void rxt1_card_check_timing(struct rxt1_card_t *rxt1_card)
+{
+	if (rxt1_card->checktiming > 0)
+		__rxt1_card_set_timing_source_auto(rxt1_card);
+	if (rxt1_card->stopdma) {
+		// This is legacy, stopdma is no longer used to trigger the ISR into disabling DMA and interrupts.
+		rxt1_card->dmactrl &= ~(DMA_GO | FRMR_IEN);
+		__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS, rxt1_card->dmactrl,
+							target_regs[RXT1_DMA].iomask);
+		__rxt1_card_set_timing_source(rxt1_card, 4, 0, 0);
+		rxt1_card->stopdma = 0x0;
+
+	}
+}
+
+/* The group master's DMA interrupt stands in for the grouped cards' */
+static void rxt1_card_group_interrupt(void)
+{
+	struct rxt1_card_t *rxt1_card;
+	unsigned int status;
+	int x;
+
+	for (x = 0; x < MAX_RXT1_CARDS; x++) {
+		rxt1_card = rxt1_group[x];
+		if (!rxt1_card)
+			continue;
+		status = rxt1_card_pci_in(rxt1_card, RXT1_DMA + TARG_REGS);
+		if (status & DMA_INT) {
+			rxt1_card_dma_interrupt(rxt1_card, status);
+			rxt1_card_check_timing(rxt1_card);
+		}
+	}
+}
+
+static irqreturn_t rxt1_card_interrupt_gen2(int irq, void *dev_id)
+{
+	struct rxt1_card_t *rxt1_card = dev_id;
+	unsigned char cis;
+
+	unsigned int status;
+	inirq = 1;
+
+	/* Make sure it's really for us */
+	status = rxt1_card_pci_in(rxt1_card, RXT1_DMA + TARG_REGS);
+
+	/* Ignore if it's not for us */
+	if (!(status & (FRMR_ISTAT | DMA_INT))) {
+		if (unlikely(debug & DEBUG_MAIN))
+			printk(KERN_DEBUG "R%dT1[%d]: Int called with no INT status high!\n", rxt1_card->numspans, rxt1_card->num);
+		return IRQ_NONE;
+	}
+
+	/* A grouped card's DMA belongs to the group master's interrupt */
+	if (rxt1_card->grouped) {
+		if (!(status & FRMR_ISTAT))
+			return IRQ_NONE;
+		status &= ~DMA_INT;
+	}
+
+	/* The edges of cards about to join the group are measured against the master's */
+	if (status & DMA_INT) {
+		rxt1_card->dma_stamp = ktime_get();
+		if (unlikely(rxt1_card->group_check)) {
+			rxt1_card->group_check = 0;
+			schedule_work(&rxt1_group_work);
+		}
+	}
+
+	if (unlikely(!rxt1_card->spansstarted)) {
+		if (status & DMA_INT)
+			__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS,
+								rxt1_card->dmactrl | DMA_ACK,
+								target_regs[RXT1_DMA].iomask);
+		if (debug & DEBUG_MAIN)
+			printk(KERN_DEBUG "R%dT1[%d]: Not prepped yet!\n", rxt1_card->numspans, rxt1_card->num);
+		return IRQ_NONE;
+	}
+
+	if (unlikely((rxt1_card->intcount < 20) && debug & DEBUG_MAIN))
+		printk(KERN_DEBUG "R%dT1[%d]: 2G: Got interrupt, status = 0x%08X, CIS = 0x%04X\n",
+			   rxt1_card->numspans, rxt1_card->num, status,
+			   __rxt1_span_framer_in(rxt1_card, 0, FRMR_CIS));
+
+	if (status & DMA_INT)
+		rxt1_card_dma_interrupt(rxt1_card, status);
+
+	if ((status & FRMR_ISTAT) && !(polling && (status & DMA_INT))) {
 		cis = __rxt1_span_framer_in(rxt1_card, 0, FRMR_CIS);
 		/* all cards have span 0 */
 		if (cis & FRMR_CIS_GIS1)
@@ -3122,19 +3372,132 @@ static irqreturn_t rxt1_card_interrupt_gen2(int irq, void *dev_id)
 		}
 	}
 
-	if (rxt1_card->checktiming > 0)
-		__rxt1_card_set_timing_source_auto(rxt1_card);
-	if (rxt1_card->stopdma) {
-		// This is legacy, stopdma is no longer used to trigger the ISR into disabling DMA and interrupts.
-		rxt1_card->dmactrl &= ~(DMA_GO | FRMR_IEN);
+	if (!rxt1_card->grouped)
+		rxt1_card_check_timing(rxt1_card);
+
+	if ((status & DMA_INT) && (rxt1_card == rxt1_group_master))
+		rxt1_card_group_interrupt();
+
+	return IRQ_RETVAL(1);
+}
+
+/* Hand a card's DMA interrupt to the group master, or take it back */
+static void rxt1_card_set_grouped(struct rxt1_card_t *rxt1_card, int grouped)
+{
+	unsigned long flags;
+
+	if (rxt1_card->grouped == grouped)
+		return;
+
+	if (grouped) {
+		spin_lock_irqsave(&rxt1_card->reglock, flags);
+		rxt1_card->dmactrl |= DMA_IMSK;
 		__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS, rxt1_card->dmactrl,
 							target_regs[RXT1_DMA].iomask);
-		__rxt1_card_set_timing_source(rxt1_card, 4, 0, 0);
-		rxt1_card->stopdma = 0x0;
+		spin_unlock_irqrestore(&rxt1_card->reglock, flags);
+		synchronize_irq(rxt1_card->dev->irq);
+		rxt1_card->grouped = 1;
+		rxt1_group[rxt1_card->num] = rxt1_card;
+	} else {
+		rxt1_group[rxt1_card->num] = NULL;
+		if (rxt1_group_master)
+			synchronize_irq(rxt1_group_master->dev->irq);
+		rxt1_card->grouped = 0;
+		spin_lock_irqsave(&rxt1_card->reglock, flags);
+		rxt1_card->dmactrl &= ~DMA_IMSK;
+		__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS, rxt1_card->dmactrl,
+							target_regs[RXT1_DMA].iomask);
+		spin_unlock_irqrestore(&rxt1_card->reglock, flags);
+	}
+	if (grouped)
+		printk(KERN_INFO "R%dT1[%d]: DMA interrupt handed to card %d\n", rxt1_card->numspans,
+			   rxt1_card->num, rxt1_group_master->num);
+	else
+		printk(KERN_INFO "R%dT1[%d]: DMA interrupt back on the card\n", rxt1_card->numspans,
+			   rxt1_card->num);
+}
+
+/*
+ * A card's half of the DMA buffer has to be ready when the master's interrupt
+ *  comes, or it waits for the next one. Only a card whose last edge came at
+ *  most a quarter period before the master's is serviced from there. Both
+ *  edges have to be fresh, taken on the cards' own interrupts.
+ */
+static int rxt1_card_group_in_phase(struct rxt1_card_t *master, struct rxt1_card_t *rxt1_card)
+{
+	u32 period = rxt1_card->dmachunks * NSEC_PER_MSEC;
+	ktime_t now = ktime_get();
+	s64 diff;
+	u64 lead;
+	u32 rem;
+
+	if (master->dmachunks != rxt1_card->dmachunks)
+		return 0;
+	if ((ktime_to_ns(ktime_sub(now, master->dma_stamp)) > 2 * period) ||
+		(ktime_to_ns(ktime_sub(now, rxt1_card->dma_stamp)) > 2 * period))
+		return 0;
 
+	diff = ktime_to_ns(ktime_sub(master->dma_stamp, rxt1_card->dma_stamp));
+	if (diff >= 0) {
+		lead = diff;
+		rem = do_div(lead, period);
+	} else {
+		lead = -diff;
+		rem = do_div(lead, period);
+		if (rem)
+			rem = period - rem;
 	}
+	return rem <= period / 4;
+}
 
-	return IRQ_RETVAL(1);
+/*
+ * With single_irq on a timing cable only the card that masters the timing bus
+ *  interrupts while its DMA runs, the others are serviced from its handler on
+ *  the same edge. Cards whose buffers come due too long before the master's
+ *  edge keep their own interrupts.
+ */
+static void rxt1_card_group_update(void)
+{
+	struct rxt1_card_t *master = NULL;
+	struct rxt1_card_t *rxt1_card;
+	int x;
+
+	mutex_lock(&rxt1_group_mutex);
+	if (single_irq && timingcable && (syncnum >= 0) && (syncnum < MAX_RXT1_CARDS))
+		master = rxt1_cards[syncnum];
+	if (master && !(master->dmactrl & DMA_GO))
+		master = NULL;
+
+	/* A new master measures every card again once they are back on their own */
+	if (master != rxt1_group_master) {
+		for (x = 0; x < MAX_RXT1_CARDS; x++) {
+			rxt1_card = rxt1_cards[x];
+			if (!rxt1_card)
+				continue;
+			rxt1_card_set_grouped(rxt1_card, 0);
+			rxt1_card->group_check = (master != NULL);
+		}
+		rxt1_group_master = master;
+	}
+
+	for (x = 0; x < MAX_RXT1_CARDS; x++) {
+		rxt1_card = rxt1_cards[x];
+		if (!rxt1_card || (rxt1_card == master))
+			continue;
+		rxt1_card_set_grouped(rxt1_card, master && (rxt1_card->dmactrl & DMA_GO) &&
+							  (rxt1_card->grouped ||
+							   rxt1_card_group_in_phase(master, rxt1_card)));
+	}
+	mutex_unlock(&rxt1_group_mutex);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void rxt1_group_bh(void *data)
+#else
+static void rxt1_group_bh(struct work_struct *data)
+#endif
+{
+	rxt1_card_group_update();
 }
 
 static void rxt1_card_tsi_reset(struct rxt1_card_t *rxt1_card)
@@ -3202,7 +3565,8 @@ static int rxt1_card_hardware_init_1(struct rxt1_card_t *rxt1_card, int gen2)
 
 	/* Setup counter */
 	rxt1_card->dmactrl =
-		((DAHDI_MAX_CHUNKSIZE * 2 * 32) << 16) | (rxt1_card->dmactrl & ~DMA_LEN);
+		((DAHDI_MAX_CHUNKSIZE * 2 * 32 * rxt1_card->dmachunks) << 16) |
+		(rxt1_card->dmactrl & ~DMA_LEN);
 	if (double_buffer != 1)
 		rxt1_card->dmactrl |= 0x80;
 	__rxt1_card_pci_out(rxt1_card, RXT1_DMA + TARG_REGS, rxt1_card->dmactrl,
@@ -3318,7 +3682,7 @@ static unsigned short int rxt1_card_dsp_ping(struct rxt1_card_t *rxt1_card, int
 		return 0;
 }
 
-static int __devinit rxt1_span_download_dsp(struct rxt1_card_t *rxt1_card, int span_num)
+static int rxt1_span_download_dsp(struct rxt1_card_t *rxt1_card, int span_num)
 {
 	unsigned short int DspId;
 	gpakDownloadStatus_t dl_res = 0;
@@ -3343,7 +3707,7 @@ static int __devinit rxt1_span_download_dsp(struct rxt1_card_t *rxt1_card, int s
 		return 0;
 }
 
-static void __devinit rxt1_span_run_dsp(struct rxt1_card_t *rxt1_card, int span_num)
+static void rxt1_span_run_dsp(struct rxt1_card_t *rxt1_card, int span_num)
 {
 	unsigned long flags;
 	unsigned long hcs;
@@ -3566,9 +3930,9 @@ static void rxt1_card_dsp_show_portconfig(GpakPortConfig_t PortConfig)
 	return;
 }
 
-static int __devinit rxt1_span_dsp_configureports(struct rxt1_card_t *rxt1_card,
-												  GpakPortConfig_t PortConfig,
-												  int span_num)
+static int rxt1_span_dsp_configureports(struct rxt1_card_t *rxt1_card,
+										GpakPortConfig_t PortConfig,
+										int span_num)
 {
 	gpakConfigPortStatus_t cp_res;
 	GPAK_PortConfigStat_t cp_error;
@@ -3694,6 +4058,33 @@ static GpakChannelConfig_t Gpak_chan_config = {
 	Disabled
 };
 
+/*
+ * Channel configuration the card's DSPs run with, built from the template on
+ *  every call. Cards launch in parallel, the template itself is never written.
+ */
+static void rxt1_card_dsp_chanconfig(struct rxt1_card_t *rxt1_card, GpakChannelConfig_t *ChanConfig)
+{
+	*ChanConfig = Gpak_chan_config;
+
+	ChanConfig->EcanParametersA.EcanNlpType = nlp_type;
+	ChanConfig->EcanParametersB.EcanNlpType = nlp_type;
+
+	ChanConfig->EcanEnableB = Enabled;
+
+	ChanConfig->EcanEnableA = Disabled;
+
+	/* Tones are detected on the echo cancelled line side, only the 5510
+	 *  images carry the detectors. */
+	if (dtmf && (rxt1_card->dsp_type == DSP_5510)) {
+		ChanConfig->ToneTypesB = DTMF_tone;
+		ChanConfig->FaxCngDetB = Enabled;
+	} else {
+		ChanConfig->ToneTypesB = Null_tone;
+		ChanConfig->FaxCngDetB = Disabled;
+	}
+	ChanConfig->MuteToneB = Disabled;
+}
+
 static void rxt1_card_dsp_show_chanconfig(GpakChannelConfig_t ChanConfig)
 {
 	if (debug & DEBUG_DSP) {
@@ -3782,9 +4173,31 @@ static void rxt1_card_dsp_show_chanconfig(GpakChannelConfig_t ChanConfig)
 	return;
 }
 
-static int __devinit rxt1_span_dsp_configurechannel(struct rxt1_card_t *rxt1_card,
-													GpakChannelConfig_t ChanConfig,
-													int chan_num, int span_num)
+/* Fill in the time slots and companding of a channel on its span's DSP */
+/* Fill in the time slots, companding and digit muting of a channel on the DSP */
+static void rxt1_span_dsp_chanslots(struct rxt1_card_t *rxt1_card, int span_num, int chan_num,
+									GpakChannelConfig_t *ChanConfig)
+{
+	int slot = (span_num + 4) + (chan_num * 4);
+
+	if ((ChanConfig->ToneTypesB != Null_tone) &&
+		test_bit(chan_num, &rxt1_card->rxt1_spans[span_num]->mutemask))
+		ChanConfig->MuteToneB = Enabled;
+
+	if ((rxt1_card->rxt1_spans[span_num]->spantype == TYPE_E1) && (chan_num == 15))
+		ChanConfig->SoftwareCompand = cmpNone;
+	else
+		ChanConfig->SoftwareCompand = cmpPCMU;
+
+	ChanConfig->PcmInSlotA = slot;
+	ChanConfig->PcmOutSlotA = slot;
+	ChanConfig->PcmInSlotB = slot;
+	ChanConfig->PcmOutSlotB = slot;
+}
+
+static int rxt1_span_dsp_configurechannel(struct rxt1_card_t *rxt1_card,
+										  GpakChannelConfig_t ChanConfig,
+										  int chan_num, int span_num)
 {
 	GPAK_ChannelConfigStat_t chan_config_err;
 	gpakConfigChanStatus_t chan_conf_stat;
@@ -3796,7 +4209,7 @@ static int __devinit rxt1_span_dsp_configurechannel(struct rxt1_card_t *rxt1_car
 	DspId = (rxt1_card->num * 4) + span_num;
 
 	if ((chan_conf_stat =
-		 gpakConfigureChannel(rxt1_card, DspId, chan_num, tdmToTdm, &Gpak_chan_config,
+		 gpakConfigureChannel(rxt1_card, DspId, chan_num, tdmToTdm, &ChanConfig,
 							  &chan_config_err)))
 		printk(KERN_ERR "R%dT1[%d]: DSP %d: Chan %d G168 DSP Chan Config failed error = %d  %d\n",
 			   rxt1_card->numspans, rxt1_card->num, DspId + 1, chan_num,
@@ -3883,6 +4296,8 @@ static void rxt1_card_dsp_cpustats(struct rxt1_card_t *rxt1_card, int span_num)
 	gpakReadCpuUsageStat_t cpu_status_status;
 	unsigned short int pPeakUsage, pPrev1SecPeakUsage;
 	unsigned short int DspId;
+	gpakCmdStats_t cmd_stats;
+	u64 avg_ns;
 
 	rxt1_card_select_dsp(rxt1_card, span_num, 0);
 	DspId = (rxt1_card->num * 4) + span_num;
@@ -3897,63 +4312,199 @@ static void rxt1_card_dsp_cpustats(struct rxt1_card_t *rxt1_card, int span_num)
 			   rxt1_card->numspans, rxt1_card->num, DspId + 1, pPeakUsage,
 			   pPrev1SecPeakUsage);
 
+	gpakReadCmdStats(rxt1_card, DspId, &cmd_stats);
+	if ((debug & DEBUG_DSP) && cmd_stats.Commands) {
+		avg_ns = cmd_stats.TotalNs;
+		do_div(avg_ns, cmd_stats.Commands);
+		printk(KERN_DEBUG "R%dT1[%d]: DSP %d: %lu commands, %lu failed, avg %u us max %u us (%u cmds/s)\n",
+			   rxt1_card->numspans, rxt1_card->num, DspId + 1, cmd_stats.Commands,
+			   cmd_stats.Failures, (unsigned int) avg_ns / 1000, cmd_stats.MaxNs / 1000,
+			   avg_ns ? (unsigned int) (NSEC_PER_SEC / (unsigned int) avg_ns) : 0);
+	}
+
 	rxt1_card_unselect_dsp(rxt1_card, span_num);
 	return;
 }
 
-static void rxt1_chan_ec_enable(struct rxt1_card_t *rxt1_card, int span_num, int chan_num)
+/*
+ * Sample the CPU load and the TDM error counters of a span's DSP. The DSP
+ *  counts framing errors and slips since its last reset, so only the growth
+ *  of a counter is new. The rolling average covers about eight samples.
+ *  Returns 1 when the DSP was found reset or has stopped answering.
+ */
+static int rxt1_span_dsp_health(struct rxt1_card_t *rxt1_card, int span_num)
 {
-	gpakAlgControlStat_t a_c_stat;
-	GPAK_AlgControlStat_t a_c_err;
-	unsigned short int DspId;
-	unsigned int en_mask = ec_disable_1;
-	unsigned int mask;
+	struct rxt1_dsp_health *health = &rxt1_card->rxt1_spans[span_num]->health;
+	unsigned short int DspId = (rxt1_card->num * 4) + span_num;
+	unsigned short int peak, prev_peak, dsp_ver;
+	unsigned short int raw[5], slips[6];
+	unsigned long framing = 0, slipped = 0;
+	unsigned short int delta;
+	int x, failed;
+
+	memset(slips, 0, sizeof(slips));
+	failed = (gpakPingDsp(rxt1_card, DspId, &dsp_ver) != PngSuccess) ||
+		gpakReadCpuUsage(rxt1_card, DspId, &peak, &prev_peak) ||
+		gpakReadFramingStats(rxt1_card, DspId, &raw[0], &raw[1], &raw[2], &raw[3], &slips[0]);
+
+	if (gpakTestDspReset(rxt1_card, DspId)) {
+		printk(KERN_ERR "R%dT1[%d]: DSP %d: DSP was reset\n", rxt1_card->numspans,
+			   rxt1_card->num, DspId + 1);
+		return 1;
+	}
+	if (failed) {
+		health->failures++;
+		if (++health->fail_run < 3)
+			return 0;
+		printk(KERN_ERR "R%dT1[%d]: DSP %d: DSP stopped answering\n", rxt1_card->numspans,
+			   rxt1_card->num, DspId + 1);
+		return 1;
+	}
+	health->fail_run = 0;
+	raw[4] = slips[0] + slips[1] + slips[2] + slips[3] + slips[4] + slips[5];
+
+	if (health->samples++) {
+		for (x = 0; x < 4; x++) {
+			delta = raw[x] - health->raw[x];
+			health->framing[x] += delta;
+			framing += delta;
+		}
+		slipped = (unsigned short int) (raw[4] - health->raw[4]);
+		health->slips += slipped;
+		health->cpu_avg += (prev_peak << 1) - (health->cpu_avg >> 3);
+	} else
+		health->cpu_avg = prev_peak << 4;
+	memcpy(health->raw, raw, sizeof(raw));
+
+	health->cpu_last = prev_peak;
+	if (peak > health->cpu_peak)
+		health->cpu_peak = peak;
+	if (prev_peak > health->cpu_peak)
+		health->cpu_peak = prev_peak;
+
+	if (prev_peak >= dsp_cpu_warn) {
+		if (!health->cpu_warned)
+			printk(KERN_WARNING "R%dT1[%d]: DSP %d: CPU load at %d%%, close to saturation\n",
+				   rxt1_card->numspans, rxt1_card->num, DspId + 1, prev_peak);
+		health->cpu_warned = 1;
+	} else
+		health->cpu_warned = 0;
 
-	if (span_num == 1)
-		en_mask = ec_disable_2;
-	if (span_num == 2)
-		en_mask = ec_disable_3;
-	if (span_num == 3)
-		en_mask = ec_disable_4;
+	if (framing || slipped)
+		printk(KERN_WARNING "R%dT1[%d]: DSP %d: %lu TDM framing errors and %lu slips\n",
+			   rxt1_card->numspans, rxt1_card->num, DspId + 1, framing, slipped);
 
-	if (en_mask & (1 << chan_num)) {
-		if (debug & DEBUG_DSP)
-			printk(KERN_DEBUG "R%dT1[%d]: Echo Can NOT enable DSP %d EC Chan %d\n", rxt1_card->numspans, rxt1_card->num,
-				   span_num, chan_num);
-		return;
+	return 0;
+}
+
+/* EC control command of one channel, queued to the DSP of its span */
+struct rxt1_ec_cmd {
+	gpakCmd_t cmd;
+	struct rxt1_card_t *rxt1_card;
+	int span_num;
+	int chan_num;
+	int enable;
+	int retried;
+	GpakEcanParms_t ecan_next;	/* canceller parameters last requested */
+	GpakEcanParms_t ecan_cur;	/* canceller parameters the DSP runs with */
+	GpakEcanParms_t ecan_bench;	/* parameters to give back after the EC bench */
+};
+
+/*
+ * Give channels lent to the EC bench back the canceller parameters they had,
+ *  with the canceller bypassed as it was. Called with ec_lock held.
+ */
+static void __rxt1_span_ec_bench_return(struct rxt1_card_t *rxt1_card, int span_num,
+										unsigned int bits)
+{
+	struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[span_num];
+	int chan_num;
+
+	bits &= rxt1_span->ec_bench;
+	for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
+		if (bits & (1 << chan_num))
+			rxt1_span->ec_cmd[chan_num].ecan_next = rxt1_span->ec_cmd[chan_num].ecan_bench;
 	}
+	rxt1_card->nextec[span_num] &= ~bits;
+	rxt1_span->ec_reconfig |= bits;
+	rxt1_span->ec_bench &= ~bits;
+}
 
-	DspId = (rxt1_card->num * 4) + span_num;
+static unsigned int rxt1_span_ec_disabled(int span_num)
+{
+	if (span_num == 1)
+		return ec_disable_2;
+	if (span_num == 2)
+		return ec_disable_3;
+	if (span_num == 3)
+		return ec_disable_4;
+	return ec_disable_1;
+}
 
-	if (debug & DEBUG_DSP)
-		printk(KERN_DEBUG "R%dT1[%d]: Echo Can enable DSP %d EC Chan %d\n", rxt1_card->numspans, rxt1_card->num,
-			   span_num, chan_num);
+/*
+ * Record the outcome of a channel's EC control. When the last command of a
+ *  burst completes the time since the first one was queued is kept as the
+ *  time-to-EC-active of the burst. Called with ec_lock held.
+ */
+static void rxt1_chan_ec_complete(struct rxt1_card_t *rxt1_card, int span_num, int chan_num,
+								  int enable, gpakAlgControlStat_t a_c_stat)
+{
+	struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[span_num];
+	u64 burst_ns;
 
-	rxt1_card_select_dsp(rxt1_card, span_num, 0);
+	if (a_c_stat != AcSuccess)
+		printk(KERN_ERR "R%dT1[%d]: G168 DSP %s Alg Control failed on Span %d Chan %d res = %d\n",
+			   rxt1_card->numspans, rxt1_card->num, enable ? "Enable" : "Disable",
+			   span_num + 1, chan_num, a_c_stat);
 
-	if ((a_c_stat = gpakAlgControl(rxt1_card, DspId, chan_num, EnableEcanB, &a_c_err))) {
-		if ((a_c_stat =
-			 gpakAlgControl(rxt1_card, DspId, chan_num, EnableEcanB, &a_c_err))) {
-			if ((a_c_stat =
-				 gpakAlgControl(rxt1_card, DspId, chan_num, EnableEcanB, &a_c_err))) {
-				printk
-					(KERN_ERR "R%dT1[%d]: G168 DSP Enable Alg Control failed res = %d error = %d\n",
-					 rxt1_card->numspans, rxt1_card->num, a_c_stat, a_c_err);
-			}
-		}
+	if (enable)
+		rxt1_card->currec[span_num] |= (1 << chan_num);
+	else
+		rxt1_card->currec[span_num] &= ~(1 << chan_num);
+	rxt1_span->ec_busy &= ~(1 << chan_num);
+
+	if (--rxt1_card->ec_pending == 0) {
+		burst_ns = ktime_to_ns(ktime_sub(ktime_get(), rxt1_card->ec_start));
+		do_div(burst_ns, 1000);
+		rxt1_card->ec_last_us = (unsigned int) burst_ns;
+		if (rxt1_card->ec_last_us > rxt1_card->ec_max_us)
+			rxt1_card->ec_max_us = rxt1_card->ec_last_us;
+		if (debug & DEBUG_DSP)
+			printk(KERN_DEBUG "R%dT1[%d]: Echo Can %d channels changed in %u us (max %u us)\n",
+				   rxt1_card->numspans, rxt1_card->num, rxt1_card->ec_burst,
+				   rxt1_card->ec_last_us, rxt1_card->ec_max_us);
+		wake_up(&rxt1_card->ec_wait);
 	}
 
-	msleep(1);
+	/* The channel may have been toggled or given new parameters while its
+	 *  command was in flight */
+	if (((rxt1_card->nextec[span_num] ^ rxt1_card->currec[span_num]) | rxt1_span->ec_reconfig) &
+		(1 << chan_num))
+		queue_work(rxt1_card->dspwq, &rxt1_card->dspwork);
+}
 
-	mask = __rxt1_card_pci_in(rxt1_card, TARG_REGS + RXT1_ECA1 + (span_num * 2));
-	mask |= (1 << chan_num);
+static void rxt1_chan_ec_done(gpakCmd_t *pCmd)
+{
+	struct rxt1_ec_cmd *ec_cmd = container_of(pCmd, struct rxt1_ec_cmd, cmd);
+	struct rxt1_card_t *rxt1_card = ec_cmd->rxt1_card;
+	gpakAlgControlStat_t a_c_stat;
+	unsigned long flags;
 
-	if (debug & DEBUG_DSP)
-		printk(KERN_DEBUG "R%dT1[%d]: Echo Mask 0x%X\n", rxt1_card->numspans, rxt1_card->num, mask);
+	a_c_stat = gpakAlgControlResult(pCmd);
 
-	rxt1_card_unselect_dsp(rxt1_card, span_num);
+	/* A lost reply is worth one more attempt, a rejected command is not */
+	if ((a_c_stat == AcDspCommFailure) && !ec_cmd->retried) {
+		ec_cmd->retried = 1;
+		if (!gpakQueueAlgControl(rxt1_card, (rxt1_card->num * 4) + ec_cmd->span_num,
+								 ec_cmd->chan_num, ec_cmd->enable ? EnableEcanB : BypassEcanB,
+								 pCmd))
+			return;
+	}
 
-	return;
+	spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+	rxt1_chan_ec_complete(rxt1_card, ec_cmd->span_num, ec_cmd->chan_num, ec_cmd->enable,
+						  a_c_stat);
+	spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
 }
 
 static void rxt1_chan_ec_disable(struct rxt1_card_t *rxt1_card, int span_num,
@@ -3962,7 +4513,6 @@ static void rxt1_chan_ec_disable(struct rxt1_card_t *rxt1_card, int span_num,
 	gpakAlgControlStat_t a_c_stat;
 	GPAK_AlgControlStat_t a_c_err;
 	unsigned short int DspId;
-	unsigned int mask;
 
 	DspId = (rxt1_card->num * 4) + span_num;
 
@@ -3972,29 +4522,126 @@ static void rxt1_chan_ec_disable(struct rxt1_card_t *rxt1_card, int span_num,
 
 	rxt1_card_select_dsp(rxt1_card, span_num, 0);
 
-	if ((a_c_stat = gpakAlgControl(rxt1_card, DspId, chan_num, BypassEcanB, &a_c_err))) {
-		if ((a_c_stat =
-			 gpakAlgControl(rxt1_card, DspId, chan_num, BypassEcanB, &a_c_err))) {
-			if ((a_c_stat =
-				 gpakAlgControl(rxt1_card, DspId, chan_num, BypassEcanB, &a_c_err))) {
-				printk
-					(KERN_ERR "R%dT1[%d]: G168 DSP Disable Alg Control failed res = %d error = %d\n",
-					 rxt1_card->numspans, rxt1_card->num, a_c_stat, a_c_err);
-			}
+	if ((a_c_stat = gpakAlgControl(rxt1_card, DspId, chan_num, BypassEcanB, &a_c_err)))
+		printk(KERN_ERR "R%dT1[%d]: G168 DSP Disable Alg Control failed res = %d error = %d\n",
+			   rxt1_card->numspans, rxt1_card->num, a_c_stat, a_c_err);
+
+	rxt1_card_unselect_dsp(rxt1_card, span_num);
+
+	return;
+}
+
+/* DAHDI echo canceller parameters and the canceller settings they set */
+static const struct {
+	const char *name;
+	size_t offset;
+} rxt1_ec_params[] = {
+	{"tail", offsetof(GpakEcanParms_t, EcanTapLength)},
+	{"nlp", offsetof(GpakEcanParms_t, EcanNlpType)},
+	{"adapt", offsetof(GpakEcanParms_t, EcanAdaptEnable)},
+	{"g165", offsetof(GpakEcanParms_t, EcanG165DetEnable)},
+	{"dbl_talk", offsetof(GpakEcanParms_t, EcanDblTalkThresh)},
+	{"nlp_thresh", offsetof(GpakEcanParms_t, EcanNlpThreshold)},
+	{"nlp_conv", offsetof(GpakEcanParms_t, EcanNlpConv)},
+	{"nlp_unconv", offsetof(GpakEcanParms_t, EcanNlpUnConv)},
+	{"nlp_supp", offsetof(GpakEcanParms_t, EcanNlpMaxSuppress)},
+	{"cng_thresh", offsetof(GpakEcanParms_t, EcanCngThreshold)},
+	{"adapt_limit", offsetof(GpakEcanParms_t, EcanAdaptLimit)},
+	{"cross_corr", offsetof(GpakEcanParms_t, EcanCrossCorrLimit)},
+	{"fir_segs", offsetof(GpakEcanParms_t, EcanNumFirSegments)},
+	{"fir_seg_len", offsetof(GpakEcanParms_t, EcanFirSegmentLen)},
+};
+
+/*
+ * Build the canceller parameters of a DAHDI echo canceller request on top of
+ *  the driver defaults. The tail can only be shortened, the DSP channels are
+ *  sized for the default one.
+ */
+static int rxt1_chan_ec_params(struct rxt1_card_t *rxt1_card, struct dahdi_echocanparams *ecp,
+							   struct dahdi_echocanparam *p, GpakEcanParms_t *parms)
+{
+	GpakChannelConfig_t ChanConfig;
+	int x, y;
+
+	rxt1_card_dsp_chanconfig(rxt1_card, &ChanConfig);
+	*parms = ChanConfig.EcanParametersB;
+	if (ec_taps && ecp->tap_length)
+		parms->EcanTapLength = ecp->tap_length;
+
+	for (x = 0; x < ecp->param_count; x++) {
+		for (y = 0; y < ARRAY_SIZE(rxt1_ec_params); y++) {
+			if (!strcasecmp(p[x].name, rxt1_ec_params[y].name))
+				break;
+		}
+		if ((y == ARRAY_SIZE(rxt1_ec_params)) || (p[x].value < 0) || (p[x].value > 0x7fff) ||
+			((rxt1_ec_params[y].offset == offsetof(GpakEcanParms_t, EcanNlpType)) &&
+			 (p[x].value > RHINO_NLP_MAX))) {
+			printk(KERN_WARNING "R%dT1[%d]: invalid echo canceller parameter %s=%d; failing request\n",
+				   rxt1_card->numspans, rxt1_card->num, p[x].name, p[x].value);
+			return -EINVAL;
 		}
+		*(short int *) ((char *) parms + rxt1_ec_params[y].offset) = p[x].value;
 	}
 
-	msleep(1);
+	if ((parms->EcanTapLength == 0) ||
+		(parms->EcanTapLength > Gpak_chan_config.EcanParametersB.EcanTapLength)) {
+		printk(KERN_WARNING "R%dT1[%d]: echo canceller tail of %d taps not supported; failing request\n",
+			   rxt1_card->numspans, rxt1_card->num, parms->EcanTapLength);
+		return -EINVAL;
+	}
 
-	mask = __rxt1_card_pci_in(rxt1_card, TARG_REGS + RXT1_ECA1 + (span_num * 2));
-	mask &= ~(1 << chan_num);
+	return 0;
+}
 
-	if (debug & DEBUG_DSP)
-		printk(KERN_DEBUG "R%dT1[%d]: Echo Mask 0x%X\n", rxt1_card->numspans, rxt1_card->num, mask);
+/*
+ * Reload a channel with the canceller parameters last requested for it. The
+ *  DSP only takes them with a fresh channel configuration, which leaves the
+ *  canceller enabled. A configuration the DSP rejects is replaced by the one
+ *  the channel ran with before.
+ */
+static void rxt1_chan_ec_reconfigure(struct rxt1_card_t *rxt1_card, int span_num, int chan_num)
+{
+	struct rxt1_ec_cmd *ec_cmd = &rxt1_card->rxt1_spans[span_num]->ec_cmd[chan_num];
+	GpakChannelConfig_t ChanConfig;
+	GPAK_TearDownChanStat_t td_err;
+	GPAK_ChannelConfigStat_t cc_err;
+	gpakTearDownStatus_t td_stat;
+	gpakConfigChanStatus_t cc_stat;
+	unsigned short int DspId;
+	unsigned long flags;
 
-	rxt1_card_unselect_dsp(rxt1_card, span_num);
+	DspId = (rxt1_card->num * 4) + span_num;
 
-	return;
+	rxt1_card_dsp_chanconfig(rxt1_card, &ChanConfig);
+	spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+	ChanConfig.EcanParametersB = ec_cmd->ecan_next;
+	spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
+	rxt1_span_dsp_chanslots(rxt1_card, span_num, chan_num, &ChanConfig);
+	ChanConfig.EcanEnableB = Enabled;
+
+	if ((td_stat = gpakTearDownChannel(rxt1_card, DspId, chan_num, &td_err))) {
+		printk(KERN_ERR "R%dT1[%d]: DSP %d: Chan %d G168 DSP Tear Down failed res = %d error = %d\n",
+			   rxt1_card->numspans, rxt1_card->num, DspId + 1, chan_num, td_stat, td_err);
+		return;
+	}
+
+	cc_stat = gpakConfigureChannel(rxt1_card, DspId, chan_num, tdmToTdm, &ChanConfig, &cc_err);
+	if (cc_stat == CcsSuccess) {
+		ec_cmd->ecan_cur = ChanConfig.EcanParametersB;
+		if (debug & DEBUG_DSP)
+			printk(KERN_DEBUG "R%dT1[%d]: DSP %d: Chan %d Echo Can tail %d NLP %d\n",
+				   rxt1_card->numspans, rxt1_card->num, DspId + 1, chan_num,
+				   ec_cmd->ecan_cur.EcanTapLength, ec_cmd->ecan_cur.EcanNlpType);
+		return;
+	}
+
+	printk(KERN_ERR "R%dT1[%d]: DSP %d: Chan %d Echo Can parameters rejected res = %d error = %d\n",
+		   rxt1_card->numspans, rxt1_card->num, DspId + 1, chan_num, cc_stat, cc_err);
+	ChanConfig.EcanParametersB = ec_cmd->ecan_cur;
+	if ((cc_stat = gpakConfigureChannel(rxt1_card, DspId, chan_num, tdmToTdm, &ChanConfig,
+										&cc_err)))
+		printk(KERN_ERR "R%dT1[%d]: DSP %d: Chan %d G168 DSP Chan Config failed error = %d  %d\n",
+			   rxt1_card->numspans, rxt1_card->num, DspId + 1, chan_num, cc_err, cc_stat);
 }
 
 static int rxt1_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
@@ -4010,17 +4657,21 @@ static int rxt1_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanpara
 	struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[chan->span->offset];
 #endif
 
-	int span_num, chan_num;
+	int span_num, chan_num, res;
+	unsigned long flags;
 	const struct dahdi_echocan_ops *ops;
 	const struct dahdi_echocan_features *features;
+	struct rxt1_ec_cmd *ec_cmd;
+	GpakEcanParms_t parms;
 	ops = &my_ec_ops;
 	features = &my_ec_features;
 
-	if (ecp->param_count > 0) {
-		printk(KERN_WARNING
-			   "R%dT1[%d]: echo canceller does not support parameters; failing request\n", rxt1_card->numspans, rxt1_card->num);
-		return -EINVAL;
-	}
+	if ((res = rxt1_chan_ec_params(rxt1_card, ecp, p, &parms)))
+		return res;
+
+	/* The DSPs could not be reloaded, there is no canceller to give */
+	if (rxt1_card->dsp_reload_fails >= DSP_RELOAD_TRIES)
+		return -EIO;
 
 	span_num = chan->span->offset;
 	chan_num = chan->chanpos - 1;
@@ -4035,7 +4686,17 @@ static int rxt1_echocan_create(struct dahdi_chan *chan, struct dahdi_echocanpara
 
 		(*ec)->ops = ops;
 		(*ec)->features = *features;
+		spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+		/* The EC bench gives the channel up */
+		__rxt1_span_ec_bench_return(rxt1_card, span_num, 1 << chan_num);
 		rxt1_card->nextec[span_num] |= (1 << chan_num);
+		ec_cmd = &rxt1_span->ec_cmd[chan_num];
+		if (memcmp(&parms, &ec_cmd->ecan_next, sizeof(parms)) &&
+			!(rxt1_span_ec_disabled(span_num) & (1 << chan_num))) {
+			ec_cmd->ecan_next = parms;
+			rxt1_span->ec_reconfig |= (1 << chan_num);
+		}
+		spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
 		if (debug & DEBUG_DSP)
 			printk(KERN_DEBUG "R%dT1[%d]: echo can create nextec 0x%X\n", rxt1_card->numspans, rxt1_card->num, rxt1_card->nextec[span_num]);
 		queue_work(rxt1_card->dspwq, &rxt1_card->dspwork);
@@ -4055,6 +4716,7 @@ static void rxt1_echocan_free(struct dahdi_chan *chan, struct dahdi_echocan_stat
 	struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[chan->span->offset];
 #endif
 	int span_num, chan_num;
+	unsigned long flags;
 
 	memset(ec, 0, sizeof(*ec));
 	chan_num = chan->chanpos - 1;
@@ -4068,7 +4730,9 @@ static void rxt1_echocan_free(struct dahdi_chan *chan, struct dahdi_echocan_stat
 	if (rxt1_span->dsp_up == 1) {
 		if (debug & DEBUG_DSP)
 			printk(KERN_DEBUG "R%dT1[%d]: echo can free nextec 0x%X\n", rxt1_card->numspans, rxt1_card->num, rxt1_card->nextec[span_num]);
+		spin_lock_irqsave(&rxt1_card->ec_lock, flags);
 		rxt1_card->nextec[span_num] &= ~(1 << chan_num);
+		spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
 		queue_work(rxt1_card->dspwq, &rxt1_card->dspwork);
 	}
 }
@@ -4082,65 +4746,349 @@ static void echocan_bh(struct work_struct *data)
 {
 	struct rxt1_card_t *rxt1_card = container_of(data, struct rxt1_card_t, dspwork);
 #endif
-	unsigned int todo[4], chan_num, span_num;
+	struct rxt1_span_t *rxt1_span;
+	struct rxt1_ec_cmd *ec_cmd;
+	unsigned int todo, chan_num, span_num;
+	unsigned long flags;
+	int enable;
+
+	/* Left for the DSP recovery to replay */
+	if (rxt1_card->dsp_recovering || rxt1_card->dsp_reload_fails)
+		return;
+
+	/*
+	 * Channels with new canceller parameters are reconfigured first. That is
+	 *  done synchronously, outside ec_lock, with the channels marked busy.
+	 */
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		rxt1_span = rxt1_card->rxt1_spans[span_num];
+		spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+		todo = rxt1_span->ec_reconfig & ~rxt1_span->ec_busy;
+		rxt1_span->ec_reconfig &= ~todo;
+		rxt1_span->ec_busy |= todo;
+		spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
+		if (!todo)
+			continue;
 
+		for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
+			if (rxt1_card->dsp_recovering)
+				break;
+			if (todo & (1 << chan_num))
+				rxt1_chan_ec_reconfigure(rxt1_card, span_num, chan_num);
+		}
+
+		/* A reload in the meantime configures the channels again */
+		spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+		rxt1_span->ec_busy &= ~todo;
+		if (rxt1_card->dsp_recovering)
+			rxt1_span->ec_reconfig |= todo;
+		else
+			rxt1_card->currec[span_num] |= todo;
+		spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
+		wake_up(&rxt1_card->ec_wait);
+	}
+
+	/*
+	 * Queue the EC control of every changed channel to the span's DSP at once.
+	 *  Each DSP transacts its commands back to back from its own command queue
+	 *  and the spans' DSPs run in parallel. Commands complete in
+	 *  rxt1_chan_ec_done(), channels still in flight are left for the next pass.
+	 */
+	spin_lock_irqsave(&rxt1_card->ec_lock, flags);
 	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
-		todo[span_num] = rxt1_card->nextec[span_num] ^ rxt1_card->currec[span_num];
+		if (rxt1_card->dsp_recovering)
+			break;
+		rxt1_span = rxt1_card->rxt1_spans[span_num];
+		todo = (rxt1_card->nextec[span_num] ^ rxt1_card->currec[span_num]) & ~rxt1_span->ec_busy;
 		if (debug & DEBUG_DSP) {
 			printk(KERN_DEBUG "R%dT1[%d]: %d Span %d Echo Can control bh change 0x%X to 0x%X\n",
 				   rxt1_card->numspans, rxt1_card->num,
-				   rxt1_card->num, span_num, todo[span_num],
-				   (rxt1_card->nextec[span_num] & todo[span_num]));
-			printk(KERN_DEBUG "R%dT1[%d]: nextec 0x%X currec 0x%X\n", rxt1_card->numspans, rxt1_card->num, rxt1_card->nextec[span_num],
-				   rxt1_card->currec[span_num]);
+				   rxt1_card->num, span_num, todo,
+				   (rxt1_card->nextec[span_num] & todo));
+			printk(KERN_DEBUG "R%dT1[%d]: nextec 0x%X currec 0x%X busy 0x%X\n", rxt1_card->numspans, rxt1_card->num, rxt1_card->nextec[span_num],
+				   rxt1_card->currec[span_num], rxt1_span->ec_busy);
 		}
 
-		for (chan_num = 0; chan_num < rxt1_card->rxt1_spans[span_num]->span.channels;
-			 chan_num++) {
-			if (todo[span_num] & (1 << chan_num)) {
-				if (rxt1_card->nextec[span_num] & (1 << chan_num)) {
-					rxt1_chan_ec_enable(rxt1_card, span_num, chan_num);
-					rxt1_card->currec[span_num] |= (1 << chan_num);
-				} else {
-					rxt1_chan_ec_disable(rxt1_card, span_num, chan_num);
-					rxt1_card->currec[span_num] &= ~(1 << chan_num);
-				}
+		for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
+			if (!(todo & (1 << chan_num)))
+				continue;
+
+			enable = (rxt1_card->nextec[span_num] & (1 << chan_num)) ? 1 : 0;
+			if (enable && (rxt1_span_ec_disabled(span_num) & (1 << chan_num))) {
+				if (debug & DEBUG_DSP)
+					printk(KERN_DEBUG "R%dT1[%d]: Echo Can NOT enable DSP %d EC Chan %d\n", rxt1_card->numspans, rxt1_card->num,
+						   span_num, chan_num);
+				rxt1_card->currec[span_num] |= (1 << chan_num);
+				continue;
 			}
+
+			if (debug & DEBUG_DSP)
+				printk(KERN_DEBUG "R%dT1[%d]: Echo Can %s DSP %d EC Chan %d\n", rxt1_card->numspans, rxt1_card->num,
+					   enable ? "enable" : "disable", span_num, chan_num);
+
+			if (rxt1_card->ec_pending++ == 0) {
+				rxt1_card->ec_start = ktime_get();
+				rxt1_card->ec_burst = 0;
+			}
+			rxt1_card->ec_burst++;
+			rxt1_span->ec_busy |= (1 << chan_num);
+
+			ec_cmd = &rxt1_span->ec_cmd[chan_num];
+			ec_cmd->enable = enable;
+			ec_cmd->retried = 0;
+			if (gpakQueueAlgControl(rxt1_card, (rxt1_card->num * 4) + span_num, chan_num,
+									enable ? EnableEcanB : BypassEcanB, &ec_cmd->cmd))
+				rxt1_chan_ec_complete(rxt1_card, span_num, chan_num, enable,
+									  AcDspCommFailure);
 		}
 	}
+	spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
 }
 
-static int __devinit rxt1_card_init_dsp(struct rxt1_card_t *rxt1_card)
+static const char rxt1_dtmf_digits[] = "123A456B789C*0#D";
+
+/*
+ * Report a tone detected by a span's DSP to DAHDI. The DSP tells the start of
+ *  a digit and the end of the last one, fax CNG is only reported once it ends
+ *  and is passed on as the 'f' digit.
+ */
+static void rxt1_span_tone_event(struct rxt1_card_t *rxt1_card, int span_num,
+								 unsigned short int chan_num, GpakToneCodes_t tone)
 {
-	int loops = 0;
-	__u16 high, low;
-	int span_num, chan_num, chan_count;
-	int ifb_z = 4;
-	int strt = 4;
-	int skip = 4;
+	struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[span_num];
+	struct dahdi_chan *chan;
+	unsigned char digit;
 
-	if (debug & DEBUG_DSP)
-		printk(KERN_DEBUG "R%dT1[%d]: Reset DSP\n", rxt1_card->numspans, rxt1_card->num);
-	rxt1_card_reset_dsp(rxt1_card);
-	if (debug & DEBUG_DSP)
-		printk(KERN_DEBUG "R%dT1[%d]: Un-Reset DSP\n", rxt1_card->numspans, rxt1_card->num);
+	if (chan_num >= rxt1_span->span.channels)
+		return;
+	chan = rxt1_span->chans[chan_num];
 
-	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECB1, 0, 0);
-	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECB2, 0, 0);
-	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECB3, 0, 0);
-	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECB4, 0, 0);
+	if (debug & DEBUG_DTMF)
+		printk(KERN_DEBUG "R%dT1[%d]: Span %d Chan %d tone %d\n", rxt1_card->numspans,
+			   rxt1_card->num, span_num + 1, chan_num, tone);
 
-	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECA1, 0, 0);
-	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECA2, 0, 0);
-	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECA3, 0, 0);
-	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECA4, 0, 0);
+	if (!test_bit(chan_num, &rxt1_span->dtmfmask)) {
+		rxt1_span->dtmf_digit[chan_num] = 0;
+		return;
+	}
 
-	if (no_ec)
-		return 0;
+	if (tone <= DtmfDigitD) {
+		digit = rxt1_dtmf_digits[tone];
+		rxt1_span->dtmf_digit[chan_num] = digit;
+		dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFDOWN | digit);
+	} else if (tone == EndofMFDigit) {
+		digit = rxt1_span->dtmf_digit[chan_num];
+		rxt1_span->dtmf_digit[chan_num] = 0;
+		if (digit)
+			dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFUP | digit);
+	} else if (tone == EndofCngDigit) {
+		dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFDOWN | 'f');
+		dahdi_qevent_lock(chan, DAHDI_EVENT_DTMFUP | 'f');
+	}
+}
 
-	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_HPIC,
-						(~EC_ON & __rxt1_card_pci_in(rxt1_card, TARG_REGS + RXT1_HPIC)),
-						target_regs[RXT1_HPIC].iomask);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void dtmf_bh(void *data)
+{
+	struct rxt1_card_t *rxt1_card = data;
+#else
+static void dtmf_bh(struct work_struct *data)
+{
+	struct rxt1_card_t *rxt1_card = container_of(data, struct rxt1_card_t, dtmfwork);
+#endif
+	gpakReadEventFIFOMessageStat_t ref_stat;
+	GpakAsyncEventCode_t event_code;
+	GpakAsyncEventData_t event_data;
+	unsigned short int chan_num;
+	int span_num, events;
+
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		/* Bounded, so a DSP that keeps failing cannot hold the queue */
+		for (events = 0; events < 32; events++) {
+			/* A DSP reload stops the detection */
+			if (!rxt1_card->dtmf_up)
+				return;
+			ref_stat = gpakReadEventFIFOMessage(rxt1_card, (rxt1_card->num * 4) + span_num,
+												&chan_num, &event_code, &event_data);
+			if (ref_stat == RefInvalidEvent)
+				continue;
+			if (ref_stat != RefEventAvail)
+				break;
+			if (event_code == EventToneDetect)
+				rxt1_span_tone_event(rxt1_card, span_num, chan_num,
+									 event_data.toneEvent.ToneCode);
+		}
+	}
+}
+
+static int rxt1_card_ec_settled(struct rxt1_card_t *rxt1_card)
+{
+	int span_num;
+
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		if (rxt1_card->nextec[span_num] != rxt1_card->currec[span_num])
+			return 0;
+		if (rxt1_card->rxt1_spans[span_num]->ec_reconfig | rxt1_card->rxt1_spans[span_num]->ec_busy)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Lend the idle channels of the card to the EC bench, those neither open nor
+ *  cancelling, or give back the lent ones that have been opened since.
+ *  Called with ec_lock held. Returns the number of channels lent.
+ */
+static int __rxt1_card_ec_bench_idle(struct rxt1_card_t *rxt1_card, int lend)
+{
+	struct rxt1_span_t *rxt1_span;
+	unsigned int open;
+	int span_num, chan_num, lent = 0;
+
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		rxt1_span = rxt1_card->rxt1_spans[span_num];
+		open = 0;
+		for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
+			if (rxt1_span->span.chans[chan_num]->flags & DAHDI_FLAG_OPEN)
+				open |= (1 << chan_num);
+		}
+		if (lend) {
+			rxt1_span->ec_bench = ((1U << rxt1_span->span.channels) - 1) & ~open &
+				~rxt1_card->nextec[span_num];
+			for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
+				if (rxt1_span->ec_bench & (1 << chan_num))
+					rxt1_span->ec_cmd[chan_num].ecan_bench =
+						rxt1_span->ec_cmd[chan_num].ecan_next;
+			}
+		} else
+			__rxt1_span_ec_bench_return(rxt1_card, span_num, open);
+		lent += hweight32(rxt1_span->ec_bench);
+	}
+	return lent;
+}
+
+/*
+ * Reload the channels lent to the EC bench with the given tail length and
+ *  the canceller enabled.
+ */
+static int rxt1_card_ec_bench_taps(struct rxt1_card_t *rxt1_card, int taps)
+{
+	struct rxt1_span_t *rxt1_span;
+	GpakChannelConfig_t ChanConfig;
+	int span_num, chan_num;
+	unsigned long flags;
+
+	rxt1_card_dsp_chanconfig(rxt1_card, &ChanConfig);
+	spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+	__rxt1_card_ec_bench_idle(rxt1_card, 0);
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		rxt1_span = rxt1_card->rxt1_spans[span_num];
+		for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
+			if (!(rxt1_span->ec_bench & (1 << chan_num)))
+				continue;
+			rxt1_span->ec_cmd[chan_num].ecan_next = ChanConfig.EcanParametersB;
+			rxt1_span->ec_cmd[chan_num].ecan_next.EcanTapLength = taps;
+		}
+		rxt1_span->ec_reconfig |= rxt1_span->ec_bench;
+		rxt1_card->nextec[span_num] |= rxt1_span->ec_bench;
+	}
+	spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
+	queue_work(rxt1_card->dspwq, &rxt1_card->dspwork);
+
+	if (!wait_event_timeout(rxt1_card->ec_wait, rxt1_card_ec_settled(rxt1_card), 10 * HZ)) {
+		printk(KERN_WARNING "R%dT1[%d]: EC bench timed out reloading the channels\n",
+			   rxt1_card->numspans, rxt1_card->num);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Enable and then bypass the echo canceller on every idle channel of the card
+ *  at once and report how long each burst took to reach the DSPs. Then report
+ *  the DSP load with those cancellers running at a range of tail lengths.
+ *  Channels that are opened meanwhile are left alone from then on, the others
+ *  get their parameters back at the end.
+ */
+static void rxt1_card_ec_bench(struct rxt1_card_t *rxt1_card)
+{
+	unsigned short int peak, prev_peak;
+	int span_num, pass, taps, lent;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+	lent = __rxt1_card_ec_bench_idle(rxt1_card, 1);
+	spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
+	if (!lent) {
+		printk(KERN_INFO "R%dT1[%d]: EC bench: no idle channels\n", rxt1_card->numspans,
+			   rxt1_card->num);
+		return;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+		__rxt1_card_ec_bench_idle(rxt1_card, 0);
+		rxt1_card->ec_burst = 0;
+		rxt1_card->ec_last_us = 0;
+		for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+			if (pass == 0)
+				rxt1_card->nextec[span_num] |= rxt1_card->rxt1_spans[span_num]->ec_bench;
+			else
+				rxt1_card->nextec[span_num] &= ~rxt1_card->rxt1_spans[span_num]->ec_bench;
+		}
+		spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
+		queue_work(rxt1_card->dspwq, &rxt1_card->dspwork);
+
+		if (!wait_event_timeout(rxt1_card->ec_wait, rxt1_card_ec_settled(rxt1_card), HZ)) {
+			printk(KERN_WARNING "R%dT1[%d]: EC bench timed out\n", rxt1_card->numspans,
+				   rxt1_card->num);
+			goto done;
+		}
+		printk(KERN_INFO "R%dT1[%d]: EC bench: %s %d channels took %u us\n",
+			   rxt1_card->numspans, rxt1_card->num, pass ? "bypassing" : "enabling",
+			   rxt1_card->ec_burst, rxt1_card->ec_last_us);
+	}
+
+	for (taps = Gpak_chan_config.EcanParametersB.EcanTapLength; taps >= 128; taps /= 2) {
+		if (rxt1_card_ec_bench_taps(rxt1_card, taps))
+			goto done;
+		/* let the DSPs' one second peak cover the new load only */
+		msleep(2000);
+		for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+			if (gpakReadCpuUsage(rxt1_card, (rxt1_card->num * 4) + span_num, &peak,
+								 &prev_peak) == RcuSuccess)
+				printk(KERN_INFO "R%dT1[%d]: EC bench: DSP %d with %d taps on %d channels: CPU peak %d, last second %d\n",
+					   rxt1_card->numspans, rxt1_card->num, (rxt1_card->num * 4) + span_num + 1,
+					   taps, hweight32(rxt1_card->rxt1_spans[span_num]->ec_bench), peak,
+					   prev_peak);
+		}
+	}
+
+done:
+	spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++)
+		__rxt1_span_ec_bench_return(rxt1_card, span_num, ~0U);
+	spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
+	queue_work(rxt1_card->dspwq, &rxt1_card->dspwork);
+	if (!wait_event_timeout(rxt1_card->ec_wait, rxt1_card_ec_settled(rxt1_card), 10 * HZ))
+		printk(KERN_WARNING "R%dT1[%d]: EC bench timed out restoring the channels\n",
+			   rxt1_card->numspans, rxt1_card->num);
+}
+
+/*
+ * Download and start the DSPs of the card, then configure their ports and
+ *  channels with every echo canceller bypassed. Channels that ran before
+ *  keep the canceller parameters they had.
+ */
+static int rxt1_card_load_dsp(struct rxt1_card_t *rxt1_card)
+{
+	struct rxt1_span_t *rxt1_span;
+	GpakPortConfig_t PortConfig = Gpak_32_chan_port_config;
+	GpakChannelConfig_t ChanConfig;
+	int loops = 0;
+	__u16 high, low;
+	int span_num, chan_num, chan_count;
+	int ifb_z = 4;
 
 	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
 		if (rxt1_span_download_dsp(rxt1_card, span_num)) {
@@ -4184,82 +5132,68 @@ static int __devinit rxt1_card_init_dsp(struct rxt1_card_t *rxt1_card)
 		rxt1_card_dsp_ping(rxt1_card, span_num);
 	}
 
-	Gpak_32_chan_port_config.FirstSlotMask2 = 0x1111;
-	Gpak_32_chan_port_config.SecSlotMask2 = 0x1111;
-	Gpak_32_chan_port_config.ThirdSlotMask2 = 0x1111;
-	Gpak_32_chan_port_config.FouthSlotMask2 = 0x1111;
-	Gpak_32_chan_port_config.FifthSlotMask2 = 0x1111;
-	Gpak_32_chan_port_config.SixthSlotMask2 = 0x1111;
-	Gpak_32_chan_port_config.SevenSlotMask2 = 0x1111;
-	Gpak_32_chan_port_config.EightSlotMask2 = 0x1111;
-	Gpak_32_chan_port_config.FirstSlotMask3 = 0x1111;
-	Gpak_32_chan_port_config.SecSlotMask3 = 0x1111;
-	Gpak_32_chan_port_config.ThirdSlotMask3 = 0x1111;
-	Gpak_32_chan_port_config.FouthSlotMask3 = 0x1111;
-	Gpak_32_chan_port_config.FifthSlotMask3 = 0x1111;
-	Gpak_32_chan_port_config.SixthSlotMask3 = 0x1111;
-	Gpak_32_chan_port_config.SevenSlotMask3 = 0x1111;
-	Gpak_32_chan_port_config.EightSlotMask3 = 0x1111;
+	PortConfig.FirstSlotMask2 = 0x1111;
+	PortConfig.SecSlotMask2 = 0x1111;
+	PortConfig.ThirdSlotMask2 = 0x1111;
+	PortConfig.FouthSlotMask2 = 0x1111;
+	PortConfig.FifthSlotMask2 = 0x1111;
+	PortConfig.SixthSlotMask2 = 0x1111;
+	PortConfig.SevenSlotMask2 = 0x1111;
+	PortConfig.EightSlotMask2 = 0x1111;
+	PortConfig.FirstSlotMask3 = 0x1111;
+	PortConfig.SecSlotMask3 = 0x1111;
+	PortConfig.ThirdSlotMask3 = 0x1111;
+	PortConfig.FouthSlotMask3 = 0x1111;
+	PortConfig.FifthSlotMask3 = 0x1111;
+	PortConfig.SixthSlotMask3 = 0x1111;
+	PortConfig.SevenSlotMask3 = 0x1111;
+	PortConfig.EightSlotMask3 = 0x1111;
 
 	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
 
-		if (rxt1_span_dsp_configureports(rxt1_card, Gpak_32_chan_port_config, span_num))
+		if (rxt1_span_dsp_configureports(rxt1_card, PortConfig, span_num))
 			return -1;
 
-		Gpak_32_chan_port_config.FirstSlotMask2 <<= 1;
-		Gpak_32_chan_port_config.SecSlotMask2 <<= 1;
-		Gpak_32_chan_port_config.ThirdSlotMask2 <<= 1;
-		Gpak_32_chan_port_config.FouthSlotMask2 <<= 1;
-		Gpak_32_chan_port_config.FifthSlotMask2 <<= 1;
-		Gpak_32_chan_port_config.SixthSlotMask2 <<= 1;
-		Gpak_32_chan_port_config.SevenSlotMask2 <<= 1;
-		Gpak_32_chan_port_config.EightSlotMask2 <<= 1;
-		Gpak_32_chan_port_config.FirstSlotMask3 <<= 1;
-		Gpak_32_chan_port_config.SecSlotMask3 <<= 1;
-		Gpak_32_chan_port_config.ThirdSlotMask3 <<= 1;
-		Gpak_32_chan_port_config.FouthSlotMask3 <<= 1;
-		Gpak_32_chan_port_config.FifthSlotMask3 <<= 1;
-		Gpak_32_chan_port_config.SixthSlotMask3 <<= 1;
-		Gpak_32_chan_port_config.SevenSlotMask3 <<= 1;
-		Gpak_32_chan_port_config.EightSlotMask3 <<= 1;
-	}
-
-	Gpak_chan_config.EcanParametersA.EcanNlpType = nlp_type;
-	Gpak_chan_config.EcanParametersB.EcanNlpType = nlp_type;
-
-	Gpak_chan_config.EcanEnableB = Enabled;
-
-	Gpak_chan_config.EcanEnableA = Disabled;
+		PortConfig.FirstSlotMask2 <<= 1;
+		PortConfig.SecSlotMask2 <<= 1;
+		PortConfig.ThirdSlotMask2 <<= 1;
+		PortConfig.FouthSlotMask2 <<= 1;
+		PortConfig.FifthSlotMask2 <<= 1;
+		PortConfig.SixthSlotMask2 <<= 1;
+		PortConfig.SevenSlotMask2 <<= 1;
+		PortConfig.EightSlotMask2 <<= 1;
+		PortConfig.FirstSlotMask3 <<= 1;
+		PortConfig.SecSlotMask3 <<= 1;
+		PortConfig.ThirdSlotMask3 <<= 1;
+		PortConfig.FouthSlotMask3 <<= 1;
+		PortConfig.FifthSlotMask3 <<= 1;
+		PortConfig.SixthSlotMask3 <<= 1;
+		PortConfig.SevenSlotMask3 <<= 1;
+		PortConfig.EightSlotMask3 <<= 1;
+	}
+
 	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
 		rxt1_card_dsp_ping(rxt1_card, span_num);
 	}
 
 	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		rxt1_span = rxt1_card->rxt1_spans[span_num];
 		chan_count = 0;
 
-		for (chan_num = 0; chan_num < rxt1_card->rxt1_spans[span_num]->span.channels;
-			 chan_num++) {
+		for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
 
-			if (rxt1_card->rxt1_spans[span_num]->spantype == TYPE_E1) {
+			if (rxt1_span->spantype == TYPE_E1)
 				__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_XLATE1 + span_num,
 									0xffff7fff, 0);
-				if (chan_num != 15)
-					Gpak_chan_config.SoftwareCompand = cmpPCMU;
-				else
-					Gpak_chan_config.SoftwareCompand = cmpNone;
-			} else
-				Gpak_chan_config.SoftwareCompand = cmpPCMU;
-
 
 			msleep(1);
 			chan_count++;
-			Gpak_chan_config.PcmInSlotA = (span_num + strt) + (chan_num * skip);
-			Gpak_chan_config.PcmOutSlotA = (span_num + strt) + (chan_num * skip);
-			Gpak_chan_config.PcmInSlotB = (span_num + strt) + (chan_num * skip);
-			Gpak_chan_config.PcmOutSlotB = (span_num + strt) + (chan_num * skip);
+			rxt1_card_dsp_chanconfig(rxt1_card, &ChanConfig);
+			rxt1_span_dsp_chanslots(rxt1_card, span_num, chan_num, &ChanConfig);
+			if (rxt1_span->ec_cmd)
+				ChanConfig.EcanParametersB = rxt1_span->ec_cmd[chan_num].ecan_cur;
 
-			if (rxt1_span_dsp_configurechannel
-				(rxt1_card, Gpak_chan_config, chan_num, span_num))
+			if (rxt1_span_dsp_configurechannel(rxt1_card, ChanConfig, chan_num, span_num))
 				return -1;
 
 			rxt1_chan_ec_disable(rxt1_card, span_num, chan_num);
@@ -4270,6 +5204,410 @@ static int __devinit rxt1_card_init_dsp(struct rxt1_card_t *rxt1_card)
 
 	}
 
+	return 0;
+}
+
+/*
+ * Reload the DSPs of the card after one was found reset or stopped answering.
+ *  The spans keep running on the direct audio path meanwhile. The canceller
+ *  of every channel DAHDI has asked for is enabled again once the DSPs are up.
+ */
+static void rxt1_card_recover_dsp(struct rxt1_card_t *rxt1_card)
+{
+	struct rxt1_span_t *rxt1_span;
+	int span_num, res;
+	unsigned long flags;
+	ktime_t start;
+	u64 took_ns;
+
+	printk(KERN_WARNING "R%dT1[%d]: Reloading the DSPs\n", rxt1_card->numspans, rxt1_card->num);
+	start = ktime_get();
+
+	/* Stop all DSP traffic, EC changes are held until the DSPs are back */
+	rxt1_card->dsp_recovering = 1;
+	rxt1_card->dtmf_up = 0;
+	synchronize_irq(rxt1_card->dev->irq);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	cancel_work_sync(&rxt1_card->dspwork);
+	cancel_work_sync(&rxt1_card->dtmfwork);
+#else
+	flush_workqueue(rxt1_card->dspwq);
+#endif
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++)
+		gpakStopCmdQueue(rxt1_card, (rxt1_card->num * 4) + span_num);
+
+	spin_lock_irqsave(&rxt1_card->reglock, flags);
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_HPIC,
+						(~EC_ON & __rxt1_card_pci_in(rxt1_card, TARG_REGS + RXT1_HPIC)),
+						target_regs[RXT1_HPIC].iomask);
+	spin_unlock_irqrestore(&rxt1_card->reglock, flags);
+
+	gpakRequestFiles(rxt1_card);
+	rxt1_card_reset_dsp(rxt1_card);
+	res = rxt1_card_load_dsp(rxt1_card);
+	gpakReleaseFiles(rxt1_card);
+
+	/* Every canceller is bypassed now, the EC work enables them again */
+	spin_lock_irqsave(&rxt1_card->ec_lock, flags);
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		rxt1_span = rxt1_card->rxt1_spans[span_num];
+		rxt1_card->currec[span_num] = 0;
+		rxt1_span->ec_busy = 0;
+		rxt1_span->health.fail_run = 0;
+	}
+	rxt1_card->ec_pending = 0;
+	spin_unlock_irqrestore(&rxt1_card->ec_lock, flags);
+
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		gpakTestDspReset(rxt1_card, (rxt1_card->num * 4) + span_num);
+		if (gpakStartCmdQueue(rxt1_card, (rxt1_card->num * 4) + span_num, rxt1_card->dspwq))
+			printk(KERN_ERR "R%dT1[%d]: DSP %d: Unable to start the command queue\n",
+				   rxt1_card->numspans, rxt1_card->num, (rxt1_card->num * 4) + span_num + 1);
+	}
+
+	/* The cancellers stay bypassed, the health work tries again later */
+	if (res) {
+		if (++rxt1_card->dsp_reload_fails < DSP_RELOAD_TRIES)
+			printk(KERN_ERR "R%dT1[%d]: DSP reload failed, echo cancellation is off\n",
+				   rxt1_card->numspans, rxt1_card->num);
+		else
+			printk(KERN_ERR "R%dT1[%d]: DSP reload failed %u times, echo cancellation stays off\n",
+				   rxt1_card->numspans, rxt1_card->num, rxt1_card->dsp_reload_fails);
+		rxt1_card->dsp_recovering = 0;
+		return;
+	}
+
+	spin_lock_irqsave(&rxt1_card->reglock, flags);
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_HPIC,
+						(EC_ON | __rxt1_card_pci_in(rxt1_card, TARG_REGS + RXT1_HPIC)),
+						target_regs[RXT1_HPIC].iomask);
+	spin_unlock_irqrestore(&rxt1_card->reglock, flags);
+
+	rxt1_card->dtmf_up = dtmf && (rxt1_card->dsp_type == DSP_5510);
+	rxt1_card->dsp_reload_fails = 0;
+	rxt1_card->dsp_recovering = 0;
+	queue_work(rxt1_card->dspwq, &rxt1_card->dspwork);
+
+	took_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	do_div(took_ns, 1000);
+	rxt1_card->dsp_recovery_us = (unsigned int) took_ns;
+	rxt1_card->dsp_recoveries++;
+	printk(KERN_NOTICE "R%dT1[%d]: DSPs reloaded in %u us\n", rxt1_card->numspans,
+		   rxt1_card->num, rxt1_card->dsp_recovery_us);
+}
+
+/*
+ * The health work runs on the card's own queue. Kernels without
+ *  cancel_work_sync() flush that queue when a reload stops the command
+ *  queues, so there it stays on the shared one.
+ */
+static void rxt1_card_health_sched(struct rxt1_card_t *rxt1_card, unsigned long delay)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	queue_delayed_work(rxt1_card->dspwq, &rxt1_card->healthwork, delay);
+#else
+	schedule_delayed_work(&rxt1_card->healthwork, delay);
+#endif
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void health_bh(void *data)
+{
+	struct rxt1_card_t *rxt1_card = data;
+#else
+static void health_bh(struct work_struct *data)
+{
+	struct rxt1_card_t *rxt1_card = container_of(data, struct rxt1_card_t, healthwork.work);
+#endif
+	int span_num, failed = 0;
+
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++)
+		failed |= rxt1_span_dsp_health(rxt1_card, span_num);
+
+	if (failed && dsp_recover)
+		rxt1_card_recover_dsp(rxt1_card);
+
+	/* Back off while the reloads fail, stop once the card gave up */
+	if (rxt1_card->health_up && (dsp_health > 0) &&
+		(rxt1_card->dsp_reload_fails < DSP_RELOAD_TRIES))
+		rxt1_card_health_sched(rxt1_card, (dsp_health * HZ) << rxt1_card->dsp_reload_fails);
+}
+
+/* Command transactions of a DSP, and how long the queued ones took to complete */
+static int rxt1_dsp_cmds_show(struct rxt1_card_t *rxt1_card, unsigned short int DspId,
+							 int dsp, char *buf, int len)
+{
+	gpakCmdStats_t stats;
+	u64 avg_ns = 0, queued_ns = 0;
+
+	gpakReadCmdStats(rxt1_card, DspId, &stats);
+	if (stats.Commands) {
+		avg_ns = stats.TotalNs;
+		do_div(avg_ns, stats.Commands);
+	}
+	if (stats.Queued) {
+		queued_ns = stats.QueuedNs;
+		do_div(queued_ns, stats.Queued);
+	}
+	return scnprintf(buf + len, PAGE_SIZE - len,
+					 "dsp %d: cmds %lu failed %lu avg %u us max %u us rate %u/s "
+					 "queued %lu avg %u us max %u us\n", dsp, stats.Commands, stats.Failures,
+					 (unsigned int) avg_ns / 1000, stats.MaxNs / 1000,
+					 avg_ns ? (unsigned int) (NSEC_PER_SEC / (unsigned int) avg_ns) : 0,
+					 stats.Queued, (unsigned int) queued_ns / 1000, stats.QueuedMaxNs / 1000);
+}
+
+static ssize_t rxt1_dsp_health_show(struct device *dev, struct device_attribute *attr,
+									char *buf)
+{
+	struct rxt1_card_t *rxt1_card = pci_get_drvdata(to_pci_dev(dev));
+	struct rxt1_dsp_health *health;
+	int span_num, len = 0;
+
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		health = &rxt1_card->rxt1_spans[span_num]->health;
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+						 "dsp %d: cpu %u peak %u avg %u framing %lu %lu %lu dma %lu slips %lu "
+						 "samples %lu failed %lu\n", (rxt1_card->num * 4) + span_num + 1,
+						 health->cpu_last, health->cpu_peak, health->cpu_avg >> 4,
+						 health->framing[0], health->framing[1], health->framing[2],
+						 health->framing[3], health->slips, health->samples, health->failures);
+		len += rxt1_dsp_cmds_show(rxt1_card, (rxt1_card->num * 4) + span_num,
+								  (rxt1_card->num * 4) + span_num + 1, buf, len);
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len, "recoveries %u last %u us failed %u\n",
+					 rxt1_card->dsp_recoveries, rxt1_card->dsp_recovery_us,
+					 rxt1_card->dsp_reload_fails);
+	return len;
+}
+
+static DEVICE_ATTR(dsp_health, S_IRUGO, rxt1_dsp_health_show, NULL);
+
+/* Slips the DSP of a span has counted since its last reset */
+static unsigned int rxt1_span_dsp_slips(struct rxt1_card_t *rxt1_card, int span_num)
+{
+	unsigned short int ec1, ec2, ec3, dmaec, slips[6];
+
+	memset(slips, 0, sizeof(slips));
+	if (gpakReadFramingStats(rxt1_card, (rxt1_card->num * 4) + span_num, &ec1, &ec2, &ec3,
+							 &dmaec, &slips[0]))
+		return 0;
+	return slips[0] + slips[1] + slips[2] + slips[3] + slips[4] + slips[5];
+}
+
+/*
+ * Loop a span back in the framer or in its DSP and run a test pattern
+ *  through one channel for a number of seconds. The channel's audio is
+ *  replaced while the test runs, so it should be idle. Robbed bit
+ *  signalling shows as pattern errors on T1 channels that use it.
+ */
+static int rxt1_span_selftest(struct rxt1_card_t *rxt1_card, int span_num, int mode, int secs,
+							  int chan_num)
+{
+	struct rxt1_span_t *rxt1_span = rxt1_card->rxt1_spans[span_num];
+	struct rxt1_selftest *st = &rxt1_span->selftest;
+	struct rxt1_selftest_result *res = &rxt1_span->selftest_last;
+	unsigned short int DspId = (rxt1_card->num * 4) + span_num;
+	unsigned int imr3, imr4, lim0 = 0, slips, dmamisses, dsp_slips = 0;
+	unsigned long flags;
+	int x;
+
+	if (!(rxt1_span->span.flags & DAHDI_FLAG_RUNNING))
+		return -ENETDOWN;
+	if ((chan_num < 0) || (chan_num >= rxt1_span->span.channels))
+		return -EINVAL;
+	if ((mode == SELFTEST_DSP) &&
+		(!rxt1_span->dsp_up || rxt1_card->dsp_recovering || rxt1_card->dsp_reload_fails))
+		return -ENODEV;
+
+	mutex_lock(&rxt1_card->selftest_mutex);
+
+	if (mode == SELFTEST_DSP) {
+		dsp_slips = rxt1_span_dsp_slips(rxt1_card, span_num);
+		if (gpakControlTdmLoopBack(rxt1_card, DspId, selftest_port, Enabled) != ClbSuccess) {
+			printk(KERN_ERR "R%dT1[%d]: DSP %d: Unable to loop serial port %d\n",
+				   rxt1_card->numspans, rxt1_card->num, DspId + 1, selftest_port);
+			mutex_unlock(&rxt1_card->selftest_mutex);
+			return -EIO;
+		}
+	}
+
+	/* Loop the framer if asked to and count its slips meanwhile */
+	spin_lock_irqsave(&rxt1_card->reglock, flags);
+	if (mode == SELFTEST_FRAMER) {
+		lim0 = __rxt1_span_framer_in(rxt1_card, span_num, 0x36);
+		__rxt1_span_framer_out(rxt1_card, span_num, 0x36, lim0 | 2);
+	}
+	imr3 = __rxt1_span_framer_in(rxt1_card, span_num, 0x17);
+	imr4 = __rxt1_span_framer_in(rxt1_card, span_num, 0x18);
+	__rxt1_span_framer_out(rxt1_card, span_num, 0x17, imr3 & ~0x03);
+	__rxt1_span_framer_out(rxt1_card, span_num, 0x18, imr4 & ~0xc0);
+	slips = rxt1_span->slips;
+	dmamisses = rxt1_card->dmamisses;
+	spin_unlock_irqrestore(&rxt1_card->reglock, flags);
+
+	memset(st, 0, sizeof(*st));
+	st->chan = chan_num;
+	st->latency = -1;
+	st->tx_prbs = 0x7fff;
+	wmb();
+	st->state = SELFTEST_LATENCY;
+
+	/* The marker comes back within a few milliseconds on any working loop */
+	for (x = 0; (x < 50) && (st->state == SELFTEST_LATENCY); x++)
+		msleep(20);
+	if (st->state == SELFTEST_PATTERN)
+		msleep(secs * 1000);
+
+	st->state = SELFTEST_IDLE;
+	synchronize_irq(rxt1_card->dev->irq);
+
+	spin_lock_irqsave(&rxt1_card->reglock, flags);
+	__rxt1_span_framer_out(rxt1_card, span_num, 0x17, imr3);
+	__rxt1_span_framer_out(rxt1_card, span_num, 0x18, imr4);
+	if (mode == SELFTEST_FRAMER)
+		__rxt1_span_framer_out(rxt1_card, span_num, 0x36, lim0);
+	res->slips = rxt1_span->slips - slips;
+	res->dmamisses = rxt1_card->dmamisses - dmamisses;
+	spin_unlock_irqrestore(&rxt1_card->reglock, flags);
+
+	res->dsp_slips = 0;
+	if (mode == SELFTEST_DSP) {
+		gpakControlTdmLoopBack(rxt1_card, DspId, selftest_port, Disabled);
+		res->dsp_slips = rxt1_span_dsp_slips(rxt1_card, span_num) - dsp_slips;
+	}
+
+	res->runs++;
+	res->mode = mode;
+	res->chan = chan_num;
+	res->secs = secs;
+	res->latency = st->latency;
+	res->bits = st->bits;
+	res->errors = st->errors;
+
+	mutex_unlock(&rxt1_card->selftest_mutex);
+
+	printk(KERN_INFO "R%dT1[%d]: Span %d self-test: latency %d frames, %lu errors in %lu bits, "
+		   "%u slips\n", rxt1_card->numspans, rxt1_card->num, span_num + 1, res->latency,
+		   res->errors, res->bits, res->slips + res->dsp_slips);
+	return 0;
+}
+
+static ssize_t rxt1_selftest_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct rxt1_card_t *rxt1_card = pci_get_drvdata(to_pci_dev(dev));
+	struct rxt1_selftest_result *res;
+	ssize_t len = 0;
+	u64 ber;
+	int span_num;
+
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		res = &rxt1_card->rxt1_spans[span_num]->selftest_last;
+		if (!res->runs) {
+			len += scnprintf(buf + len, PAGE_SIZE - len, "span %d: not run\n", span_num + 1);
+			continue;
+		}
+		/* errors per 10^9 bits */
+		ber = (u64) res->errors * 1000000000;
+		if (res->bits)
+			do_div(ber, res->bits);
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+						 "span %d: %s chan %d %d s %s latency %d frames bits %lu errors %lu "
+						 "ber %llu ppb slips %u dsp slips %u dma misses %u\n", span_num + 1,
+						 (res->mode == SELFTEST_DSP) ? "dsp" : "framer", res->chan + 1,
+						 res->secs, ((res->latency >= 0) && res->bits && !res->errors &&
+									 !res->slips && !res->dsp_slips && !res->dmamisses) ?
+						 "pass" : "fail", res->latency, res->bits, res->errors,
+						 (unsigned long long) ber, res->slips, res->dsp_slips,
+						 res->dmamisses);
+	}
+	return len;
+}
+
+/* "<span> framer|dsp [seconds [channel]]" runs a self-test and waits for it */
+static ssize_t rxt1_selftest_store(struct device *dev, struct device_attribute *attr,
+								   const char *buf, size_t count)
+{
+	struct rxt1_card_t *rxt1_card = pci_get_drvdata(to_pci_dev(dev));
+	char mode[8];
+	int span_num, secs = 5, chan_num = 1, res;
+
+	if (sscanf(buf, "%d %7s %d %d", &span_num, mode, &secs, &chan_num) < 2)
+		return -EINVAL;
+	if ((span_num < 1) || (span_num > rxt1_card->numspans) || (secs < 1) || (secs > 600))
+		return -EINVAL;
+
+	if (!strcmp(mode, "framer"))
+		res = rxt1_span_selftest(rxt1_card, span_num - 1, SELFTEST_FRAMER, secs, chan_num - 1);
+	else if (!strcmp(mode, "dsp"))
+		res = rxt1_span_selftest(rxt1_card, span_num - 1, SELFTEST_DSP, secs, chan_num - 1);
+	else
+		return -EINVAL;
+
+	return res ? res : count;
+}
+
+static DEVICE_ATTR(selftest, S_IRUGO | S_IWUSR, rxt1_selftest_show, rxt1_selftest_store);
+
+static int rxt1_card_init_dsp(struct rxt1_card_t *rxt1_card)
+{
+	struct rxt1_span_t *rxt1_span;
+	GpakChannelConfig_t ChanConfig;
+	int span_num, chan_num;
+
+	if (debug & DEBUG_DSP)
+		printk(KERN_DEBUG "R%dT1[%d]: Reset DSP\n", rxt1_card->numspans, rxt1_card->num);
+	rxt1_card_reset_dsp(rxt1_card);
+	if (debug & DEBUG_DSP)
+		printk(KERN_DEBUG "R%dT1[%d]: Un-Reset DSP\n", rxt1_card->numspans, rxt1_card->num);
+
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECB1, 0, 0);
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECB2, 0, 0);
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECB3, 0, 0);
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECB4, 0, 0);
+
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECA1, 0, 0);
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECA2, 0, 0);
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECA3, 0, 0);
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_ECA4, 0, 0);
+
+	if (no_ec)
+		return 0;
+
+	__rxt1_card_pci_out(rxt1_card, TARG_REGS + RXT1_HPIC,
+						(~EC_ON & __rxt1_card_pci_in(rxt1_card, TARG_REGS + RXT1_HPIC)),
+						target_regs[RXT1_HPIC].iomask);
+
+	if (gpakAttachDsps(rxt1_card, rxt1_card->num * 4, rxt1_card->numspans)) {
+		printk(KERN_ERR "R%dT1[%d]: Unable to allocate DSP state\n", rxt1_card->numspans,
+			   rxt1_card->num);
+		return -1;
+	}
+
+	if (rxt1_card_load_dsp(rxt1_card))
+		return -1;
+
+	rxt1_card_dsp_chanconfig(rxt1_card, &ChanConfig);
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		rxt1_span = rxt1_card->rxt1_spans[span_num];
+		rxt1_span->ec_cmd = kmalloc_node(rxt1_span->span.channels * sizeof *rxt1_span->ec_cmd,
+										 GFP_KERNEL, dev_to_node(&rxt1_card->dev->dev));
+		if (rxt1_span->ec_cmd == NULL) {
+			printk(KERN_ERR "R%dT1[%d]: DSP %d: Unable to allocate EC control commands\n",
+				   rxt1_card->numspans, rxt1_card->num, (rxt1_card->num * 4) + span_num + 1);
+			return -1;
+		}
+		memset(rxt1_span->ec_cmd, 0, rxt1_span->span.channels * sizeof *rxt1_span->ec_cmd);
+		for (chan_num = 0; chan_num < rxt1_span->span.channels; chan_num++) {
+			rxt1_span->ec_cmd[chan_num].rxt1_card = rxt1_card;
+			rxt1_span->ec_cmd[chan_num].span_num = span_num;
+			rxt1_span->ec_cmd[chan_num].chan_num = chan_num;
+			rxt1_span->ec_cmd[chan_num].cmd.pDone = rxt1_chan_ec_done;
+			rxt1_span->ec_cmd[chan_num].ecan_next = ChanConfig.EcanParametersB;
+			rxt1_span->ec_cmd[chan_num].ecan_cur = ChanConfig.EcanParametersB;
+		}
+	}
+
 	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
 		rxt1_card->rxt1_spans[span_num]->dsp_up = 1;
 #if DAHDI_VER >= KERNEL_VERSION(2,4,0)
@@ -4414,14 +5752,47 @@ static int __devinit rxt1_card_init_dsp(struct rxt1_card_t *rxt1_card)
 		rxt1_card_dsp_ping(rxt1_card, span_num);
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+	/* Unbound, so the command queues of the span DSPs run in parallel */
+	rxt1_card->dspwq = alloc_workqueue("rxt1_ec", WQ_UNBOUND, 0);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	rxt1_card->dspwq = alloc_workqueue("rxt1_ec", WQ_UNBOUND | WQ_NON_REENTRANT, 0);
+#else
 	rxt1_card->dspwq = create_singlethread_workqueue("rxt1_ec");
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 	INIT_WORK(&rxt1_card->dspwork, echocan_bh, rxt1_card);
+	INIT_WORK(&rxt1_card->dtmfwork, dtmf_bh, rxt1_card);
+	INIT_WORK(&rxt1_card->healthwork, health_bh, rxt1_card);
 #else
 	INIT_WORK(&rxt1_card->dspwork, echocan_bh);
+	INIT_WORK(&rxt1_card->dtmfwork, dtmf_bh);
+	INIT_DELAYED_WORK(&rxt1_card->healthwork, health_bh);
 #endif
 
+	for (span_num = 0; span_num < rxt1_card->numspans; span_num++) {
+		if (gpakStartCmdQueue(rxt1_card, (rxt1_card->num * 4) + span_num, rxt1_card->dspwq))
+			printk(KERN_ERR "R%dT1[%d]: DSP %d: Unable to start the command queue\n",
+				   rxt1_card->numspans, rxt1_card->num, (rxt1_card->num * 4) + span_num + 1);
+	}
+
+	if (ecbench)
+		rxt1_card_ec_bench(rxt1_card);
+
+	if (dtmf && (rxt1_card->dsp_type == DSP_5510)) {
+		rxt1_card->dtmf_up = 1;
+		printk(KERN_INFO "R%dT1[%d]: DSP DTMF detection enabled\n", rxt1_card->numspans,
+			   rxt1_card->num);
+	}
+
+	if (device_create_file(&rxt1_card->dev->dev, &dev_attr_dsp_health))
+		printk(KERN_WARNING "R%dT1[%d]: Unable to export the DSP health\n",
+			   rxt1_card->numspans, rxt1_card->num);
+	rxt1_card->health_up = 1;
+	if (dsp_health > 0)
+		rxt1_card_health_sched(rxt1_card, dsp_health * HZ);
+
 	printk(KERN_NOTICE "R%dT1[%d]: G168 DSP configured successfully\n", rxt1_card->numspans, rxt1_card->num);
 
 	return (0);
@@ -4429,9 +5800,9 @@ static int __devinit rxt1_card_init_dsp(struct rxt1_card_t *rxt1_card)
 
 
 
-static int __devinit rxt1_card_launch(struct rxt1_card_t *rxt1_card)
+static int rxt1_card_launch(struct rxt1_card_t *rxt1_card)
 {
-	int span_num;
+	int span_num, dsp_fw;
   int i;
 
 	if (rxt1_card->rxt1_spans[0]->span.flags & DAHDI_FLAG_REGISTERED)
@@ -4454,6 +5825,22 @@ static int __devinit rxt1_card_launch(struct rxt1_card_t *rxt1_card)
 	for (span_num = 0; span_num < rxt1_card->numspans; span_num++)
 		rxt1_span_serial_setup(rxt1_card, span_num);
 
+	/* check to see if the hardware version is compativle with this driver version */
+	if (rxt1_card->version > 35) {
+		/* The DSP image loads while the DSPs are reset */
+		dsp_fw = !no_ec;
+		if (dsp_fw)
+			gpakRequestFiles(rxt1_card);
+		rxt1_card_init_dsp(rxt1_card);
+		if (dsp_fw)
+			gpakReleaseFiles(rxt1_card);
+	} else
+		printk(KERN_ALERT "R%dT1[%d]: Found card HW version %d, however this driver requires HW version >35. Please contact support.\n",
+			   rxt1_card->numspans, rxt1_card->num, rxt1_card->version);
+
+	/* Cards launch in parallel, but keep their span numbers in card order */
+	rhino_launch_wait_turn(&rxt1_launch, rxt1_card->num);
+
 #if DAHDI_VER < KERNEL_VERSION(2,6,0)
 	if (dahdi_register(&rxt1_card->rxt1_spans[0]->span, 0)) {
 		printk(KERN_ERR "R%dT1[%d]: Unable to register span %s\n",
@@ -4504,22 +5891,52 @@ static int __devinit rxt1_card_launch(struct rxt1_card_t *rxt1_card)
 	tasklet_init(&rxt1_card->t4_tlet, t4_tasklet, (unsigned long) rxt1_card);
 #endif
 
-	/* check to see if the hardware version is compativle with this driver version */
-	if (rxt1_card->version > 35)
-		rxt1_card_init_dsp(rxt1_card);
-	else
-		printk(KERN_ALERT "R%dT1[%d]: Found card HW version %d, however this driver requires HW version >35. Please contact support.\n",
-			   rxt1_card->numspans, rxt1_card->num, rxt1_card->version);
+	if (device_create_file(&rxt1_card->dev->dev, &dev_attr_selftest))
+		printk(KERN_WARNING "R%dT1[%d]: Unable to export the self-test\n",
+			   rxt1_card->numspans, rxt1_card->num);
 
 	return 0;
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void launch_bh(void *data)
+{
+	struct rxt1_card_t *rxt1_card = data;
+#else
+static void launch_bh(struct work_struct *data)
+{
+	struct rxt1_card_t *rxt1_card = container_of(data, struct rxt1_card_t, launchwork);
+#endif
+	ktime_t start = ktime_get();
+
+	rxt1_card_launch(rxt1_card);
+	printk(KERN_INFO "R%dT1[%d]: Launched in %u ms\n", rxt1_card->numspans, rxt1_card->num,
+		   (unsigned int) ktime_to_ms(ktime_sub(ktime_get(), start)));
+	rhino_launch_done(&rxt1_launch, rxt1_card->num, &rxt1_card->launched);
+}
+
+static int rxt1_card_request_irq(struct rxt1_card_t *rxt1_card)
+{
+	struct pci_dev *pdev = rxt1_card->dev;
+	int cpu;
+
+	if (rhino_request_irq(pdev, rxt1_card_interrupt_gen2, "rxt1", rxt1_card, msi,
+						  rxt1_card->num, &rxt1_card->msi, &cpu))
+		return -EIO;
+
+	printk(KERN_INFO "R%dT1[%d]: %s interrupt %d, node %d, cpu %d\n", rxt1_card->numspans,
+		   rxt1_card->num, rxt1_card->msi ? "MSI" : "INTx", pdev->irq,
+		   dev_to_node(&pdev->dev), cpu);
+	return 0;
+}
+
 static int __devinit rxt1_driver_init_one(struct pci_dev *pdev,
 										  const struct pci_device_id *ent)
 {
 	struct rxt1_card_t *rxt1_card;
 	struct devtype *dt;
-	int x, f;
+	int node = dev_to_node(&pdev->dev);
+	int x, y, f;
 	int basesize;
 	/* used for kmalloc'ing large blocks */
 	struct rxt1_span_t *span_block;
@@ -4540,7 +5957,8 @@ static int __devinit rxt1_driver_init_one(struct pci_dev *pdev,
 		return -ENOMEM;
 	}
 
-	rxt1_card = kmalloc(sizeof *rxt1_card, GFP_KERNEL);
+	/* Keep the card's state on the node its DMA lands on */
+	rxt1_card = kmalloc_node(sizeof *rxt1_card, GFP_KERNEL, node);
 	if (rxt1_card == NULL)
 		return -ENOMEM;
 
@@ -4558,7 +5976,7 @@ static int __devinit rxt1_driver_init_one(struct pci_dev *pdev,
 	else
 		rxt1_card->numspans = 4;
 
-	span_block = kmalloc(rxt1_card->numspans * sizeof *span_block, GFP_KERNEL);
+	span_block = kmalloc_node(rxt1_card->numspans * sizeof *span_block, GFP_KERNEL, node);
 
 	if (span_block == NULL) {
 		kfree(rxt1_card);
@@ -4576,7 +5994,26 @@ static int __devinit rxt1_driver_init_one(struct pci_dev *pdev,
 	rxt1_cards[x] = rxt1_card;
 	rxt1_card->num = x;
 	spin_lock_init(&rxt1_card->reglock);
-	basesize = DAHDI_MAX_CHUNKSIZE * 32 * 2 * 4;
+	spin_lock_init(&rxt1_card->ec_lock);
+	for (y = 0; y < 4; y++)
+		mutex_init(&rxt1_card->dsp_mutex[y]);
+	mutex_init(&rxt1_card->selftest_mutex);
+	init_waitqueue_head(&rxt1_card->ec_wait);
+	init_completion(&rxt1_card->launched);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&rxt1_card->launchwork, launch_bh, rxt1_card);
+#else
+	INIT_WORK(&rxt1_card->launchwork, launch_bh);
+#endif
+	if ((dma_chunks == 2 || dma_chunks == 4 || dma_chunks == 8) && double_buffer == 1)
+		rxt1_card->dmachunks = dma_chunks;
+	else {
+		if (dma_chunks != 1)
+			printk(KERN_WARNING "R%dT1[%d]: dma_chunks %d needs double_buffer=1 and 1, 2, 4 or 8, using 1\n",
+				   rxt1_card->numspans, rxt1_card->num, dma_chunks);
+		rxt1_card->dmachunks = 1;
+	}
+	basesize = DAHDI_MAX_CHUNKSIZE * 32 * 2 * 4 * rxt1_card->dmachunks;
 
 	rxt1_card->variety = dt->desc;
 
@@ -4648,8 +6085,8 @@ static int __devinit rxt1_driver_init_one(struct pci_dev *pdev,
 		}
 
 		chan_count = rxt1_card->rxt1_spans[x]->spantype == TYPE_E1 ? 31 : 24;
-		chan_block = kmalloc(chan_count * sizeof *chan_block, GFP_KERNEL);
-		ec_block = kmalloc(chan_count * sizeof *ec_block, GFP_KERNEL);
+		chan_block = kmalloc_node(chan_count * sizeof *chan_block, GFP_KERNEL, node);
+		ec_block = kmalloc_node(chan_count * sizeof *ec_block, GFP_KERNEL, node);
 
 		if (chan_block == NULL || ec_block == NULL) {
 			if (chan_block)
@@ -4669,7 +6106,7 @@ static int __devinit rxt1_driver_init_one(struct pci_dev *pdev,
 
 			kfree(span_block);
 			iounmap(rxt1_card->membase);
-			pci_free_consistent(pdev, DAHDI_MAX_CHUNKSIZE * 2 * 2 * 32 * 4,
+			pci_free_consistent(pdev, DAHDI_MAX_CHUNKSIZE * 2 * 2 * 32 * 4 * rxt1_card->dmachunks,
 								(void *) rxt1_card->writechunk, rxt1_card->writedma);
 			pci_release_regions(pdev);
 			rxt1_cards[rxt1_card->num] = NULL;
@@ -4691,8 +6128,7 @@ static int __devinit rxt1_driver_init_one(struct pci_dev *pdev,
 	/* Continue hardware intiialization */
 	rxt1_card_hardware_init_2(rxt1_card);
 
-	if (request_irq
-		(pdev->irq, rxt1_card_interrupt_gen2, IRQF_SHARED, "rxt1", rxt1_card)) {
+	if (rxt1_card_request_irq(rxt1_card)) {
 		printk(KERN_ERR "R%dT1[%d]: Unable to request IRQ %d\n", rxt1_card->numspans, rxt1_card->num, pdev->irq);
 		for (x = 0; x < rxt1_card->numspans; x++) {
 			kfree(rxt1_card->rxt1_spans[x]->chans[0]);
@@ -4702,7 +6138,7 @@ static int __devinit rxt1_driver_init_one(struct pci_dev *pdev,
 		kfree(span_block);
 		iounmap(rxt1_card->membase);
 
-		pci_free_consistent(pdev, DAHDI_MAX_CHUNKSIZE * 2 * 2 * 32 * 4,
+		pci_free_consistent(pdev, DAHDI_MAX_CHUNKSIZE * 2 * 2 * 32 * 4 * rxt1_card->dmachunks,
 							(void *) rxt1_card->writechunk, rxt1_card->writedma);
 
 		kfree(rxt1_card);
@@ -4713,25 +6149,14 @@ static int __devinit rxt1_driver_init_one(struct pci_dev *pdev,
 
 	rxt1_card_init_spans(rxt1_card);
 
-	/* Launch cards as appropriate */
-	x = 0;
-	for (;;) {
-		/* Find a card to activate */
-		f = 0;
-		for (x = 0; rxt1_cards[x]; x++) {
-			if (rxt1_cards[x]->order <= highestorder) {
-				rxt1_card_launch(rxt1_cards[x]);
-				if (rxt1_cards[x]->order == highestorder)
-					f = 1;
-			}
-		}
-
-		/* If we found at least one, increment the highest order and search again,
-		 *    otherwise stop */
-		if (f)
-			highestorder++;
-		else
-			break;
+	/*
+	 * The DSP download and span registration take seconds per card, launch
+	 * the cards from a work item so that they come up in parallel.
+	 */
+	if (!rhino_launch_queue(&rxt1_launch, rxt1_card->num, &rxt1_card->launchwork,
+							async_launch)) {
+		rxt1_card_launch(rxt1_card);
+		rhino_launch_done(&rxt1_launch, rxt1_card->num, &rxt1_card->launched);
 	}
 
 	printk(KERN_NOTICE "Found a Rhino: %s\n", rxt1_card->variety);
@@ -4748,6 +6173,7 @@ static int rxt1_card_hardware_stop(struct rxt1_card_t *rxt1_card)
 						target_regs[RXT1_DMA].iomask);
 	__rxt1_card_set_timing_source(rxt1_card, 4, 0, 0);
 	rxt1_card->stopdma = 0x0;
+	rxt1_card_group_update();
 
 	current->state = TASK_UNINTERRUPTIBLE;
 	schedule_timeout((25 * HZ) / 1000);
@@ -4764,6 +6190,12 @@ static void __devexit rxt1_driver_remove_one(struct pci_dev *pdev)
 	int x;
 
 	if (rxt1_card) {
+		/* The launch owns the card until it is finished */
+		wait_for_completion(&rxt1_card->launched);
+
+		/* No self-test can start or be running past this */
+		device_remove_file(&pdev->dev, &dev_attr_selftest);
+
 		/* Stop hardware */
 		rxt1_card_hardware_stop(rxt1_card);
 
@@ -4783,7 +6215,30 @@ static void __devexit rxt1_driver_remove_one(struct pci_dev *pdev)
 		dahdi_unregister_device (rxt1_card->ddev);
 #endif
 
-		free_irq(pdev->irq, rxt1_card);
+		/* Stop the DSP command queues now that DAHDI can no longer reach them */
+		if (rxt1_card->dspwq) {
+			/* and keep the interrupt handler from queueing tone work */
+			rxt1_card->dtmf_up = 0;
+			synchronize_irq(pdev->irq);
+			if (rxt1_card->health_up) {
+				device_remove_file(&pdev->dev, &dev_attr_dsp_health);
+				rxt1_card->health_up = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+				cancel_delayed_work_sync(&rxt1_card->healthwork);
+#else
+				cancel_delayed_work(&rxt1_card->healthwork);
+				flush_scheduled_work();
+				cancel_delayed_work(&rxt1_card->healthwork);
+#endif
+			}
+			for (x = 0; x < rxt1_card->numspans; x++)
+				gpakStopCmdQueue(rxt1_card, (rxt1_card->num * 4) + x);
+			destroy_workqueue(rxt1_card->dspwq);
+			rxt1_card->dspwq = NULL;
+		}
+		gpakDetachDsps(rxt1_card);
+
+		rhino_free_irq(pdev, rxt1_card, &rxt1_card->msi);
 
 		if (rxt1_card->membase)
 			iounmap(rxt1_card->membase);
@@ -4794,10 +6249,13 @@ static void __devexit rxt1_driver_remove_one(struct pci_dev *pdev)
 			release_mem_region(rxt1_card->memaddr, rxt1_card->memlen);
 
 		/* Immediately free resources */
-		pci_free_consistent(pdev, DAHDI_MAX_CHUNKSIZE * 2 * 2 * 32 * 4,
+		pci_free_consistent(pdev, DAHDI_MAX_CHUNKSIZE * 2 * 2 * 32 * 4 * rxt1_card->dmachunks,
 							(void *) rxt1_card->writechunk, rxt1_card->writedma);
 
+		/* the group work no longer finds the card */
+		mutex_lock(&rxt1_group_mutex);
 		rxt1_cards[rxt1_card->num] = NULL;
+		mutex_unlock(&rxt1_group_mutex);
 		pci_set_drvdata(pdev, NULL);
 
 		for (x = 0; x < rxt1_card->numspans; x++) {
@@ -4807,6 +6265,7 @@ static void __devexit rxt1_driver_remove_one(struct pci_dev *pdev)
 			 */
 			kfree(rxt1_card->rxt1_spans[x]->chans[0]);
 			kfree(rxt1_card->rxt1_spans[x]->ec[0]);
+			kfree(rxt1_card->rxt1_spans[x]->ec_cmd);
 		}
 
 		/*
@@ -4842,15 +6301,29 @@ static struct pci_driver rxt1_driver = {
 static int __init rxt1_driver_init(void)
 {
 	int res;
+
+	rhino_launch_init(&rxt1_launch, "rxt1_launch");
+
 	res = pci_register_driver(&rxt1_driver);
-	if (res)
+	if (res) {
+		rhino_launch_exit(&rxt1_launch);
 		return -ENODEV;
+	}
+
+	/* The spans are registered once module load returns, so dahdi_cfg can follow */
+	rhino_launch_wait_all(&rxt1_launch);
 	return 0;
 }
 
 static void __exit rxt1_cleanup(void)
 {
 	pci_unregister_driver(&rxt1_driver);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	cancel_work_sync(&rxt1_group_work);
+#else
+	flush_scheduled_work();
+#endif
+	rhino_launch_exit(&rxt1_launch);
 }
 
 
@@ -4869,6 +6342,8 @@ module_param(noburst, int, 0600);
 module_param(debugslips, int, 0600);
 module_param(polling, int, 0600);
 module_param(timingcable, int, 0600);
+module_param(single_irq, int, 0400);
+MODULE_PARM_DESC(single_irq, "With timingcable, service the DMA of all cards from the timing master's interrupt");
 module_param(t1e1override, int, 0600);
 module_param(alarmdebounce, int, 0600);
 module_param(j1mode, int, 0600);
@@ -4882,13 +6357,35 @@ module_param(sic3_set, int, 0600);
 module_param(insert_idle, int, 0600);
 module_param(local_loop, int, 0600);
 module_param(double_buffer, int, 0600);
+module_param(dma_chunks, int, 0400);
+MODULE_PARM_DESC(dma_chunks, "DAHDI chunks per DMA interrupt, 2, 4 or 8 cut the interrupt rate for 2(n - 1) ms more round trip latency");
 module_param(ec_disable_1, int, 0600);
 module_param(ec_disable_2, int, 0600);
 module_param(ec_disable_3, int, 0600);
 module_param(ec_disable_4, int, 0600);
 module_param(no_ec, int, 0600);
-module_param(nlp_type, int, 0600);
+module_param(ecbench, int, 0600);
+MODULE_PARM_DESC(ecbench, "Time EC enable/bypass and DSP load per tail length on the idle channels when the DSPs come up");
+module_param(dtmf, int, 0600);
+MODULE_PARM_DESC(dtmf, "Detect DTMF and fax CNG tones on the DSP (5510 DSP only)");
+module_param(dtmfmute, int, 0600);
+MODULE_PARM_DESC(dtmfmute, "Mute DTMF digits detected by the DSP on channels that report tones");
+module_param_call(nlp_type, rhino_param_set_nlp, param_get_int, &nlp_type, 0600);
 MODULE_PARM_DESC(nlp_type, "0 - off, 1 - mute, 2 - rand, 3 - hoth, 4 - supp");
+module_param(ec_taps, int, 0600);
+MODULE_PARM_DESC(ec_taps, "Run the echo canceller with the tail length requested by DAHDI instead of 1024 taps");
+module_param(dsp_health, int, 0600);
+MODULE_PARM_DESC(dsp_health, "Seconds between DSP health samples, 0 to disable");
+module_param(dsp_cpu_warn, int, 0600);
+MODULE_PARM_DESC(dsp_cpu_warn, "DSP CPU load in percent that is warned about");
+module_param(dsp_recover, int, 0600);
+MODULE_PARM_DESC(dsp_recover, "Reload DSPs found reset or not answering");
+module_param(selftest_port, int, 0600);
+MODULE_PARM_DESC(selftest_port, "DSP serial port looped by the dsp self-test");
+module_param(async_launch, int, 0600);
+MODULE_PARM_DESC(async_launch, "Bring the cards up in parallel, module load still waits for all of them");
+module_param(msi, int, 0400);
+MODULE_PARM_DESC(msi, "Interrupt through MSI when the platform supports it, 0 for the shared INTx line");
 module_param(gen_clk, int, 0600);
 
 
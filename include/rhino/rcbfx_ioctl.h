@@ -130,5 +130,10 @@ struct rcb_chan_echo_coefs {
 #define RCB_CHAN_SET_ECHOTUNE _IOW (DAHDI_CODE, 63, struct rcb_chan_echo_coefs)
 #define RCB_CHAN_SET_CBPARAMS _IOW (DAHDI_CODE, 64, struct rcb_card_params_t)
 #define RCB_CHAN_GET_BDINFO _IOR (DAHDI_CODE, 65, int)
+/* Like the above, but return as soon as the card has the table */
+#define RCB_CHAN_SET_ECHOTUNE_NB _IOW (DAHDI_CODE, 66, struct rcb_chan_echo_coefs)
+#define RCB_CHAN_SET_CBPARAMS_NB _IOW (DAHDI_CODE, 67, struct rcb_card_params_t)
+/* Wait up to the given ms for the card to take the tables handed to it */
+#define RCB_CHAN_PARAM_WAIT _IOW (DAHDI_CODE, 68, int)
 
 #endif /* _RCBFX_IOCTL_H */
@@ -0,0 +1,190 @@
+/*
+ * Rhino Equipment Corp.  Routines shared by the card drivers
+ *
+ * Copyright (C) 2013-2015, QTurbo, LLC
+ *
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef _RHINO_CARD_H
+#define _RHINO_CARD_H
+
+#include <linux/version.h>
+#include <linux/pci.h>
+#include <linux/interrupt.h>
+#include <linux/topology.h>
+#include <linux/bitops.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/moduleparam.h>
+
+/* Highest G.PAK NLP type: 0 off, 1 mute, 2 rand, 3 hoth, 4 supp */
+#define RHINO_NLP_MAX 4
+
+/*
+ * Setter of the nlp_type module parameter. An NLP type the DSP does not know
+ *  is refused, which fails the module load or the sysfs write.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+static inline int rhino_param_set_nlp(const char *val, const struct kernel_param *kp)
+#else
+static inline int rhino_param_set_nlp(const char *val, struct kernel_param *kp)
+#endif
+{
+	struct kernel_param tmp = *kp;
+	int nlp, res;
+
+	tmp.arg = &nlp;
+	if ((res = param_set_int(val, &tmp)))
+		return res;
+	if ((nlp < 0) || (nlp > RHINO_NLP_MAX))
+		return -EINVAL;
+	*(int *) kp->arg = nlp;
+	return 0;
+}
+
+/*
+ * Use MSI when use_msi is set and the card and the bridges above it allow,
+ *  the shared INTx line otherwise. *msi tells rhino_free_irq() which one it
+ *  got. The interrupt is steered to the index-th online CPU of the card's
+ *  node, so a card's audio is always handled on the same core. *cpu is -1
+ *  where the kernel cannot steer interrupts.
+ */
+static inline int rhino_request_irq(struct pci_dev *pdev, irq_handler_t handler,
+									const char *name, void *dev_id, int use_msi,
+									int index, int *msi, int *cpu)
+{
+	unsigned long flags = IRQF_SHARED;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+	const struct cpumask *mask = cpu_online_mask;
+	int node = dev_to_node(&pdev->dev);
+	int c, n = 0;
+#endif
+
+	*msi = 0;
+	*cpu = -1;
+#ifdef CONFIG_PCI_MSI
+	if (use_msi && !pci_enable_msi(pdev)) {
+		*msi = 1;
+		flags = 0;
+	}
+#endif
+	if (request_irq(pdev->irq, handler, flags, name, dev_id)) {
+		if (*msi)
+			pci_disable_msi(pdev);
+		*msi = 0;
+		return -EIO;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+	if (node >= 0 && cpumask_intersects(cpumask_of_node(node), cpu_online_mask))
+		mask = cpumask_of_node(node);
+	for_each_cpu_and(c, mask, cpu_online_mask)
+		n++;
+	n = index % n;
+	for_each_cpu_and(c, mask, cpu_online_mask) {
+		if (!n--)
+			break;
+	}
+	irq_set_affinity_hint(pdev->irq, cpumask_of(c));
+	*cpu = c;
+#endif
+	return 0;
+}
+
+static inline void rhino_free_irq(struct pci_dev *pdev, void *dev_id, int *msi)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+	irq_set_affinity_hint(pdev->irq, NULL);
+#endif
+	free_irq(pdev->irq, dev_id);
+	if (*msi)
+		pci_disable_msi(pdev);
+	*msi = 0;
+}
+
+/*
+ * The DSP download and span registration take seconds per card, so a
+ *  driver launches its cards from work items and they come up in parallel.
+ *  The spans still register in card order, and module load waits until
+ *  every card is up so that dahdi_cfg can follow it.
+ */
+struct rhino_launch {
+	unsigned long *launching;	/* cards whose launch has not finished */
+	int cards;
+	wait_queue_head_t wait;
+	struct workqueue_struct *wq;
+};
+
+#define DEFINE_RHINO_LAUNCH(name, ncards) \
+	static DECLARE_BITMAP(name##_launching, ncards); \
+	static struct rhino_launch name = { \
+		.launching = name##_launching, \
+		.cards = ncards, \
+		.wait = __WAIT_QUEUE_HEAD_INITIALIZER(name.wait), \
+	}
+
+static inline void rhino_launch_init(struct rhino_launch *launch, const char *name)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	launch->wq = alloc_workqueue(name, WQ_UNBOUND, launch->cards);
+#else
+	launch->wq = create_workqueue(name);
+#endif
+}
+
+static inline void rhino_launch_exit(struct rhino_launch *launch)
+{
+	if (launch->wq)
+		destroy_workqueue(launch->wq);
+	launch->wq = NULL;
+}
+
+/* Returns 0 when the card was not queued and the caller has to launch it */
+static inline int rhino_launch_queue(struct rhino_launch *launch, int card,
+									 struct work_struct *work, int async)
+{
+	set_bit(card, launch->launching);
+	if (!async || !launch->wq)
+		return 0;
+	queue_work(launch->wq, work);
+	return 1;
+}
+
+/* Sleeps until every card before this one has finished its launch */
+static inline void rhino_launch_wait_turn(struct rhino_launch *launch, int card)
+{
+	wait_event(launch->wait, find_first_bit(launch->launching, card) >= card);
+}
+
+/* Lets the cards after this one register their spans, and module load return */
+static inline void rhino_launch_done(struct rhino_launch *launch, int card,
+									 struct completion *launched)
+{
+	complete_all(launched);
+	clear_bit(card, launch->launching);
+	wake_up_all(&launch->wait);
+}
+
+static inline void rhino_launch_wait_all(struct rhino_launch *launch)
+{
+	wait_event(launch->wait, bitmap_empty(launch->launching, launch->cards));
+}
+
+#endif
@@ -1,5 +1,13 @@
 #!/bin/bash
 DIR=/sys/module/rcbfx/parameters
+REGS=/sys/kernel/debug/rcbfx/${CARD:-1}/regs
+
+# Snapshot registers $1 to $2 of every port of the card in one pass
+function dump_regs
+{
+	echo "$1 $2" > $REGS
+	od -An -tu1 -w24 -v $REGS | awk -v reg=$1 '{ print "Reg " reg++ ":" $0 }'
+}
 
 function dump_reg
 {
@@ -10,7 +18,10 @@ function dump_reg
 	cat $DIR/reg_addr $DIR/reg_val
 }
 
-if [ -z "$1" ]
+if [ -w $REGS ]
+then
+	dump_regs ${1:-1} ${1:-255}
+elif [ -z "$1" ]
 then
 	echo "No register specified - Probing all possible register locations. This will take about 10 minutes. Sit back, relax, and enjoy some espresso."
 	for REG in `seq 1 255`
@@ -1,5 +1,13 @@
 #!/bin/bash
 DIR=/sys/module/rcbfx/parameters
+REGS=/sys/kernel/debug/rcbfx/${CARD:-1}/regs
+
+# Snapshot registers $1 to $2 of every port of the card in one pass
+function dump_regs
+{
+	echo "$1 $2" > $REGS
+	od -An -tu1 -w24 -v $REGS | awk -v reg=$1 '{ print "Reg " reg++ ":" $0 }'
+}
 
 function dump_reg
 {
@@ -10,6 +18,12 @@ function dump_reg
 	cat $DIR/reg_addr $DIR/reg_val
 }
 
+if [ -w $REGS ]
+then
+	dump_regs 1 45
+	exit 0
+fi
+
 echo "This will take about 2 minutes..."
 for REG in `seq 1 45`
 do